@@ -106,6 +106,9 @@ void qemu_aio_flush(void)
     do {
         ret = 0;
 
+        /* Requests delayed by I/O throttling must be submitted first */
+        bdrv_io_limits_flush_all();
+
 	/*
 	 * If there are pending emulated aio start them now so flush
 	 * will be able to return 1.
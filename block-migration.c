@@ -14,6 +14,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "hw/hw.h"
+#include "hw/qdev.h"
 #include "qemu-queue.h"
 #include "qemu-timer.h"
 #include "monitor.h"
@@ -27,6 +28,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -68,6 +70,7 @@ typedef struct BlkMigBlock {
 typedef struct BlkMigState {
     int blk_enable;
     int shared_base;
+    int zero_blocks;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
     int submitted;
@@ -86,17 +89,24 @@ static BlkMigState block_mig_state;
 static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 {
     int len;
+    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    /* Don't waste bandwidth on blocks that only contain zeroes */
+    if (block_mig_state.zero_blocks && buffer_is_zero(blk->buf, BLOCK_SIZE)) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
     len = strlen(blk->bmds->bs->device_name);
     qemu_put_byte(f, len);
     qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
 
-    qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    if (!(flags & BLK_MIG_FLAG_ZERO_BLOCK)) {
+        qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
+    }
 }
 
 int blk_mig_active(void)
@@ -315,6 +325,21 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
     }
 }
 
+/* Devices used by a block job can't be migrated, they share its dirty bitmap */
+static int blk_mig_devices_in_use(Monitor *mon)
+{
+    BlockDriverState *bs;
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        if (!bdrv_is_read_only(bs) && bdrv_in_use(bs)) {
+            monitor_printf(mon, "Device %s is in use, cannot migrate it\n",
+                           bdrv_get_device_name(bs));
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static void init_blk_migration(Monitor *mon, QEMUFile *f)
 {
     block_mig_state.submitted = 0;
@@ -571,6 +596,10 @@ static int block_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     }
 
     if (stage == 1) {
+        if (blk_mig_devices_in_use(mon)) {
+            qemu_file_set_error(f);
+            return 0;
+        }
         init_blk_migration(mon, f);
 
         /* start track dirty blocks */
@@ -683,9 +712,12 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = qemu_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                buf = qemu_mallocz(BLOCK_SIZE);
+            } else {
+                buf = qemu_malloc(BLOCK_SIZE);
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+            }
             ret = bdrv_write(bs, addr, buf, nr_sectors);
 
             qemu_free(buf);
@@ -714,11 +746,21 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
 
 static void block_set_params(int blk_enable, int shared_base, void *opaque)
 {
+    const char *zero_blocks;
+
     block_mig_state.blk_enable = blk_enable;
     block_mig_state.shared_base = shared_base;
 
     /* shared base means that blk_enable = 1 */
     block_mig_state.blk_enable |= shared_base;
+
+    /*
+     * Older versions can't parse zero blocks, and the stream doesn't say
+     * whether they are used, so old machine types turn them off.
+     */
+    zero_blocks = qdev_prop_get_global("block-migration", "zero-blocks");
+    block_mig_state.zero_blocks = !zero_blocks ||
+                                  strcmp(zero_blocks, "off") != 0;
 }
 
 void blk_mig_init(void)
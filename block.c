@@ -23,11 +23,14 @@
  */
 #include "config-host.h"
 #include "qemu-common.h"
+#include "qemu-timer.h"
 #include "trace.h"
 #include "monitor.h"
 #include "block_int.h"
 #include "module.h"
 #include "qemu-objects.h"
+#include "qemu-error.h"
+#include "bitmap.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -41,6 +44,10 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #endif
 
 static BlockDriverAIOCB *bdrv_aio_readv_em(BlockDriverState *bs,
@@ -57,6 +64,37 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors);
 static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors);
+static int bdrv_write_tracked(BlockDriverState *bs, int64_t sector_num,
+                              const uint8_t *buf, int nb_sectors);
+static int bdrv_writes_tracked(BlockDriverState *bs);
+static BlockDriverAIOCB *bdrv_io_limits_intercept(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write);
+static void bdrv_io_limits_account(BlockDriverState *bs, int is_write,
+                                   int nb_sectors);
+static void bdrv_io_limits_enable(BlockDriverState *bs);
+static void bdrv_io_limits_disable(BlockDriverState *bs);
+static int bdrv_io_limits_any(BlockIOLimit *io_limits);
+static BlockDriverAIOCB *bdrv_aio_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static BlockDriverAIOCB *bdrv_aio_tracked_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static void bdrv_cor_mark_allocated(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors);
+static void bdrv_load_dirty_bitmaps(BlockDriverState *bs);
+static void bdrv_close_dirty_bitmaps(BlockDriverState *bs);
+static void bdrv_mark_dirty_bitmaps(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors);
+static BlockDriverAIOCB *bdrv_shared_cache_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+static void bdrv_shared_cache_invalidate(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         int64_t nb_sectors);
+static void bdrv_shared_cache_attach(BlockDriverState *bs);
+static void bdrv_shared_cache_detach(BlockDriverState *bs);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -192,6 +230,11 @@ BlockDriverState *bdrv_new(const char *device_name)
 
     bs = qemu_mallocz(sizeof(BlockDriverState));
     pstrcpy(bs->device_name, sizeof(bs->device_name), device_name);
+    QTAILQ_INIT(&bs->throttled_reqs[0]);
+    QTAILQ_INIT(&bs->throttled_reqs[1]);
+    QLIST_INIT(&bs->tracked_requests);
+    QTAILQ_INIT(&bs->waiting_requests);
+    QLIST_INIT(&bs->dirty_bitmaps);
     if (device_name[0] != '\0') {
         QTAILQ_INSERT_TAIL(&bdrv_states, bs, list);
     }
@@ -452,7 +495,9 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
      * Clear flags that are internal to the block layer before opening the
      * image.
      */
-    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+    open_flags = flags & ~(BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING |
+                           BDRV_O_COPY_ON_READ | BDRV_O_DETECT_ZEROES |
+                           BDRV_O_SHARED_CACHE);
 
     /*
      * Snapshots should be writable.
@@ -625,8 +670,9 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         }
 
         /* backing files always opened read-only */
-        back_flags =
-            flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT | BDRV_O_NO_BACKING);
+        back_flags = flags & ~(BDRV_O_RDWR | BDRV_O_SNAPSHOT |
+                               BDRV_O_NO_BACKING | BDRV_O_COPY_ON_READ |
+                               BDRV_O_DETECT_ZEROES);
 
         ret = bdrv_open(bs->backing_hd, backing_filename, back_flags, back_drv);
         if (ret < 0) {
@@ -641,6 +687,23 @@ int bdrv_open(BlockDriverState *bs, const char *filename, int flags,
         }
     }
 
+    if ((flags & BDRV_O_COPY_ON_READ) && !bs->read_only) {
+        bdrv_enable_copy_on_read(bs);
+    }
+
+    if ((flags & BDRV_O_SHARED_CACHE) && !bs->is_temporary) {
+        bdrv_shared_cache_attach(bs);
+    }
+
+    if (bs->device_name[0] != '\0') {
+        bdrv_load_dirty_bitmaps(bs);
+    }
+
+    /* Limits of the drive apply to the new medium, too */
+    if (!bs->io_limits_enabled && bdrv_io_limits_any(&bs->io_limits)) {
+        bdrv_io_limits_enable(bs);
+    }
+
     if (!bdrv_key_required(bs)) {
         /* call the change callback */
         bs->media_changed = 1;
@@ -659,7 +722,20 @@ unlink_and_fail:
 
 void bdrv_close(BlockDriverState *bs)
 {
+    /*
+     * Throttled requests still need the driver.  Submit them and wait for
+     * them to complete; bdrv_open enables the limits again.
+     */
+    if (bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    }
+
     if (bs->drv) {
+        qemu_aio_flush();
+        bdrv_close_dirty_bitmaps(bs);
+        if (bs->shared_image) {
+            bdrv_shared_cache_detach(bs);
+        }
         if (bs == bs_snapshots) {
             bs_snapshots = NULL;
         }
@@ -676,6 +752,11 @@ void bdrv_close(BlockDriverState *bs)
 #endif
         bs->opaque = NULL;
         bs->drv = NULL;
+        bs->copy_on_read = 0;
+        qemu_free(bs->cor_allocated);
+        bs->cor_allocated = NULL;
+        bs->backing_file[0] = '\0';
+        bs->backing_format[0] = '\0';
 
         if (bs->file != NULL) {
             bdrv_close(bs->file);
@@ -897,6 +978,31 @@ int bdrv_change_backing_file(BlockDriverState *bs,
     }
 }
 
+/*
+ * Removes the backing file link from the image header and closes the backing
+ * file.  The caller must make sure that all data has been copied into the
+ * image before.
+ */
+int bdrv_drop_backing_file(BlockDriverState *bs)
+{
+    int ret;
+
+    if (!bs->backing_hd) {
+        return 0;
+    }
+
+    ret = bdrv_change_backing_file(bs, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_delete(bs->backing_hd);
+    bs->backing_hd = NULL;
+    bs->backing_file[0] = '\0';
+    bs->backing_format[0] = '\0';
+    return 0;
+}
+
 static int bdrv_check_byte_request(BlockDriverState *bs, int64_t offset,
                                    size_t size)
 {
@@ -968,6 +1074,362 @@ static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
     }
 }
 
+/*
+ * Named dirty bitmaps record which parts of an image have been written since
+ * the bitmap was created or last exported, for incremental backups.
+ *
+ * They are kept in memory while the image is open and saved to a file next
+ * to the image ("<image>.bitmaps").  The file is marked in use while the image
+ * is open for writing; if it is found in use when the image is opened, QEMU
+ * was not shut down cleanly, writes may be missing from the bitmaps and all
+ * bits are set.
+ */
+
+#define BDRV_DIRTY_BITMAPS_MAGIC   0x5144424d /* "QDBM" */
+#define BDRV_DIRTY_BITMAPS_VERSION 1
+#define BDRV_DIRTY_BITMAPS_IN_USE  1
+
+typedef struct BdrvDirtyBitmapsHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t nb_bitmaps;
+} BdrvDirtyBitmapsHeader;
+
+/* Followed by the name and then the bits, padded to a multiple of 8 bytes */
+typedef struct BdrvDirtyBitmapEntry {
+    uint32_t name_len;
+    uint32_t granularity;
+    uint64_t nb_bits;
+} BdrvDirtyBitmapEntry;
+
+static int bdrv_dirty_bitmaps_path(BlockDriverState *bs, char *path,
+                                   int path_size)
+{
+    /* Only images in local files can have bitmaps */
+    if (!bs->file || !bs->file->drv ||
+        strcmp(bs->file->drv->format_name, "file")) {
+        return -ENOTSUP;
+    }
+    snprintf(path, path_size, "%s.bitmaps", bs->file->filename);
+    return 0;
+}
+
+static void bdrv_mark_dirty_bitmaps(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors)
+{
+    BdrvDirtyBitmap *bitmap;
+    int64_t start, end;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        start = sector_num * BDRV_SECTOR_SIZE / bitmap->granularity;
+        end = ((sector_num + nb_sectors) * BDRV_SECTOR_SIZE - 1) /
+              bitmap->granularity;
+        for (; start <= end && start < bitmap->nb_bits; start++) {
+            if (!test_and_set_bit(start, bitmap->bitmap)) {
+                bitmap->count++;
+            }
+        }
+    }
+}
+
+static BdrvDirtyBitmap *bdrv_new_dirty_bitmap(const char *name,
+                                              int granularity, int nb_bits)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = qemu_mallocz(sizeof(*bitmap));
+    bitmap->name = qemu_strdup(name);
+    bitmap->granularity = granularity;
+    bitmap->nb_bits = nb_bits;
+    bitmap->bitmap = bitmap_new(nb_bits);
+    return bitmap;
+}
+
+static void bdrv_free_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    QLIST_REMOVE(bitmap, list);
+    qemu_free(bitmap->bitmap);
+    qemu_free(bitmap->name);
+    qemu_free(bitmap);
+}
+
+static int bdrv_save_dirty_bitmaps(BlockDriverState *bs, int in_use)
+{
+    BdrvDirtyBitmapsHeader header;
+    BdrvDirtyBitmapEntry entry;
+    BdrvDirtyBitmap *bitmap;
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    uint8_t *buf;
+    size_t len, nb_bytes, i;
+    int nb_bitmaps = 0;
+    int fd, ret = 0;
+
+    if (bdrv_dirty_bitmaps_path(bs, path, sizeof(path)) < 0) {
+        return -ENOTSUP;
+    }
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        nb_bitmaps++;
+    }
+    if (nb_bitmaps == 0) {
+        unlink(path);
+        return 0;
+    }
+
+    /* Write a new file and rename it so that the old one stays valid */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = qemu_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+
+    header.magic = cpu_to_be32(BDRV_DIRTY_BITMAPS_MAGIC);
+    header.version = cpu_to_be32(BDRV_DIRTY_BITMAPS_VERSION);
+    header.flags = cpu_to_be32(in_use ? BDRV_DIRTY_BITMAPS_IN_USE : 0);
+    header.nb_bitmaps = cpu_to_be32(nb_bitmaps);
+    if (qemu_write_full(fd, &header, sizeof(header)) != sizeof(header)) {
+        ret = -errno;
+        goto out;
+    }
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        entry.name_len = cpu_to_be32(strlen(bitmap->name));
+        entry.granularity = cpu_to_be32(bitmap->granularity);
+        entry.nb_bits = cpu_to_be64(bitmap->nb_bits);
+
+        nb_bytes = (bitmap->nb_bits + 7) / 8;
+        len = strlen(bitmap->name) + nb_bytes;
+        len = (len + 7) & ~7;
+        buf = qemu_mallocz(len);
+        memcpy(buf, bitmap->name, strlen(bitmap->name));
+        for (i = 0; i < nb_bytes; i++) {
+            buf[strlen(bitmap->name) + i] =
+                bitmap->bitmap[i / sizeof(unsigned long)] >>
+                ((i % sizeof(unsigned long)) * 8);
+        }
+
+        if (qemu_write_full(fd, &entry, sizeof(entry)) != sizeof(entry) ||
+            qemu_write_full(fd, buf, len) != len) {
+            ret = -errno;
+        }
+        qemu_free(buf);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    if (fsync(fd) < 0) {
+        ret = -errno;
+    }
+
+out:
+    close(fd);
+    if (ret == 0 && rename(tmp_path, path) < 0) {
+        ret = -errno;
+    }
+    if (ret < 0) {
+        unlink(tmp_path);
+        error_report("could not save dirty bitmaps to %s: %s", path,
+                     strerror(-ret));
+    }
+    return ret;
+}
+
+static int bdrv_read_full(int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = read(fd, buf, count);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -EIO;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return 0;
+}
+
+static void bdrv_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmapsHeader header;
+    BdrvDirtyBitmapEntry entry;
+    BdrvDirtyBitmap *bitmap;
+    char path[PATH_MAX];
+    char *name;
+    uint8_t *buf;
+    size_t len, nb_bytes, i;
+    uint32_t n, name_len;
+    int fd, in_use;
+
+    if (bdrv_dirty_bitmaps_path(bs, path, sizeof(path)) < 0) {
+        return;
+    }
+
+    fd = qemu_open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return;
+    }
+
+    if (bdrv_read_full(fd, &header, sizeof(header)) < 0 ||
+        be32_to_cpu(header.magic) != BDRV_DIRTY_BITMAPS_MAGIC ||
+        be32_to_cpu(header.version) != BDRV_DIRTY_BITMAPS_VERSION) {
+        error_report("ignoring invalid dirty bitmap file %s", path);
+        goto out;
+    }
+    in_use = be32_to_cpu(header.flags) & BDRV_DIRTY_BITMAPS_IN_USE;
+
+    for (n = be32_to_cpu(header.nb_bitmaps); n > 0; n--) {
+        if (bdrv_read_full(fd, &entry, sizeof(entry)) < 0) {
+            goto fail;
+        }
+        name_len = be32_to_cpu(entry.name_len);
+        nb_bytes = (be64_to_cpu(entry.nb_bits) + 7) / 8;
+        if (name_len > 1023 || be64_to_cpu(entry.nb_bits) > INT_MAX ||
+            be32_to_cpu(entry.granularity) < BDRV_SECTOR_SIZE) {
+            goto fail;
+        }
+
+        len = (name_len + nb_bytes + 7) & ~7;
+        buf = qemu_malloc(len);
+        if (bdrv_read_full(fd, buf, len) < 0) {
+            qemu_free(buf);
+            goto fail;
+        }
+
+        name = qemu_mallocz(name_len + 1);
+        memcpy(name, buf, name_len);
+        bitmap = bdrv_new_dirty_bitmap(name, be32_to_cpu(entry.granularity),
+                                       be64_to_cpu(entry.nb_bits));
+        for (i = 0; i < nb_bytes; i++) {
+            bitmap->bitmap[i / sizeof(unsigned long)] |=
+                (unsigned long)buf[name_len + i] <<
+                ((i % sizeof(unsigned long)) * 8);
+        }
+        if (in_use) {
+            bitmap_fill(bitmap->bitmap, bitmap->nb_bits);
+        }
+        bitmap->count = 0;
+        for (i = 0; i < bitmap->nb_bits; i++) {
+            bitmap->count += !!test_bit(i, bitmap->bitmap);
+        }
+        QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+        qemu_free(name);
+        qemu_free(buf);
+    }
+
+    if (in_use) {
+        error_report("%s was not closed cleanly, marking the whole image as "
+                     "dirty in its bitmaps", bs->filename);
+    }
+    if (!bs->read_only) {
+        bdrv_save_dirty_bitmaps(bs, 1);
+    }
+    goto out;
+
+fail:
+    error_report("ignoring invalid dirty bitmap file %s", path);
+    while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        bdrv_free_dirty_bitmap(QLIST_FIRST(&bs->dirty_bitmaps));
+    }
+out:
+    close(fd);
+}
+
+static void bdrv_close_dirty_bitmaps(BlockDriverState *bs)
+{
+    if (QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        return;
+    }
+    if (!bs->read_only) {
+        bdrv_save_dirty_bitmaps(bs, 0);
+    }
+    while (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        bdrv_free_dirty_bitmap(QLIST_FIRST(&bs->dirty_bitmaps));
+    }
+}
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (!strcmp(bitmap->name, name)) {
+            return bitmap;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Adds a bitmap with all bits clear; granularity 0 selects the cluster size
+ * of the image.
+ */
+int bdrv_add_dirty_bitmap(BlockDriverState *bs, const char *name,
+                          int granularity)
+{
+    BdrvDirtyBitmap *bitmap;
+    BlockDriverInfo bdi;
+    int64_t nb_bits;
+    char path[PATH_MAX];
+    int ret;
+
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    if (bdrv_dirty_bitmaps_path(bs, path, sizeof(path)) < 0) {
+        return -ENOTSUP;
+    }
+    if (bdrv_find_dirty_bitmap(bs, name)) {
+        return -EEXIST;
+    }
+
+    if (granularity == 0) {
+        granularity = 65536;
+        if (bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0) {
+            granularity = bdi.cluster_size;
+        }
+    }
+    if (granularity < BDRV_SECTOR_SIZE || (granularity & (granularity - 1))) {
+        return -EINVAL;
+    }
+
+    nb_bits = (bdrv_getlength(bs) + granularity - 1) / granularity;
+    if (nb_bits > INT_MAX) {
+        return -EINVAL;
+    }
+
+    bitmap = bdrv_new_dirty_bitmap(name, granularity, nb_bits);
+    QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
+
+    ret = bdrv_save_dirty_bitmaps(bs, 1);
+    if (ret < 0) {
+        bdrv_free_dirty_bitmap(bitmap);
+    }
+    return ret;
+}
+
+int bdrv_remove_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        return -ENOENT;
+    }
+    if (bitmap->busy) {
+        return -EBUSY;
+    }
+
+    bdrv_free_dirty_bitmap(bitmap);
+    return bdrv_save_dirty_bitmaps(bs, 1);
+}
+
 /* Return < 0 if error. Important errors are:
   -EIO         generic I/O error (may happen for all errors)
   -ENOMEDIUM   No media inserted.
@@ -985,14 +1447,24 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
+    /* Copies of old data must see the write, see bdrv_aio_tracked_writev */
+    if (bdrv_writes_tracked(bs)) {
+        return bdrv_write_tracked(bs, sector_num, buf, nb_sectors);
+    }
+
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
+    bdrv_mark_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 
+    if (bs->shared_image && nb_sectors > 0) {
+        bdrv_shared_cache_invalidate(bs, sector_num, nb_sectors);
+    }
+
     return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
 
@@ -1142,6 +1614,14 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
         return -EACCES;
     if (bdrv_in_use(bs))
         return -EBUSY;
+
+    /* Cached chunks past the new end, and a partial last chunk, go stale */
+    if (bs->shared_image && bs->total_sectors > 0) {
+        int64_t start = MIN(bs->total_sectors, offset >> BDRV_SECTOR_BITS);
+        start = MAX(start - 1, 0);
+        bdrv_shared_cache_invalidate(bs, start, bs->total_sectors - start);
+    }
+
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
@@ -1685,6 +2165,18 @@ void bdrv_mon_event(const BlockDriverState *bdrv,
     qobject_decref(data);
 }
 
+static void bdrv_print_dirty_bitmap(QObject *obj, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(obj);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "    dirty bitmap %s: granularity=%" PRId64
+                        " count=%" PRId64 "\n",
+                        qdict_get_str(qdict, "name"),
+                        qdict_get_int(qdict, "granularity"),
+                        qdict_get_int(qdict, "count"));
+}
+
 static void bdrv_print_dict(QObject *obj, void *opaque)
 {
     QDict *bs_dict;
@@ -1713,11 +2205,27 @@ static void bdrv_print_dict(QObject *obj, void *opaque)
                             qdict_get_bool(qdict, "ro"),
                             qdict_get_str(qdict, "drv"),
                             qdict_get_bool(qdict, "encrypted"));
+        if (qdict_haskey(qdict, "bps")) {
+            monitor_printf(mon, " bps=%" PRId64 " bps_rd=%" PRId64
+                                " bps_wr=%" PRId64 " iops=%" PRId64
+                                " iops_rd=%" PRId64 " iops_wr=%" PRId64,
+                                qdict_get_int(qdict, "bps"),
+                                qdict_get_int(qdict, "bps_rd"),
+                                qdict_get_int(qdict, "bps_wr"),
+                                qdict_get_int(qdict, "iops"),
+                                qdict_get_int(qdict, "iops_rd"),
+                                qdict_get_int(qdict, "iops_wr"));
+        }
     } else {
         monitor_printf(mon, " [not inserted]");
     }
 
     monitor_printf(mon, "\n");
+
+    if (qdict_haskey(bs_dict, "dirty-bitmaps")) {
+        qlist_iter(qobject_to_qlist(qdict_get(bs_dict, "dirty-bitmaps")),
+                   bdrv_print_dirty_bitmap, mon);
+    }
 }
 
 void bdrv_info_print(Monitor *mon, const QObject *data)
@@ -1754,15 +2262,65 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
                 qdict_put(qdict, "backing_file",
                           qstring_from_str(bs->backing_file));
             }
+            if (bs->io_limits_enabled) {
+                QDict *qdict = qobject_to_qdict(obj);
+                BlockIOLimit *l = &bs->io_limits;
+
+                qdict_put(qdict, "bps",
+                          qint_from_int(l->bps[BLOCK_IO_LIMIT_TOTAL]));
+                qdict_put(qdict, "bps_rd",
+                          qint_from_int(l->bps[BLOCK_IO_LIMIT_READ]));
+                qdict_put(qdict, "bps_wr",
+                          qint_from_int(l->bps[BLOCK_IO_LIMIT_WRITE]));
+                qdict_put(qdict, "iops",
+                          qint_from_int(l->iops[BLOCK_IO_LIMIT_TOTAL]));
+                qdict_put(qdict, "iops_rd",
+                          qint_from_int(l->iops[BLOCK_IO_LIMIT_READ]));
+                qdict_put(qdict, "iops_wr",
+                          qint_from_int(l->iops[BLOCK_IO_LIMIT_WRITE]));
+                qdict_put(qdict, "bps_burst", qint_from_int(l->bps_burst));
+                qdict_put(qdict, "iops_burst", qint_from_int(l->iops_burst));
+            }
 
             qdict_put_obj(bs_dict, "inserted", obj);
         }
+
+        if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+            QDict *bs_dict = qobject_to_qdict(bs_obj);
+            QList *bitmaps = qlist_new();
+            BdrvDirtyBitmap *bitmap;
+
+            QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+                qlist_append_obj(bitmaps, qobject_from_jsonf(
+                    "{ 'name': %s, 'granularity': %d, 'count': %" PRId64 " }",
+                    bitmap->name, bitmap->granularity, bitmap->count));
+            }
+            qdict_put_obj(bs_dict, "dirty-bitmaps", QOBJECT(bitmaps));
+        }
         qlist_append_obj(bs_list, bs_obj);
     }
 
     *ret_data = QOBJECT(bs_list);
 }
 
+/* Prints the non-empty buckets of a latency histogram as "<upper bound>:count" */
+static void bdrv_latency_print(Monitor *mon, const char *name, QList *list)
+{
+    QListEntry *entry;
+    int bucket = 0;
+
+    monitor_printf(mon, "    %s_latency_us:", name);
+    QLIST_FOREACH_ENTRY(list, entry) {
+        int64_t count = qint_get_int(qobject_to_qint(entry->value));
+        if (count) {
+            monitor_printf(mon, " <%" PRId64 ":%" PRId64,
+                           (int64_t)1 << bucket, count);
+        }
+        bucket++;
+    }
+    monitor_printf(mon, "\n");
+}
+
 static void bdrv_stats_iter(QObject *data, void *opaque)
 {
     QDict *qdict;
@@ -1781,6 +2339,31 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
                         qdict_get_int(qdict, "wr_operations"));
+    monitor_printf(mon, "    flush_operations=%" PRId64
+                        " rd_total_time_ns=%" PRId64
+                        " wr_total_time_ns=%" PRId64
+                        " flush_total_time_ns=%" PRId64
+                        "\n",
+                        qdict_get_int(qdict, "flush_operations"),
+                        qdict_get_int(qdict, "rd_total_time_ns"),
+                        qdict_get_int(qdict, "wr_total_time_ns"),
+                        qdict_get_int(qdict, "flush_total_time_ns"));
+    monitor_printf(mon, "    in_flight=%" PRId64
+                        " max_in_flight=%" PRId64
+                        " avg_queue_depth=%.2f"
+                        " rd_merged=%" PRId64
+                        " wr_merged=%" PRId64
+                        "\n",
+                        qdict_get_int(qdict, "in_flight"),
+                        qdict_get_int(qdict, "max_in_flight"),
+                        qdict_get_double(qdict, "avg_queue_depth"),
+                        qdict_get_int(qdict, "rd_merged"),
+                        qdict_get_int(qdict, "wr_merged"));
+
+    qdict = qobject_to_qdict(qdict_get(qdict, "latency"));
+    bdrv_latency_print(mon, "read", qdict_get_qlist(qdict, "read"));
+    bdrv_latency_print(mon, "write", qdict_get_qlist(qdict, "write"));
+    bdrv_latency_print(mon, "flush", qdict_get_qlist(qdict, "flush"));
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1788,10 +2371,21 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
     qlist_iter(qobject_to_qlist(data), bdrv_stats_iter, mon);
 }
 
+static QList *bdrv_latency_list(BlockDriverState *bs, int type)
+{
+    QList *list = qlist_new();
+    int i;
+
+    for (i = 0; i < BDRV_LATENCY_BUCKETS; i++) {
+        qlist_append(list, qint_from_int(bs->latency[type][i]));
+    }
+    return list;
+}
+
 static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
     QObject *res;
-    QDict *dict;
+    QDict *dict, *stats, *latency;
 
     res = qobject_from_jsonf("{ 'stats': {"
                              "'rd_bytes': %" PRId64 ","
@@ -1806,6 +2400,29 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              (uint64_t)BDRV_SECTOR_SIZE);
     dict  = qobject_to_qdict(res);
 
+    stats = qobject_to_qdict(qdict_get(dict, "stats"));
+    qdict_put(stats, "flush_operations", qint_from_int(bs->flush_ops));
+    qdict_put(stats, "rd_merged", qint_from_int(bs->rd_merged));
+    qdict_put(stats, "wr_merged", qint_from_int(bs->wr_merged));
+    qdict_put(stats, "rd_total_time_ns",
+              qint_from_int(bs->total_time_ns[BDRV_ACCT_READ]));
+    qdict_put(stats, "wr_total_time_ns",
+              qint_from_int(bs->total_time_ns[BDRV_ACCT_WRITE]));
+    qdict_put(stats, "flush_total_time_ns",
+              qint_from_int(bs->total_time_ns[BDRV_ACCT_FLUSH]));
+    qdict_put(stats, "in_flight", qint_from_int(bs->in_flight));
+    qdict_put(stats, "max_in_flight", qint_from_int(bs->max_in_flight));
+    qdict_put(stats, "avg_queue_depth",
+              qfloat_from_double(bs->queue_depth_samples ?
+                                 (double)bs->queue_depth_sum /
+                                 bs->queue_depth_samples : 0));
+
+    latency = qdict_new();
+    qdict_put(latency, "read", bdrv_latency_list(bs, BDRV_ACCT_READ));
+    qdict_put(latency, "write", bdrv_latency_list(bs, BDRV_ACCT_WRITE));
+    qdict_put(latency, "flush", bdrv_latency_list(bs, BDRV_ACCT_FLUSH));
+    qdict_put(stats, "latency", latency);
+
     if (*bs->device_name) {
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
     }
@@ -1868,10 +2485,56 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
+    bdrv_mark_dirty_bitmaps(bs, sector_num, nb_sectors);
 
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/*
+ * Compresses one cluster for bdrv_write_compressed_cluster(), so that several
+ * clusters can be compressed in parallel.  out_buf must hold a cluster.
+ * Returns the compressed length, 0 if the cluster does not compress, or a
+ * negative errno.  Unlike the rest of the block layer, this function may be
+ * called from any thread.
+ */
+int bdrv_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                          const uint8_t *buf)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_compress_cluster)
+        return -ENOTSUP;
+
+    return drv->bdrv_compress_cluster(bs, out_buf, buf);
+}
+
+/*
+ * Writes the cluster at sector_num whose data buf was compressed by
+ * bdrv_compress_cluster() into out_len bytes of out_buf.  If out_len is 0,
+ * buf is written uncompressed.
+ */
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors,
+                                  const uint8_t *out_buf, int out_len)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_compressed_cluster)
+        return -ENOTSUP;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+    bdrv_mark_dirty_bitmaps(bs, sector_num, nb_sectors);
+
+    return drv->bdrv_write_compressed_cluster(bs, sector_num, buf, nb_sectors,
+                                              out_buf, out_len);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -2121,22 +2784,145 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 /**************************************************************/
 /* async I/Os */
 
-BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
-                                 QEMUIOVector *qiov, int nb_sectors,
-                                 BlockDriverCompletionFunc *cb, void *opaque)
-{
-    BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
-
-    trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
+/*
+ * Request accounting
+ *
+ * Requests submitted through bdrv_aio_readv/writev/flush are wrapped in a
+ * BdrvAcctAIOCB that records their latency from submission, including time
+ * spent in the throttling queue, to completion.  Each BlockDriverState is
+ * accounted separately, so comparing a drive with its protocol layer
+ * (bs->file) shows how much of the latency comes from the host.
+ */
 
-    if (!drv)
-        return NULL;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
+typedef struct BdrvAcctAIOCB {
+    BlockDriverAIOCB common;
+    BlockDriverAIOCB *real_acb;
+    QEMUBH *bh;
+    bool submitting;
+    int type;
+    int ret;
+    int64_t start;
+} BdrvAcctAIOCB;
+
+static void bdrv_acct_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvAcctAIOCB *acb = container_of(blockacb, BdrvAcctAIOCB, common);
+
+    if (acb->bh) {
+        /* Already accounted, only the callback is pending */
+        qemu_bh_delete(acb->bh);
+    } else {
+        bdrv_aio_cancel(acb->real_acb);
+        acb->common.bs->in_flight--;
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_acct_aio_pool = {
+    .aiocb_size         = sizeof(BdrvAcctAIOCB),
+    .cancel             = bdrv_acct_cancel,
+};
+
+static int bdrv_latency_bucket(int64_t ns)
+{
+    int64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (us > 0 && bucket < BDRV_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void bdrv_acct_bh(void *opaque)
+{
+    BdrvAcctAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_acct_cb(void *opaque, int ret)
+{
+    BdrvAcctAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+    int64_t latency = get_clock() - acb->start;
+
+    trace_bdrv_acct_done(bs, acb, acb->type, ret, latency);
+
+    bs->in_flight--;
+    bs->latency[acb->type][bdrv_latency_bucket(latency)]++;
+    bs->total_time_ns[acb->type] += latency;
+
+    if (acb->submitting) {
+        /* The caller doesn't have the AIOCB yet, complete it from a BH */
+        acb->ret = ret;
+        acb->bh = qemu_bh_new(bdrv_acct_bh, acb);
+        qemu_bh_schedule(acb->bh);
+        return;
+    }
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static BdrvAcctAIOCB *bdrv_acct_start(BlockDriverState *bs, int type,
+                                      BlockDriverCompletionFunc *cb,
+                                      void *opaque)
+{
+    BdrvAcctAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_acct_aio_pool, bs, cb, opaque);
+    acb->type = type;
+    acb->start = get_clock();
+    acb->real_acb = NULL;
+    acb->bh = NULL;
+    acb->submitting = true;
+
+    bs->queue_depth_sum += bs->in_flight;
+    bs->queue_depth_samples++;
+    bs->in_flight++;
+    if (bs->in_flight > bs->max_in_flight) {
+        bs->max_in_flight = bs->in_flight;
+    }
+
+    trace_bdrv_acct_start(bs, acb, type, acb->start, bs->in_flight);
+    return acb;
+}
+
+/* Must be called right after submitting the request that acb wraps */
+static BlockDriverAIOCB *bdrv_acct_submitted(BdrvAcctAIOCB *acb,
+                                             BlockDriverAIOCB *real_acb)
+{
+    acb->submitting = false;
+    if (!real_acb && !acb->bh) {
+        acb->common.bs->in_flight--;
+        qemu_aio_release(acb);
         return NULL;
+    }
+    acb->real_acb = real_acb;
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *bdrv_aio_do_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
 
-    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
+    if (bs->copy_on_read && bs->backing_hd) {
+        ret = bdrv_aio_copy_on_readv(bs, sector_num, qiov, nb_sectors,
+                                     cb, opaque);
+    } else if (bs->shared_image && bs->read_only && nb_sectors > 0) {
+        ret = bdrv_shared_cache_readv(bs, sector_num, qiov, nb_sectors,
+                                      cb, opaque);
+    } else {
+        ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+    }
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
@@ -2147,6 +2933,48 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
+/*
+ * Synchronous requests are waited for in qemu_aio_wait(), where the throttling
+ * timer doesn't run, so they pass with throttle == false.  They still count
+ * against the limits, but are never delayed.
+ */
+static BlockDriverAIOCB *bdrv_aio_readv_common(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, bool throttle)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvAcctAIOCB *acct;
+    BlockDriverAIOCB *ret;
+
+    trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
+
+    if (!drv)
+        return NULL;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return NULL;
+
+    acct = bdrv_acct_start(bs, BDRV_ACCT_READ, cb, opaque);
+    if (bs->io_limits_enabled && throttle) {
+        ret = bdrv_io_limits_intercept(bs, sector_num, qiov, nb_sectors,
+                                       bdrv_acct_cb, acct, 0);
+    } else {
+        if (bs->io_limits_enabled) {
+            bdrv_io_limits_account(bs, 0, nb_sectors);
+        }
+        ret = bdrv_aio_do_readv(bs, sector_num, qiov, nb_sectors,
+                                bdrv_acct_cb, acct);
+    }
+    return bdrv_acct_submitted(acct, ret);
+}
+
+BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_aio_readv_common(bs, sector_num, qiov, nb_sectors,
+                                 cb, opaque, true);
+}
+
 typedef struct BlockCompleteData {
     BlockDriverCompletionFunc *cb;
     void *opaque;
@@ -2183,22 +3011,41 @@ static BlockCompleteData *blk_dirty_cb_alloc(BlockDriverState *bs,
     return blkdata;
 }
 
-BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
-                                  QEMUIOVector *qiov, int nb_sectors,
-                                  BlockDriverCompletionFunc *cb, void *opaque)
+/*
+ * Submits a write to the image format driver.  With detect-zeroes enabled,
+ * writes that only contain zeroes go to bdrv_aio_write_zeroes instead so that
+ * the driver can record them in its metadata rather than allocate clusters.
+ */
+static BlockDriverAIOCB *bdrv_driver_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
-    BlockDriverAIOCB *ret;
-    BlockCompleteData *blk_cb_data;
 
-    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
+    if ((bs->open_flags & BDRV_O_DETECT_ZEROES) && drv->bdrv_aio_write_zeroes &&
+        qemu_iovec_is_zero(qiov, (size_t)nb_sectors * BDRV_SECTOR_SIZE)) {
+        trace_bdrv_aio_write_zeroes(bs, sector_num, nb_sectors, opaque);
+        return drv->bdrv_aio_write_zeroes(bs, sector_num, qiov, nb_sectors,
+                                          cb, opaque);
+    }
 
-    if (!drv)
-        return NULL;
-    if (bs->read_only)
-        return NULL;
-    if (bdrv_check_request(bs, sector_num, nb_sectors))
-        return NULL;
+    return drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
+static int bdrv_writes_tracked(BlockDriverState *bs)
+{
+    /* Keep tracking until copies that are still in flight have completed */
+    return bs->copy_on_read || !QLIST_EMPTY(&bs->tracked_requests) ||
+           !QTAILQ_EMPTY(&bs->waiting_requests) ||
+           (bs->job && bs->job->job_type->before_write);
+}
+
+static BlockDriverAIOCB *bdrv_aio_do_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriverAIOCB *ret;
+    BlockCompleteData *blk_cb_data;
 
     if (bs->dirty_bitmap) {
         blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
@@ -2206,9 +3053,19 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
         cb = &block_complete_cb;
         opaque = blk_cb_data;
     }
+    bdrv_mark_dirty_bitmaps(bs, sector_num, nb_sectors);
+
+    if (bs->shared_image && nb_sectors > 0) {
+        bdrv_shared_cache_invalidate(bs, sector_num, nb_sectors);
+    }
 
-    ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
-                               cb, opaque);
+    if (bdrv_writes_tracked(bs)) {
+        ret = bdrv_aio_tracked_writev(bs, sector_num, qiov, nb_sectors,
+                                      cb, opaque);
+    } else {
+        ret = bdrv_driver_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                     cb, opaque);
+    }
 
     if (ret) {
         /* Update stats even though technically transfer has not happened. */
@@ -2222,6 +3079,45 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
+static BlockDriverAIOCB *bdrv_aio_writev_common(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, bool throttle)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvAcctAIOCB *acct;
+    BlockDriverAIOCB *ret;
+
+    trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return NULL;
+
+    acct = bdrv_acct_start(bs, BDRV_ACCT_WRITE, cb, opaque);
+    if (bs->io_limits_enabled && throttle) {
+        ret = bdrv_io_limits_intercept(bs, sector_num, qiov, nb_sectors,
+                                       bdrv_acct_cb, acct, 1);
+    } else {
+        if (bs->io_limits_enabled) {
+            bdrv_io_limits_account(bs, 1, nb_sectors);
+        }
+        ret = bdrv_aio_do_writev(bs, sector_num, qiov, nb_sectors,
+                                 bdrv_acct_cb, acct);
+    }
+    return bdrv_acct_submitted(acct, ret);
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_aio_writev_common(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, true);
+}
+
 
 typedef struct MultiwriteCB {
     int error;
@@ -2286,9 +3182,12 @@ static int multiwrite_req_compare(const void *a, const void *b)
 /*
  * Takes a bunch of requests and tries to merge them. Returns the number of
  * requests that remain after merging.
+ *
+ * Reads are only merged when they are exactly sequential: overlapping reads
+ * would need the same data in two buffers, and gaps can't be filled.
  */
 static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
-    int num_reqs, MultiwriteCB *mcb)
+    int num_reqs, MultiwriteCB *mcb, int is_write)
 {
     int i, outidx;
 
@@ -2302,185 +3201,1877 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
         int merge = 0;
         int64_t oldreq_last = reqs[outidx].sector + reqs[outidx].nb_sectors;
 
-        // This handles the cases that are valid for all block drivers, namely
-        // exactly sequential writes and overlapping writes.
-        if (reqs[i].sector <= oldreq_last) {
-            merge = 1;
-        }
+        // This handles the cases that are valid for all block drivers, namely
+        // exactly sequential writes and overlapping writes.
+        if (reqs[i].sector == oldreq_last ||
+            (is_write && reqs[i].sector < oldreq_last)) {
+            merge = 1;
+        }
+
+        // The block driver may decide that it makes sense to combine requests
+        // even if there is a gap of some sectors between them. In this case,
+        // the gap is filled with zeros (therefore only applicable for yet
+        // unused space in format like qcow2).
+        if (!merge && is_write && bs->drv->bdrv_merge_requests) {
+            merge = bs->drv->bdrv_merge_requests(bs, &reqs[outidx], &reqs[i]);
+        }
+
+        if (reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1 > IOV_MAX) {
+            merge = 0;
+        }
+
+        if (merge) {
+            size_t size;
+            QEMUIOVector *qiov = qemu_mallocz(sizeof(*qiov));
+            qemu_iovec_init(qiov,
+                reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1);
+
+            // Add the first request to the merged one. If the requests are
+            // overlapping, drop the last sectors of the first request.
+            size = (reqs[i].sector - reqs[outidx].sector) << 9;
+            qemu_iovec_concat(qiov, reqs[outidx].qiov, size);
+
+            // We might need to add some zeros between the two requests
+            if (reqs[i].sector > oldreq_last) {
+                size_t zero_bytes = (reqs[i].sector - oldreq_last) << 9;
+                uint8_t *buf = qemu_blockalign(bs, zero_bytes);
+                memset(buf, 0, zero_bytes);
+                qemu_iovec_add(qiov, buf, zero_bytes);
+                mcb->callbacks[i].free_buf = buf;
+            }
+
+            // Add the second request
+            qemu_iovec_concat(qiov, reqs[i].qiov, reqs[i].qiov->size);
+
+            reqs[outidx].nb_sectors = qiov->size >> 9;
+            reqs[outidx].qiov = qiov;
+
+            mcb->callbacks[i].free_qiov = reqs[outidx].qiov;
+        } else {
+            outidx++;
+            reqs[outidx].sector     = reqs[i].sector;
+            reqs[outidx].nb_sectors = reqs[i].nb_sectors;
+            reqs[outidx].qiov       = reqs[i].qiov;
+        }
+    }
+
+    return outidx + 1;
+}
+
+static int bdrv_aio_multi_rw(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs, int is_write)
+{
+    BlockDriverAIOCB *acb;
+    MultiwriteCB *mcb;
+    int i;
+
+    /* don't submit requests if we don't have a medium */
+    if (bs->drv == NULL) {
+        for (i = 0; i < num_reqs; i++) {
+            reqs[i].error = -ENOMEDIUM;
+        }
+        return -1;
+    }
+
+    if (num_reqs == 0) {
+        return 0;
+    }
+
+    // Create MultiwriteCB structure
+    mcb = qemu_mallocz(sizeof(*mcb) + num_reqs * sizeof(*mcb->callbacks));
+    mcb->num_requests = 0;
+    mcb->num_callbacks = num_reqs;
+
+    for (i = 0; i < num_reqs; i++) {
+        mcb->callbacks[i].cb = reqs[i].cb;
+        mcb->callbacks[i].opaque = reqs[i].opaque;
+    }
+
+    // Check for mergable requests
+    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb, is_write);
+
+    if (is_write) {
+        trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+        bs->wr_merged += mcb->num_callbacks - num_reqs;
+    } else {
+        trace_bdrv_aio_multiread(mcb, mcb->num_callbacks, num_reqs);
+        bs->rd_merged += mcb->num_callbacks - num_reqs;
+    }
+
+    /*
+     * Run the aio requests. As soon as one request can't be submitted
+     * successfully, fail all requests that are not yet submitted (we must
+     * return failure for all requests anyway)
+     *
+     * num_requests cannot be set to the right value immediately: If
+     * bdrv_aio_writev fails for some request, num_requests would be too high
+     * and therefore multiwrite_cb() would never recognize the multiwrite
+     * request as completed. We also cannot use the loop variable i to set it
+     * when the first request fails because the callback may already have been
+     * called for previously submitted requests. Thus, num_requests must be
+     * incremented for each request that is submitted.
+     *
+     * The problem that callbacks may be called early also means that we need
+     * to take care that num_requests doesn't become 0 before all requests are
+     * submitted - multiwrite_cb() would consider the multiwrite request
+     * completed. A dummy request that is "completed" by a manual call to
+     * multiwrite_cb() takes care of this.
+     */
+    mcb->num_requests = 1;
+
+    // Run the aio requests
+    for (i = 0; i < num_reqs; i++) {
+        mcb->num_requests++;
+        if (is_write) {
+            acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        } else {
+            acb = bdrv_aio_readv(bs, reqs[i].sector, reqs[i].qiov,
+                reqs[i].nb_sectors, multiwrite_cb, mcb);
+        }
+
+        if (acb == NULL) {
+            // We can only fail the whole thing if no request has been
+            // submitted yet. Otherwise we'll wait for the submitted AIOs to
+            // complete and report the error in the callback.
+            if (i == 0) {
+                trace_bdrv_aio_multiwrite_earlyfail(mcb);
+                goto fail;
+            } else {
+                trace_bdrv_aio_multiwrite_latefail(mcb, i);
+                multiwrite_cb(mcb, -EIO);
+                break;
+            }
+        }
+    }
+
+    /* Complete the dummy request */
+    multiwrite_cb(mcb, 0);
+
+    return 0;
+
+fail:
+    for (i = 0; i < mcb->num_callbacks; i++) {
+        reqs[i].error = -EIO;
+    }
+    qemu_free(mcb);
+    return -1;
+}
+
+/*
+ * Submit multiple AIO write requests at once.
+ *
+ * On success, the function returns 0 and all requests in the reqs array have
+ * been submitted. In error case this function returns -1, and any of the
+ * requests may or may not be submitted yet. In particular, this means that the
+ * callback will be called for some of the requests, for others it won't. The
+ * caller must check the error field of the BlockRequest to wait for the right
+ * callbacks (if error != 0, no callback will be called).
+ *
+ * The implementation may modify the contents of the reqs array, e.g. to merge
+ * requests. However, the fields opaque and error are left unmodified as they
+ * are used to signal failure for a single request to the caller.
+ */
+int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, 1);
+}
+
+/*
+ * Submit multiple AIO read requests at once, merging sequential ones.
+ * Same calling conventions as bdrv_aio_multiwrite().
+ */
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+{
+    return bdrv_aio_multi_rw(bs, reqs, num_reqs, 0);
+}
+
+BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BdrvAcctAIOCB *acct;
+    BlockDriverAIOCB *ret;
+
+    trace_bdrv_aio_flush(bs, opaque);
+
+    if (bs->open_flags & BDRV_O_NO_FLUSH) {
+        return bdrv_aio_noop_em(bs, cb, opaque);
+    }
+
+    if (!drv)
+        return NULL;
+
+    acct = bdrv_acct_start(bs, BDRV_ACCT_FLUSH, cb, opaque);
+    ret = drv->bdrv_aio_flush(bs, bdrv_acct_cb, acct);
+    if (ret) {
+        bs->flush_ops++;
+    }
+    return bdrv_acct_submitted(acct, ret);
+}
+
+void bdrv_aio_cancel(BlockDriverAIOCB *acb)
+{
+    acb->pool->cancel(acb);
+}
+
+/*
+ * Plugging a device delays submission of its requests until the matching
+ * bdrv_io_unplug(), so that a whole batch can be handed to the host with a
+ * single system call. Calls may be nested.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
+/*
+ * Sets how long (in ns) the host AIO backend may busy-poll for completions
+ * before waiting for a notification. 0 disables polling.
+ */
+void bdrv_set_aio_poll(BlockDriverState *bs, int64_t poll_ns)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_set_aio_poll) {
+        drv->bdrv_set_aio_poll(bs, poll_ns);
+    } else if (bs->file) {
+        bdrv_set_aio_poll(bs->file, poll_ns);
+    }
+}
+
+/*
+ * Sets how much memory (in bytes) the image format driver may use to cache
+ * its metadata tables, e.g. the vmdk grain tables.
+ */
+int bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t size)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_set_metadata_cache_size) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_set_metadata_cache_size(bs, size);
+}
+
+/**************************************************************/
+/* I/O throttling */
+
+/*
+ * Every limit is a leaky bucket: dispatched requests fill it up and it drains
+ * at the configured rate.  A request may be dispatched as long as none of the
+ * buckets it is accounted against is filled beyond its burst size; otherwise
+ * it is queued and restarted from a timer.  Reads and writes are queued
+ * separately so that a saturated write limit does not hold back reads.
+ */
+
+struct BlockThrottledAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int is_write;
+    BlockDriverAIOCB *real_acb;
+    /* Set while the request is handed to the driver */
+    bool dispatching;
+    int ret;
+    QTAILQ_ENTRY(BlockThrottledAIOCB) list;
+};
+
+static void bdrv_throttled_cancel(BlockDriverAIOCB *blockacb)
+{
+    BlockThrottledAIOCB *acb =
+        container_of(blockacb, BlockThrottledAIOCB, common);
+
+    if (acb->real_acb) {
+        bdrv_aio_cancel(acb->real_acb);
+    } else {
+        QTAILQ_REMOVE(&acb->common.bs->throttled_reqs[acb->is_write],
+                      acb, list);
+    }
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_throttled_aio_pool = {
+    .aiocb_size         = sizeof(BlockThrottledAIOCB),
+    .cancel             = bdrv_throttled_cancel,
+};
+
+static void bdrv_throttled_cb(void *opaque, int ret)
+{
+    BlockThrottledAIOCB *acb = opaque;
+
+    if (acb->dispatching) {
+        /* Completed synchronously, bdrv_io_limits_dispatch() finishes it */
+        acb->ret = ret;
+        return;
+    }
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_io_limits_leak(BlockDriverState *bs)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    double elapsed = (now - bs->io_limits_timestamp) / 1000000000.0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        bs->io_level_bytes[i] -= bs->io_limits.bps[i] * elapsed;
+        if (bs->io_level_bytes[i] < 0 || !bs->io_limits.bps[i]) {
+            bs->io_level_bytes[i] = 0;
+        }
+        bs->io_level_ops[i] -= bs->io_limits.iops[i] * elapsed;
+        if (bs->io_level_ops[i] < 0 || !bs->io_limits.iops[i]) {
+            bs->io_level_ops[i] = 0;
+        }
+    }
+    bs->io_limits_timestamp = now;
+}
+
+/*
+ * Returns the time in ns that has to pass before the bucket allows another
+ * request, or 0 if a request can be dispatched right away.
+ */
+static int64_t bdrv_io_limits_bucket_wait(double level, int64_t rate,
+                                          int64_t burst)
+{
+    double max;
+
+    if (!rate) {
+        return 0;
+    }
+
+    max = burst ? burst : rate / 10.0;
+    if (level <= max) {
+        return 0;
+    }
+
+    return (int64_t)((level - max) * 1000000000.0 / rate) + 1;
+}
+
+static int64_t bdrv_io_limits_wait(BlockDriverState *bs, int is_write)
+{
+    BlockIOLimit *l = &bs->io_limits;
+    int64_t wait, max_wait = 0;
+    int i, idx[2] = { is_write, BLOCK_IO_LIMIT_TOTAL };
+
+    bdrv_io_limits_leak(bs);
+
+    for (i = 0; i < 2; i++) {
+        wait = bdrv_io_limits_bucket_wait(bs->io_level_bytes[idx[i]],
+                                          l->bps[idx[i]], l->bps_burst);
+        max_wait = MAX(max_wait, wait);
+        wait = bdrv_io_limits_bucket_wait(bs->io_level_ops[idx[i]],
+                                          l->iops[idx[i]], l->iops_burst);
+        max_wait = MAX(max_wait, wait);
+    }
+
+    return max_wait;
+}
+
+static void bdrv_io_limits_account(BlockDriverState *bs, int is_write,
+                                   int nb_sectors)
+{
+    double bytes = (double)nb_sectors * BDRV_SECTOR_SIZE;
+
+    bs->io_level_bytes[is_write] += bytes;
+    bs->io_level_bytes[BLOCK_IO_LIMIT_TOTAL] += bytes;
+    bs->io_level_ops[is_write] += 1;
+    bs->io_level_ops[BLOCK_IO_LIMIT_TOTAL] += 1;
+}
+
+static void bdrv_io_limits_dispatch(BlockThrottledAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    bdrv_io_limits_account(bs, acb->is_write, acb->nb_sectors);
+
+    acb->dispatching = true;
+    acb->ret = -EINPROGRESS;
+    if (acb->is_write) {
+        acb->real_acb = bdrv_aio_do_writev(bs, acb->sector_num, acb->qiov,
+                                           acb->nb_sectors,
+                                           bdrv_throttled_cb, acb);
+    } else {
+        acb->real_acb = bdrv_aio_do_readv(bs, acb->sector_num, acb->qiov,
+                                          acb->nb_sectors,
+                                          bdrv_throttled_cb, acb);
+    }
+    acb->dispatching = false;
+
+    if (!acb->real_acb) {
+        bdrv_throttled_cb(acb, -EIO);
+    } else if (acb->ret != -EINPROGRESS) {
+        bdrv_throttled_cb(acb, acb->ret);
+    }
+}
+
+static void bdrv_io_limits_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BlockThrottledAIOCB *acb;
+    int64_t wait, next_wait = 0;
+    int is_write;
+
+    for (is_write = 0; is_write < 2; is_write++) {
+        while ((acb = QTAILQ_FIRST(&bs->throttled_reqs[is_write]))) {
+            wait = bdrv_io_limits_wait(bs, is_write);
+            if (wait) {
+                if (!next_wait || wait < next_wait) {
+                    next_wait = wait;
+                }
+                break;
+            }
+            QTAILQ_REMOVE(&bs->throttled_reqs[is_write], acb, list);
+            bdrv_io_limits_dispatch(acb);
+        }
+    }
+
+    if (next_wait) {
+        qemu_mod_timer(bs->io_limits_timer,
+                       qemu_get_clock_ns(rt_clock) + next_wait);
+    }
+}
+
+static BlockDriverAIOCB *bdrv_io_limits_intercept(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BlockThrottledAIOCB *acb;
+    int64_t wait;
+
+    /* Keep requests in order: only bypass the queue if it is empty */
+    if (QTAILQ_EMPTY(&bs->throttled_reqs[is_write])) {
+        wait = bdrv_io_limits_wait(bs, is_write);
+        if (!wait) {
+            bdrv_io_limits_account(bs, is_write, nb_sectors);
+            if (is_write) {
+                return bdrv_aio_do_writev(bs, sector_num, qiov, nb_sectors,
+                                          cb, opaque);
+            } else {
+                return bdrv_aio_do_readv(bs, sector_num, qiov, nb_sectors,
+                                         cb, opaque);
+            }
+        }
+        qemu_mod_timer(bs->io_limits_timer,
+                       qemu_get_clock_ns(rt_clock) + wait);
+    }
+
+    acb = qemu_aio_get(&bdrv_throttled_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->is_write = is_write;
+    acb->real_acb = NULL;
+    acb->dispatching = false;
+    QTAILQ_INSERT_TAIL(&bs->throttled_reqs[is_write], acb, list);
+
+    trace_bdrv_io_limits_intercept(bs, sector_num, nb_sectors, is_write, acb);
+
+    return &acb->common;
+}
+
+/* Dispatches all queued requests, ignoring the limits */
+static void bdrv_io_limits_flush(BlockDriverState *bs)
+{
+    BlockThrottledAIOCB *acb;
+    int is_write;
+
+    for (is_write = 0; is_write < 2; is_write++) {
+        while ((acb = QTAILQ_FIRST(&bs->throttled_reqs[is_write]))) {
+            QTAILQ_REMOVE(&bs->throttled_reqs[is_write], acb, list);
+            bdrv_io_limits_dispatch(acb);
+        }
+    }
+}
+
+/*
+ * Requests held back by throttling are invisible to the AIO backends, so
+ * qemu_aio_flush() calls this to make sure that they are submitted before it
+ * starts waiting for completions.
+ */
+void bdrv_io_limits_flush_all(void)
+{
+    BlockDriverState *bs;
+
+    QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bs->io_limits_enabled) {
+            bdrv_io_limits_flush(bs);
+        }
+    }
+}
+
+static void bdrv_io_limits_enable(BlockDriverState *bs)
+{
+    bs->io_limits_timer = qemu_new_timer_ns(rt_clock, bdrv_io_limits_timer_cb,
+                                            bs);
+    bs->io_limits_timestamp = qemu_get_clock_ns(rt_clock);
+    memset(bs->io_level_bytes, 0, sizeof(bs->io_level_bytes));
+    memset(bs->io_level_ops, 0, sizeof(bs->io_level_ops));
+    bs->io_limits_enabled = 1;
+}
+
+static void bdrv_io_limits_disable(BlockDriverState *bs)
+{
+    bs->io_limits_enabled = 0;
+    bdrv_io_limits_flush(bs);
+
+    qemu_del_timer(bs->io_limits_timer);
+    qemu_free_timer(bs->io_limits_timer);
+    bs->io_limits_timer = NULL;
+}
+
+static int bdrv_io_limits_any(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] || io_limits->iops[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    int enable = bdrv_io_limits_any(io_limits);
+
+    if (bs->io_limits_enabled) {
+        /* Account what has been used so far at the old rates */
+        bdrv_io_limits_leak(bs);
+    }
+
+    bs->io_limits = *io_limits;
+
+    if (enable && !bs->io_limits_enabled) {
+        bdrv_io_limits_enable(bs);
+    } else if (!enable && bs->io_limits_enabled) {
+        bdrv_io_limits_disable(bs);
+    } else if (enable) {
+        /* Queued requests may be allowed to run earlier now */
+        qemu_mod_timer(bs->io_limits_timer, qemu_get_clock_ns(rt_clock));
+    }
+
+    if (bs->change_cb) {
+        bs->change_cb(bs->change_opaque, CHANGE_USERS);
+    }
+}
+
+void bdrv_get_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits)
+{
+    *io_limits = bs->io_limits;
+}
+
+/**************************************************************/
+/* copy-on-read */
+
+/*
+ * With copy-on-read, sectors that are read from the backing file are written
+ * into the image so that later reads don't have to go to the backing file
+ * again.  The copy is done in whole clusters to avoid partial cluster
+ * allocations that would need another read from the backing file.
+ *
+ * A copy writes back data that was read earlier, so it must not overlap
+ * with a guest write that is in flight at the same time.  Copies and writes
+ * are therefore tracked and a request that conflicts with an in-flight one
+ * waits until it has completed.  Guest writes never wait for each other.
+ */
+
+typedef struct BdrvTrackedAIOCB {
+    BlockDriverAIOCB common;
+    BdrvTrackedRequest req;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    BlockDriverAIOCB *real_acb;
+    /* copy-on-read only: buffer for the cluster aligned request */
+    uint8_t *bounce;
+    struct iovec bounce_iov;
+    QEMUIOVector bounce_qiov;
+} BdrvTrackedAIOCB;
+
+static int bdrv_tracked_request_overlaps(BdrvTrackedRequest *req,
+                                         BdrvTrackedRequest *other)
+{
+    return req->sector_num < other->sector_num + other->nb_sectors &&
+           other->sector_num < req->sector_num + req->nb_sectors;
+}
+
+static int bdrv_tracked_request_conflicts(BlockDriverState *bs,
+                                          BdrvTrackedRequest *req)
+{
+    BdrvTrackedRequest *other;
+
+    QLIST_FOREACH(other, &bs->tracked_requests, list) {
+        if (!req->serialising && !other->serialising) {
+            continue;
+        }
+        if (bdrv_tracked_request_overlaps(req, other)) {
+            return 1;
+        }
+    }
+
+    /*
+     * A write must not overtake a copy that is already waiting, or the copy
+     * would read the new data.
+     */
+    if (!req->serialising) {
+        QTAILQ_FOREACH(other, &bs->waiting_requests, wait_list) {
+            if (other->serialising &&
+                bdrv_tracked_request_overlaps(req, other)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Marks the request as in flight and returns 1, or queues it and returns 0 if
+ * it has to wait for a conflicting request.  A queued request is started by
+ * calling its resume function.
+ */
+int bdrv_tracked_request_begin(BlockDriverState *bs, BdrvTrackedRequest *req)
+{
+    if (bdrv_tracked_request_conflicts(bs, req)) {
+        QTAILQ_INSERT_TAIL(&bs->waiting_requests, req, wait_list);
+        return 0;
+    }
+
+    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    return 1;
+}
+
+void bdrv_tracked_request_end(BlockDriverState *bs, BdrvTrackedRequest *req)
+{
+    QTAILQ_HEAD(, BdrvTrackedRequest) waiting;
+    BdrvTrackedRequest *next;
+
+    QLIST_REMOVE(req, list);
+
+    /* Give all waiting requests another chance, in order */
+    QTAILQ_INIT(&waiting);
+    while ((next = QTAILQ_FIRST(&bs->waiting_requests))) {
+        QTAILQ_REMOVE(&bs->waiting_requests, next, wait_list);
+        QTAILQ_INSERT_TAIL(&waiting, next, wait_list);
+    }
+
+    while ((next = QTAILQ_FIRST(&waiting))) {
+        QTAILQ_REMOVE(&waiting, next, wait_list);
+        if (bdrv_tracked_request_begin(bs, next)) {
+            next->resume(next);
+        }
+    }
+}
+
+static void bdrv_tracked_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvTrackedAIOCB *acb = container_of(blockacb, BdrvTrackedAIOCB, common);
+    BlockDriverState *bs = acb->common.bs;
+
+    if (acb->real_acb) {
+        bdrv_aio_cancel(acb->real_acb);
+        bdrv_tracked_request_end(bs, &acb->req);
+    } else {
+        QTAILQ_REMOVE(&bs->waiting_requests, &acb->req, wait_list);
+    }
+    qemu_vfree(acb->bounce);
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_tracked_aio_pool = {
+    .aiocb_size         = sizeof(BdrvTrackedAIOCB),
+    .cancel             = bdrv_tracked_cancel,
+};
+
+static void bdrv_tracked_complete(BdrvTrackedAIOCB *acb, int ret)
+{
+    bdrv_tracked_request_end(acb->common.bs, &acb->req);
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_vfree(acb->bounce);
+    qemu_aio_release(acb);
+}
+
+static BdrvTrackedAIOCB *bdrv_tracked_aio_get(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvTrackedAIOCB *acb;
+
+    acb = qemu_aio_get(&bdrv_tracked_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->real_acb = NULL;
+    acb->bounce = NULL;
+    acb->req.sector_num = sector_num;
+    acb->req.nb_sectors = nb_sectors;
+    acb->req.serialising = 0;
+    return acb;
+}
+
+static void bdrv_tracked_write_cb(void *opaque, int ret)
+{
+    BdrvTrackedAIOCB *acb = opaque;
+
+    /* Image formats allocate whole clusters, even for partial writes */
+    if (ret == 0) {
+        bdrv_cor_mark_allocated(acb->common.bs, acb->sector_num,
+                                acb->nb_sectors);
+    }
+    acb->real_acb = NULL;
+    bdrv_tracked_complete(acb, ret);
+}
+
+static int bdrv_tracked_write_start(BdrvTrackedAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->real_acb = bdrv_driver_aio_writev(bs, acb->sector_num, acb->qiov,
+                                           acb->nb_sectors,
+                                           bdrv_tracked_write_cb, acb);
+    return acb->real_acb ? 0 : -EIO;
+}
+
+static void bdrv_tracked_write_resume(BdrvTrackedRequest *req)
+{
+    BdrvTrackedAIOCB *acb = container_of(req, BdrvTrackedAIOCB, req);
+
+    if (bdrv_tracked_write_start(acb) < 0) {
+        bdrv_tracked_complete(acb, -EIO);
+    }
+}
+
+static BlockDriverAIOCB *bdrv_aio_tracked_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvTrackedAIOCB *acb;
+
+    if (bs->job && bs->job->job_type->before_write) {
+        bs->job->job_type->before_write(bs->job, sector_num, nb_sectors);
+    }
+
+    acb = bdrv_tracked_aio_get(bs, sector_num, qiov, nb_sectors, cb, opaque);
+    acb->req.resume = bdrv_tracked_write_resume;
+
+    if (bdrv_tracked_request_begin(bs, &acb->req)) {
+        if (bdrv_tracked_write_start(acb) < 0) {
+            QLIST_REMOVE(&acb->req, list);
+            qemu_aio_release(acb);
+            return NULL;
+        }
+    }
+
+    return &acb->common;
+}
+
+static void bdrv_copy_on_read_write_cb(void *opaque, int ret)
+{
+    BdrvTrackedAIOCB *acb = opaque;
+
+    /* The guest got its data, failing to keep a copy is not an error */
+    trace_bdrv_copy_on_read_done(acb->common.bs, acb->req.sector_num,
+                                 acb->req.nb_sectors, ret);
+    if (ret == 0) {
+        bdrv_cor_mark_allocated(acb->common.bs, acb->req.sector_num,
+                                acb->req.nb_sectors);
+    }
+    acb->real_acb = NULL;
+    bdrv_tracked_complete(acb, 0);
+}
+
+static void bdrv_copy_on_read_read_cb(void *opaque, int ret)
+{
+    BdrvTrackedAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->real_acb = NULL;
+    if (ret < 0) {
+        bdrv_tracked_complete(acb, ret);
+        return;
+    }
+
+    qemu_iovec_from_buffer(acb->qiov, acb->bounce +
+        (acb->sector_num - acb->req.sector_num) * BDRV_SECTOR_SIZE,
+        acb->nb_sectors * BDRV_SECTOR_SIZE);
+
+    acb->real_acb = bdrv_driver_aio_writev(bs, acb->req.sector_num,
+                                           &acb->bounce_qiov,
+                                           acb->req.nb_sectors,
+                                           bdrv_copy_on_read_write_cb, acb);
+    if (!acb->real_acb) {
+        bdrv_tracked_complete(acb, 0);
+    }
+}
+
+static int bdrv_copy_on_read_start(BdrvTrackedAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+
+    acb->real_acb = bs->drv->bdrv_aio_readv(bs, acb->req.sector_num,
+                                            &acb->bounce_qiov,
+                                            acb->req.nb_sectors,
+                                            bdrv_copy_on_read_read_cb, acb);
+    return acb->real_acb ? 0 : -EIO;
+}
+
+static void bdrv_copy_on_read_resume(BdrvTrackedRequest *req)
+{
+    BdrvTrackedAIOCB *acb = container_of(req, BdrvTrackedAIOCB, req);
+
+    if (bdrv_copy_on_read_start(acb) < 0) {
+        bdrv_tracked_complete(acb, -EIO);
+    }
+}
+
+/*
+ * Records that the clusters covering a range are allocated in the image.  The
+ * bitmap is seeded from the image metadata when copy-on-read is enabled and
+ * every write goes through the tracked path, so clusters that are not marked
+ * are really unallocated.
+ */
+static void bdrv_cor_mark_allocated(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors)
+{
+    int64_t start, end;
+
+    if (!bs->cor_allocated || nb_sectors <= 0) {
+        return;
+    }
+    start = sector_num / bs->cor_cluster_sectors;
+    end = (sector_num + nb_sectors - 1) / bs->cor_cluster_sectors + 1;
+    end = MIN(end, bs->cor_nb_clusters);
+    if (start < end) {
+        bitmap_set(bs->cor_allocated, start, end - start);
+    }
+}
+
+static int bdrv_cor_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                                 int64_t end_sector)
+{
+    int64_t start = sector_num / bs->cor_cluster_sectors;
+    int64_t end = DIV_ROUND_UP(end_sector, bs->cor_cluster_sectors);
+    int pnum;
+
+    if (bs->cor_allocated) {
+        return end <= bs->cor_nb_clusters &&
+               find_next_zero_bit(bs->cor_allocated, end, start) >= end;
+    }
+
+    /* Too many clusters for a bitmap, ask the image */
+    while (sector_num < end_sector) {
+        if (!bdrv_is_allocated(bs, sector_num,
+                               MIN(end_sector - sector_num, INT_MAX),
+                               &pnum) || pnum <= 0) {
+            return 0;
+        }
+        sector_num += pnum;
+    }
+    return 1;
+}
+
+/* Marks everything that the image already has, done once on enabling */
+static void bdrv_cor_seed_allocated(BlockDriverState *bs)
+{
+    int64_t sector_num = 0;
+    int ret, pnum;
+
+    while (sector_num < bs->total_sectors) {
+        ret = bdrv_is_allocated(bs, sector_num,
+                                MIN(bs->total_sectors - sector_num, INT_MAX),
+                                &pnum);
+        if (pnum <= 0) {
+            /* Unmarked clusters are copied, which only costs a rewrite */
+            break;
+        }
+        if (ret) {
+            bdrv_cor_mark_allocated(bs, sector_num, pnum);
+        }
+        sector_num += pnum;
+    }
+}
+
+/*
+ * Only clusters that are not allocated in this image are read whole and
+ * written back; reads of allocated clusters go to the image directly.
+ */
+static BlockDriverAIOCB *bdrv_aio_copy_on_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvTrackedAIOCB *acb;
+    int64_t cluster_sector_num, cluster_end;
+    int cluster_sectors = bs->cor_cluster_sectors;
+
+    cluster_sector_num = sector_num - sector_num % cluster_sectors;
+    cluster_end = sector_num + nb_sectors + cluster_sectors - 1;
+    cluster_end -= cluster_end % cluster_sectors;
+    cluster_end = MIN(cluster_end, bs->total_sectors);
+
+    if (bdrv_cor_is_allocated(bs, cluster_sector_num, cluster_end)) {
+        return bs->drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                       cb, opaque);
+    }
+
+    acb = bdrv_tracked_aio_get(bs, sector_num, qiov, nb_sectors, cb, opaque);
+    acb->req.sector_num = cluster_sector_num;
+    acb->req.nb_sectors = cluster_end - cluster_sector_num;
+    acb->req.serialising = 1;
+    acb->req.resume = bdrv_copy_on_read_resume;
+
+    acb->bounce_iov.iov_len = acb->req.nb_sectors * BDRV_SECTOR_SIZE;
+    acb->bounce = qemu_blockalign(bs, acb->bounce_iov.iov_len);
+    acb->bounce_iov.iov_base = acb->bounce;
+    qemu_iovec_init_external(&acb->bounce_qiov, &acb->bounce_iov, 1);
+
+    trace_bdrv_aio_copy_on_readv(bs, sector_num, nb_sectors,
+                                 acb->req.sector_num, acb->req.nb_sectors);
+
+    if (bdrv_tracked_request_begin(bs, &acb->req)) {
+        if (bdrv_copy_on_read_start(acb) < 0) {
+            QLIST_REMOVE(&acb->req, list);
+            qemu_vfree(acb->bounce);
+            qemu_aio_release(acb);
+            return NULL;
+        }
+    }
+
+    return &acb->common;
+}
+
+/*
+ * Copy-on-read is reference counted so that it can be requested by the user
+ * and by image streaming independently.  Writes that were submitted before
+ * it is enabled are not tracked, so callers enabling it on an image in use
+ * must drain all requests first.
+ */
+void bdrv_enable_copy_on_read(BlockDriverState *bs)
+{
+    BlockDriverInfo bdi;
+
+    if (bs->copy_on_read++ > 0) {
+        return;
+    }
+
+    bs->cor_cluster_sectors = 1;
+    if (bdrv_get_info(bs, &bdi) == 0 &&
+        bdi.cluster_size > BDRV_SECTOR_SIZE) {
+        bs->cor_cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    }
+    bs->cor_nb_clusters = DIV_ROUND_UP(bs->total_sectors,
+                                       bs->cor_cluster_sectors);
+    if (bs->cor_nb_clusters <= INT_MAX) {
+        bs->cor_allocated = bitmap_new(bs->cor_nb_clusters);
+        bdrv_cor_seed_allocated(bs);
+    }
+}
+
+void bdrv_disable_copy_on_read(BlockDriverState *bs)
+{
+    assert(bs->copy_on_read > 0);
+    if (--bs->copy_on_read == 0) {
+        qemu_free(bs->cor_allocated);
+        bs->cor_allocated = NULL;
+    }
+}
+
+/**************************************************************/
+/* shared read cache */
+
+/*
+ * Drives opened with BDRV_O_SHARED_CACHE share a cache for reads from their
+ * read-only images, which are typically the base images of many overlays.
+ * Images are identified by their format and host file, including its size
+ * and modification time, so a cluster of a base image is read from the host
+ * only once no matter how many drives use it.  Data is cached in chunks of
+ * SHARED_CACHE_CHUNK_SIZE; a read that needs a chunk which another request
+ * is loading waits for that load instead of issuing its own.
+ *
+ * The cache is private to the process unless -block-cache name= puts it in
+ * a POSIX shared memory segment of that name.  All processes using the
+ * segment can read each other's cached images and feed each other data, so
+ * only VMs that trust each other may share one.  Everything read from the
+ * segment is checked before use, and a lock that can't be taken within
+ * SHARED_CACHE_LOCK_TIMEOUT, e.g. because its owner is stopped, makes the
+ * read bypass the cache.
+ *
+ * Writes through any drive that was opened with the flag, e.g. bdrv_commit
+ * into a base image, drop the affected chunks.  Images that are written by
+ * other processes while in use are not coherent, as with any other image
+ * opened by more than one process.
+ */
+
+#define SHARED_CACHE_CHUNK_SIZE     (64 * 1024)
+#define SHARED_CACHE_CHUNK_SECTORS  (SHARED_CACHE_CHUNK_SIZE / BDRV_SECTOR_SIZE)
+#define SHARED_CACHE_DEFAULT_SIZE   (64 * 1024 * 1024)
+#define SHARED_CACHE_LOCK_TIMEOUT   (10 * 1000 * 1000)     /* ns */
+#define SHARED_CACHE_MAGIC          "QEMU block cache"
+#define SHARED_CACHE_VERSION        1
+
+typedef struct BdrvSharedImage {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    char format[16];
+} BdrvSharedImage;
+
+/* Slots are linked by index since each process maps the segment elsewhere */
+typedef struct BdrvSharedSlot {
+    BdrvSharedImage image;
+    int64_t index;
+    int32_t nb_sectors;         /* 0 if the slot is free */
+    int32_t hash_next;          /* next in the hash bucket or free list */
+    int32_t lru_prev;
+    int32_t lru_next;
+} BdrvSharedSlot;
+
+typedef struct BdrvSharedCacheHeader {
+    char magic[16];
+    uint32_t version;
+    uint32_t nb_slots;
+    uint32_t used;
+    int32_t free_head;
+    int32_t lru_head;           /* least recently used */
+    int32_t lru_tail;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} BdrvSharedCacheHeader;
+
+typedef struct BdrvSharedCacheLoad {
+    BdrvSharedImage image;
+    int64_t first;              /* index of the first chunk */
+    int nb_chunks;
+    int nb_sectors;
+    int invalid;                /* the image was written, don't cache */
+    uint8_t *buf;
+    QEMUIOVector qiov;
+    QLIST_ENTRY(BdrvSharedCacheLoad) list;
+} BdrvSharedCacheLoad;
+
+typedef struct BdrvSharedCacheAIOCB {
+    BlockDriverAIOCB common;
+    QEMUBH *bh;
+    QEMUIOVector *qiov;
+    int64_t sector_num;
+    int nb_sectors;
+    BdrvSharedCacheLoad **loads;        /* per chunk, NULL once copied */
+    int nb_chunks;
+    int pending;
+    int ret;
+    QLIST_ENTRY(BdrvSharedCacheAIOCB) list;     /* waiting for loads */
+} BdrvSharedCacheAIOCB;
+
+static int64_t shared_cache_max_size = SHARED_CACHE_DEFAULT_SIZE;
+static char *shared_cache_name;
+static BdrvSharedCacheHeader *shared_cache;
+static int32_t *shared_cache_buckets;
+static BdrvSharedSlot *shared_cache_slots;
+static uint8_t *shared_cache_data;
+static int32_t shared_cache_nb_slots;   /* our copy, the header's may change */
+static int shared_cache_is_shared;      /* mapped from a named segment */
+static int shared_cache_disabled;       /* the segment became unusable */
+static uint64_t shared_cache_hits;
+static uint64_t shared_cache_misses;
+static QLIST_HEAD(, BdrvSharedCacheLoad) shared_cache_loads =
+    QLIST_HEAD_INITIALIZER(shared_cache_loads);
+static QLIST_HEAD(, BdrvSharedCacheAIOCB) shared_cache_waiting =
+    QLIST_HEAD_INITIALIZER(shared_cache_waiting);
+
+/* Returns the size of a segment and where its parts start */
+static size_t bdrv_shared_cache_layout(uint32_t nb_slots,
+                                       size_t *buckets_offset,
+                                       size_t *slots_offset,
+                                       size_t *data_offset)
+{
+    size_t offset = sizeof(BdrvSharedCacheHeader);
+
+    offset = (offset + 7) & ~(size_t)7;
+    *buckets_offset = offset;
+    offset += MAX(nb_slots, 1) * sizeof(int32_t);
+    offset = (offset + 7) & ~(size_t)7;
+    *slots_offset = offset;
+    offset += nb_slots * sizeof(BdrvSharedSlot);
+    offset = (offset + 4095) & ~(size_t)4095;
+    *data_offset = offset;
+    return offset + (size_t)nb_slots * SHARED_CACHE_CHUNK_SIZE;
+}
+
+/* Drops all cached data; the lock must be held or not yet be shared */
+static void bdrv_shared_cache_reset(void)
+{
+    int32_t i;
+
+    for (i = 0; i < MAX(shared_cache_nb_slots, 1); i++) {
+        shared_cache_buckets[i] = -1;
+    }
+    for (i = 0; i < shared_cache_nb_slots; i++) {
+        shared_cache_slots[i].nb_sectors = 0;
+        shared_cache_slots[i].hash_next =
+            i + 1 < shared_cache_nb_slots ? i + 1 : -1;
+    }
+    shared_cache->free_head = shared_cache_nb_slots ? 0 : -1;
+    shared_cache->lru_head = -1;
+    shared_cache->lru_tail = -1;
+    shared_cache->used = 0;
+}
+
+/* A slot index or -1 for none; anything else means the segment is corrupt */
+static int bdrv_shared_cache_valid(int32_t n)
+{
+    return n >= -1 && n < shared_cache_nb_slots;
+}
+
+/* Called with the lock held when the lists in the segment make no sense */
+static void bdrv_shared_cache_corrupt(void)
+{
+    static int reported;
+
+    if (!reported) {
+        error_report("Shared block cache %s is corrupt, dropping its data",
+                     shared_cache_name);
+        reported = 1;
+    }
+    bdrv_shared_cache_reset();
+}
+
+static void bdrv_shared_cache_setup(void *segment, uint32_t nb_slots)
+{
+    size_t buckets_offset, slots_offset, data_offset;
+
+    bdrv_shared_cache_layout(nb_slots, &buckets_offset, &slots_offset,
+                             &data_offset);
+    shared_cache = segment;
+    shared_cache_buckets = (int32_t *)((uint8_t *)segment + buckets_offset);
+    shared_cache_slots = (BdrvSharedSlot *)((uint8_t *)segment +
+                                            slots_offset);
+    shared_cache_data = (uint8_t *)segment + data_offset;
+    shared_cache_nb_slots = nb_slots;
+}
+
+#ifndef _WIN32
+/*
+ * Maps the segment shared with other processes.  Whoever finds it empty
+ * creates it with the configured size; later users take it as it is.  flock
+ * keeps others away until the creator has written the magic.
+ */
+static int bdrv_shared_cache_open(const char *name, uint32_t nb_slots)
+{
+    size_t buckets_offset, slots_offset, data_offset, size;
+    pthread_mutexattr_t attr;
+    BdrvSharedCacheHeader *header;
+    struct stat st;
+    void *segment;
+    int fd, ret;
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    if (st.st_size >= sizeof(*header)) {
+        header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+        if (header == MAP_FAILED) {
+            ret = -errno;
+            goto fail;
+        }
+        ret = 0;
+        if (!memcmp(header->magic, SHARED_CACHE_MAGIC,
+                    sizeof(header->magic))) {
+            if (header->version != SHARED_CACHE_VERSION ||
+                header->nb_slots > INT32_MAX / 2 ||
+                bdrv_shared_cache_layout(header->nb_slots, &buckets_offset,
+                                         &slots_offset, &data_offset) !=
+                st.st_size) {
+                ret = -EINVAL;
+            } else {
+                nb_slots = header->nb_slots;
+                ret = 1;
+            }
+        }
+        munmap(header, sizeof(*header));
+        if (ret < 0) {
+            goto fail;
+        }
+    } else {
+        ret = 0;
+    }
+
+    /* Without a valid magic nobody can be using the segment */
+    size = bdrv_shared_cache_layout(nb_slots, &buckets_offset, &slots_offset,
+                                    &data_offset);
+    if (ret == 0 && ftruncate(fd, size) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+    segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        ret = -errno;
+        goto fail;
+    }
+    bdrv_shared_cache_setup(segment, nb_slots);
+    shared_cache_is_shared = 1;
+
+    if (ret == 0) {
+        memset(shared_cache, 0, sizeof(*shared_cache));
+        shared_cache->version = SHARED_CACHE_VERSION;
+        shared_cache->nb_slots = nb_slots;
+        bdrv_shared_cache_reset();
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&shared_cache->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        memcpy(shared_cache->magic, SHARED_CACHE_MAGIC,
+               sizeof(shared_cache->magic));
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    return 0;
+
+fail:
+    close(fd);
+    return ret;
+}
+#endif
+
+static void bdrv_shared_cache_init(void)
+{
+    size_t buckets_offset, slots_offset, data_offset;
+    uint32_t nb_slots;
+    int ret;
+
+    nb_slots = MIN(shared_cache_max_size / SHARED_CACHE_CHUNK_SIZE,
+                   MIN(INT32_MAX, SIZE_MAX / SHARED_CACHE_CHUNK_SIZE) / 2);
+
+    if (shared_cache_name) {
+#ifndef _WIN32
+        ret = bdrv_shared_cache_open(shared_cache_name, nb_slots);
+#else
+        ret = -ENOTSUP;
+#endif
+        if (ret == 0) {
+            return;
+        }
+        error_report("Could not use shared block cache %s: %s, "
+                     "the cache is private to this process",
+                     shared_cache_name, strerror(-ret));
+    }
+
+    bdrv_shared_cache_setup(qemu_vmalloc(
+        bdrv_shared_cache_layout(nb_slots, &buckets_offset, &slots_offset,
+                                 &data_offset)), nb_slots);
+    memset(shared_cache, 0, sizeof(*shared_cache));
+    shared_cache->nb_slots = nb_slots;
+    bdrv_shared_cache_reset();
+}
+
+/* Returns 0 with the lock held, or a negative errno if it can't be taken */
+static int bdrv_shared_cache_lock(void)
+{
+#ifndef _WIN32
+    struct timespec ts;
+    int ret;
+
+    if (!shared_cache_is_shared) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += SHARED_CACHE_LOCK_TIMEOUT;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    ret = pthread_mutex_timedlock(&shared_cache->lock, &ts);
+    if (ret == EOWNERDEAD) {
+        /* The owner died in the middle of an update */
+        bdrv_shared_cache_reset();
+        pthread_mutex_consistent(&shared_cache->lock);
+        ret = 0;
+    }
+    return -ret;
+#else
+    return 0;
+#endif
+}
+
+static void bdrv_shared_cache_unlock(void)
+{
+#ifndef _WIN32
+    if (shared_cache_is_shared) {
+        pthread_mutex_unlock(&shared_cache->lock);
+    }
+#endif
+}
+
+static uint32_t bdrv_shared_cache_hash(const BdrvSharedImage *image,
+                                       int64_t index)
+{
+    uint64_t h;
+
+    h = image->ino * 0x9e3779b97f4a7c15ULL ^ image->dev ^ image->mtime;
+    h += index;
+    return (h ^ (h >> 32)) % MAX(shared_cache_nb_slots, 1);
+}
+
+static int bdrv_shared_cache_find(const BdrvSharedImage *image, int64_t index)
+{
+    BdrvSharedSlot *slot;
+    int32_t n, steps = 0;
+
+    for (n = shared_cache_buckets[bdrv_shared_cache_hash(image, index)];
+         n >= 0; n = slot->hash_next) {
+        if (!bdrv_shared_cache_valid(n) || steps++ > shared_cache_nb_slots) {
+            bdrv_shared_cache_corrupt();
+            return -1;
+        }
+        slot = &shared_cache_slots[n];
+        if (slot->index == index &&
+            !memcmp(&slot->image, image, sizeof(*image))) {
+            return n;
+        }
+    }
+    if (n != -1) {
+        bdrv_shared_cache_corrupt();
+    }
+    return -1;
+}
+
+static int bdrv_shared_cache_lru_remove(int32_t n)
+{
+    BdrvSharedSlot *slot = &shared_cache_slots[n];
+    int32_t prev = slot->lru_prev, next = slot->lru_next;
+
+    if (!bdrv_shared_cache_valid(prev) || !bdrv_shared_cache_valid(next)) {
+        bdrv_shared_cache_corrupt();
+        return -1;
+    }
+    if (prev >= 0) {
+        shared_cache_slots[prev].lru_next = next;
+    } else {
+        shared_cache->lru_head = next;
+    }
+    if (next >= 0) {
+        shared_cache_slots[next].lru_prev = prev;
+    } else {
+        shared_cache->lru_tail = prev;
+    }
+    return 0;
+}
+
+static int bdrv_shared_cache_lru_append(int32_t n)
+{
+    BdrvSharedSlot *slot = &shared_cache_slots[n];
+    int32_t tail = shared_cache->lru_tail;
+
+    if (!bdrv_shared_cache_valid(tail)) {
+        bdrv_shared_cache_corrupt();
+        return -1;
+    }
+    slot->lru_prev = tail;
+    slot->lru_next = -1;
+    if (tail >= 0) {
+        shared_cache_slots[tail].lru_next = n;
+    } else {
+        shared_cache->lru_head = n;
+    }
+    shared_cache->lru_tail = n;
+    return 0;
+}
+
+static int bdrv_shared_cache_free_slot(int32_t n)
+{
+    BdrvSharedSlot *slot = &shared_cache_slots[n];
+    int32_t *p, steps = 0;
+
+    p = &shared_cache_buckets[bdrv_shared_cache_hash(&slot->image,
+                                                     slot->index)];
+    while (*p != n) {
+        if (*p < 0 || !bdrv_shared_cache_valid(*p) ||
+            steps++ > shared_cache_nb_slots) {
+            bdrv_shared_cache_corrupt();
+            return -1;
+        }
+        p = &shared_cache_slots[*p].hash_next;
+    }
+    *p = slot->hash_next;
+    if (bdrv_shared_cache_lru_remove(n) < 0) {
+        return -1;
+    }
+
+    slot->nb_sectors = 0;
+    slot->hash_next = shared_cache->free_head;
+    shared_cache->free_head = n;
+    shared_cache->used--;
+    return 0;
+}
+
+/* Stores a loaded chunk, evicting the least recently used one if needed */
+static void bdrv_shared_cache_insert(const BdrvSharedImage *image,
+                                     int64_t index, const uint8_t *buf,
+                                     int nb_sectors)
+{
+    BdrvSharedSlot *slot;
+    uint32_t hash;
+    int32_t n;
+
+    if (shared_cache_nb_slots == 0 ||
+        bdrv_shared_cache_find(image, index) >= 0) {
+        return;
+    }
+    if (shared_cache->free_head < 0) {
+        n = shared_cache->lru_head;
+        if (n < 0 || !bdrv_shared_cache_valid(n)) {
+            bdrv_shared_cache_corrupt();
+            return;
+        }
+        if (bdrv_shared_cache_free_slot(n) < 0) {
+            return;
+        }
+    }
+
+    n = shared_cache->free_head;
+    if (!bdrv_shared_cache_valid(n) ||
+        !bdrv_shared_cache_valid(shared_cache_slots[n].hash_next)) {
+        bdrv_shared_cache_corrupt();
+        return;
+    }
+    slot = &shared_cache_slots[n];
+    shared_cache->free_head = slot->hash_next;
+    shared_cache->used++;
+
+    slot->image = *image;
+    slot->index = index;
+    slot->nb_sectors = nb_sectors;
+    memcpy(shared_cache_data + (size_t)n * SHARED_CACHE_CHUNK_SIZE, buf,
+           nb_sectors * BDRV_SECTOR_SIZE);
+
+    hash = bdrv_shared_cache_hash(image, index);
+    slot->hash_next = shared_cache_buckets[hash];
+    shared_cache_buckets[hash] = n;
+    bdrv_shared_cache_lru_append(n);
+}
+
+/* Copies the part of a chunk that the request covers into its buffers */
+static void bdrv_shared_cache_copy(BdrvSharedCacheAIOCB *acb, int64_t index,
+                                   const uint8_t *buf, int nb_sectors)
+{
+    QEMUIOVector qiov;
+    int64_t start, end;
+
+    start = MAX(acb->sector_num, index * SHARED_CACHE_CHUNK_SECTORS);
+    end = MIN(acb->sector_num + acb->nb_sectors,
+              index * SHARED_CACHE_CHUNK_SECTORS + nb_sectors);
+
+    qemu_iovec_init(&qiov, acb->qiov->niov);
+    qemu_iovec_copy(&qiov, acb->qiov,
+                    (start - acb->sector_num) * BDRV_SECTOR_SIZE,
+                    (end - start) * BDRV_SECTOR_SIZE);
+    qemu_iovec_from_buffer(&qiov, buf +
+        (start - index * SHARED_CACHE_CHUNK_SECTORS) * BDRV_SECTOR_SIZE,
+        qiov.size);
+    qemu_iovec_destroy(&qiov);
+}
+
+static void bdrv_shared_cache_release(BdrvSharedCacheAIOCB *acb)
+{
+    qemu_free(acb->loads);
+    qemu_aio_release(acb);
+}
+
+static void bdrv_shared_cache_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvSharedCacheAIOCB *acb = (BdrvSharedCacheAIOCB *)blockacb;
+
+    /* Loads carry on for the benefit of other readers */
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+    } else {
+        QLIST_REMOVE(acb, list);
+    }
+    bdrv_shared_cache_release(acb);
+}
+
+static AIOPool bdrv_shared_cache_aio_pool = {
+    .aiocb_size         = sizeof(BdrvSharedCacheAIOCB),
+    .cancel             = bdrv_shared_cache_cancel,
+};
+
+static void bdrv_shared_cache_bh(void *opaque)
+{
+    BdrvSharedCacheAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    acb->common.cb(acb->common.opaque, acb->ret);
+    bdrv_shared_cache_release(acb);
+}
 
-        // The block driver may decide that it makes sense to combine requests
-        // even if there is a gap of some sectors between them. In this case,
-        // the gap is filled with zeros (therefore only applicable for yet
-        // unused space in format like qcow2).
-        if (!merge && bs->drv->bdrv_merge_requests) {
-            merge = bs->drv->bdrv_merge_requests(bs, &reqs[outidx], &reqs[i]);
-        }
+static void bdrv_shared_cache_complete(BdrvSharedCacheAIOCB *acb)
+{
+    acb->bh = qemu_bh_new(bdrv_shared_cache_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
 
-        if (reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1 > IOV_MAX) {
-            merge = 0;
-        }
+static void bdrv_shared_cache_load_cb(void *opaque, int ret)
+{
+    BdrvSharedCacheLoad *load = opaque;
+    BdrvSharedCacheAIOCB *acb, *next;
+    int64_t index;
+    int i, offset, nb_sectors;
 
-        if (merge) {
-            size_t size;
-            QEMUIOVector *qiov = qemu_mallocz(sizeof(*qiov));
-            qemu_iovec_init(qiov,
-                reqs[outidx].qiov->niov + reqs[i].qiov->niov + 1);
+    QLIST_REMOVE(load, list);
 
-            // Add the first request to the merged one. If the requests are
-            // overlapping, drop the last sectors of the first request.
-            size = (reqs[i].sector - reqs[outidx].sector) << 9;
-            qemu_iovec_concat(qiov, reqs[outidx].qiov, size);
+    if (ret == 0 && !load->invalid && !shared_cache_disabled &&
+        bdrv_shared_cache_lock() == 0) {
+        for (i = 0; i < load->nb_chunks; i++) {
+            nb_sectors = MIN(SHARED_CACHE_CHUNK_SECTORS,
+                             load->nb_sectors - i * SHARED_CACHE_CHUNK_SECTORS);
+            bdrv_shared_cache_insert(&load->image, load->first + i,
+                                     load->buf + i * SHARED_CACHE_CHUNK_SIZE,
+                                     nb_sectors);
+        }
+        bdrv_shared_cache_unlock();
+    }
 
-            // We might need to add some zeros between the two requests
-            if (reqs[i].sector > oldreq_last) {
-                size_t zero_bytes = (reqs[i].sector - oldreq_last) << 9;
-                uint8_t *buf = qemu_blockalign(bs, zero_bytes);
-                memset(buf, 0, zero_bytes);
-                qemu_iovec_add(qiov, buf, zero_bytes);
-                mcb->callbacks[i].free_buf = buf;
+    QLIST_FOREACH_SAFE(acb, &shared_cache_waiting, list, next) {
+        for (i = 0; i < acb->nb_chunks; i++) {
+            if (acb->loads[i] != load) {
+                continue;
             }
+            if (ret < 0) {
+                acb->ret = acb->ret ? acb->ret : ret;
+            } else {
+                index = acb->sector_num / SHARED_CACHE_CHUNK_SECTORS + i;
+                offset = (index - load->first) * SHARED_CACHE_CHUNK_SECTORS;
+                bdrv_shared_cache_copy(acb, index,
+                    load->buf + offset * BDRV_SECTOR_SIZE,
+                    MIN(SHARED_CACHE_CHUNK_SECTORS,
+                        load->nb_sectors - offset));
+            }
+            acb->loads[i] = NULL;
+            acb->pending--;
+        }
+        if (acb->pending == 0) {
+            QLIST_REMOVE(acb, list);
+            bdrv_shared_cache_complete(acb);
+        }
+    }
 
-            // Add the second request
-            qemu_iovec_concat(qiov, reqs[i].qiov, reqs[i].qiov->size);
+    qemu_iovec_destroy(&load->qiov);
+    qemu_vfree(load->buf);
+    qemu_free(load);
+}
 
-            reqs[outidx].nb_sectors = qiov->size >> 9;
-            reqs[outidx].qiov = qiov;
+static BdrvSharedCacheLoad *bdrv_shared_cache_find_load(
+    const BdrvSharedImage *image, int64_t index)
+{
+    BdrvSharedCacheLoad *load;
 
-            mcb->callbacks[i].free_qiov = reqs[outidx].qiov;
-        } else {
-            outidx++;
-            reqs[outidx].sector     = reqs[i].sector;
-            reqs[outidx].nb_sectors = reqs[i].nb_sectors;
-            reqs[outidx].qiov       = reqs[i].qiov;
+    QLIST_FOREACH(load, &shared_cache_loads, list) {
+        if (!load->invalid && index >= load->first &&
+            index < load->first + load->nb_chunks &&
+            !memcmp(&load->image, image, sizeof(*image))) {
+            return load;
         }
     }
+    return NULL;
+}
 
-    return outidx + 1;
+/* Creates a load of consecutive chunks that will be read with one request */
+static BdrvSharedCacheLoad *bdrv_shared_cache_new_load(BlockDriverState *bs,
+                                                       int64_t first,
+                                                       int nb_chunks)
+{
+    BdrvSharedCacheLoad *load;
+
+    load = qemu_mallocz(sizeof(*load));
+    load->image = *bs->shared_image;
+    load->first = first;
+    load->nb_chunks = nb_chunks;
+    load->nb_sectors = MIN((int64_t)nb_chunks * SHARED_CACHE_CHUNK_SECTORS,
+                           bs->total_sectors -
+                           first * SHARED_CACHE_CHUNK_SECTORS);
+    load->buf = qemu_blockalign(bs, load->nb_sectors * BDRV_SECTOR_SIZE);
+    qemu_iovec_init(&load->qiov, 1);
+    qemu_iovec_add(&load->qiov, load->buf,
+                   load->nb_sectors * BDRV_SECTOR_SIZE);
+    QLIST_INSERT_HEAD(&shared_cache_loads, load, list);
+    return load;
 }
 
-/*
- * Submit multiple AIO write requests at once.
- *
- * On success, the function returns 0 and all requests in the reqs array have
- * been submitted. In error case this function returns -1, and any of the
- * requests may or may not be submitted yet. In particular, this means that the
- * callback will be called for some of the requests, for others it won't. The
- * caller must check the error field of the BlockRequest to wait for the right
- * callbacks (if error != 0, no callback will be called).
- *
- * The implementation may modify the contents of the reqs array, e.g. to merge
- * requests. However, the fields opaque and error are left unmodified as they
- * are used to signal failure for a single request to the caller.
- */
-int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
+static void bdrv_shared_cache_load(BlockDriverState *bs,
+                                   BdrvSharedCacheLoad *load)
 {
     BlockDriverAIOCB *acb;
-    MultiwriteCB *mcb;
-    int i;
 
-    /* don't submit writes if we don't have a medium */
-    if (bs->drv == NULL) {
-        for (i = 0; i < num_reqs; i++) {
-            reqs[i].error = -ENOMEDIUM;
-        }
-        return -1;
-    }
+    trace_bdrv_shared_cache_load(bs, load->first, load->nb_chunks);
 
-    if (num_reqs == 0) {
-        return 0;
+    acb = bs->drv->bdrv_aio_readv(bs,
+                                  load->first * SHARED_CACHE_CHUNK_SECTORS,
+                                  &load->qiov, load->nb_sectors,
+                                  bdrv_shared_cache_load_cb, load);
+    if (!acb) {
+        bdrv_shared_cache_load_cb(load, -EIO);
     }
+}
 
-    // Create MultiwriteCB structure
-    mcb = qemu_mallocz(sizeof(*mcb) + num_reqs * sizeof(*mcb->callbacks));
-    mcb->num_requests = 0;
-    mcb->num_callbacks = num_reqs;
+static BlockDriverAIOCB *bdrv_shared_cache_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvSharedCacheAIOCB *acb;
+    BdrvSharedCacheLoad *load, **new_loads;
+    int64_t first = sector_num / SHARED_CACHE_CHUNK_SECTORS;
+    int64_t last = (sector_num + nb_sectors - 1) / SHARED_CACHE_CHUNK_SECTORS;
+    int i, n, nb_new_loads = 0, load_start = -1;
 
-    for (i = 0; i < num_reqs; i++) {
-        mcb->callbacks[i].cb = reqs[i].cb;
-        mcb->callbacks[i].opaque = reqs[i].opaque;
+    /* Waiting for a stuck process would stall the guest, read directly */
+    if (shared_cache_disabled || bdrv_shared_cache_lock() < 0) {
+        trace_bdrv_shared_cache_bypass(bs, sector_num, nb_sectors);
+        return bs->drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                       cb, opaque);
     }
 
-    // Check for mergable requests
-    num_reqs = multiwrite_merge(bs, reqs, num_reqs, mcb);
+    acb = qemu_aio_get(&bdrv_shared_cache_aio_pool, bs, cb, opaque);
+    acb->bh = NULL;
+    acb->qiov = qiov;
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->nb_chunks = last - first + 1;
+    acb->loads = qemu_mallocz(acb->nb_chunks * sizeof(acb->loads[0]));
+    acb->pending = 0;
+    acb->ret = 0;
+    new_loads = qemu_malloc(acb->nb_chunks * sizeof(new_loads[0]));
+
+    for (i = 0; i <= acb->nb_chunks; i++) {
+        if (i < acb->nb_chunks) {
+            n = bdrv_shared_cache_find(bs->shared_image, first + i);
+            if (n >= 0 && shared_cache_slots[n].nb_sectors !=
+                MIN(SHARED_CACHE_CHUNK_SECTORS, bs->total_sectors -
+                    (first + i) * SHARED_CACHE_CHUNK_SECTORS)) {
+                /* Only another process can have stored this */
+                bdrv_shared_cache_free_slot(n);
+                n = -1;
+            }
+            load = n < 0 ? bdrv_shared_cache_find_load(bs->shared_image,
+                                                       first + i) : NULL;
+            if (n >= 0) {
+                shared_cache_hits++;
+                bdrv_shared_cache_copy(acb, first + i, shared_cache_data +
+                                       (size_t)n * SHARED_CACHE_CHUNK_SIZE,
+                                       shared_cache_slots[n].nb_sectors);
+                if (bdrv_shared_cache_lru_remove(n) == 0) {
+                    bdrv_shared_cache_lru_append(n);
+                }
+            } else if (load) {
+                shared_cache_hits++;
+                acb->loads[i] = load;
+                acb->pending++;
+            } else {
+                shared_cache_misses++;
+                if (load_start < 0) {
+                    load_start = i;
+                }
+                continue;
+            }
+        }
 
-    trace_bdrv_aio_multiwrite(mcb, mcb->num_callbacks, num_reqs);
+        /* Read the chunks that nobody has with one request */
+        if (load_start >= 0) {
+            load = bdrv_shared_cache_new_load(bs, first + load_start,
+                                              i - load_start);
+            new_loads[nb_new_loads++] = load;
+            for (; load_start < i; load_start++) {
+                acb->loads[load_start] = load;
+                acb->pending++;
+            }
+            load_start = -1;
+        }
+    }
+    bdrv_shared_cache_unlock();
 
-    /*
-     * Run the aio requests. As soon as one request can't be submitted
-     * successfully, fail all requests that are not yet submitted (we must
-     * return failure for all requests anyway)
-     *
-     * num_requests cannot be set to the right value immediately: If
-     * bdrv_aio_writev fails for some request, num_requests would be too high
-     * and therefore multiwrite_cb() would never recognize the multiwrite
-     * request as completed. We also cannot use the loop variable i to set it
-     * when the first request fails because the callback may already have been
-     * called for previously submitted requests. Thus, num_requests must be
-     * incremented for each request that is submitted.
-     *
-     * The problem that callbacks may be called early also means that we need
-     * to take care that num_requests doesn't become 0 before all requests are
-     * submitted - multiwrite_cb() would consider the multiwrite request
-     * completed. A dummy request that is "completed" by a manual call to
-     * multiwrite_cb() takes care of this.
-     */
-    mcb->num_requests = 1;
+    trace_bdrv_shared_cache_readv(bs, sector_num, nb_sectors, acb);
 
-    // Run the aio requests
-    for (i = 0; i < num_reqs; i++) {
-        mcb->num_requests++;
-        acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
-            reqs[i].nb_sectors, multiwrite_cb, mcb);
+    if (acb->pending == 0) {
+        bdrv_shared_cache_complete(acb);
+    } else {
+        QLIST_INSERT_HEAD(&shared_cache_waiting, acb, list);
+    }
+    for (i = 0; i < nb_new_loads; i++) {
+        bdrv_shared_cache_load(bs, new_loads[i]);
+    }
+    qemu_free(new_loads);
+    return &acb->common;
+}
 
-        if (acb == NULL) {
-            // We can only fail the whole thing if no request has been
-            // submitted yet. Otherwise we'll wait for the submitted AIOs to
-            // complete and report the error in the callback.
-            if (i == 0) {
-                trace_bdrv_aio_multiwrite_earlyfail(mcb);
-                goto fail;
-            } else {
-                trace_bdrv_aio_multiwrite_latefail(mcb, i);
-                multiwrite_cb(mcb, -EIO);
-                break;
+/* Drops cached data of the image that bs is about to overwrite */
+static void bdrv_shared_cache_invalidate(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         int64_t nb_sectors)
+{
+    BdrvSharedImage *image = bs->shared_image;
+    BdrvSharedCacheLoad *load;
+    int64_t first = sector_num / SHARED_CACHE_CHUNK_SECTORS;
+    int64_t last = (sector_num + nb_sectors - 1) / SHARED_CACHE_CHUNK_SECTORS;
+    int64_t index;
+    int32_t i;
+    int n, ret;
+
+    if (shared_cache_disabled) {
+        goto loads;
+    }
+    ret = bdrv_shared_cache_lock();
+    if (ret < 0) {
+        /* Reading on could return data that the write is replacing */
+        error_report("Could not lock shared block cache %s: %s, "
+                     "no longer using it", shared_cache_name, strerror(-ret));
+        shared_cache_disabled = 1;
+        goto loads;
+    }
+    if (last - first < shared_cache_nb_slots) {
+        for (index = first; index <= last; index++) {
+            n = bdrv_shared_cache_find(image, index);
+            if (n >= 0) {
+                bdrv_shared_cache_free_slot(n);
+            }
+        }
+    } else {
+        for (i = 0; i < shared_cache_nb_slots; i++) {
+            if (shared_cache_slots[i].nb_sectors &&
+                shared_cache_slots[i].index >= first &&
+                shared_cache_slots[i].index <= last &&
+                !memcmp(&shared_cache_slots[i].image, image,
+                        sizeof(*image))) {
+                bdrv_shared_cache_free_slot(i);
             }
         }
     }
+    bdrv_shared_cache_unlock();
 
-    /* Complete the dummy request */
-    multiwrite_cb(mcb, 0);
+loads:
+    /* Loads that are in flight may return the old data */
+    QLIST_FOREACH(load, &shared_cache_loads, list) {
+        if (load->first <= last && load->first + load->nb_chunks > first &&
+            !memcmp(&load->image, image, sizeof(*image))) {
+            load->invalid = 1;
+        }
+    }
+}
 
-    return 0;
+/*
+ * Images are the same if they are opened with the same format from the same
+ * version of a host file.  Protocols without a local file are not cached
+ * because their file names don't identify them across processes.
+ */
+static void bdrv_shared_cache_attach(BlockDriverState *bs)
+{
+    BdrvSharedImage *image;
+    struct stat st;
 
-fail:
-    for (i = 0; i < mcb->num_callbacks; i++) {
-        reqs[i].error = -EIO;
+    if (path_has_protocol(bs->filename) || stat(bs->filename, &st) < 0) {
+        return;
     }
-    qemu_free(mcb);
-    return -1;
+    if (!shared_cache) {
+        bdrv_shared_cache_init();
+    }
+
+    /* Padding must be zero, images are compared with memcmp */
+    image = qemu_mallocz(sizeof(*image));
+    image->dev = st.st_dev;
+    image->ino = st.st_ino;
+    image->size = st.st_size;
+#ifdef __linux__
+    image->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL +
+                   st.st_mtim.tv_nsec;
+#else
+    image->mtime = st.st_mtime;
+#endif
+    pstrcpy(image->format, sizeof(image->format), bs->drv->format_name);
+    bs->shared_image = image;
 }
 
-BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
-        BlockDriverCompletionFunc *cb, void *opaque)
+/* Cached data stays for other users of the image */
+static void bdrv_shared_cache_detach(BlockDriverState *bs)
 {
-    BlockDriver *drv = bs->drv;
-
-    trace_bdrv_aio_flush(bs, opaque);
+    qemu_free(bs->shared_image);
+    bs->shared_image = NULL;
+}
 
-    if (bs->open_flags & BDRV_O_NO_FLUSH) {
-        return bdrv_aio_noop_em(bs, cb, opaque);
-    }
+void bdrv_shared_cache_set_size(int64_t size)
+{
+    shared_cache_max_size = size;
+}
 
-    if (!drv)
-        return NULL;
-    return drv->bdrv_aio_flush(bs, cb, opaque);
+void bdrv_shared_cache_set_name(const char *name)
+{
+    qemu_free(shared_cache_name);
+    shared_cache_name = qemu_strdup(name);
 }
 
-void bdrv_aio_cancel(BlockDriverAIOCB *acb)
+void bdrv_shared_cache_print(Monitor *mon, const QObject *data)
 {
-    acb->pool->cancel(acb);
+    QDict *qdict = qobject_to_qdict(data);
+    int64_t hits = qdict_get_int(qdict, "hits");
+    int64_t misses = qdict_get_int(qdict, "misses");
+
+    monitor_printf(mon, "size=%" PRId64 " max-size=%" PRId64
+                   " hits=%" PRId64 " misses=%" PRId64 " hit-rate=%d%%\n",
+                   qdict_get_int(qdict, "size"),
+                   qdict_get_int(qdict, "max-size"), hits, misses,
+                   hits + misses ? (int)(hits * 100 / (hits + misses)) : 0);
 }
 
+void bdrv_info_shared_cache(Monitor *mon, QObject **ret_data)
+{
+    int64_t size = 0, max_size = 0;
+
+    if (shared_cache) {
+        max_size = (int64_t)shared_cache_nb_slots * SHARED_CACHE_CHUNK_SIZE;
+        if (!shared_cache_disabled && bdrv_shared_cache_lock() == 0) {
+            size = MIN((int64_t)shared_cache->used * SHARED_CACHE_CHUNK_SIZE,
+                       max_size);
+            bdrv_shared_cache_unlock();
+        }
+    }
+
+    *ret_data = qobject_from_jsonf("{ 'size': %" PRId64 ","
+                                   "'max-size': %" PRId64 ","
+                                   "'hits': %" PRId64 ","
+                                   "'misses': %" PRId64 " }",
+                                   size, max_size,
+                                   shared_cache_hits, shared_cache_misses);
+}
 
 /**************************************************************/
 /* async block device emulation */
@@ -2629,8 +5220,8 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
     iov.iov_base = (void *)buf;
     iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
     qemu_iovec_init_external(&qiov, &iov, 1);
-    acb = bdrv_aio_readv(bs, sector_num, &qiov, nb_sectors,
-        bdrv_rw_em_cb, &async_ret);
+    acb = bdrv_aio_readv_common(bs, sector_num, &qiov, nb_sectors,
+                                bdrv_rw_em_cb, &async_ret, false);
     if (acb == NULL) {
         async_ret = -1;
         goto fail;
@@ -2660,8 +5251,8 @@ static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
     iov.iov_base = (void *)buf;
     iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
     qemu_iovec_init_external(&qiov, &iov, 1);
-    acb = bdrv_aio_writev(bs, sector_num, &qiov, nb_sectors,
-        bdrv_rw_em_cb, &async_ret);
+    acb = bdrv_aio_writev_common(bs, sector_num, &qiov, nb_sectors,
+                                 bdrv_rw_em_cb, &async_ret, false);
     if (acb == NULL) {
         async_ret = -1;
         goto fail;
@@ -2675,6 +5266,34 @@ fail:
     return async_ret;
 }
 
+/*
+ * Synchronous write that goes through the tracked request path.  The
+ * requests it may have to wait for were submitted in the current async
+ * context, so unlike bdrv_write_em() it must not push a new one.
+ */
+static int bdrv_write_tracked(BlockDriverState *bs, int64_t sector_num,
+                              const uint8_t *buf, int nb_sectors)
+{
+    int async_ret;
+    BlockDriverAIOCB *acb;
+    struct iovec iov;
+    QEMUIOVector qiov;
+
+    async_ret = NOT_DONE;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    acb = bdrv_aio_do_writev(bs, sector_num, &qiov, nb_sectors,
+                             bdrv_rw_em_cb, &async_ret);
+    if (acb == NULL) {
+        return -EIO;
+    }
+    while (async_ret == NOT_DONE) {
+        qemu_aio_wait();
+    }
+    return async_ret;
+}
+
 void bdrv_init(void)
 {
     module_call_init(MODULE_INIT_BLOCK);
@@ -2860,6 +5479,19 @@ int bdrv_get_dirty(BlockDriverState *bs, int64_t sector)
     }
 }
 
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                    int64_t nr_sectors)
+{
+    int n;
+
+    while (nr_sectors > 0) {
+        n = MIN(nr_sectors, INT_MAX - BDRV_SECTORS_PER_DIRTY_CHUNK);
+        set_dirty_bitmap(bs, cur_sector, n, 1);
+        cur_sector += n;
+        nr_sectors -= n;
+    }
+}
+
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors)
 {
@@ -2875,6 +5507,10 @@ void bdrv_set_in_use(BlockDriverState *bs, int in_use)
 {
     assert(bs->in_use != in_use);
     bs->in_use = in_use;
+
+    if (bs->change_cb) {
+        bs->change_cb(bs->change_opaque, CHANGE_USERS);
+    }
 }
 
 int bdrv_in_use(BlockDriverState *bs)
@@ -2882,6 +5518,60 @@ int bdrv_in_use(BlockDriverState *bs)
     return bs->in_use;
 }
 
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockJob *job;
+
+    if (bs->job || bdrv_in_use(bs)) {
+        return NULL;
+    }
+    bdrv_set_in_use(bs, 1);
+
+    job = qemu_mallocz(job_type->instance_size);
+    job->job_type = job_type;
+    job->bs = bs;
+    job->cb = cb;
+    job->opaque = opaque;
+    bs->job = job;
+    return job;
+}
+
+void block_job_complete(BlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->bs;
+
+    assert(bs->job == job);
+    job->cb(job->opaque, ret);
+    bs->job = NULL;
+    qemu_free(job);
+    bdrv_set_in_use(bs, 0);
+}
+
+int block_job_set_speed(BlockJob *job, int64_t value)
+{
+    int ret;
+
+    if (!job->job_type->set_speed) {
+        return -ENOTSUP;
+    }
+    ret = job->job_type->set_speed(job, value);
+    if (ret == 0) {
+        job->speed = value;
+    }
+    return ret;
+}
+
+void block_job_cancel(BlockJob *job)
+{
+    job->cancelled = 1;
+}
+
+int block_job_is_cancelled(BlockJob *job)
+{
+    return job->cancelled;
+}
+
 int bdrv_img_create(const char *filename, const char *fmt,
                     const char *base_filename, const char *base_fmt,
                     char *options, uint64_t img_size, int flags)
@@ -16,6 +16,20 @@ typedef struct BlockDriverInfo {
     int64_t vm_state_offset;
 } BlockDriverInfo;
 
+#define BLOCK_IO_LIMIT_READ     0
+#define BLOCK_IO_LIMIT_WRITE    1
+#define BLOCK_IO_LIMIT_TOTAL    2
+
+typedef struct BlockIOLimit {
+    /* rates in bytes/s and operations/s, 0 means unlimited */
+    int64_t bps[3];
+    int64_t iops[3];
+    /* how far (in bytes/operations) a burst may exceed the rates, 0 means
+       a tenth of a second worth of I/O */
+    int64_t bps_burst;
+    int64_t iops_burst;
+} BlockIOLimit;
+
 typedef struct QEMUSnapshotInfo {
     char id_str[128]; /* unique snapshot id */
     /* the following fields are informative. They are not needed for
@@ -34,6 +48,9 @@ typedef struct QEMUSnapshotInfo {
 #define BDRV_O_NATIVE_AIO  0x0080 /* use native AIO instead of the thread pool */
 #define BDRV_O_NO_BACKING  0x0100 /* don't open the backing file */
 #define BDRV_O_NO_FLUSH    0x0200 /* disable flushing on this disk */
+#define BDRV_O_COPY_ON_READ 0x0400 /* copy read backing sectors into image */
+#define BDRV_O_DETECT_ZEROES 0x0800 /* optimize writes that only contain zeroes */
+#define BDRV_O_SHARED_CACHE 0x1000 /* share reads of read-only images between drives */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -56,6 +73,10 @@ void bdrv_info_print(Monitor *mon, const QObject *data);
 void bdrv_info(Monitor *mon, QObject **ret_data);
 void bdrv_stats_print(Monitor *mon, const QObject *data);
 void bdrv_info_stats(Monitor *mon, QObject **ret_data);
+void bdrv_shared_cache_print(Monitor *mon, const QObject *data);
+void bdrv_info_shared_cache(Monitor *mon, QObject **ret_data);
+void bdrv_shared_cache_set_size(int64_t size);
+void bdrv_shared_cache_set_name(const char *name);
 
 void bdrv_init(void);
 void bdrv_init_with_whitelist(void);
@@ -135,6 +156,13 @@ typedef struct BlockRequest {
 
 int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs,
     int num_reqs);
+int bdrv_aio_multiread(BlockDriverState *bs, BlockRequest *reqs,
+    int num_reqs);
+
+void bdrv_io_plug(BlockDriverState *bs);
+void bdrv_io_unplug(BlockDriverState *bs);
+void bdrv_set_aio_poll(BlockDriverState *bs, int64_t poll_ns);
+int bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t size);
 
 /* sg packet commands */
 int bdrv_ioctl(BlockDriverState *bs, unsigned long int req, void *buf);
@@ -204,6 +232,11 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
 const char *bdrv_get_device_name(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors);
+int bdrv_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                          const uint8_t *buf);
+int bdrv_write_compressed_cluster(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors,
+                                  const uint8_t *out_buf, int out_len);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 
 const char *bdrv_get_encrypted_filename(BlockDriverState *bs);
@@ -243,10 +276,19 @@ int bdrv_img_create(const char *filename, const char *fmt,
 
 void bdrv_set_dirty_tracking(BlockDriverState *bs, int enable);
 int bdrv_get_dirty(BlockDriverState *bs, int64_t sector);
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
+                    int64_t nr_sectors);
 void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector,
                       int nr_sectors);
 int64_t bdrv_get_dirty_count(BlockDriverState *bs);
 
+void bdrv_set_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+void bdrv_get_io_limits(BlockDriverState *bs, BlockIOLimit *io_limits);
+void bdrv_io_limits_flush_all(void);
+
+void bdrv_enable_copy_on_read(BlockDriverState *bs);
+void bdrv_disable_copy_on_read(BlockDriverState *bs);
+int bdrv_drop_backing_file(BlockDriverState *bs);
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
 
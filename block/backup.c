@@ -0,0 +1,318 @@
+/*
+ * Incremental backup
+ *
+ * Exports the clusters recorded in a named dirty bitmap to a target image
+ * while the guest keeps running.  Guest writes to clusters that have not been
+ * exported yet wait until the old data has been copied, so the target holds
+ * the contents of the clusters at the point in time the job was started.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "bitmap.h"
+#include "ratelimit.h"
+
+/* Maximum size of a single copy; larger clusters are copied one at a time */
+#define BACKUP_MAX_COPY_SIZE (1024 * 1024)
+
+/* Number of background copies that may be in flight at the same time */
+#define BACKUP_MAX_IN_FLIGHT 4
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    QEMUTimer *timer;
+    BlockDriverState *target;
+    BdrvDirtyBitmap *bitmap;
+    unsigned long *copy_bitmap; /* clusters that still have to be exported */
+    int64_t remaining;          /* number of bits set in copy_bitmap */
+    int64_t next_bit;           /* position of the background scan */
+    int sectors_per_bit;
+    int max_bits;               /* bits per copy */
+    int in_flight;
+    int ret;
+} BackupBlockJob;
+
+typedef struct BackupCopy {
+    BackupBlockJob *job;
+    BdrvTrackedRequest req;
+    int64_t bit;
+    int nb_bits;
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} BackupCopy;
+
+static void backup_complete(BackupBlockJob *s)
+{
+    BdrvDirtyBitmap *bitmap = s->bitmap;
+    int64_t bit;
+
+    trace_backup_complete(s, s->common.bs, s->ret);
+
+    /* Whatever was not exported is still changed for the next export */
+    bitmap_or(bitmap->bitmap, bitmap->bitmap, s->copy_bitmap,
+              bitmap->nb_bits);
+    bitmap->count = 0;
+    for (bit = find_first_bit(bitmap->bitmap, bitmap->nb_bits);
+         bit < bitmap->nb_bits;
+         bit = find_next_bit(bitmap->bitmap, bitmap->nb_bits, bit + 1)) {
+        bitmap->count++;
+    }
+    bitmap->busy = 0;
+
+    bdrv_delete(s->target);
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    qemu_free(s->copy_bitmap);
+    block_job_complete(&s->common, s->ret);
+}
+
+static void backup_copy_done(BackupCopy *c, int ret)
+{
+    BackupBlockJob *s = c->job;
+
+    trace_backup_copy_done(s, c->bit, c->nb_bits, ret);
+
+    if (ret < 0) {
+        bitmap_set(s->copy_bitmap, c->bit, c->nb_bits);
+        s->remaining += c->nb_bits;
+        if (s->ret == 0) {
+            s->ret = ret;
+        }
+    } else {
+        s->common.offset += c->req.nb_sectors * BDRV_SECTOR_SIZE;
+    }
+
+    /* Lets guest writes to the range go ahead */
+    bdrv_tracked_request_end(s->common.bs, &c->req);
+
+    qemu_vfree(c->buf);
+    qemu_free(c);
+    s->in_flight--;
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+}
+
+static void backup_write_cb(void *opaque, int ret)
+{
+    backup_copy_done(opaque, ret);
+}
+
+static void backup_read_cb(void *opaque, int ret)
+{
+    BackupCopy *c = opaque;
+
+    if (ret < 0) {
+        backup_copy_done(c, ret);
+        return;
+    }
+
+    if (!bdrv_aio_writev(c->job->target, c->req.sector_num, &c->qiov,
+                         c->req.nb_sectors, backup_write_cb, c)) {
+        backup_copy_done(c, -EIO);
+    }
+}
+
+static void backup_copy_start(BackupCopy *c)
+{
+    BlockDriverState *bs = c->job->common.bs;
+
+    /*
+     * Bypass bdrv_aio_readv(): the copy is already a tracked request and must
+     * not be throttled or turned into another copy-on-read request.
+     */
+    if (!bs->drv->bdrv_aio_readv(bs, c->req.sector_num, &c->qiov,
+                                 c->req.nb_sectors, backup_read_cb, c)) {
+        backup_copy_done(c, -EIO);
+    }
+}
+
+static void backup_copy_resume(BdrvTrackedRequest *req)
+{
+    backup_copy_start(container_of(req, BackupCopy, req));
+}
+
+/* Copies nb_bits clusters starting at bit, which must all be set */
+static void backup_copy(BackupBlockJob *s, int64_t bit, int nb_bits)
+{
+    BlockDriverState *bs = s->common.bs;
+    BackupCopy *c;
+    int64_t sector_num = bit * s->sectors_per_bit;
+
+    trace_backup_copy(s, bit, nb_bits);
+
+    bitmap_clear(s->copy_bitmap, bit, nb_bits);
+    s->remaining -= nb_bits;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->job = s;
+    c->bit = bit;
+    c->nb_bits = nb_bits;
+    c->req.sector_num = sector_num;
+    c->req.nb_sectors = MIN((int64_t)nb_bits * s->sectors_per_bit,
+                            bs->total_sectors - sector_num);
+    c->req.serialising = 1;
+    c->req.resume = backup_copy_resume;
+
+    c->buf = qemu_blockalign(bs, c->req.nb_sectors * BDRV_SECTOR_SIZE);
+    c->iov.iov_base = c->buf;
+    c->iov.iov_len = c->req.nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&c->qiov, &c->iov, 1);
+
+    s->in_flight++;
+    if (bdrv_tracked_request_begin(bs, &c->req)) {
+        backup_copy_start(c);
+    }
+}
+
+/* Returns the number of consecutive set bits in [bit, end), at most max */
+static int backup_count_bits(BackupBlockJob *s, int64_t bit, int64_t end)
+{
+    int n = 0;
+
+    while (bit + n < end && n < s->max_bits &&
+           test_bit(bit + n, s->copy_bitmap)) {
+        n++;
+    }
+    return n;
+}
+
+static void backup_before_write(BlockJob *job, int64_t sector_num,
+                                int nb_sectors)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+    int64_t bit, end;
+    int n;
+
+    if (block_job_is_cancelled(job) || s->ret < 0) {
+        return;
+    }
+
+    end = MIN((sector_num + nb_sectors - 1) / s->sectors_per_bit + 1,
+              s->bitmap->nb_bits);
+    bit = find_next_bit(s->copy_bitmap, end, sector_num / s->sectors_per_bit);
+    while (bit < end) {
+        n = backup_count_bits(s, bit, end);
+        backup_copy(s, bit, n);
+        bit = find_next_bit(s->copy_bitmap, end, bit + n);
+    }
+}
+
+static void backup_run(void *opaque)
+{
+    BackupBlockJob *s = opaque;
+    int64_t nb_bits = s->bitmap->nb_bits;
+    int64_t bit, delay;
+    int n;
+
+    if (block_job_is_cancelled(&s->common) || s->ret < 0 ||
+        s->remaining == 0) {
+        /* Copies in flight reschedule the timer when they complete */
+        if (s->in_flight == 0) {
+            backup_complete(s);
+        }
+        return;
+    }
+
+    if (s->in_flight >= BACKUP_MAX_IN_FLIGHT) {
+        return;
+    }
+
+    /* Guest writes only ever clear bits, so the scan need not wrap around */
+    bit = find_next_bit(s->copy_bitmap, nb_bits, s->next_bit);
+    if (bit >= nb_bits) {
+        s->remaining = 0;
+        qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+        return;
+    }
+    n = backup_count_bits(s, bit, nb_bits);
+
+    if (s->common.speed) {
+        /* Don't let a single copy use up several slices */
+        n = MIN(n, MAX(s->limit.slice_quota /
+                       (s->sectors_per_bit * BDRV_SECTOR_SIZE), 1));
+        delay = ratelimit_calculate_delay(&s->limit,
+            (int64_t)n * s->sectors_per_bit * BDRV_SECTOR_SIZE);
+        if (delay > 0) {
+            s->next_bit = bit;
+            qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock) + delay);
+            return;
+        }
+    }
+
+    backup_copy(s, bit, n);
+    s->next_bit = bit + n;
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+}
+
+static int backup_set_speed(BlockJob *job, int64_t value)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    ratelimit_set_speed(&s->limit, value, SLICE_TIME);
+    return 0;
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size = sizeof(BackupBlockJob),
+    .job_type      = "backup",
+    .set_speed     = backup_set_speed,
+    .before_write  = backup_before_write,
+};
+
+/*
+ * Starts exporting the clusters marked in bitmap to target, which must be at
+ * least as large as bs.  The bitmap is cleared and starts recording changes
+ * for the next export; clusters that could not be exported are marked in it
+ * again when the job ends.  The job takes ownership of target.
+ */
+int backup_start(BlockDriverState *bs, BlockDriverState *target,
+                 BdrvDirtyBitmap *bitmap, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BackupBlockJob *s;
+
+    if (speed < 0) {
+        return -EINVAL;
+    }
+    if (bitmap->busy) {
+        return -EBUSY;
+    }
+
+    s = block_job_create(&backup_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY;
+    }
+
+    /* Writes that are in flight must not be missed by both bitmaps */
+    qemu_aio_flush();
+
+    s->target = target;
+    s->bitmap = bitmap;
+    s->sectors_per_bit = bitmap->granularity / BDRV_SECTOR_SIZE;
+    s->max_bits = MAX(BACKUP_MAX_COPY_SIZE / bitmap->granularity, 1);
+    s->copy_bitmap = bitmap_new(bitmap->nb_bits);
+    bitmap_copy(s->copy_bitmap, bitmap->bitmap, bitmap->nb_bits);
+    s->remaining = bitmap->count;
+    s->common.len = MIN(bitmap->count * bitmap->granularity,
+                        bs->total_sectors * BDRV_SECTOR_SIZE);
+    s->timer = qemu_new_timer_ns(rt_clock, backup_run, s);
+    block_job_set_speed(&s->common, speed);
+
+    bitmap_zero(bitmap->bitmap, bitmap->nb_bits);
+    bitmap->count = 0;
+    bitmap->busy = 1;
+
+    trace_backup_start(bs, target, s, bitmap->name, speed);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+    return 0;
+}
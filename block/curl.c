@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "block_int.h"
+#include "bitmap.h"
 #include <curl/curl.h>
 
 // #define DEBUG
@@ -35,32 +36,57 @@
 #endif
 
 #define CURL_NUM_STATES 8
-#define CURL_NUM_ACB    8
 #define SECTOR_SIZE     512
-#define READ_AHEAD_SIZE (256 * 1024)
+#define READ_AHEAD_SIZE (1024 * 1024)
 
-#define FIND_RET_NONE   0
-#define FIND_RET_OK     1
-#define FIND_RET_WAIT   2
+/* Data is downloaded and cached in blocks of this size */
+#define CURL_BLOCK_SIZE (256 * 1024)
+#define CURL_CACHE_SIZE (32 * 1024 * 1024)
+#define CURL_HASH_SIZE  256
+
+/* Number of back-to-back reads after which read-ahead starts */
+#define CURL_SEQ_THRESHOLD 2
+
+enum {
+    CURL_BLOCK_QUEUED,      /* waiting for a free connection */
+    CURL_BLOCK_LOADING,     /* being downloaded */
+    CURL_BLOCK_VALID,
+    CURL_BLOCK_ERROR,
+};
 
 struct BDRVCURLState;
 
+typedef struct CURLBlock {
+    int64_t index;
+    int state;
+    int prefetch;           /* queued for read-ahead, not for a request */
+    int refcnt;             /* number of requests using the block */
+    size_t len;
+    uint8_t *data;
+    QLIST_ENTRY(CURLBlock) hash_next;
+    QTAILQ_ENTRY(CURLBlock) lru_next;
+    QTAILQ_ENTRY(CURLBlock) queue_next;
+} CURLBlock;
+
 typedef struct CURLAIOCB {
     BlockDriverAIOCB common;
+    QEMUBH *bh;
     QEMUIOVector *qiov;
+    QEMUIOVector cur_qiov;
     size_t start;
     size_t end;
+    CURLBlock **blocks;
+    int nb_blocks;
+    int ret;
+    QLIST_ENTRY(CURLAIOCB) next;
 } CURLAIOCB;
 
 typedef struct CURLState
 {
     struct BDRVCURLState *s;
-    CURLAIOCB *acb[CURL_NUM_ACB];
     CURL *curl;
-    char *orig_buf;
-    size_t buf_start;
+    CURLBlock *block;
     size_t buf_off;
-    size_t buf_len;
     char range[128];
     char errmsg[CURL_ERROR_SIZE];
     char in_use;
@@ -72,10 +98,28 @@ typedef struct BDRVCURLState {
     CURLState states[CURL_NUM_STATES];
     char *url;
     size_t readahead_size;
+
+    /* Block cache */
+    size_t cache_size;
+    int nb_blocks;
+    QLIST_HEAD(, CURLBlock) hash[CURL_HASH_SIZE];
+    QTAILQ_HEAD(, CURLBlock) lru;           /* least recently used first */
+    QTAILQ_HEAD(, CURLBlock) fetch_queue;   /* blocks needed by requests */
+    QTAILQ_HEAD(, CURLBlock) prefetch_queue;
+    QLIST_HEAD(, CURLAIOCB) acbs;           /* requests waiting for blocks */
+
+    /* Blocks evicted from memory are kept in this file if it is set */
+    int cache_fd;
+    unsigned long *cache_file_bitmap;
+
+    /* Sequential read detection */
+    size_t seq_next;
+    int seq_count;
 } BDRVCURLState;
 
 static void curl_clean_state(CURLState *s);
 static void curl_multi_do(void *arg);
+static int curl_aio_flush(void *opaque);
 
 static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
                         void *s, void *sp)
@@ -83,14 +127,16 @@ static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
     DPRINTF("CURL (AIO): Sock action %d on fd %d\n", action, fd);
     switch (action) {
         case CURL_POLL_IN:
-            qemu_aio_set_fd_handler(fd, curl_multi_do, NULL, NULL, NULL, s);
+            qemu_aio_set_fd_handler(fd, curl_multi_do, NULL,
+                                    curl_aio_flush, NULL, s);
             break;
         case CURL_POLL_OUT:
-            qemu_aio_set_fd_handler(fd, NULL, curl_multi_do, NULL, NULL, s);
+            qemu_aio_set_fd_handler(fd, NULL, curl_multi_do,
+                                    curl_aio_flush, NULL, s);
             break;
         case CURL_POLL_INOUT:
-            qemu_aio_set_fd_handler(fd, curl_multi_do,
-                                    curl_multi_do, NULL, NULL, s);
+            qemu_aio_set_fd_handler(fd, curl_multi_do, curl_multi_do,
+                                    curl_aio_flush, NULL, s);
             break;
         case CURL_POLL_REMOVE:
             qemu_aio_set_fd_handler(fd, NULL, NULL, NULL, NULL, NULL);
@@ -117,98 +163,324 @@ static size_t curl_read_cb(void *ptr, size_t size, size_t nmemb, void *opaque)
 {
     CURLState *s = ((CURLState*)opaque);
     size_t realsize = size * nmemb;
-    int i;
+    CURLBlock *block = s->block;
 
     DPRINTF("CURL: Just reading %zd bytes\n", realsize);
 
-    if (!s || !s->orig_buf)
-        goto read_end;
+    if (!block) {
+        return realsize;
+    }
 
-    memcpy(s->orig_buf + s->buf_off, ptr, realsize);
+    /* A server that ignores the range would overflow the block */
+    if (realsize > block->len - s->buf_off) {
+        return 0;
+    }
+
+    memcpy(block->data + s->buf_off, ptr, realsize);
     s->buf_off += realsize;
 
-    for(i=0; i<CURL_NUM_ACB; i++) {
-        CURLAIOCB *acb = s->acb[i];
+    return realsize;
+}
+
+static CURLBlock *curl_block_find(BDRVCURLState *s, int64_t index)
+{
+    CURLBlock *block;
+
+    QLIST_FOREACH(block, &s->hash[index % CURL_HASH_SIZE], hash_next) {
+        if (block->index == index) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void curl_block_free(BDRVCURLState *s, CURLBlock *block)
+{
+    /* Failed blocks are already out of the hash table */
+    if (block->state != CURL_BLOCK_ERROR) {
+        QLIST_REMOVE(block, hash_next);
+    }
+    QTAILQ_REMOVE(&s->lru, block, lru_next);
+    s->nb_blocks--;
+    qemu_free(block->data);
+    qemu_free(block);
+}
+
+static void curl_block_unref(BDRVCURLState *s, CURLBlock *block)
+{
+    if (--block->refcnt == 0 && block->state == CURL_BLOCK_ERROR) {
+        curl_block_free(s, block);
+    }
+}
+
+/*
+ * Frees the least recently used blocks until the cache fits into its size
+ * limit.  Blocks that are in use or still being downloaded are skipped.
+ */
+static void curl_cache_evict(BDRVCURLState *s)
+{
+    CURLBlock *block, *next;
+    ssize_t ret;
 
-        if (!acb)
+    QTAILQ_FOREACH_SAFE(block, &s->lru, lru_next, next) {
+        if ((size_t)s->nb_blocks * CURL_BLOCK_SIZE <= s->cache_size) {
+            break;
+        }
+        if (block->refcnt || block->state != CURL_BLOCK_VALID) {
             continue;
+        }
 
-        if ((s->buf_off >= acb->end)) {
-            qemu_iovec_from_buffer(acb->qiov, s->orig_buf + acb->start,
-                                   acb->end - acb->start);
-            acb->common.cb(acb->common.opaque, 0);
-            qemu_aio_release(acb);
-            s->acb[i] = NULL;
+        if (s->cache_fd >= 0 && !test_bit(block->index, s->cache_file_bitmap)) {
+            ret = pwrite(s->cache_fd, block->data, block->len,
+                         block->index * CURL_BLOCK_SIZE);
+            if (ret == (ssize_t)block->len) {
+                set_bit(block->index, s->cache_file_bitmap);
+            }
         }
+        curl_block_free(s, block);
     }
+}
 
-read_end:
-    return realsize;
+/*
+ * Looks up a block in the cache.  Blocks that are not cached are created and
+ * queued for download, either for a request or for read-ahead.  Requests get
+ * a reference to the block, taken before eviction can free it.
+ */
+static CURLBlock *curl_block_get(BDRVCURLState *s, int64_t index, int prefetch)
+{
+    CURLBlock *block;
+
+    block = curl_block_find(s, index);
+    if (block) {
+        QTAILQ_REMOVE(&s->lru, block, lru_next);
+        QTAILQ_INSERT_TAIL(&s->lru, block, lru_next);
+
+        /* A request needs the block now, don't let it wait for read-ahead */
+        if (!prefetch && block->state == CURL_BLOCK_QUEUED &&
+            block->prefetch) {
+            QTAILQ_REMOVE(&s->prefetch_queue, block, queue_next);
+            QTAILQ_INSERT_TAIL(&s->fetch_queue, block, queue_next);
+            block->prefetch = 0;
+        }
+        if (!prefetch) {
+            block->refcnt++;
+        }
+        return block;
+    }
+
+    block = qemu_mallocz(sizeof(*block));
+    block->index = index;
+    block->len = MIN(CURL_BLOCK_SIZE, s->len - index * CURL_BLOCK_SIZE);
+    block->data = qemu_malloc(block->len);
+    block->refcnt = !prefetch;
+    QLIST_INSERT_HEAD(&s->hash[index % CURL_HASH_SIZE], block, hash_next);
+    QTAILQ_INSERT_TAIL(&s->lru, block, lru_next);
+    s->nb_blocks++;
+
+    if (s->cache_fd >= 0 && test_bit(index, s->cache_file_bitmap) &&
+        pread(s->cache_fd, block->data, block->len,
+              index * CURL_BLOCK_SIZE) == (ssize_t)block->len) {
+        block->state = CURL_BLOCK_VALID;
+    } else {
+        block->state = CURL_BLOCK_QUEUED;
+        block->prefetch = prefetch;
+        if (prefetch) {
+            QTAILQ_INSERT_TAIL(&s->prefetch_queue, block, queue_next);
+        } else {
+            QTAILQ_INSERT_TAIL(&s->fetch_queue, block, queue_next);
+        }
+    }
+
+    curl_cache_evict(s);
+    return block;
 }
 
-static int curl_find_buf(BDRVCURLState *s, size_t start, size_t len,
-                         CURLAIOCB *acb)
+static int curl_init_state(BDRVCURLState *s, CURLState *state)
 {
-    int i;
-    size_t end = start + len;
+    state->s = s;
+    if (state->curl) {
+        return 0;
+    }
 
-    for (i=0; i<CURL_NUM_STATES; i++) {
+    state->curl = curl_easy_init();
+    if (!state->curl) {
+        return -EIO;
+    }
+    curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
+    curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
+    curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
+    curl_easy_setopt(state->curl, CURLOPT_WRITEDATA, (void *)state);
+    curl_easy_setopt(state->curl, CURLOPT_PRIVATE, (void *)state);
+    curl_easy_setopt(state->curl, CURLOPT_AUTOREFERER, 1);
+    curl_easy_setopt(state->curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
+
+#ifdef DEBUG_VERBOSE
+    curl_easy_setopt(state->curl, CURLOPT_VERBOSE, 1);
+#endif
+
+    return 0;
+}
+
+static void curl_clean_state(CURLState *s)
+{
+    if (s->s->multi)
+        curl_multi_remove_handle(s->s->multi, s->curl);
+    s->in_use = 0;
+}
+
+static void curl_fetch_block(CURLState *state, CURLBlock *block)
+{
+    BDRVCURLState *s = state->s;
+    size_t start = block->index * CURL_BLOCK_SIZE;
+
+    block->state = CURL_BLOCK_LOADING;
+    state->in_use = 1;
+    state->block = block;
+    state->buf_off = 0;
+    state->errmsg[0] = '\0';
+
+    snprintf(state->range, 127, "%zd-%zd", start, start + block->len - 1);
+    DPRINTF("CURL (AIO): Reading block %" PRId64 " (%s)%s\n",
+            block->index, state->range, block->prefetch ? " ahead" : "");
+    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+
+    curl_multi_add_handle(s->multi, state->curl);
+}
+
+/*
+ * Starts downloading queued blocks on all idle connections.  Blocks that
+ * requests are waiting for go first.  Returns the number of new downloads.
+ */
+static int curl_start_fetches(BDRVCURLState *s)
+{
+    CURLBlock *block;
+    int i, started = 0;
+
+    for (i = 0; i < CURL_NUM_STATES; i++) {
         CURLState *state = &s->states[i];
-        size_t buf_end = (state->buf_start + state->buf_off);
-        size_t buf_fend = (state->buf_start + state->buf_len);
 
-        if (!state->orig_buf)
+        if (state->in_use) {
             continue;
-        if (!state->buf_off)
+        }
+
+        block = QTAILQ_FIRST(&s->fetch_queue);
+        if (block) {
+            QTAILQ_REMOVE(&s->fetch_queue, block, queue_next);
+        } else {
+            block = QTAILQ_FIRST(&s->prefetch_queue);
+            if (!block) {
+                break;
+            }
+            QTAILQ_REMOVE(&s->prefetch_queue, block, queue_next);
+        }
+
+        if (curl_init_state(s, state) < 0) {
+            QLIST_REMOVE(block, hash_next);
+            block->state = CURL_BLOCK_ERROR;
+            if (block->refcnt == 0) {
+                curl_block_free(s, block);
+            }
             continue;
+        }
+        curl_fetch_block(state, block);
+        started++;
+    }
+    return started;
+}
 
-        // Does the existing buffer cover our section?
-        if ((start >= state->buf_start) &&
-            (start <= buf_end) &&
-            (end >= state->buf_start) &&
-            (end <= buf_end))
-        {
-            char *buf = state->orig_buf + (start - state->buf_start);
+static void curl_aio_bh(void *opaque)
+{
+    CURLAIOCB *acb = opaque;
 
-            qemu_iovec_from_buffer(acb->qiov, buf, len);
-            acb->common.cb(acb->common.opaque, 0);
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
 
-            return FIND_RET_OK;
-        }
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_release(acb);
+}
 
-        // Wait for unfinished chunks
-        if ((start >= state->buf_start) &&
-            (start <= buf_fend) &&
-            (end >= state->buf_start) &&
-            (end <= buf_fend))
-        {
-            int j;
-
-            acb->start = start - state->buf_start;
-            acb->end = acb->start + len;
-
-            for (j=0; j<CURL_NUM_ACB; j++) {
-                if (!state->acb[j]) {
-                    state->acb[j] = acb;
-                    return FIND_RET_WAIT;
-                }
-            }
+static void curl_aio_release_blocks(CURLAIOCB *acb)
+{
+    BDRVCURLState *s = acb->common.bs->opaque;
+    int i;
+
+    for (i = 0; i < acb->nb_blocks; i++) {
+        curl_block_unref(s, acb->blocks[i]);
+    }
+    qemu_free(acb->blocks);
+    acb->blocks = NULL;
+    acb->nb_blocks = 0;
+    qemu_iovec_destroy(&acb->cur_qiov);
+    curl_cache_evict(s);
+}
+
+/*
+ * Completes a request if all of its blocks are there.  Returns 0 if the
+ * request still has to wait.
+ */
+static int curl_aio_check(CURLAIOCB *acb)
+{
+    BDRVCURLState *s = acb->common.bs->opaque;
+    CURLBlock *block;
+    size_t block_start, start, end;
+    int i;
+
+    acb->ret = 0;
+    for (i = 0; i < acb->nb_blocks; i++) {
+        if (acb->blocks[i]->state == CURL_BLOCK_ERROR) {
+            acb->ret = -EIO;
+            goto done;
+        }
+        if (acb->blocks[i]->state != CURL_BLOCK_VALID) {
+            return 0;
         }
     }
 
-    return FIND_RET_NONE;
+    for (i = 0; i < acb->nb_blocks; i++) {
+        block = acb->blocks[i];
+        block_start = block->index * CURL_BLOCK_SIZE;
+        start = MAX(acb->start, block_start);
+        end = MIN(acb->end, block_start + block->len);
+
+        qemu_iovec_reset(&acb->cur_qiov);
+        qemu_iovec_copy(&acb->cur_qiov, acb->qiov, start - acb->start,
+                        end - start);
+        qemu_iovec_from_buffer(&acb->cur_qiov, block->data + start - block_start,
+                               end - start);
+    }
+
+    /* Reads beyond the end of a file that isn't sector aligned */
+    if (acb->end > s->len) {
+        start = MAX(acb->start, s->len);
+        qemu_iovec_memset_skip(acb->qiov, 0, acb->end - start,
+                               start - acb->start);
+    }
+
+done:
+    QLIST_REMOVE(acb, next);
+    curl_aio_release_blocks(acb);
+    acb->bh = qemu_bh_new(curl_aio_bh, acb);
+    qemu_bh_schedule(acb->bh);
+    return 1;
 }
 
-static void curl_multi_do(void *arg)
+static void curl_check_acbs(BDRVCURLState *s)
+{
+    CURLAIOCB *acb, *next;
+
+    QLIST_FOREACH_SAFE(acb, &s->acbs, next, next) {
+        curl_aio_check(acb);
+    }
+}
+
+static void curl_multi_read(BDRVCURLState *s)
 {
-    BDRVCURLState *s = (BDRVCURLState *)arg;
     int running;
     int r;
     int msgs_in_queue;
 
-    if (!s->multi)
-        return;
-
     do {
         r = curl_multi_socket_all(s->multi, &running);
     } while(r == CURLM_CALL_MULTI_PERFORM);
@@ -228,7 +500,25 @@ static void curl_multi_do(void *arg)
             case CURLMSG_DONE:
             {
                 CURLState *state = NULL;
+                CURLBlock *block;
+
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&state);
+                block = state->block;
+                state->block = NULL;
+
+                if (msg->data.result == CURLE_OK &&
+                    state->buf_off == block->len) {
+                    block->state = CURL_BLOCK_VALID;
+                } else {
+                    fprintf(stderr, "CURL: Error reading %s: %s\n",
+                            state->range, state->errmsg[0] ? state->errmsg :
+                            "incomplete transfer");
+                    QLIST_REMOVE(block, hash_next);
+                    block->state = CURL_BLOCK_ERROR;
+                    if (block->refcnt == 0) {
+                        curl_block_free(s, block);
+                    }
+                }
                 curl_clean_state(state);
                 break;
             }
@@ -239,111 +529,146 @@ static void curl_multi_do(void *arg)
     } while(msgs_in_queue);
 }
 
-static CURLState *curl_init_state(BDRVCURLState *s)
+static int curl_aio_flush(void *opaque)
 {
-    CURLState *state = NULL;
-    int i, j;
+    BDRVCURLState *s = opaque;
+    int i;
+
+    if (!QLIST_EMPTY(&s->acbs)) {
+        return 1;
+    }
+
+    /* Keep read-ahead going in tools that have no main loop */
+    for (i = 0; i < CURL_NUM_STATES; i++) {
+        if (s->states[i].in_use) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void curl_multi_do(void *arg)
+{
+    BDRVCURLState *s = (BDRVCURLState *)arg;
+
+    if (!s->multi)
+        return;
 
+    /* New downloads only start when the multi handle is driven again */
     do {
-        for (i=0; i<CURL_NUM_STATES; i++) {
-            for (j=0; j<CURL_NUM_ACB; j++)
-                if (s->states[i].acb[j])
-                    continue;
-            if (s->states[i].in_use)
-                continue;
-
-            state = &s->states[i];
-            state->in_use = 1;
+        curl_multi_read(s);
+    } while (curl_start_fetches(s));
+
+    curl_check_acbs(s);
+}
+
+/*
+ * Options are appended to the URL as ":name=value:", for example
+ * http://server/image.iso:readahead=2M:cache_size=64M:
+ */
+static int curl_parse_filename(BDRVCURLState *s, char *file,
+                               const char **cache_file)
+{
+    char *end, *opt;
+    const char *val;
+    int64_t size;
+    int found = 0;
+
+    while ((end = file + strlen(file) - 1) > file && *end == ':') {
+        *end = '\0';
+        opt = strrchr(file, ':');
+        if (!opt) {
+            *end = ':';
             break;
         }
-        if (!state) {
-            usleep(100);
-            curl_multi_do(s);
+
+        if (strstart(opt + 1, "readahead=", &val)) {
+            size = strtosz_suffix(val, NULL, STRTOSZ_DEFSUFFIX_B);
+            if (size < 0 || (size & 0x1ff) != 0) {
+                fprintf(stderr, "HTTP_READAHEAD_SIZE %s is not a multiple "
+                        "of 512\n", val);
+                return -EINVAL;
+            }
+            s->readahead_size = size;
+        } else if (strstart(opt + 1, "cache_size=", &val)) {
+            size = strtosz_suffix(val, NULL, STRTOSZ_DEFSUFFIX_B);
+            if (size < CURL_BLOCK_SIZE) {
+                fprintf(stderr, "CURL: cache_size must be at least %d\n",
+                        CURL_BLOCK_SIZE);
+                return -EINVAL;
+            }
+            s->cache_size = size;
+        } else if (strstart(opt + 1, "cache_file=", &val)) {
+            *cache_file = val;
+        } else {
+            *end = ':';
+            break;
         }
-    } while(!state);
 
-    if (state->curl)
-        goto has_curl;
+        /* Keep the separator, it terminates the previous option */
+        opt[1] = '\0';
+        found = 1;
+    }
 
-    state->curl = curl_easy_init();
-    if (!state->curl)
-        return NULL;
-    curl_easy_setopt(state->curl, CURLOPT_URL, s->url);
-    curl_easy_setopt(state->curl, CURLOPT_TIMEOUT, 5);
-    curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
-    curl_easy_setopt(state->curl, CURLOPT_WRITEDATA, (void *)state);
-    curl_easy_setopt(state->curl, CURLOPT_PRIVATE, (void *)state);
-    curl_easy_setopt(state->curl, CURLOPT_AUTOREFERER, 1);
-    curl_easy_setopt(state->curl, CURLOPT_FOLLOWLOCATION, 1);
-    curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
-    curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
-    
-#ifdef DEBUG_VERBOSE
-    curl_easy_setopt(state->curl, CURLOPT_VERBOSE, 1);
-#endif
+    /* Remove the separator before the first option */
+    if (found) {
+        file[strlen(file) - 1] = '\0';
+    }
+    return 0;
+}
 
-has_curl:
+static int curl_open_cache_file(BDRVCURLState *s, const char *filename)
+{
+    int64_t nb_blocks = (s->len + CURL_BLOCK_SIZE - 1) / CURL_BLOCK_SIZE;
 
-    state->s = s;
+    s->cache_fd = qemu_open(filename, O_RDWR | O_CREAT | O_TRUNC | O_BINARY,
+                            0600);
+    if (s->cache_fd < 0) {
+        return -errno;
+    }
 
-    return state;
-}
+    /* The file is sparse, it only takes space for the blocks written to it */
+    if (ftruncate(s->cache_fd, s->len) < 0) {
+        int ret = -errno;
+        close(s->cache_fd);
+        s->cache_fd = -1;
+        return ret;
+    }
 
-static void curl_clean_state(CURLState *s)
-{
-    if (s->s->multi)
-        curl_multi_remove_handle(s->s->multi, s->curl);
-    s->in_use = 0;
+    s->cache_file_bitmap = bitmap_new(MAX(nb_blocks, 1));
+    return 0;
 }
 
 static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVCURLState *s = bs->opaque;
     CURLState *state = NULL;
-    double d;
-
-    #define RA_OPTSTR ":readahead="
+    const char *cache_file = NULL;
     char *file;
-    char *ra;
-    const char *ra_val;
-    int parse_state = 0;
+    double d;
+    int i, ret;
 
     static int inited = 0;
 
     file = qemu_strdup(filename);
     s->readahead_size = READ_AHEAD_SIZE;
+    s->cache_size = CURL_CACHE_SIZE;
+    s->cache_fd = -1;
 
-    /* Parse a trailing ":readahead=#:" param, if present. */
-    ra = file + strlen(file) - 1;
-    while (ra >= file) {
-        if (parse_state == 0) {
-            if (*ra == ':')
-                parse_state++;
-            else
-                break;
-        } else if (parse_state == 1) {
-            if (*ra > '9' || *ra < '0') {
-                char *opt_start = ra - strlen(RA_OPTSTR) + 1;
-                if (opt_start > file &&
-                    strncmp(opt_start, RA_OPTSTR, strlen(RA_OPTSTR)) == 0) {
-                    ra_val = ra + 1;
-                    ra -= strlen(RA_OPTSTR) - 1;
-                    *ra = '\0';
-                    s->readahead_size = atoi(ra_val);
-                    break;
-                } else {
-                    break;
-                }
-            }
-        }
-        ra--;
+    if (curl_parse_filename(s, file, &cache_file) < 0) {
+        goto out_noclean;
     }
 
-    if ((s->readahead_size & 0x1ff) != 0) {
-        fprintf(stderr, "HTTP_READAHEAD_SIZE %zd is not a multiple of 512\n",
-                s->readahead_size);
-        goto out_noclean;
+    /* Read-ahead must not push out the data it was fetched for */
+    s->readahead_size = MIN(s->readahead_size, s->cache_size / 2);
+
+    for (i = 0; i < CURL_HASH_SIZE; i++) {
+        QLIST_INIT(&s->hash[i]);
     }
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->fetch_queue);
+    QTAILQ_INIT(&s->prefetch_queue);
+    QLIST_INIT(&s->acbs);
 
     if (!inited) {
         curl_global_init(CURL_GLOBAL_ALL);
@@ -352,8 +677,8 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
 
     DPRINTF("CURL: Opening %s\n", file);
     s->url = file;
-    state = curl_init_state(s);
-    if (!state)
+    state = &s->states[0];
+    if (curl_init_state(s, state) < 0)
         goto out_noclean;
 
     // Get file size
@@ -365,22 +690,30 @@ static int curl_open(BlockDriverState *bs, const char *filename, int flags)
     curl_easy_getinfo(state->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &d);
     curl_easy_setopt(state->curl, CURLOPT_WRITEFUNCTION, (void *)curl_read_cb);
     curl_easy_setopt(state->curl, CURLOPT_NOBODY, 0);
-    if (d)
+    if (d > 0)
         s->len = (size_t)d;
     else if(!s->len)
         goto out;
     DPRINTF("CURL: Size = %zd\n", s->len);
 
-    curl_clean_state(state);
     curl_easy_cleanup(state->curl);
     state->curl = NULL;
 
+    if (cache_file) {
+        ret = curl_open_cache_file(s, cache_file);
+        if (ret < 0) {
+            fprintf(stderr, "CURL: Could not create cache file %s: %s\n",
+                    cache_file, strerror(-ret));
+            goto out_noclean;
+        }
+    }
+
     // Now we know the file exists and its size, so let's
     // initialize the multi interface!
 
     s->multi = curl_multi_init();
-    curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s); 
-    curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb ); 
+    curl_multi_setopt( s->multi, CURLMOPT_SOCKETDATA, s);
+    curl_multi_setopt( s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb );
     curl_multi_do(s);
 
     return 0;
@@ -391,12 +724,23 @@ out:
     state->curl = NULL;
 out_noclean:
     qemu_free(file);
+    s->url = NULL;
     return -EINVAL;
 }
 
 static void curl_aio_cancel(BlockDriverAIOCB *blockacb)
 {
-    // Do we have to implement canceling? Seems to work without...
+    CURLAIOCB *acb = container_of(blockacb, CURLAIOCB, common);
+
+    /* Downloads continue, the blocks just stay in the cache */
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+        acb->bh = NULL;
+    } else {
+        QLIST_REMOVE(acb, next);
+        curl_aio_release_blocks(acb);
+    }
+    qemu_aio_release(acb);
 }
 
 static AIOPool curl_aio_pool = {
@@ -404,59 +748,71 @@ static AIOPool curl_aio_pool = {
     .cancel             = curl_aio_cancel,
 };
 
+/*
+ * Queues read-ahead for clients that read the image sequentially, e.g. when
+ * booting from an ISO.  The blocks are downloaded in parallel on the idle
+ * connections.
+ */
+static void curl_readahead(BDRVCURLState *s, size_t start, size_t end)
+{
+    int64_t index, last;
+
+    if (start == s->seq_next) {
+        s->seq_count++;
+    } else {
+        s->seq_count = 0;
+    }
+    s->seq_next = end;
+
+    if (s->seq_count < CURL_SEQ_THRESHOLD || !s->readahead_size ||
+        end >= s->len) {
+        return;
+    }
+
+    last = (MIN(end + s->readahead_size, s->len) - 1) / CURL_BLOCK_SIZE;
+    for (index = (end - 1) / CURL_BLOCK_SIZE + 1; index <= last; index++) {
+        curl_block_get(s, index, 1);
+    }
+}
+
 static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVCURLState *s = bs->opaque;
     CURLAIOCB *acb;
-    size_t start = sector_num * SECTOR_SIZE;
-    size_t end;
-    CURLState *state;
+    CURLBlock *block;
+    int64_t index, first, last;
 
     acb = qemu_aio_get(&curl_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
 
+    acb->bh = NULL;
     acb->qiov = qiov;
-
-    // In case we have the requested data already (e.g. read-ahead),
-    // we can just call the callback and be done.
-
-    switch (curl_find_buf(s, start, nb_sectors * SECTOR_SIZE, acb)) {
-        case FIND_RET_OK:
-            qemu_aio_release(acb);
-            // fall through
-        case FIND_RET_WAIT:
-            return &acb->common;
-        default:
-            break;
+    acb->start = sector_num * SECTOR_SIZE;
+    acb->end = acb->start + nb_sectors * SECTOR_SIZE;
+    acb->blocks = NULL;
+    acb->nb_blocks = 0;
+    qemu_iovec_init(&acb->cur_qiov, qiov->niov);
+    QLIST_INSERT_HEAD(&s->acbs, acb, next);
+
+    // Take a reference to all blocks the request needs, so that they can't
+    // be evicted before the last one has arrived.
+
+    if (acb->start < s->len) {
+        first = acb->start / CURL_BLOCK_SIZE;
+        last = (MIN(acb->end, s->len) - 1) / CURL_BLOCK_SIZE;
+        acb->blocks = qemu_malloc((last - first + 1) * sizeof(CURLBlock *));
+        for (index = first; index <= last; index++) {
+            block = curl_block_get(s, index, 0);
+            acb->blocks[acb->nb_blocks++] = block;
+        }
     }
 
-    // No cache found, so let's start a new request
-
-    state = curl_init_state(s);
-    if (!state)
-        return NULL;
-
-    acb->start = 0;
-    acb->end = (nb_sectors * SECTOR_SIZE);
-
-    state->buf_off = 0;
-    if (state->orig_buf)
-        qemu_free(state->orig_buf);
-    state->buf_start = start;
-    state->buf_len = acb->end + s->readahead_size;
-    end = MIN(start + state->buf_len, s->len) - 1;
-    state->orig_buf = qemu_malloc(state->buf_len);
-    state->acb[0] = acb;
-
-    snprintf(state->range, 127, "%zd-%zd", start, end);
-    DPRINTF("CURL (AIO): Reading %d at %zd (%s)\n",
-            (nb_sectors * SECTOR_SIZE), start, state->range);
-    curl_easy_setopt(state->curl, CURLOPT_RANGE, state->range);
+    curl_readahead(s, acb->start, acb->end);
 
-    curl_multi_add_handle(s->multi, state->curl);
+    curl_aio_check(acb);
     curl_multi_do(s);
 
     return &acb->common;
@@ -465,6 +821,7 @@ static BlockDriverAIOCB *curl_aio_readv(BlockDriverState *bs,
 static void curl_close(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
+    CURLBlock *block, *next;
     int i;
 
     DPRINTF("CURL: Close\n");
@@ -475,15 +832,22 @@ static void curl_close(BlockDriverState *bs)
             curl_easy_cleanup(s->states[i].curl);
             s->states[i].curl = NULL;
         }
-        if (s->states[i].orig_buf) {
-            qemu_free(s->states[i].orig_buf);
-            s->states[i].orig_buf = NULL;
-        }
     }
     if (s->multi)
         curl_multi_cleanup(s->multi);
-    if (s->url)
-        free(s->url);
+
+    QTAILQ_FOREACH_SAFE(block, &s->lru, lru_next, next) {
+        if (block->state != CURL_BLOCK_ERROR) {
+            QLIST_REMOVE(block, hash_next);
+        }
+        qemu_free(block->data);
+        qemu_free(block);
+    }
+    if (s->cache_fd >= 0) {
+        close(s->cache_fd);
+        qemu_free(s->cache_file_bitmap);
+    }
+    qemu_free(s->url);
 }
 
 static int64_t curl_getlength(BlockDriverState *bs)
@@ -0,0 +1,259 @@
+/*
+ * Image mirroring
+ *
+ * Copies a running image to a target image while tracking guest writes,
+ * and switches the device over to the target once both are in sync.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu-error.h"
+#include "block_int.h"
+#include "ratelimit.h"
+
+/* Data is copied in units of dirty bitmap chunks */
+#define MIRROR_CHUNK_SECTORS BDRV_SECTORS_PER_DIRTY_CHUNK
+#define MIRROR_CHUNK_SIZE (MIRROR_CHUNK_SECTORS * BDRV_SECTOR_SIZE)
+
+/* Number of clean chunks skipped in one go before yielding to the main loop */
+#define MIRROR_MAX_LOOKUPS 4096
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct MirrorBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    QEMUTimer *timer;
+    BlockDriverState *target;
+    int64_t sector_num;         /* position of the dirty bitmap scan */
+    int64_t end;
+    int nb_sectors;             /* size of the request in flight */
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} MirrorBlockJob;
+
+static void mirror_complete(MirrorBlockJob *s, int ret)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    trace_mirror_complete(s, bs, ret);
+
+    if (s->target) {
+        bdrv_delete(s->target);
+        s->target = NULL;
+    }
+    bdrv_set_dirty_tracking(bs, 0);
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    qemu_vfree(s->buf);
+    block_job_complete(&s->common, ret);
+}
+
+static void mirror_update_progress(MirrorBlockJob *s)
+{
+    int64_t dirty = bdrv_get_dirty_count(s->common.bs) * MIRROR_CHUNK_SIZE;
+
+    s->common.offset = MAX(s->common.len - dirty, 0);
+}
+
+/*
+ * Switches the device over to the target.  All requests are drained first; if
+ * no guest write has dirtied the image meanwhile, the target is identical to
+ * the source and the device can be reopened on it before the guest gets a
+ * chance to submit anything else.
+ */
+static int mirror_pivot(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+    BlockDriver *drv, *old_drv;
+    char filename[1024];
+    char old_filename[1024];
+    int flags;
+    int ret;
+
+    qemu_aio_flush();
+    if (bdrv_get_dirty_count(bs)) {
+        return -EAGAIN;
+    }
+
+    ret = bdrv_flush(s->target);
+    if (ret < 0) {
+        return ret;
+    }
+
+    pstrcpy(filename, sizeof(filename), s->target->filename);
+    drv = s->target->drv;
+    bdrv_delete(s->target);
+    s->target = NULL;
+
+    pstrcpy(old_filename, sizeof(old_filename), bs->filename);
+    old_drv = bs->drv;
+    flags = bs->open_flags;
+
+    trace_mirror_pivot(s, bs, filename);
+
+    bdrv_flush(bs);
+    bdrv_close(bs);
+    ret = bdrv_open(bs, filename, flags, drv);
+    if (ret < 0) {
+        /* Fall back to the source, which is still up to date */
+        if (bdrv_open(bs, old_filename, flags, old_drv) < 0) {
+            error_report("could not reopen %s after failing to switch to %s",
+                         old_filename, filename);
+        }
+    }
+    return ret;
+}
+
+static void mirror_write_cb(void *opaque, int ret)
+{
+    MirrorBlockJob *s = opaque;
+
+    if (ret < 0) {
+        mirror_complete(s, ret);
+        return;
+    }
+
+    s->sector_num += s->nb_sectors;
+    mirror_update_progress(s);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+}
+
+static void mirror_read_cb(void *opaque, int ret)
+{
+    MirrorBlockJob *s = opaque;
+
+    if (ret < 0) {
+        mirror_complete(s, ret);
+        return;
+    }
+
+    if (!bdrv_aio_writev(s->target, s->sector_num, &s->qiov, s->nb_sectors,
+                         mirror_write_cb, s)) {
+        mirror_complete(s, -EIO);
+    }
+}
+
+static void mirror_run(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t delay;
+    int lookups = 0;
+    int ret;
+
+    if (block_job_is_cancelled(&s->common)) {
+        mirror_complete(s, 0);
+        return;
+    }
+
+    if (bdrv_get_dirty_count(bs) == 0) {
+        ret = mirror_pivot(s);
+        if (ret != -EAGAIN) {
+            mirror_complete(s, ret);
+            return;
+        }
+    }
+
+    /* Look for the next dirty chunk, wrapping around at the end */
+    for (;;) {
+        if (s->sector_num >= s->end) {
+            s->sector_num = 0;
+        }
+        if (bdrv_get_dirty(bs, s->sector_num)) {
+            break;
+        }
+        s->sector_num += MIRROR_CHUNK_SECTORS;
+        if (++lookups == MIRROR_MAX_LOOKUPS) {
+            qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+            return;
+        }
+    }
+
+    s->nb_sectors = MIN(MIRROR_CHUNK_SECTORS, s->end - s->sector_num);
+
+    if (s->common.speed) {
+        delay = ratelimit_calculate_delay(&s->limit,
+                                          s->nb_sectors * BDRV_SECTOR_SIZE);
+        if (delay > 0) {
+            qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock) + delay);
+            return;
+        }
+    }
+
+    trace_mirror_one_iteration(s, s->sector_num, s->nb_sectors);
+
+    /*
+     * Clear the chunk before reading it: a guest write that completes after
+     * this point marks it dirty again and it is copied once more.
+     */
+    bdrv_reset_dirty(bs, s->sector_num, s->nb_sectors);
+
+    s->iov.iov_base = s->buf;
+    s->iov.iov_len = s->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&s->qiov, &s->iov, 1);
+    if (!bdrv_aio_readv(bs, s->sector_num, &s->qiov, s->nb_sectors,
+                        mirror_read_cb, s)) {
+        mirror_complete(s, -EIO);
+    }
+}
+
+static int mirror_set_speed(BlockJob *job, int64_t value)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    ratelimit_set_speed(&s->limit, value, SLICE_TIME);
+    return 0;
+}
+
+static BlockJobType mirror_job_type = {
+    .instance_size = sizeof(MirrorBlockJob),
+    .job_type      = "mirror",
+    .set_speed     = mirror_set_speed,
+};
+
+/*
+ * Starts mirroring bs to target, which must be at least as large as bs.  The
+ * job takes ownership of target.
+ */
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 int64_t speed, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    MirrorBlockJob *s;
+
+    if (speed < 0) {
+        return -EINVAL;
+    }
+
+    s = block_job_create(&mirror_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY;
+    }
+
+    s->target = target;
+    s->end = bs->total_sectors;
+    s->common.len = s->end * BDRV_SECTOR_SIZE;
+    s->buf = qemu_blockalign(bs, MIRROR_CHUNK_SIZE);
+    s->timer = qemu_new_timer_ns(rt_clock, mirror_run, s);
+    block_job_set_speed(&s->common, speed);
+
+    /*
+     * Writes that are in flight must complete before everything is marked
+     * dirty, or their completion could be missed.
+     */
+    qemu_aio_flush();
+    bdrv_set_dirty_tracking(bs, 1);
+    bdrv_set_dirty(bs, 0, s->end);
+    mirror_update_progress(s);
+
+    trace_mirror_start(bs, target, s, speed);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+    return 0;
+}
@@ -45,6 +45,41 @@
 #define logout(fmt, ...) ((void)0)
 #endif
 
+/*
+ * Requests are sent to the server without waiting for the replies of earlier
+ * ones; the handle of a request is the index of its slot in the state, so
+ * replies can come back in any order.
+ */
+#define MAX_NBD_REQUESTS 16
+
+/* qemu-nbd refuses requests that don't fit in its 1 MB buffer */
+#define NBD_MAX_SECTORS 2040
+
+#define NBD_REQUEST_SIZE (4 + 4 + 8 + 8 + 4)
+#define NBD_REPLY_SIZE   (4 + 4 + 8)
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC   0x67446698
+
+typedef struct NBDAIOCB {
+    BlockDriverAIOCB common;
+    QEMUIOVector *qiov;
+    int is_write;
+    int64_t sector_num;
+    int nb_sectors;
+    int issued_sectors;         /* sectors already handed to requests */
+    int pending;                /* requests in flight */
+    int ret;
+    bool *finished;             /* set on completion if cancelled */
+    QTAILQ_ENTRY(NBDAIOCB) next;
+} NBDAIOCB;
+
+typedef struct NBDRequest {
+    NBDAIOCB *acb;              /* NULL if the slot is free */
+    struct nbd_request header;
+    size_t qiov_offset;
+    QTAILQ_ENTRY(NBDRequest) next;
+} NBDRequest;
+
 typedef struct BDRVNBDState {
     int sock;
     off_t size;
@@ -55,8 +90,29 @@ typedef struct BDRVNBDState {
      * it's a string of the form <hostname|ip4|\[ip6\]>:port
      */
     char *host_spec;
+
+    NBDRequest reqs[MAX_NBD_REQUESTS];
+    int in_flight;
+    int broken;                 /* connection lost, fail all requests */
+    QEMUBH *fail_bh;
+
+    /* AIOCBs that still have sectors without a request */
+    QTAILQ_HEAD(, NBDAIOCB) acb_queue;
+
+    /* requests that have not been sent completely */
+    QTAILQ_HEAD(, NBDRequest) send_queue;
+    uint8_t send_buf[NBD_REQUEST_SIZE];
+    size_t send_offset;
+
+    /* reply that is being received */
+    uint8_t reply_buf[NBD_REPLY_SIZE];
+    size_t reply_offset;
+    NBDRequest *recv_req;
+    size_t recv_offset;
 } BDRVNBDState;
 
+static void nbd_update_handlers(BDRVNBDState *s);
+
 static int nbd_config(BDRVNBDState *s, const char *filename, int flags)
 {
     char *file;
@@ -139,6 +195,7 @@ static int nbd_establish_connection(BlockDriverState *bs)
     s->sock = sock;
     s->size = size;
     s->blocksize = blocksize;
+    nbd_update_handlers(s);
 
     logout("Established connection with NBD server\n");
     return 0;
@@ -149,11 +206,15 @@ static void nbd_teardown_connection(BlockDriverState *bs)
     BDRVNBDState *s = bs->opaque;
     struct nbd_request request;
 
+    qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
+
     request.type = NBD_CMD_DISC;
     request.handle = (uint64_t)(intptr_t)bs;
     request.from = 0;
     request.len = 0;
-    nbd_send_request(s->sock, &request);
+    if (!s->broken) {
+        nbd_send_request(s->sock, &request);
+    }
 
     closesocket(s->sock);
 }
@@ -169,6 +230,9 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
         return result;
     }
 
+    QTAILQ_INIT(&s->acb_queue);
+    QTAILQ_INIT(&s->send_queue);
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
@@ -177,69 +241,363 @@ static int nbd_open(BlockDriverState *bs, const char* filename, int flags)
     return result;
 }
 
-static int nbd_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+/*
+ * Transfers up to len bytes between the socket and qiov, starting at offset
+ * in qiov.  Returns the number of bytes transferred, -EAGAIN if the socket
+ * isn't ready or -EIO if the connection is broken.
+ */
+static ssize_t nbd_qiov_io(int sock, QEMUIOVector *qiov, size_t offset,
+                           size_t len, int do_read)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
+    struct iovec *iov = qiov->iov;
+    ssize_t ret;
 
-    request.type = NBD_CMD_READ;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+    while (offset >= iov->iov_len) {
+        offset -= iov->iov_len;
+        iov++;
+    }
+    len = MIN(len, iov->iov_len - offset);
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+    if (do_read) {
+        ret = recv(sock, iov->iov_base + offset, len, 0);
+    } else {
+        ret = send(sock, iov->iov_base + offset, len, 0);
+    }
+    if (ret < 0) {
+        ret = -socket_error();
+        if (ret == -EINTR || ret == -EAGAIN || ret == -EWOULDBLOCK) {
+            return -EAGAIN;
+        }
+        return -EIO;
+    }
+    return ret ? ret : -EIO;
+}
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+static ssize_t nbd_buf_io(int sock, uint8_t *buf, size_t len, int do_read)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return nbd_qiov_io(sock, &qiov, 0, len, do_read);
+}
 
-    if (reply.error !=0)
-        return -reply.error;
+static void nbd_aio_finish(NBDAIOCB *acb)
+{
+    if (acb->finished) {
+        *acb->finished = true;
+    } else {
+        acb->common.cb(acb->common.opaque, acb->ret);
+    }
+    qemu_aio_release(acb);
+}
 
-    if (reply.handle != request.handle)
-        return -EIO;
+static void nbd_complete_request(BDRVNBDState *s, NBDRequest *req, int ret)
+{
+    NBDAIOCB *acb = req->acb;
 
-    if (nbd_wr_sync(s->sock, buf, request.len, 1) != request.len)
-        return -EIO;
+    req->acb = NULL;
+    s->in_flight--;
 
-    return 0;
+    if (ret < 0) {
+        acb->ret = ret;
+    }
+    if (--acb->pending == 0 && acb->issued_sectors == acb->nb_sectors) {
+        nbd_aio_finish(acb);
+    }
 }
 
-static int nbd_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+/* Fails everything in flight after the connection to the server broke */
+static void nbd_fail_all(void *opaque)
 {
-    BDRVNBDState *s = bs->opaque;
-    struct nbd_request request;
-    struct nbd_reply reply;
+    BDRVNBDState *s = opaque;
+    NBDAIOCB *acb;
+    int i;
+
+    qemu_bh_delete(s->fail_bh);
+    s->fail_bh = NULL;
+
+    while ((acb = QTAILQ_FIRST(&s->acb_queue))) {
+        QTAILQ_REMOVE(&s->acb_queue, acb, next);
+        acb->issued_sectors = acb->nb_sectors;
+        acb->ret = -EIO;
+        if (acb->pending == 0) {
+            nbd_aio_finish(acb);
+        }
+    }
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        if (s->reqs[i].acb) {
+            nbd_complete_request(s, &s->reqs[i], -EIO);
+        }
+    }
+}
 
-    request.type = NBD_CMD_WRITE;
-    request.handle = (uint64_t)(intptr_t)bs;
-    request.from = sector_num * 512;;
-    request.len = nb_sectors * 512;
+/*
+ * Requests are failed from a bottom half because the connection may break
+ * while a new request is submitted, and its callback must not run before
+ * bdrv_aio_readv/writev() has returned.
+ */
+static void nbd_connection_lost(BDRVNBDState *s)
+{
+    logout("Connection to NBD server lost\n");
+    s->broken = 1;
+    s->recv_req = NULL;
+    QTAILQ_INIT(&s->send_queue);
+    nbd_update_handlers(s);
+
+    s->fail_bh = qemu_bh_new(nbd_fail_all, s);
+    qemu_bh_schedule(s->fail_bh);
+}
 
-    if (nbd_send_request(s->sock, &request) == -1)
-        return -errno;
+/* Sends queued requests until the socket is full */
+static void nbd_send_pending(BDRVNBDState *s)
+{
+    NBDRequest *req;
+    size_t len;
+    ssize_t ret;
+
+    while (!s->broken && (req = QTAILQ_FIRST(&s->send_queue))) {
+        if (s->send_offset == 0) {
+            cpu_to_be32w((uint32_t*)s->send_buf, NBD_REQUEST_MAGIC);
+            cpu_to_be32w((uint32_t*)(s->send_buf + 4), req->header.type);
+            cpu_to_be64w((uint64_t*)(s->send_buf + 8), req->header.handle);
+            cpu_to_be64w((uint64_t*)(s->send_buf + 16), req->header.from);
+            cpu_to_be32w((uint32_t*)(s->send_buf + 24), req->header.len);
+        }
 
-    if (nbd_wr_sync(s->sock, (uint8_t*)buf, request.len, 0) != request.len)
-        return -EIO;
+        len = NBD_REQUEST_SIZE;
+        if (req->header.type == NBD_CMD_WRITE) {
+            len += req->header.len;
+        }
 
-    if (nbd_receive_reply(s->sock, &reply) == -1)
-        return -errno;
+        if (s->send_offset < NBD_REQUEST_SIZE) {
+            ret = nbd_buf_io(s->sock, s->send_buf + s->send_offset,
+                             NBD_REQUEST_SIZE - s->send_offset, 0);
+        } else {
+            ret = nbd_qiov_io(s->sock, req->acb->qiov,
+                              req->qiov_offset + s->send_offset -
+                              NBD_REQUEST_SIZE,
+                              len - s->send_offset, 0);
+        }
+        if (ret == -EAGAIN) {
+            break;
+        } else if (ret < 0) {
+            nbd_connection_lost(s);
+            return;
+        }
 
-    if (reply.error !=0)
-        return -reply.error;
+        s->send_offset += ret;
+        if (s->send_offset == len) {
+            QTAILQ_REMOVE(&s->send_queue, req, next);
+            s->send_offset = 0;
+        }
+    }
+    nbd_update_handlers(s);
+}
 
-    if (reply.handle != request.handle)
-        return -EIO;
+static void nbd_send_ready(void *opaque)
+{
+    nbd_send_pending(opaque);
+}
 
-    return 0;
+/* Turns the queued AIOCBs into requests as long as there are free slots */
+static void nbd_submit(BDRVNBDState *s)
+{
+    NBDAIOCB *acb;
+    NBDRequest *req;
+    int i, nb_sectors;
+
+    for (i = 0; i < MAX_NBD_REQUESTS; i++) {
+        acb = QTAILQ_FIRST(&s->acb_queue);
+        if (!acb) {
+            break;
+        }
+
+        req = &s->reqs[i];
+        if (req->acb) {
+            continue;
+        }
+
+        nb_sectors = MIN(acb->nb_sectors - acb->issued_sectors,
+                         NBD_MAX_SECTORS);
+        req->acb = acb;
+        req->header.type = acb->is_write ? NBD_CMD_WRITE : NBD_CMD_READ;
+        req->header.handle = i;
+        req->header.from = (acb->sector_num + acb->issued_sectors) * 512;
+        req->header.len = nb_sectors * 512;
+        req->qiov_offset = acb->issued_sectors * 512;
+
+        acb->issued_sectors += nb_sectors;
+        acb->pending++;
+        if (acb->issued_sectors == acb->nb_sectors) {
+            QTAILQ_REMOVE(&s->acb_queue, acb, next);
+        }
+
+        s->in_flight++;
+        QTAILQ_INSERT_TAIL(&s->send_queue, req, next);
+    }
+
+    nbd_send_pending(s);
+}
+
+/* Reads replies until the socket is empty */
+static void nbd_reply_ready(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+    NBDRequest *req;
+    uint32_t magic, error;
+    uint64_t handle;
+    ssize_t ret;
+
+    while (!s->broken) {
+        req = s->recv_req;
+        if (!req) {
+            ret = nbd_buf_io(s->sock, s->reply_buf + s->reply_offset,
+                             NBD_REPLY_SIZE - s->reply_offset, 1);
+            if (ret == -EAGAIN) {
+                break;
+            } else if (ret < 0) {
+                nbd_connection_lost(s);
+                return;
+            }
+            s->reply_offset += ret;
+            if (s->reply_offset < NBD_REPLY_SIZE) {
+                continue;
+            }
+            s->reply_offset = 0;
+
+            magic = be32_to_cpup((uint32_t*)s->reply_buf);
+            error = be32_to_cpup((uint32_t*)(s->reply_buf + 4));
+            handle = be64_to_cpup((uint64_t*)(s->reply_buf + 8));
+            if (magic != NBD_REPLY_MAGIC || handle >= MAX_NBD_REQUESTS ||
+                !s->reqs[handle].acb) {
+                logout("Invalid reply from NBD server\n");
+                nbd_connection_lost(s);
+                return;
+            }
+
+            req = &s->reqs[handle];
+            if (error || req->header.type != NBD_CMD_READ) {
+                /* No data follows */
+                nbd_complete_request(s, req, error ? -error : 0);
+                nbd_submit(s);
+                continue;
+            }
+            s->recv_req = req;
+            s->recv_offset = 0;
+        }
+
+        ret = nbd_qiov_io(s->sock, req->acb->qiov,
+                          req->qiov_offset + s->recv_offset,
+                          req->header.len - s->recv_offset, 1);
+        if (ret == -EAGAIN) {
+            break;
+        } else if (ret < 0) {
+            nbd_connection_lost(s);
+            return;
+        }
+        s->recv_offset += ret;
+        if (s->recv_offset == req->header.len) {
+            s->recv_req = NULL;
+            nbd_complete_request(s, req, 0);
+            nbd_submit(s);
+        }
+    }
+}
+
+static int nbd_have_requests(void *opaque)
+{
+    BDRVNBDState *s = opaque;
+
+    return s->in_flight > 0 || !QTAILQ_EMPTY(&s->acb_queue);
+}
+
+static void nbd_update_handlers(BDRVNBDState *s)
+{
+    if (s->broken) {
+        qemu_aio_set_fd_handler(s->sock, NULL, NULL, NULL, NULL, NULL);
+        return;
+    }
+    qemu_aio_set_fd_handler(s->sock, nbd_reply_ready,
+                            QTAILQ_EMPTY(&s->send_queue) ? NULL :
+                            nbd_send_ready,
+                            nbd_have_requests, NULL, s);
+}
+
+static void nbd_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    NBDAIOCB *acb = container_of(blockacb, NBDAIOCB, common);
+    BDRVNBDState *s = acb->common.bs->opaque;
+    bool finished = false;
+
+    /* Don't issue what is left; requests already sent can't be cancelled */
+    if (acb->issued_sectors < acb->nb_sectors) {
+        QTAILQ_REMOVE(&s->acb_queue, acb, next);
+        acb->issued_sectors = acb->nb_sectors;
+    }
+    if (acb->pending == 0) {
+        qemu_aio_release(acb);
+        return;
+    }
+
+    acb->finished = &finished;
+    while (!finished) {
+        qemu_aio_wait();
+    }
+}
+
+static AIOPool nbd_aio_pool = {
+    .aiocb_size         = sizeof(NBDAIOCB),
+    .cancel             = nbd_aio_cancel,
+};
+
+static BlockDriverAIOCB *nbd_aio_rw(BlockDriverState *bs, int64_t sector_num,
+        QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    BDRVNBDState *s = bs->opaque;
+    NBDAIOCB *acb;
+
+    if (s->broken) {
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&nbd_aio_pool, bs, cb, opaque);
+    acb->qiov = qiov;
+    acb->is_write = is_write;
+    acb->sector_num = sector_num;
+    acb->nb_sectors = nb_sectors;
+    acb->issued_sectors = 0;
+    acb->pending = 0;
+    acb->ret = 0;
+    acb->finished = NULL;
+
+    QTAILQ_INSERT_TAIL(&s->acb_queue, acb, next);
+    nbd_submit(s);
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *nbd_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
+
+static BlockDriverAIOCB *nbd_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return nbd_aio_rw(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
 }
 
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+
+    if (s->fail_bh) {
+        qemu_bh_delete(s->fail_bh);
+    }
     qemu_free(s->export_name);
     qemu_free(s->host_spec);
 
@@ -257,8 +615,8 @@ static BlockDriver bdrv_nbd = {
     .format_name	= "nbd",
     .instance_size	= sizeof(BDRVNBDState),
     .bdrv_file_open	= nbd_open,
-    .bdrv_read		= nbd_read,
-    .bdrv_write		= nbd_write,
+    .bdrv_aio_readv	= nbd_aio_readv,
+    .bdrv_aio_writev	= nbd_aio_writev,
     .bdrv_close		= nbd_close,
     .bdrv_getlength	= nbd_getlength,
     .protocol_name	= "nbd",
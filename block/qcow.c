@@ -857,23 +857,12 @@ static int qcow_make_empty(BlockDriverState *bs)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+static int qcow_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                                 const uint8_t *buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-    if (!out_buf)
-        return -1;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
@@ -881,8 +870,7 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
+        return -EIO;
     }
 
     strm.avail_in = s->cluster_size;
@@ -892,31 +880,67 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
-        return -1;
+        return -EIO;
     }
     out_len = strm.next_out - out_buf;
 
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        /* could not compress */
+        return 0;
+    }
+    return out_len;
+}
+
+static int qcow_write_compressed_cluster(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *buf, int nb_sectors,
+                                         const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    if (out_len == 0) {
         /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
-                                            out_len, 0, 0);
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        return bdrv_write(bs, sector_num, buf, s->cluster_sectors);
     }
 
-    qemu_free(out_buf);
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
+                                        out_len, 0, 0);
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
+        return -EIO;
+    }
     return 0;
 }
 
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+    ret = qcow_compress_cluster(bs, out_buf, buf);
+    if (ret >= 0) {
+        ret = qcow_write_compressed_cluster(bs, sector_num, buf, nb_sectors,
+                                            out_buf, ret);
+    }
+    qemu_free(out_buf);
+    return ret;
+}
+
 static int qcow_flush(BlockDriverState *bs)
 {
     return bdrv_flush(bs->file);
@@ -970,6 +994,8 @@ static BlockDriver bdrv_qcow = {
     .bdrv_aio_writev	= qcow_aio_writev,
     .bdrv_aio_flush	= qcow_aio_flush,
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_compress_cluster = qcow_compress_cluster,
+    .bdrv_write_compressed_cluster = qcow_write_compressed_cluster,
     .bdrv_get_info	= qcow_get_info,
 
     .create_options = qcow_create_options,
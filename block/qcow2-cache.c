@@ -273,6 +273,23 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/* Like qcow2_cache_get(), but returns -ENOENT instead of doing any I/O */
+int qcow2_cache_get_cached(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset, void **table)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset == offset) {
+            c->entries[i].cache_hits++;
+            c->entries[i].ref++;
+            *table = c->entries[i].table;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i;
@@ -389,10 +389,12 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
  * Return 0, if the offset is found
  * Return -errno, otherwise.
  *
+ * With cached_only, an L2 table that is not in the cache is not read and
+ * -ENOENT is returned instead.
  */
 
-int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
-    int *num, uint64_t *cluster_offset)
+static int get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset, bool cached_only)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int l1_index, l2_index;
@@ -439,7 +441,12 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* load the l2 table in memory */
 
     l2_offset &= ~QCOW_OFLAG_COPIED;
-    ret = l2_load(bs, l2_offset, &l2_table);
+    if (cached_only) {
+        ret = qcow2_cache_get_cached(bs, s->l2_table_cache, l2_offset,
+                                     (void**) &l2_table);
+    } else {
+        ret = l2_load(bs, l2_offset, &l2_table);
+    }
     if (ret < 0) {
         return ret;
     }
@@ -472,6 +479,19 @@ out:
     return 0;
 }
 
+int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, false);
+}
+
+/* For callers that must not block on metadata I/O */
+int qcow2_get_cluster_offset_cached(BlockDriverState *bs, uint64_t offset,
+    int *num, uint64_t *cluster_offset)
+{
+    return get_cluster_offset(bs, offset, num, cluster_offset, true);
+}
+
 /*
  * get_cluster_table
  *
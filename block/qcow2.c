@@ -390,6 +390,10 @@ static void qcow2_aio_cancel(BlockDriverAIOCB *blockacb)
     QCowAIOCB *acb = container_of(blockacb, QCowAIOCB, common);
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
+    if (acb->bh) {
+        qemu_bh_delete(acb->bh);
+        acb->bh = NULL;
+    }
     qemu_aio_release(acb);
 }
 
@@ -735,6 +739,68 @@ static BlockDriverAIOCB *qcow2_aio_writev(BlockDriverState *bs,
     return &acb->common;
 }
 
+static void qcow2_aio_write_zeroes_bh(void *opaque)
+{
+    QCowAIOCB *acb = opaque;
+
+    qemu_bh_delete(acb->bh);
+    acb->bh = NULL;
+    acb->common.cb(acb->common.opaque, 0);
+    qemu_iovec_destroy(&acb->hd_qiov);
+    qemu_aio_release(acb);
+}
+
+/*
+ * qcow2 has no zero clusters, but unallocated clusters read as zeroes if
+ * there is no backing file.  Writing zeroes to them is a no-op, so only
+ * requests that touch allocated clusters need to be written.
+ */
+static BlockDriverAIOCB *qcow2_aio_write_zeroes(BlockDriverState *bs,
+                                                int64_t sector_num,
+                                                QEMUIOVector *qiov,
+                                                int nb_sectors,
+                                                BlockDriverCompletionFunc *cb,
+                                                void *opaque)
+{
+    QCowAIOCB *acb;
+    uint64_t cluster_offset;
+    int64_t sector = sector_num;
+    int remaining = nb_sectors;
+    int n, ret;
+
+    if (bs->backing_hd) {
+        return qcow2_aio_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+    }
+
+    /*
+     * This runs in AIO submission, so only look at L2 tables in the cache.
+     * If one isn't there, the zeroes are written like any other data.
+     */
+    while (remaining > 0) {
+        n = remaining;
+        ret = qcow2_get_cluster_offset_cached(bs, sector << 9, &n,
+                                              &cluster_offset);
+        if (ret < 0 || cluster_offset != 0) {
+            return qcow2_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque);
+        }
+        sector += n;
+        remaining -= n;
+    }
+
+    acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
+    if (!acb) {
+        return NULL;
+    }
+
+    if (qcow2_schedule_bh(qcow2_aio_write_zeroes_bh, acb) < 0) {
+        qemu_iovec_destroy(&acb->hd_qiov);
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    return &acb->common;
+}
+
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1143,28 +1209,12 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static int qcow2_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                                  const uint8_t *buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(bs->file);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(bs->file, cluster_offset);
-        return 0;
-    }
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
@@ -1172,8 +1222,7 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                        Z_DEFLATED, -12,
                        9, Z_DEFAULT_STRATEGY);
     if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
+        return -EIO;
     }
 
     strm.avail_in = s->cluster_size;
@@ -1183,34 +1232,78 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
-        return -1;
+        return -EIO;
     }
     out_len = strm.next_out - out_buf;
 
     deflateEnd(&strm);
 
     if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+        /* could not compress */
+        return 0;
+    }
+    return out_len;
+}
+
+static int qcow2_write_compressed_cluster(BlockDriverState *bs,
+                                          int64_t sector_num,
+                                          const uint8_t *buf, int nb_sectors,
+                                          const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    if (out_len == 0) {
         /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        return bdrv_write(bs, sector_num, buf, s->cluster_sectors);
     }
 
-    qemu_free(out_buf);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset)
+        return -EIO;
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
+        return -EIO;
+    }
     return 0;
 }
 
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+    uint64_t cluster_offset;
+
+    if (nb_sectors == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(bs->file);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(bs->file, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+    ret = qcow2_compress_cluster(bs, out_buf, buf);
+    if (ret >= 0) {
+        ret = qcow2_write_compressed_cluster(bs, sector_num, buf, nb_sectors,
+                                             out_buf, ret);
+    }
+    qemu_free(out_buf);
+    return ret;
+}
+
 static int qcow2_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -1367,11 +1460,14 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_aio_readv     = qcow2_aio_readv,
     .bdrv_aio_writev    = qcow2_aio_writev,
+    .bdrv_aio_write_zeroes = qcow2_aio_write_zeroes,
     .bdrv_aio_flush     = qcow2_aio_flush,
 
     .bdrv_discard           = qcow2_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_compress_cluster  = qcow2_compress_cluster,
+    .bdrv_write_compressed_cluster = qcow2_write_compressed_cluster,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
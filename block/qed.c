@@ -299,18 +299,30 @@ static void qed_plug_allocating_write_reqs(BDRVQEDState *s)
     s->allocating_write_reqs_plugged = true;
 }
 
-static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
+/**
+ * Restart allocating write requests that are waiting for their turn
+ *
+ * Each request looks up its clusters again, so requests that still conflict
+ * with an allocation in progress queue themselves up again.
+ */
+static void qed_wake_allocating_write_reqs(BDRVQEDState *s)
 {
+    QSIMPLEQ_HEAD(, QEDAIOCB) reqs = QSIMPLEQ_HEAD_INITIALIZER(reqs);
     QEDAIOCB *acb;
 
+    QSIMPLEQ_CONCAT(&reqs, &s->waiting_write_reqs);
+    while ((acb = QSIMPLEQ_FIRST(&reqs))) {
+        QSIMPLEQ_REMOVE_HEAD(&reqs, next);
+        qed_aio_next_io(acb, 0);
+    }
+}
+
+static void qed_unplug_allocating_write_reqs(BDRVQEDState *s)
+{
     assert(s->allocating_write_reqs_plugged);
 
     s->allocating_write_reqs_plugged = false;
-
-    acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-    if (acb) {
-        qed_aio_next_io(acb, 0);
-    }
+    qed_wake_allocating_write_reqs(s);
 }
 
 static void qed_finish_clear_need_check(void *opaque, int ret)
@@ -346,7 +358,7 @@ static void qed_need_check_timer_cb(void *opaque)
     BDRVQEDState *s = opaque;
 
     /* The timer should only fire when allocating writes have drained */
-    assert(!QSIMPLEQ_FIRST(&s->allocating_write_reqs));
+    assert(QTAILQ_EMPTY(&s->allocating_write_reqs));
 
     trace_qed_need_check_timer_cb(s);
 
@@ -382,7 +394,9 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     int ret;
 
     s->bs = bs;
-    QSIMPLEQ_INIT(&s->allocating_write_reqs);
+    QTAILQ_INIT(&s->allocating_write_reqs);
+    QSIMPLEQ_INIT(&s->waiting_write_reqs);
+    QSIMPLEQ_INIT(&s->table_update_reqs);
 
     ret = bdrv_pread(bs->file, 0, &le_header, sizeof(le_header));
     if (ret < 0) {
@@ -875,6 +889,81 @@ static void qed_aio_complete_bh(void *opaque)
     }
 }
 
+/**
+ * Finish the cluster allocation of a write request
+ *
+ * The reserved range is released and waiting requests are restarted.
+ */
+static void qed_aio_end_alloc(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    QTAILQ_REMOVE(&s->allocating_write_reqs, acb, alloc_next);
+    acb->allocating = false;
+    s->alloc_generation++;
+
+    qed_wake_allocating_write_reqs(s);
+
+    if (QTAILQ_EMPTY(&s->allocating_write_reqs) &&
+        (s->header.features & QED_F_NEED_CHECK)) {
+        qed_start_need_check_timer(s);
+    }
+}
+
+static void qed_aio_complete(QEDAIOCB *acb, int ret);
+static void qed_aio_write_l2_update(void *opaque, int ret);
+
+/**
+ * Wait for our turn to update the L1/L2 tables
+ *
+ * Tables are written back in whole sectors from the cached copy, so two
+ * updates of neighbouring entries could overwrite each other on disk if they
+ * were in flight at the same time.  A queued request is restarted in
+ * qed_aio_write_l2_update() when the current update has finished.
+ */
+static bool qed_aio_start_table_update(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    if (s->table_update_acb) {
+        QSIMPLEQ_INSERT_TAIL(&s->table_update_reqs, acb, next);
+        return false;
+    }
+    s->table_update_acb = acb;
+    return true;
+}
+
+static void qed_aio_end_table_update(QEDAIOCB *acb)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    assert(s->table_update_acb == acb);
+    s->table_update_acb = NULL;
+
+    acb = QSIMPLEQ_FIRST(&s->table_update_reqs);
+    if (acb) {
+        QSIMPLEQ_REMOVE_HEAD(&s->table_update_reqs, next);
+        qed_aio_write_l2_update(acb, 0);
+    }
+}
+
+/**
+ * Finish the L1/L2 update of an allocating write and continue the request
+ */
+static void qed_aio_write_table_update_cb(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+
+    if (ret) {
+        qed_aio_complete(acb, ret);
+        return;
+    }
+
+    qed_aio_end_table_update(acb);
+    qed_aio_end_alloc(acb);
+    qed_aio_next_io(acb, 0);
+}
+
 static void qed_aio_complete(QEDAIOCB *acb, int ret)
 {
     BDRVQEDState *s = acb_to_s(acb);
@@ -890,20 +979,12 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
     acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
-    /* Start next allocating write request waiting behind this one.  Note that
-     * requests enqueue themselves when they first hit an unallocated cluster
-     * but they wait until the entire request is finished before waking up the
-     * next request in the queue.  This ensures that we don't cycle through
-     * requests multiple times but rather finish one at a time completely.
-     */
-    if (acb == QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_REMOVE_HEAD(&s->allocating_write_reqs, next);
-        acb = QSIMPLEQ_FIRST(&s->allocating_write_reqs);
-        if (acb) {
-            qed_aio_next_io(acb, 0);
-        } else if (s->header.features & QED_F_NEED_CHECK) {
-            qed_start_need_check_timer(s);
-        }
+    /* Let other requests go ahead if an allocation failed half-way */
+    if (s->table_update_acb == acb) {
+        qed_aio_end_table_update(acb);
+    }
+    if (acb->allocating) {
+        qed_aio_end_alloc(acb);
     }
 }
 
@@ -915,17 +996,18 @@ static void qed_commit_l2_update(void *opaque, int ret)
     QEDAIOCB *acb = opaque;
     BDRVQEDState *s = acb_to_s(acb);
     CachedL2Table *l2_table = acb->request.l2_table;
+    uint64_t l2_offset = l2_table->offset;
 
+    /* l2_table may be freed if it was already in the cache */
     qed_commit_l2_cache_entry(&s->l2_cache, l2_table);
 
     /* This is guaranteed to succeed because we just committed the entry to the
      * cache.
      */
-    acb->request.l2_table = qed_find_l2_cache_entry(&s->l2_cache,
-                                                    l2_table->offset);
+    acb->request.l2_table = qed_find_l2_cache_entry(&s->l2_cache, l2_offset);
     assert(acb->request.l2_table != NULL);
 
-    qed_aio_next_io(opaque, ret);
+    qed_aio_write_table_update_cb(opaque, ret);
 }
 
 /**
@@ -962,6 +1044,10 @@ static void qed_aio_write_l2_update(void *opaque, int ret)
         goto err;
     }
 
+    if (!qed_aio_start_table_update(acb)) {
+        return;
+    }
+
     if (need_alloc) {
         qed_unref_l2_cache_entry(acb->request.l2_table);
         acb->request.l2_table = qed_new_l2_table(s);
@@ -978,7 +1064,7 @@ static void qed_aio_write_l2_update(void *opaque, int ret)
     } else {
         /* Write out only the updated part of the L2 table */
         qed_write_l2_table(s, &acb->request, index, acb->cur_nclusters, false,
-                            qed_aio_next_io, acb);
+                            qed_aio_write_table_update_cb, acb);
     }
     return;
 
@@ -1097,29 +1183,96 @@ static bool qed_should_set_need_check(BDRVQEDState *s)
 }
 
 /**
- * Write new data cluster
+ * Wait for our turn to allocate clusters
  *
  * @acb:        Write request
  * @len:        Length in bytes
+ * @ret:        true if the request may go ahead, false if it was queued
  *
- * This path is taken when writing to previously unallocated clusters.
+ * Allocating writes reserve the clusters they fill, or the whole range of the
+ * L2 table if a new table has to be allocated, until the L1/L2 update is on
+ * disk.  Requests for disjoint ranges proceed in parallel; a request that
+ * overlaps a reserved range is queued and restarted from qed_aio_next_io()
+ * when the allocation finishes.  A request whose cluster lookup raced with a
+ * finished allocation looks up its clusters again.
  */
-static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
+static bool qed_aio_start_alloc(QEDAIOCB *acb, size_t len)
 {
     BDRVQEDState *s = acb_to_s(acb);
+    uint64_t start, end;
+    QEDAIOCB *other;
+
+    if (acb->find_cluster_ret == QED_CLUSTER_L1) {
+        start = acb->cur_pos & ~((1ULL << s->l1_shift) - 1);
+        end = start + (1ULL << s->l1_shift);
+    } else {
+        start = qed_start_of_cluster(s, acb->cur_pos);
+        end = qed_start_of_cluster(s, acb->cur_pos + len - 1) +
+              s->header.cluster_size;
+    }
 
     /* Cancel timer when the first allocating request comes in */
-    if (QSIMPLEQ_EMPTY(&s->allocating_write_reqs)) {
+    if (QTAILQ_EMPTY(&s->allocating_write_reqs)) {
         qed_cancel_need_check_timer(s);
     }
 
-    /* Freeze this request if another allocating write is in progress */
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs)) {
-        QSIMPLEQ_INSERT_TAIL(&s->allocating_write_reqs, acb, next);
+    if (s->allocating_write_reqs_plugged) {
+        goto wait;
     }
-    if (acb != QSIMPLEQ_FIRST(&s->allocating_write_reqs) ||
-        s->allocating_write_reqs_plugged) {
-        return; /* wait for existing request to finish */
+    QTAILQ_FOREACH(other, &s->allocating_write_reqs, alloc_next) {
+        if (start < other->alloc_end && other->alloc_start < end) {
+            goto wait;
+        }
+    }
+
+    /* The L2 table may have changed while it was being read */
+    if (acb->lookup_generation != s->alloc_generation) {
+        qed_aio_next_io(acb, 0);
+        return false;
+    }
+
+    trace_qed_aio_start_alloc(s, acb, start, end);
+    acb->allocating = true;
+    acb->alloc_start = start;
+    acb->alloc_end = end;
+    QTAILQ_INSERT_TAIL(&s->allocating_write_reqs, acb, alloc_next);
+    return true;
+
+wait:
+    QSIMPLEQ_INSERT_TAIL(&s->waiting_write_reqs, acb, next);
+    return false;
+}
+
+/**
+ * Continue an allocating write once the need check flag is on disk
+ */
+static void qed_aio_write_need_check_cb(void *opaque, int ret)
+{
+    QEDAIOCB *acb = opaque;
+
+    qed_unplug_allocating_write_reqs(acb_to_s(acb));
+
+    if (ret) {
+        qed_aio_complete(acb, ret);
+        return;
+    }
+    qed_aio_write_prefill(acb, 0);
+}
+
+/**
+ * Write new data cluster
+ *
+ * @acb:        Write request
+ * @len:        Length in bytes
+ *
+ * This path is taken when writing to previously unallocated clusters.
+ */
+static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    if (!qed_aio_start_alloc(acb, len)) {
+        return;
     }
 
     acb->cur_nclusters = qed_bytes_to_clusters(s,
@@ -1128,13 +1281,68 @@ static void qed_aio_write_alloc(QEDAIOCB *acb, size_t len)
     qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
 
     if (qed_should_set_need_check(s)) {
+        /* No other request may update tables before the flag is on disk */
+        qed_plug_allocating_write_reqs(s);
         s->header.features |= QED_F_NEED_CHECK;
-        qed_write_header(s, qed_aio_write_prefill, acb);
+        qed_write_header(s, qed_aio_write_need_check_cb, acb);
     } else {
         qed_aio_write_prefill(acb, 0);
     }
 }
 
+/**
+ * Turn unallocated clusters into zero clusters
+ *
+ * @acb:        Write request
+ * @len:        Length in bytes, a multiple of the cluster size
+ *
+ * This path is taken for writes of zeroes that cover whole unallocated
+ * clusters.  Only the L2 table is updated, no data clusters are allocated.
+ */
+static void qed_aio_write_zero_clusters(QEDAIOCB *acb, size_t len)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+
+    trace_qed_aio_write_zero_clusters(s, acb, acb->cur_pos, len);
+
+    if (!qed_aio_start_alloc(acb, len)) {
+        return;
+    }
+
+    acb->cur_nclusters = qed_bytes_to_clusters(s, len);
+    acb->cur_cluster = 1; /* zero cluster marker */
+    qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
+
+    qed_aio_write_l2_update(acb, 0);
+}
+
+/**
+ * Write zeroes to unallocated or zero clusters
+ *
+ * @acb:        Write request
+ * @len:        Length in bytes
+ *
+ * Clusters that already read as zeroes are skipped and whole unallocated
+ * clusters become zero clusters.  Partial clusters are written normally.
+ */
+static void qed_aio_write_zeroes(QEDAIOCB *acb, size_t len)
+{
+    BDRVQEDState *s = acb_to_s(acb);
+    size_t offset_in_cluster = qed_offset_into_cluster(s, acb->cur_pos);
+
+    if (acb->find_cluster_ret == QED_CLUSTER_ZERO || !s->bs->backing_hd) {
+        qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset, len);
+        qed_aio_next_io(acb, 0);
+    } else if (offset_in_cluster) {
+        qed_aio_write_alloc(acb, MIN(len, s->header.cluster_size -
+                                          offset_in_cluster));
+    } else if (len < s->header.cluster_size) {
+        qed_aio_write_alloc(acb, len);
+    } else {
+        qed_aio_write_zero_clusters(acb, qed_start_of_cluster(s, len));
+    }
+}
+
 /**
  * Write data cluster in place
  *
@@ -1182,7 +1390,11 @@ static void qed_aio_write_data(void *opaque, int ret,
     case QED_CLUSTER_L2:
     case QED_CLUSTER_L1:
     case QED_CLUSTER_ZERO:
-        qed_aio_write_alloc(acb, len);
+        if (acb->is_zero_write) {
+            qed_aio_write_zeroes(acb, len);
+        } else {
+            qed_aio_write_alloc(acb, len);
+        }
         break;
 
     default:
@@ -1276,6 +1488,7 @@ static void qed_aio_next_io(void *opaque, int ret)
     }
 
     /* Find next cluster and start I/O */
+    acb->lookup_generation = s->alloc_generation;
     qed_find_cluster(s, &acb->request,
                       acb->cur_pos, acb->end_pos - acb->cur_pos,
                       io_fn, acb);
@@ -1285,7 +1498,8 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
                                        int64_t sector_num,
                                        QEMUIOVector *qiov, int nb_sectors,
                                        BlockDriverCompletionFunc *cb,
-                                       void *opaque, bool is_write)
+                                       void *opaque, bool is_write,
+                                       bool is_zero_write)
 {
     QEDAIOCB *acb = qemu_aio_get(&qed_aio_pool, bs, cb, opaque);
 
@@ -1293,12 +1507,14 @@ static BlockDriverAIOCB *qed_aio_setup(BlockDriverState *bs,
                          opaque, is_write);
 
     acb->is_write = is_write;
+    acb->is_zero_write = is_zero_write;
     acb->finished = NULL;
     acb->qiov = qiov;
     acb->qiov_offset = 0;
     acb->cur_pos = (uint64_t)sector_num * BDRV_SECTOR_SIZE;
     acb->end_pos = acb->cur_pos + nb_sectors * BDRV_SECTOR_SIZE;
     acb->request.l2_table = NULL;
+    acb->allocating = false;
     qemu_iovec_init(&acb->cur_qiov, qiov->niov);
 
     /* Start request */
@@ -1312,7 +1528,8 @@ static BlockDriverAIOCB *bdrv_qed_aio_readv(BlockDriverState *bs,
                                             BlockDriverCompletionFunc *cb,
                                             void *opaque)
 {
-    return qed_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, false);
+    return qed_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                         false, false);
 }
 
 static BlockDriverAIOCB *bdrv_qed_aio_writev(BlockDriverState *bs,
@@ -1321,7 +1538,19 @@ static BlockDriverAIOCB *bdrv_qed_aio_writev(BlockDriverState *bs,
                                              BlockDriverCompletionFunc *cb,
                                              void *opaque)
 {
-    return qed_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, true);
+    return qed_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                         true, false);
+}
+
+static BlockDriverAIOCB *bdrv_qed_aio_write_zeroes(BlockDriverState *bs,
+                                                   int64_t sector_num,
+                                                   QEMUIOVector *qiov,
+                                                   int nb_sectors,
+                                                   BlockDriverCompletionFunc *cb,
+                                                   void *opaque)
+{
+    return qed_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque,
+                         true, true);
 }
 
 static BlockDriverAIOCB *bdrv_qed_aio_flush(BlockDriverState *bs,
@@ -1487,6 +1716,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_make_empty          = bdrv_qed_make_empty,
     .bdrv_aio_readv           = bdrv_qed_aio_readv,
     .bdrv_aio_writev          = bdrv_qed_aio_writev,
+    .bdrv_aio_write_zeroes    = bdrv_qed_aio_write_zeroes,
     .bdrv_aio_flush           = bdrv_qed_aio_flush,
     .bdrv_truncate            = bdrv_qed_truncate,
     .bdrv_getlength           = bdrv_qed_getlength,
@@ -127,8 +127,10 @@ typedef struct QEDAIOCB {
     BlockDriverAIOCB common;
     QEMUBH *bh;
     int bh_ret;                     /* final return status for completion bh */
-    QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next request */
+    QSIMPLEQ_ENTRY(QEDAIOCB) next;  /* next waiting request */
+    QTAILQ_ENTRY(QEDAIOCB) alloc_next; /* next allocating write request */
     bool is_write;                  /* false - read, true - write */
+    bool is_zero_write;             /* request only contains zeroes */
     bool *finished;                 /* signal for cancel completion */
     uint64_t end_pos;               /* request end on block device, in bytes */
 
@@ -143,6 +145,12 @@ typedef struct QEDAIOCB {
     unsigned int cur_nclusters;     /* number of clusters being accessed */
     int find_cluster_ret;           /* used for L1/L2 update */
 
+    /* Allocating write state, see qed_aio_start_alloc() */
+    bool allocating;
+    uint64_t alloc_start;           /* reserved range on block device */
+    uint64_t alloc_end;
+    uint64_t lookup_generation;     /* s->alloc_generation at cluster lookup */
+
     QEDRequest request;
 } QEDAIOCB;
 
@@ -158,9 +166,15 @@ typedef struct {
     uint32_t l2_shift;
     uint32_t l2_mask;
 
-    /* Allocating write request queue */
-    QSIMPLEQ_HEAD(, QEDAIOCB) allocating_write_reqs;
+    /* Allocating write requests in progress and waiting for their turn */
+    QTAILQ_HEAD(, QEDAIOCB) allocating_write_reqs;
+    QSIMPLEQ_HEAD(, QEDAIOCB) waiting_write_reqs;
     bool allocating_write_reqs_plugged;
+    uint64_t alloc_generation;      /* number of finished allocations */
+
+    /* L1/L2 table updates are written one at a time */
+    QEDAIOCB *table_update_acb;
+    QSIMPLEQ_HEAD(, QEDAIOCB) table_update_reqs;
 
     /* Periodic flush and clear need check flag */
     QEMUTimer *need_check_timer;
@@ -84,6 +84,9 @@
 #define SD_INODE_SIZE (sizeof(SheepdogInode))
 #define CURRENT_VDI_ID 0
 
+/* Number of persistent connections used for object I/O of one image */
+#define SD_NR_CONNECTIONS 4
+
 typedef struct SheepdogReq {
     uint8_t proto_ver;
     uint8_t opcode;
@@ -282,7 +285,15 @@ struct SheepdogAIOCB {
     QLIST_HEAD(aioreq_head, AIOReq) aioreq_head;
 };
 
-typedef struct BDRVSheepdogState {
+typedef struct BDRVSheepdogState BDRVSheepdogState;
+
+typedef struct SheepdogConn {
+    BDRVSheepdogState *s;
+    int fd;
+    int in_flight;              /* requests sent and not yet answered */
+} SheepdogConn;
+
+struct BDRVSheepdogState {
     SheepdogInode inode;
 
     uint32_t min_dirty_data_idx;
@@ -293,11 +304,12 @@ typedef struct BDRVSheepdogState {
 
     char *addr;
     char *port;
-    int fd;
+    SheepdogConn conns[SD_NR_CONNECTIONS];
+    int meta_fd;                /* blocking connection for metadata requests */
 
     uint32_t aioreq_seq_num;
     QLIST_HEAD(outstanding_aio_head, AIOReq) outstanding_aio_head;
-} BDRVSheepdogState;
+};
 
 static const char * sd_strerror(int err)
 {
@@ -352,10 +364,12 @@ static const char * sd_strerror(int err)
  * 2. In sd_readv_writev_bh_cb, the callbacks of BHs, we send the I/O
  *    requests to the server and link the requests to the
  *    outstanding_list in the BDRVSheepdogState.  we exits the
- *    function without waiting for receiving the response.
+ *    function without waiting for receiving the response.  Each image
+ *    keeps SD_NR_CONNECTIONS connections open and requests are spread
+ *    over them by object, see sd_get_conn.
  *
  * 3. We receive the response in aio_read_response, the fd handler to
- *    the sheepdog connection.  If metadata update is needed, we send
+ *    the sheepdog connections.  If metadata update is needed, we send
  *    the write request to the vdi object in sd_write_done, the write
  *    completion function.  The AIOCB callback is not called until all
  *    the requests belonging to the AIOCB are finished.
@@ -784,21 +798,22 @@ static void send_pending_req(BDRVSheepdogState *s, uint64_t oid, uint32_t id)
 /*
  * Receive responses of the I/O requests.
  *
- * This function is registered as a fd handler, and called from the
- * main loop when s->fd is ready for reading responses.
+ * This function is registered as a fd handler for each connection, and
+ * called from the main loop when conn->fd is ready for reading responses.
  */
 static void aio_read_response(void *opaque)
 {
     SheepdogObjRsp rsp;
-    BDRVSheepdogState *s = opaque;
-    int fd = s->fd;
+    SheepdogConn *conn = opaque;
+    BDRVSheepdogState *s = conn->s;
+    int fd = conn->fd;
     int ret;
     AIOReq *aio_req = NULL;
     SheepdogAIOCB *acb;
     int rest;
     unsigned long idx;
 
-    if (QLIST_EMPTY(&s->outstanding_aio_head)) {
+    if (!conn->in_flight) {
         return;
     }
 
@@ -819,6 +834,7 @@ static void aio_read_response(void *opaque)
         error_report("cannot find aio_req %x\n", rsp.id);
         return;
     }
+    conn->in_flight--;
 
     acb = aio_req->aiocb;
 
@@ -875,9 +891,13 @@ static void aio_read_response(void *opaque)
 
 static int aio_flush_request(void *opaque)
 {
-    BDRVSheepdogState *s = opaque;
+    SheepdogConn *conn = opaque;
 
-    return !QLIST_EMPTY(&s->outstanding_aio_head);
+    /*
+     * Requests waiting for a create to finish are sent when the create's
+     * response arrives, which is in flight on one of the connections.
+     */
+    return conn->in_flight > 0;
 }
 
 #if !defined(SOL_TCP) || !defined(TCP_CORK)
@@ -906,13 +926,14 @@ static int set_nodelay(int fd)
 }
 
 /*
- * Return a socket discriptor to read/write objects.
+ * Open a socket discriptor to read/write objects.
  *
  * We cannot use this discriptor for other operations because
  * the block driver may be on waiting response from the server.
  */
-static int get_sheep_fd(BDRVSheepdogState *s)
+static int get_sheep_fd(SheepdogConn *conn)
 {
+    BDRVSheepdogState *s = conn->s;
     int ret, fd;
 
     fd = connect_to_sdog(s->addr, s->port);
@@ -930,9 +951,74 @@ static int get_sheep_fd(BDRVSheepdogState *s)
         return -1;
     }
 
+    conn->fd = fd;
+    conn->in_flight = 0;
     qemu_aio_set_fd_handler(fd, aio_read_response, NULL, aio_flush_request,
-                            NULL, s);
-    return fd;
+                            NULL, conn);
+    return 0;
+}
+
+static void close_sheep_fds(BDRVSheepdogState *s)
+{
+    int i;
+
+    for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+        if (s->conns[i].fd >= 0) {
+            qemu_aio_set_fd_handler(s->conns[i].fd, NULL, NULL, NULL, NULL,
+                                    NULL);
+            closesocket(s->conns[i].fd);
+            s->conns[i].fd = -1;
+        }
+    }
+}
+
+/*
+ * Pick the connection that a request to oid is sent on.
+ *
+ * Every object has a home connection that all writes to it are sent on,
+ * so they reach the server in the order they were issued.  Reads have no
+ * such ordering needs and go to the least loaded connection, preferring
+ * the home connection.
+ */
+static SheepdogConn *sd_get_conn(BDRVSheepdogState *s, uint64_t oid,
+                                 enum AIOCBState aiocb_type)
+{
+    SheepdogConn *conn = &s->conns[data_oid_to_idx(oid) % SD_NR_CONNECTIONS];
+    int i;
+
+    if (aiocb_type == AIOCB_READ_UDATA) {
+        for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+            if (s->conns[i].in_flight < conn->in_flight) {
+                conn = &s->conns[i];
+            }
+        }
+    }
+    return conn;
+}
+
+/*
+ * Return the connection for synchronous metadata requests (vdi lookups,
+ * inode updates, snapshots and vmstate), connecting on first use.  It
+ * stays open for later requests; put_meta_fd() drops it after an error so
+ * that the next request starts on a fresh connection.
+ */
+static int get_meta_fd(BDRVSheepdogState *s)
+{
+    if (s->meta_fd < 0) {
+        s->meta_fd = connect_to_sdog(s->addr, s->port);
+        if (s->meta_fd >= 0) {
+            set_nodelay(s->meta_fd);
+        }
+    }
+    return s->meta_fd;
+}
+
+static void put_meta_fd(BDRVSheepdogState *s, int ret)
+{
+    if (ret < 0 && s->meta_fd >= 0) {
+        closesocket(s->meta_fd);
+        s->meta_fd = -1;
+    }
 }
 
 /*
@@ -1013,7 +1099,7 @@ static int find_vdi_name(BDRVSheepdogState *s, char *filename, uint32_t snapid,
     unsigned int wlen, rlen = 0;
     char buf[SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN];
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
         return -1;
     }
@@ -1050,7 +1136,7 @@ static int find_vdi_name(BDRVSheepdogState *s, char *filename, uint32_t snapid,
 
     ret = 0;
 out:
-    closesocket(fd);
+    put_meta_fd(s, ret);
     return ret;
 }
 
@@ -1067,6 +1153,7 @@ static int add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
     uint64_t offset = aio_req->offset;
     uint8_t flags = aio_req->flags;
     uint64_t old_oid = aio_req->base_oid;
+    SheepdogConn *conn = sd_get_conn(s, oid, aiocb_type);
 
     if (!nr_copies) {
         error_report("bug\n");
@@ -1097,24 +1184,25 @@ static int add_aio_request(BDRVSheepdogState *s, AIOReq *aio_req,
 
     hdr.id = aio_req->id;
 
-    set_cork(s->fd, 1);
+    set_cork(conn->fd, 1);
 
     /* send a header */
-    ret = do_write(s->fd, &hdr, sizeof(hdr));
+    ret = do_write(conn->fd, &hdr, sizeof(hdr));
     if (ret) {
         error_report("failed to send a req, %s\n", strerror(errno));
         return -EIO;
     }
 
     if (wlen) {
-        ret = do_writev(s->fd, iov, wlen, aio_req->iov_offset);
+        ret = do_writev(conn->fd, iov, wlen, aio_req->iov_offset);
         if (ret) {
             error_report("failed to send a data, %s\n", strerror(errno));
             return -EIO;
         }
     }
 
-    set_cork(s->fd, 0);
+    set_cork(conn->fd, 0);
+    conn->in_flight++;
 
     return 0;
 }
@@ -1178,7 +1266,7 @@ static int write_object(int fd, char *buf, uint64_t oid, int copies,
 
 static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 {
-    int ret, fd;
+    int ret, fd, i;
     uint32_t vid = 0;
     BDRVSheepdogState *s = bs->opaque;
     char vdi[SD_MAX_VDI_LEN], tag[SD_MAX_VDI_TAG_LEN];
@@ -1188,16 +1276,21 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
     strstart(filename, "sheepdog:", (const char **)&filename);
 
     QLIST_INIT(&s->outstanding_aio_head);
-    s->fd = -1;
+    for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+        s->conns[i].s = s;
+        s->conns[i].fd = -1;
+    }
+    s->meta_fd = -1;
 
     memset(vdi, 0, sizeof(vdi));
     memset(tag, 0, sizeof(tag));
     if (parse_vdiname(s, filename, vdi, &snapid, tag) < 0) {
         goto out;
     }
-    s->fd = get_sheep_fd(s);
-    if (s->fd < 0) {
-        goto out;
+    for (i = 0; i < SD_NR_CONNECTIONS; i++) {
+        if (get_sheep_fd(&s->conns[i]) < 0) {
+            goto out;
+        }
     }
 
     ret = find_vdi_name(s, vdi, snapid, tag, &vid, 0);
@@ -1210,7 +1303,7 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
         s->is_snapshot = 1;
     }
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
         error_report("failed to connect\n");
         goto out;
@@ -1218,8 +1311,7 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
 
     buf = qemu_malloc(SD_INODE_SIZE);
     ret = read_object(fd, buf, vid_to_vdi_oid(vid), 0, SD_INODE_SIZE, 0);
-
-    closesocket(fd);
+    put_meta_fd(s, ret);
 
     if (ret) {
         goto out;
@@ -1234,29 +1326,21 @@ static int sd_open(BlockDriverState *bs, const char *filename, int flags)
     qemu_free(buf);
     return 0;
 out:
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL, NULL);
-    if (s->fd >= 0) {
-        closesocket(s->fd);
-    }
+    close_sheep_fds(s);
+    put_meta_fd(s, -1);
     qemu_free(buf);
     return -1;
 }
 
-static int do_sd_create(char *filename, int64_t vdi_size,
-                        uint32_t base_vid, uint32_t *vdi_id, int snapshot,
-                        const char *addr, const char *port)
+static int do_sd_create(int fd, char *filename, int64_t vdi_size,
+                        uint32_t base_vid, uint32_t *vdi_id, int snapshot)
 {
     SheepdogVdiReq hdr;
     SheepdogVdiRsp *rsp = (SheepdogVdiRsp *)&hdr;
-    int fd, ret;
+    int ret;
     unsigned int wlen, rlen = 0;
     char buf[SD_MAX_VDI_LEN];
 
-    fd = connect_to_sdog(addr, port);
-    if (fd < 0) {
-        return -EIO;
-    }
-
     memset(buf, 0, sizeof(buf));
     strncpy(buf, filename, SD_MAX_VDI_LEN);
 
@@ -1273,9 +1357,6 @@ static int do_sd_create(char *filename, int64_t vdi_size,
     hdr.vdi_size = vdi_size;
 
     ret = do_req(fd, (SheepdogReq *)&hdr, buf, &wlen, &rlen);
-
-    closesocket(fd);
-
     if (ret) {
         return -EIO;
     }
@@ -1294,7 +1375,7 @@ static int do_sd_create(char *filename, int64_t vdi_size,
 
 static int sd_create(const char *filename, QEMUOptionParameter *options)
 {
-    int ret;
+    int ret, fd;
     uint32_t vid = 0, base_vid = 0;
     int64_t vdi_size = 0;
     char *backing_file = NULL;
@@ -1354,7 +1435,14 @@ static int sd_create(const char *filename, QEMUOptionParameter *options)
         bdrv_delete(bs);
     }
 
-    return do_sd_create((char *)vdi, vdi_size, base_vid, &vid, 0, s.addr, s.port);
+    fd = connect_to_sdog(s.addr, s.port);
+    if (fd < 0) {
+        return -EIO;
+    }
+    ret = do_sd_create(fd, (char *)vdi, vdi_size, base_vid, &vid, 0);
+    closesocket(fd);
+
+    return ret;
 }
 
 static void sd_close(BlockDriverState *bs)
@@ -1367,29 +1455,25 @@ static void sd_close(BlockDriverState *bs)
 
     dprintf("%s\n", s->name);
 
-    fd = connect_to_sdog(s->addr, s->port);
-    if (fd < 0) {
-        return;
-    }
-
-    memset(&hdr, 0, sizeof(hdr));
-
-    hdr.opcode = SD_OP_RELEASE_VDI;
-    wlen = strlen(s->name) + 1;
-    hdr.data_length = wlen;
-    hdr.flags = SD_FLAG_CMD_WRITE;
+    fd = get_meta_fd(s);
+    if (fd >= 0) {
+        memset(&hdr, 0, sizeof(hdr));
 
-    ret = do_req(fd, (SheepdogReq *)&hdr, s->name, &wlen, &rlen);
+        hdr.opcode = SD_OP_RELEASE_VDI;
+        wlen = strlen(s->name) + 1;
+        hdr.data_length = wlen;
+        hdr.flags = SD_FLAG_CMD_WRITE;
 
-    closesocket(fd);
+        ret = do_req(fd, (SheepdogReq *)&hdr, s->name, &wlen, &rlen);
 
-    if (!ret && rsp->result != SD_RES_SUCCESS &&
-        rsp->result != SD_RES_VDI_NOT_LOCKED) {
-        error_report("%s, %s\n", sd_strerror(rsp->result), s->name);
+        if (!ret && rsp->result != SD_RES_SUCCESS &&
+            rsp->result != SD_RES_VDI_NOT_LOCKED) {
+            error_report("%s, %s\n", sd_strerror(rsp->result), s->name);
+        }
     }
 
-    qemu_aio_set_fd_handler(s->fd, NULL, NULL, NULL, NULL, NULL);
-    closesocket(s->fd);
+    close_sheep_fds(s);
+    put_meta_fd(s, -1);
     qemu_free(s->addr);
 }
 
@@ -1414,7 +1498,7 @@ static int sd_truncate(BlockDriverState *bs, int64_t offset)
         return -EINVAL;
     }
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
         return -EIO;
     }
@@ -1424,7 +1508,7 @@ static int sd_truncate(BlockDriverState *bs, int64_t offset)
     s->inode.vdi_size = offset;
     ret = write_object(fd, (char *)&s->inode, vid_to_vdi_oid(s->inode.vdi_id),
                        s->inode.nr_copies, datalen, 0, 0);
-    close(fd);
+    put_meta_fd(s, ret);
 
     if (ret < 0) {
         error_report("failed to update an inode.\n");
@@ -1490,24 +1574,25 @@ static int sd_create_branch(BDRVSheepdogState *s)
 
     buf = qemu_malloc(SD_INODE_SIZE);
 
-    ret = do_sd_create(s->name, s->inode.vdi_size, s->inode.vdi_id, &vid, 1,
-                       s->addr, s->port);
-    if (ret) {
+    fd = get_meta_fd(s);
+    if (fd < 0) {
+        error_report("failed to connect\n");
+        ret = -EIO;
         goto out;
     }
 
-    dprintf("%" PRIx32 " is created.\n", vid);
-
-    fd = connect_to_sdog(s->addr, s->port);
-    if (fd < 0) {
-        error_report("failed to connect\n");
+    ret = do_sd_create(fd, s->name, s->inode.vdi_size, s->inode.vdi_id, &vid,
+                       1);
+    if (ret) {
+        put_meta_fd(s, ret);
         goto out;
     }
 
+    dprintf("%" PRIx32 " is created.\n", vid);
+
     ret = read_object(fd, buf, vid_to_vdi_oid(vid), s->inode.nr_copies,
                       SD_INODE_SIZE, 0);
-
-    closesocket(fd);
+    put_meta_fd(s, ret);
 
     if (ret < 0) {
         goto out;
@@ -1709,10 +1794,9 @@ static int sd_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     datalen = SD_INODE_SIZE - sizeof(s->inode.data_vdi_id);
 
     /* refresh inode. */
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
-        ret = -EIO;
-        goto cleanup;
+        return -EIO;
     }
 
     ret = write_object(fd, (char *)&s->inode, vid_to_vdi_oid(s->inode.vdi_id),
@@ -1723,8 +1807,8 @@ static int sd_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         goto cleanup;
     }
 
-    ret = do_sd_create(s->name, s->inode.vdi_size, s->inode.vdi_id, &new_vid, 1,
-                       s->addr, s->port);
+    ret = do_sd_create(fd, s->name, s->inode.vdi_size, s->inode.vdi_id,
+                       &new_vid, 1);
     if (ret < 0) {
         error_report("failed to create inode for snapshot. %s\n",
                      strerror(errno));
@@ -1748,7 +1832,7 @@ static int sd_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
             s->inode.name, s->inode.snap_id, s->inode.vdi_id);
 
 cleanup:
-    closesocket(fd);
+    put_meta_fd(s, ret);
     return ret;
 }
 
@@ -1782,7 +1866,7 @@ static int sd_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         goto out;
     }
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
         error_report("failed to connect\n");
         goto out;
@@ -1791,8 +1875,7 @@ static int sd_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     buf = qemu_malloc(SD_INODE_SIZE);
     ret = read_object(fd, buf, vid_to_vdi_oid(vid), s->inode.nr_copies,
                       SD_INODE_SIZE, 0);
-
-    closesocket(fd);
+    put_meta_fd(s, ret);
 
     if (ret) {
         ret = -ENOENT;
@@ -1814,7 +1897,8 @@ static int sd_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
 
     return 0;
 out:
-    /* recover bdrv_sd_state */
+    /* recover bdrv_sd_state, but keep the current metadata connection */
+    old_s->meta_fd = s->meta_fd;
     memcpy(s, old_s, sizeof(BDRVSheepdogState));
     qemu_free(buf);
     qemu_free(old_s);
@@ -1846,7 +1930,7 @@ static int sd_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab)
 
     vdi_inuse = qemu_malloc(max);
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
         goto out;
     }
@@ -1860,9 +1944,8 @@ static int sd_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab)
     req.data_length = max;
 
     ret = do_req(fd, (SheepdogReq *)&req, vdi_inuse, &wlen, &rlen);
-
-    closesocket(fd);
     if (ret) {
+        put_meta_fd(s, ret);
         goto out;
     }
 
@@ -1872,12 +1955,6 @@ static int sd_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab)
     hval = fnv_64a_buf(s->name, strlen(s->name), FNV1A_64_INIT);
     start_nr = hval & (SD_NR_VDIS - 1);
 
-    fd = connect_to_sdog(s->addr, s->port);
-    if (fd < 0) {
-        error_report("failed to connect\n");
-        goto out;
-    }
-
     for (vid = start_nr; found < nr; vid = (vid + 1) % SD_NR_VDIS) {
         if (!test_bit(vid, vdi_inuse)) {
             break;
@@ -1905,7 +1982,6 @@ static int sd_snapshot_list(BlockDriverState *bs, QEMUSnapshotInfo **psn_tab)
         }
     }
 
-    closesocket(fd);
 out:
     *psn_tab = sn_tab;
 
@@ -1924,10 +2000,9 @@ static int do_load_save_vmstate(BDRVSheepdogState *s, uint8_t *data,
     uint32_t vdi_index;
     uint64_t offset;
 
-    fd = connect_to_sdog(s->addr, s->port);
+    fd = get_meta_fd(s);
     if (fd < 0) {
-        ret = -EIO;
-        goto cleanup;
+        return -EIO;
     }
 
     while (size) {
@@ -1958,7 +2033,7 @@ static int do_load_save_vmstate(BDRVSheepdogState *s, uint8_t *data,
         ret += data_len;
     }
 cleanup:
-    closesocket(fd);
+    put_meta_fd(s, ret);
     return ret;
 }
 
@@ -0,0 +1,179 @@
+/*
+ * Image streaming
+ *
+ * Copies the data of the backing file chain into an image while the guest
+ * keeps running, then removes the backing file link.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block_int.h"
+#include "ratelimit.h"
+
+enum {
+    /*
+     * Size of data buffer for populating the image file.  This should be large
+     * enough to process multiple clusters in a single call, so that populating
+     * contiguous regions of the image is efficient.
+     */
+    STREAM_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /*
+     * Number of allocation lookups done in one go before giving the main loop
+     * a chance to run, in case most of the image is already allocated.
+     */
+    STREAM_MAX_LOOKUPS = 256,
+};
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct StreamBlockJob {
+    BlockJob common;
+    RateLimit limit;
+    QEMUTimer *timer;
+    int64_t sector_num;
+    int64_t end;
+    int nb_sectors;             /* size of the request in flight */
+    void *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} StreamBlockJob;
+
+static void stream_complete(StreamBlockJob *s, int ret)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    trace_stream_complete(s, bs, s->sector_num, ret);
+
+    bdrv_disable_copy_on_read(bs);
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    qemu_vfree(s->buf);
+    block_job_complete(&s->common, ret);
+}
+
+static void stream_read_cb(void *opaque, int ret)
+{
+    StreamBlockJob *s = opaque;
+
+    if (ret < 0) {
+        stream_complete(s, ret);
+        return;
+    }
+
+    s->sector_num += s->nb_sectors;
+    s->common.offset = s->sector_num * BDRV_SECTOR_SIZE;
+
+    /*
+     * Continue from a timer rather than a bottom half so that qemu_aio_flush()
+     * doesn't wait for the whole image to be streamed.
+     */
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+}
+
+static void stream_run(void *opaque)
+{
+    StreamBlockJob *s = opaque;
+    BlockDriverState *bs = s->common.bs;
+    int64_t delay;
+    int lookups = 0;
+    int n;
+
+    if (block_job_is_cancelled(&s->common)) {
+        stream_complete(s, 0);
+        return;
+    }
+
+    while (s->sector_num < s->end) {
+        if (lookups++ == STREAM_MAX_LOOKUPS) {
+            qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+            return;
+        }
+
+        if (bdrv_is_allocated(bs, s->sector_num,
+                              STREAM_BUFFER_SIZE / BDRV_SECTOR_SIZE, &n)) {
+            s->sector_num += MAX(n, 1);
+            s->common.offset = s->sector_num * BDRV_SECTOR_SIZE;
+            continue;
+        }
+        n = MIN(MAX(n, 1), s->end - s->sector_num);
+
+        if (s->common.speed) {
+            delay = ratelimit_calculate_delay(&s->limit,
+                                              n * BDRV_SECTOR_SIZE);
+            if (delay > 0) {
+                qemu_mod_timer(s->timer,
+                               qemu_get_clock_ns(rt_clock) + delay);
+                return;
+            }
+        }
+
+        trace_stream_one_iteration(s, s->sector_num, n);
+
+        /* Copy-on-read is enabled, so reading populates the image */
+        s->nb_sectors = n;
+        s->iov.iov_base = s->buf;
+        s->iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&s->qiov, &s->iov, 1);
+        if (!bdrv_aio_readv(bs, s->sector_num, &s->qiov, n,
+                            stream_read_cb, s)) {
+            stream_complete(s, -EIO);
+        }
+        return;
+    }
+
+    /* Everything is in the image now, the backing file is not needed */
+    stream_complete(s, bdrv_drop_backing_file(bs));
+}
+
+static int stream_set_speed(BlockJob *job, int64_t value)
+{
+    StreamBlockJob *s = container_of(job, StreamBlockJob, common);
+
+    if (value < 0) {
+        return -EINVAL;
+    }
+    ratelimit_set_speed(&s->limit, value, SLICE_TIME);
+    return 0;
+}
+
+static BlockJobType stream_job_type = {
+    .instance_size = sizeof(StreamBlockJob),
+    .job_type      = "stream",
+    .set_speed     = stream_set_speed,
+};
+
+int stream_start(BlockDriverState *bs, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    StreamBlockJob *s;
+
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    if (speed < 0) {
+        return -EINVAL;
+    }
+
+    s = block_job_create(&stream_job_type, bs, cb, opaque);
+    if (!s) {
+        return -EBUSY;
+    }
+
+    s->end = bs->total_sectors;
+    s->common.len = s->end * BDRV_SECTOR_SIZE;
+    s->buf = qemu_blockalign(bs, STREAM_BUFFER_SIZE);
+    s->timer = qemu_new_timer_ns(rt_clock, stream_run, s);
+    block_job_set_speed(&s->common, speed);
+
+    /* Writes submitted before copy-on-read is enabled are not tracked */
+    qemu_aio_flush();
+    bdrv_enable_copy_on_read(bs);
+
+    trace_stream_start(bs, s, speed);
+    qemu_mod_timer(s->timer, qemu_get_clock_ns(rt_clock));
+    return 0;
+}
@@ -58,7 +58,8 @@ typedef struct {
     char check_bytes[4];
 } __attribute__((packed)) VMDK4Header;
 
-#define L2_CACHE_SIZE 16
+/* Default amount of memory used to cache grain tables */
+#define L2_CACHE_DEFAULT_SIZE (256 * 1024)
 
 typedef struct BDRVVmdkState {
     int64_t l1_table_offset;
@@ -69,20 +70,37 @@ typedef struct BDRVVmdkState {
     uint32_t l1_entry_sectors;
 
     unsigned int l2_size;
+    unsigned int l2_cache_entries;  /* number of cached grain tables */
     uint32_t *l2_cache;
-    uint32_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    uint32_t *l2_cache_offsets;
+    uint32_t *l2_cache_counts;
 
     unsigned int cluster_sectors;
     uint32_t parent_cid;
+    int parent_cid_checked;     /* the backing file CID has been verified */
+    int cid_updated;            /* the CID has been updated since open */
 } BDRVVmdkState;
 
+typedef struct VmdkAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int is_write;
+    int n;                      /* sectors handled by the current step */
+    size_t qiov_offset;         /* bytes of qiov completed so far */
+    QEMUIOVector cur_qiov;
+    BlockDriverAIOCB *hd_aiocb;
+    QEMUBH *bh;
+    int bh_ret;
+    bool *finished;             /* signal for cancel completion */
+} VmdkAIOCB;
+
 typedef struct VmdkMetaData {
     uint32_t offset;
     unsigned int l1_index;
     unsigned int l2_index;
     unsigned int l2_offset;
-    int valid;
 } VmdkMetaData;
 
 static int vmdk_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -161,11 +179,13 @@ static int vmdk_is_cid_valid(BlockDriverState *bs)
     BlockDriverState *p_bs = bs->backing_hd;
     uint32_t cur_pcid;
 
-    if (p_bs) {
+    /* The backing file is read-only, so checking it once is enough */
+    if (p_bs && !s->parent_cid_checked) {
         cur_pcid = vmdk_read_cid(p_bs,0);
         if (s->parent_cid != cur_pcid)
             // CID not valid
             return 0;
+        s->parent_cid_checked = 1;
     }
 #endif
     // CID valid
@@ -358,6 +378,33 @@ static int vmdk_parent_open(BlockDriverState *bs)
     return 0;
 }
 
+/*
+ * Resizes the grain table cache so that it uses at most size bytes.  At least
+ * one grain table is always cached, and never more than the image has.
+ */
+static int vmdk_set_cache_size(BlockDriverState *bs, int64_t size)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int64_t entries;
+
+    if (size < 0) {
+        return -EINVAL;
+    }
+
+    entries = size / (s->l2_size * sizeof(uint32_t));
+    entries = MAX(MIN(entries, s->l1_size), 1);
+
+    qemu_free(s->l2_cache);
+    qemu_free(s->l2_cache_offsets);
+    qemu_free(s->l2_cache_counts);
+
+    s->l2_cache_entries = entries;
+    s->l2_cache = qemu_malloc(entries * s->l2_size * sizeof(uint32_t));
+    s->l2_cache_offsets = qemu_mallocz(entries * sizeof(uint32_t));
+    s->l2_cache_counts = qemu_mallocz(entries * sizeof(uint32_t));
+    return 0;
+}
+
 static int vmdk_open(BlockDriverState *bs, int flags)
 {
     BDRVVmdkState *s = bs->opaque;
@@ -423,20 +470,16 @@ static int vmdk_open(BlockDriverState *bs, int flags)
         }
     }
 
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint32_t));
+    vmdk_set_cache_size(bs, L2_CACHE_DEFAULT_SIZE);
     return 0;
  fail:
     qemu_free(s->l1_backup_table);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
     return -1;
 }
 
-static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
-                                   uint64_t offset, int allocate);
-
 static int get_whole_cluster(BlockDriverState *bs, uint64_t cluster_offset,
-                             uint64_t offset, int allocate)
+                             uint64_t offset)
 {
     BDRVVmdkState *s = bs->opaque;
     uint8_t  whole_grain[s->cluster_sectors*512];        // 128 sectors * 512 bytes each = grain size 64KB
@@ -484,29 +527,27 @@ static int vmdk_L2update(BlockDriverState *bs, VmdkMetaData *m_data)
     return 0;
 }
 
-static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
-                                   uint64_t offset, int allocate)
+static uint64_t get_cluster_offset(BlockDriverState *bs, uint64_t offset,
+                                   int allocate)
 {
     BDRVVmdkState *s = bs->opaque;
+    VmdkMetaData m_data;
     unsigned int l1_index, l2_offset, l2_index;
     int min_index, i, j;
     uint32_t min_count, *l2_table, tmp = 0;
     uint64_t cluster_offset;
 
-    if (m_data)
-        m_data->valid = 0;
-
     l1_index = (offset >> 9) / s->l1_entry_sectors;
     if (l1_index >= s->l1_size)
         return 0;
     l2_offset = s->l1_table[l1_index];
     if (!l2_offset)
         return 0;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
+    for(i = 0; i < s->l2_cache_entries; i++) {
         if (l2_offset == s->l2_cache_offsets[i]) {
             /* increment the hit count */
             if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
+                for(j = 0; j < s->l2_cache_entries; j++) {
                     s->l2_cache_counts[j] >>= 1;
                 }
             }
@@ -517,13 +558,14 @@ static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
     /* not found: load a new entry in the least used one */
     min_index = 0;
     min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
+    for(i = 0; i < s->l2_cache_entries; i++) {
         if (s->l2_cache_counts[i] < min_count) {
             min_count = s->l2_cache_counts[i];
             min_index = i;
         }
     }
     l2_table = s->l2_cache + (min_index * s->l2_size);
+    s->l2_cache_offsets[min_index] = 0;
     if (bdrv_pread(bs->file, (int64_t)l2_offset * 512, l2_table, s->l2_size * sizeof(uint32_t)) !=
                                                                         s->l2_size * sizeof(uint32_t))
         return 0;
@@ -544,123 +586,244 @@ static uint64_t get_cluster_offset(BlockDriverState *bs, VmdkMetaData *m_data,
 
         cluster_offset >>= 9;
         tmp = cpu_to_le32(cluster_offset);
-        l2_table[l2_index] = tmp;
 
         /* First of all we write grain itself, to avoid race condition
          * that may to corrupt the image.
          * This problem may occur because of insufficient space on host disk
          * or inappropriate VM shutdown.
          */
-        if (get_whole_cluster(bs, cluster_offset, offset, allocate) == -1)
+        if (get_whole_cluster(bs, cluster_offset, offset) == -1)
             return 0;
 
-        if (m_data) {
-            m_data->offset = tmp;
-            m_data->l1_index = l1_index;
-            m_data->l2_index = l2_index;
-            m_data->l2_offset = l2_offset;
-            m_data->valid = 1;
-        }
+        /*
+         * The grain now holds the old contents, so the L2 tables can be
+         * updated before the guest data is written.  Doing it here instead of
+         * when the write completes means that concurrent requests never see
+         * a grain that is allocated in the cache but not on disk.
+         */
+        m_data.offset = tmp;
+        m_data.l1_index = l1_index;
+        m_data.l2_index = l2_index;
+        m_data.l2_offset = l2_offset;
+        if (vmdk_L2update(bs, &m_data) == -1)
+            return 0;
+        l2_table[l2_index] = tmp;
     }
     cluster_offset <<= 9;
     return cluster_offset;
 }
 
-static int vmdk_is_allocated(BlockDriverState *bs, int64_t sector_num,
-                             int nb_sectors, int *pnum)
+/*
+ * Returns the offset of the grain that contains sector_num like
+ * get_cluster_offset() and stores in *pnum the number of sectors, at most
+ * nb_sectors, that are contiguous in the image file from there on.  For
+ * unallocated grains, *pnum covers the following unallocated grains instead.
+ */
+static uint64_t get_extent_offset(BlockDriverState *bs, int64_t sector_num,
+                                  int nb_sectors, int allocate, int *pnum)
 {
     BDRVVmdkState *s = bs->opaque;
+    uint64_t cluster_offset, next;
     int index_in_cluster, n;
-    uint64_t cluster_offset;
 
-    cluster_offset = get_cluster_offset(bs, NULL, sector_num << 9, 0);
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, allocate);
     index_in_cluster = sector_num % s->cluster_sectors;
     n = s->cluster_sectors - index_in_cluster;
-    if (n > nb_sectors)
-        n = nb_sectors;
-    *pnum = n;
-    return (cluster_offset != 0);
+
+    while (n < nb_sectors && (cluster_offset || !allocate)) {
+        next = get_cluster_offset(bs, (sector_num + n) << 9, allocate);
+        if (cluster_offset) {
+            if (next != cluster_offset + (index_in_cluster + n) * 512) {
+                break;
+            }
+        } else if (next) {
+            break;
+        }
+        n += s->cluster_sectors;
+    }
+
+    *pnum = MIN(n, nb_sectors);
+    return cluster_offset;
 }
 
-static int vmdk_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static int vmdk_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum)
 {
-    BDRVVmdkState *s = bs->opaque;
-    int index_in_cluster, n, ret;
-    uint64_t cluster_offset;
+    return get_extent_offset(bs, sector_num, nb_sectors, 0, pnum) != 0;
+}
 
-    while (nb_sectors > 0) {
-        cluster_offset = get_cluster_offset(bs, NULL, sector_num << 9, 0);
-        index_in_cluster = sector_num % s->cluster_sectors;
-        n = s->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors)
-            n = nb_sectors;
-        if (!cluster_offset) {
-            // try to read from parent image, if exist
-            if (bs->backing_hd) {
-                if (!vmdk_is_cid_valid(bs))
-                    return -1;
-                ret = bdrv_read(bs->backing_hd, sector_num, buf, n);
-                if (ret < 0)
-                    return -1;
-            } else {
-                memset(buf, 0, 512 * n);
-            }
-        } else {
-            if(bdrv_pread(bs->file, cluster_offset + index_in_cluster * 512, buf, n * 512) != n * 512)
-                return -1;
-        }
-        nb_sectors -= n;
-        sector_num += n;
-        buf += n * 512;
+static void vmdk_aio_cancel(BlockDriverAIOCB *blockacb)
+{
+    VmdkAIOCB *acb = container_of(blockacb, VmdkAIOCB, common);
+    bool finished = false;
+
+    /* Wait for the request to finish */
+    acb->finished = &finished;
+    while (!finished) {
+        qemu_aio_wait();
     }
-    return 0;
+
+    /* acb is back in the pool, don't leave a pointer to our stack in it */
+    acb->finished = NULL;
+}
+
+static AIOPool vmdk_aio_pool = {
+    .aiocb_size         = sizeof(VmdkAIOCB),
+    .cancel             = vmdk_aio_cancel,
+};
+
+static void vmdk_aio_complete_bh(void *opaque)
+{
+    VmdkAIOCB *acb = opaque;
+    BlockDriverCompletionFunc *cb = acb->common.cb;
+    void *user_opaque = acb->common.opaque;
+    int ret = acb->bh_ret;
+    bool *finished = acb->finished;
+
+    qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
+
+    cb(user_opaque, ret);
+
+    /* Signal cancel completion */
+    if (finished) {
+        *finished = true;
+    }
+}
+
+/*
+ * Completes the request from a bottom half, so that the callback is never
+ * invoked before bdrv_aio_readv/writev have returned.
+ */
+static void vmdk_aio_complete(VmdkAIOCB *acb, int ret)
+{
+    qemu_iovec_destroy(&acb->cur_qiov);
+
+    acb->bh_ret = ret;
+    acb->bh = qemu_bh_new(vmdk_aio_complete_bh, acb);
+    qemu_bh_schedule(acb->bh);
 }
 
-static int vmdk_write(BlockDriverState *bs, int64_t sector_num,
-                     const uint8_t *buf, int nb_sectors)
+/*
+ * Processes the next run of contiguous sectors of the request.  Only the
+ * grain table lookup and grain allocation are synchronous; the data is
+ * transferred with AIO so that several requests can be in flight at once.
+ */
+static void vmdk_aio_next(void *opaque, int ret)
 {
+    VmdkAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
     BDRVVmdkState *s = bs->opaque;
-    VmdkMetaData m_data;
-    int index_in_cluster, n;
     uint64_t cluster_offset;
-    static int cid_update = 0;
+    int64_t file_sector;
 
-    if (sector_num > bs->total_sectors) {
-        fprintf(stderr,
-                "(VMDK) Wrong offset: sector_num=0x%" PRIx64
-                " total_sectors=0x%" PRIx64 "\n",
-                sector_num, bs->total_sectors);
-        return -1;
+    acb->hd_aiocb = NULL;
+    if (ret < 0) {
+        goto done;
     }
 
-    while (nb_sectors > 0) {
-        index_in_cluster = sector_num & (s->cluster_sectors - 1);
-        n = s->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors)
-            n = nb_sectors;
-        cluster_offset = get_cluster_offset(bs, &m_data, sector_num << 9, 1);
-        if (!cluster_offset)
-            return -1;
+ next:
+    acb->sector_num += acb->n;
+    acb->nb_sectors -= acb->n;
+    acb->qiov_offset += acb->n * 512;
 
-        if (bdrv_pwrite(bs->file, cluster_offset + index_in_cluster * 512, buf, n * 512) != n * 512)
-            return -1;
-        if (m_data.valid) {
-            /* update L2 tables */
-            if (vmdk_L2update(bs, &m_data) == -1)
-                return -1;
+    if (acb->nb_sectors == 0) {
+        ret = 0;
+        goto done;
+    }
+
+    cluster_offset = get_extent_offset(bs, acb->sector_num, acb->nb_sectors,
+                                       acb->is_write, &acb->n);
+    file_sector = (cluster_offset >> 9) +
+                  acb->sector_num % s->cluster_sectors;
+
+    qemu_iovec_reset(&acb->cur_qiov);
+    qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset,
+                    acb->n * 512);
+
+    if (acb->is_write) {
+        if (!cluster_offset) {
+            ret = -EIO;
+            goto done;
         }
-        nb_sectors -= n;
-        sector_num += n;
-        buf += n * 512;
 
         // update CID on the first write every time the virtual disk is opened
-        if (!cid_update) {
+        if (!s->cid_updated) {
             vmdk_write_cid(bs, time(NULL));
-            cid_update++;
+            s->cid_updated = 1;
+        }
+
+        acb->hd_aiocb = bdrv_aio_writev(bs->file, file_sector, &acb->cur_qiov,
+                                        acb->n, vmdk_aio_next, acb);
+    } else if (cluster_offset) {
+        acb->hd_aiocb = bdrv_aio_readv(bs->file, file_sector, &acb->cur_qiov,
+                                       acb->n, vmdk_aio_next, acb);
+    } else if (bs->backing_hd) {
+        // try to read from parent image, if exist
+        if (!vmdk_is_cid_valid(bs)) {
+            ret = -EIO;
+            goto done;
         }
+        acb->hd_aiocb = bdrv_aio_readv(bs->backing_hd, acb->sector_num,
+                                       &acb->cur_qiov, acb->n,
+                                       vmdk_aio_next, acb);
+    } else {
+        qemu_iovec_memset(&acb->cur_qiov, 0, acb->cur_qiov.size);
+        goto next;
     }
-    return 0;
+
+    if (acb->hd_aiocb == NULL) {
+        ret = -EIO;
+        goto done;
+    }
+    return;
+
+done:
+    vmdk_aio_complete(acb, ret);
+}
+
+static BlockDriverAIOCB *vmdk_aio_setup(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    VmdkAIOCB *acb;
+
+    acb = qemu_aio_get(&vmdk_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->is_write = is_write;
+    acb->n = 0;
+    acb->qiov_offset = 0;
+    acb->hd_aiocb = NULL;
+    acb->bh = NULL;
+    acb->finished = NULL;
+    qemu_iovec_init(&acb->cur_qiov, qiov->niov);
+
+    vmdk_aio_next(acb, 0);
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *vmdk_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return vmdk_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
+
+static BlockDriverAIOCB *vmdk_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (sector_num > bs->total_sectors) {
+        fprintf(stderr,
+                "(VMDK) Wrong offset: sector_num=0x%" PRIx64
+                " total_sectors=0x%" PRIx64 "\n",
+                sector_num, bs->total_sectors);
+        return NULL;
+    }
+
+    return vmdk_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
 }
 
 static int vmdk_create(const char *filename, QEMUOptionParameter *options)
@@ -819,7 +982,10 @@ static void vmdk_close(BlockDriverState *bs)
     BDRVVmdkState *s = bs->opaque;
 
     qemu_free(s->l1_table);
+    qemu_free(s->l1_backup_table);
     qemu_free(s->l2_cache);
+    qemu_free(s->l2_cache_offsets);
+    qemu_free(s->l2_cache_counts);
 }
 
 static int vmdk_flush(BlockDriverState *bs)
@@ -827,6 +993,12 @@ static int vmdk_flush(BlockDriverState *bs)
     return bdrv_flush(bs->file);
 }
 
+static BlockDriverAIOCB *vmdk_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_aio_flush(bs->file, cb, opaque);
+}
+
 
 static QEMUOptionParameter vmdk_create_options[] = {
     {
@@ -852,13 +1024,17 @@ static BlockDriver bdrv_vmdk = {
     .instance_size	= sizeof(BDRVVmdkState),
     .bdrv_probe		= vmdk_probe,
     .bdrv_open      = vmdk_open,
-    .bdrv_read		= vmdk_read,
-    .bdrv_write		= vmdk_write,
     .bdrv_close		= vmdk_close,
     .bdrv_create	= vmdk_create,
     .bdrv_flush		= vmdk_flush,
     .bdrv_is_allocated	= vmdk_is_allocated,
 
+    .bdrv_aio_readv	= vmdk_aio_readv,
+    .bdrv_aio_writev	= vmdk_aio_writev,
+    .bdrv_aio_flush	= vmdk_aio_flush,
+
+    .bdrv_set_metadata_cache_size = vmdk_set_cache_size,
+
     .create_options = vmdk_create_options,
 };
 
@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
+#include "bitmap.h"
 
 /**************************************************************/
 
@@ -115,7 +116,7 @@ typedef struct BDRVVPCState {
     int max_table_entries;
     uint32_t *pagetable;
     uint64_t bat_offset;
-    uint64_t last_bitmap_offset;
+    unsigned long *bitmap_written;  /* blocks whose bitmap is all set */
 
     uint32_t block_size;
     uint32_t bitmap_size;
@@ -129,6 +130,21 @@ typedef struct BDRVVPCState {
 #endif
 } BDRVVPCState;
 
+typedef struct VpcAIOCB {
+    BlockDriverAIOCB common;
+    int64_t sector_num;
+    QEMUIOVector *qiov;
+    int nb_sectors;
+    int is_write;
+    int n;                      /* sectors handled by the current step */
+    size_t qiov_offset;         /* bytes of qiov completed so far */
+    QEMUIOVector cur_qiov;
+    BlockDriverAIOCB *hd_aiocb;
+    QEMUBH *bh;
+    int bh_ret;
+    bool *finished;             /* signal for cancel completion */
+} VpcAIOCB;
+
 static uint32_t vpc_checksum(uint8_t* buf, size_t size)
 {
     uint32_t res = 0;
@@ -211,7 +227,7 @@ static int vpc_open(BlockDriverState *bs, int flags)
         }
     }
 
-    s->last_bitmap_offset = (int64_t) -1;
+    s->bitmap_written = bitmap_new(s->max_table_entries);
 
 #ifdef CACHE
     s->pageentry_u8 = qemu_malloc(512);
@@ -251,15 +267,18 @@ static inline int64_t get_sector_offset(BlockDriverState *bs,
 
     // We must ensure that we don't write to any sectors which are marked as
     // unused in the bitmap. We get away with setting all bits in the block
-    // bitmap each time we write to a new block. This might cause Virtual PC to
-    // miss sparse read optimization, but it's not a problem in terms of
+    // bitmap the first time we write to a block. This might cause Virtual PC
+    // to miss sparse read optimization, but it's not a problem in terms of
     // correctness.
-    if (write && (s->last_bitmap_offset != bitmap_offset)) {
+    if (write && !test_bit(pagetable_index, s->bitmap_written)) {
         uint8_t bitmap[s->bitmap_size];
 
-        s->last_bitmap_offset = bitmap_offset;
         memset(bitmap, 0xff, s->bitmap_size);
-        bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap, s->bitmap_size);
+        if (bdrv_pwrite_sync(bs->file, bitmap_offset, bitmap,
+                             s->bitmap_size) < 0) {
+            return -1;
+        }
+        set_bit(pagetable_index, s->bitmap_written);
     }
 
 //    printf("sector: %" PRIx64 ", index: %x, offset: %x, bioff: %" PRIx64 ", bloff: %" PRIx64 "\n",
@@ -344,8 +363,13 @@ static int64_t alloc_block(BlockDriverState* bs, int64_t sector_num)
 
     // Initialize the block's bitmap
     memset(bitmap, 0xff, s->bitmap_size);
-    bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
+    ret = bdrv_pwrite_sync(bs->file, s->free_data_block_offset, bitmap,
         s->bitmap_size);
+    if (ret < 0) {
+        s->pagetable[index] = 0xFFFFFFFF;
+        return -1;
+    }
+    set_bit(index, s->bitmap_written);
 
     // Write new footer (the old one will be overwritten)
     s->free_data_block_offset += s->block_size + s->bitmap_size;
@@ -367,74 +391,159 @@ fail:
     return -1;
 }
 
-static int vpc_read(BlockDriverState *bs, int64_t sector_num,
-                    uint8_t *buf, int nb_sectors)
+static void vpc_aio_cancel(BlockDriverAIOCB *blockacb)
 {
-    BDRVVPCState *s = bs->opaque;
-    int ret;
-    int64_t offset;
-    int64_t sectors, sectors_per_block;
+    VpcAIOCB *acb = container_of(blockacb, VpcAIOCB, common);
+    bool finished = false;
 
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 0);
+    /* Wait for the request to finish */
+    acb->finished = &finished;
+    while (!finished) {
+        qemu_aio_wait();
+    }
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
-        sectors = sectors_per_block - (sector_num % sectors_per_block);
-        if (sectors > nb_sectors) {
-            sectors = nb_sectors;
-        }
+    /* acb is back in the pool, don't leave a pointer to our stack in it */
+    acb->finished = NULL;
+}
 
-        if (offset == -1) {
-            memset(buf, 0, sectors * BDRV_SECTOR_SIZE);
-        } else {
-            ret = bdrv_pread(bs->file, offset, buf,
-                sectors * BDRV_SECTOR_SIZE);
-            if (ret != sectors * BDRV_SECTOR_SIZE) {
-                return -1;
-            }
-        }
+static AIOPool vpc_aio_pool = {
+    .aiocb_size         = sizeof(VpcAIOCB),
+    .cancel             = vpc_aio_cancel,
+};
+
+static void vpc_aio_complete_bh(void *opaque)
+{
+    VpcAIOCB *acb = opaque;
+    BlockDriverCompletionFunc *cb = acb->common.cb;
+    void *user_opaque = acb->common.opaque;
+    int ret = acb->bh_ret;
+    bool *finished = acb->finished;
+
+    qemu_bh_delete(acb->bh);
+    qemu_aio_release(acb);
 
-        nb_sectors -= sectors;
-        sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+    cb(user_opaque, ret);
+
+    /* Signal cancel completion */
+    if (finished) {
+        *finished = true;
     }
-    return 0;
 }
 
-static int vpc_write(BlockDriverState *bs, int64_t sector_num,
-    const uint8_t *buf, int nb_sectors)
+/* Completes the request from a bottom half, never from within submission */
+static void vpc_aio_complete(VpcAIOCB *acb, int ret)
+{
+    qemu_iovec_destroy(&acb->cur_qiov);
+
+    acb->bh_ret = ret;
+    acb->bh = qemu_bh_new(vpc_aio_complete_bh, acb);
+    qemu_bh_schedule(acb->bh);
+}
+
+/*
+ * Processes the part of the request that falls into the next block.  The BAT
+ * is kept in memory, so only block allocation is synchronous; the data is
+ * transferred with AIO so that several requests can be in flight at once.
+ */
+static void vpc_aio_next(void *opaque, int ret)
 {
+    VpcAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
     BDRVVPCState *s = bs->opaque;
     int64_t offset;
-    int64_t sectors, sectors_per_block;
-    int ret;
+    int64_t sectors_per_block;
 
-    while (nb_sectors > 0) {
-        offset = get_sector_offset(bs, sector_num, 1);
+    acb->hd_aiocb = NULL;
+    if (ret < 0) {
+        goto done;
+    }
 
-        sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
-        sectors = sectors_per_block - (sector_num % sectors_per_block);
-        if (sectors > nb_sectors) {
-            sectors = nb_sectors;
-        }
+ next:
+    acb->sector_num += acb->n;
+    acb->nb_sectors -= acb->n;
+    acb->qiov_offset += acb->n * BDRV_SECTOR_SIZE;
 
-        if (offset == -1) {
-            offset = alloc_block(bs, sector_num);
-            if (offset < 0)
-                return -1;
-        }
+    if (acb->nb_sectors == 0) {
+        ret = 0;
+        goto done;
+    }
 
-        ret = bdrv_pwrite(bs->file, offset, buf, sectors * BDRV_SECTOR_SIZE);
-        if (ret != sectors * BDRV_SECTOR_SIZE) {
-            return -1;
+    offset = get_sector_offset(bs, acb->sector_num, acb->is_write);
+
+    sectors_per_block = s->block_size >> BDRV_SECTOR_BITS;
+    acb->n = sectors_per_block - (acb->sector_num % sectors_per_block);
+    if (acb->n > acb->nb_sectors) {
+        acb->n = acb->nb_sectors;
+    }
+
+    qemu_iovec_reset(&acb->cur_qiov);
+    qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset,
+                    acb->n * BDRV_SECTOR_SIZE);
+
+    if (acb->is_write) {
+        if (offset == -1) {
+            offset = alloc_block(bs, acb->sector_num);
+            if (offset < 0) {
+                ret = -EIO;
+                goto done;
+            }
         }
+        acb->hd_aiocb = bdrv_aio_writev(bs->file, offset >> BDRV_SECTOR_BITS,
+                                        &acb->cur_qiov, acb->n,
+                                        vpc_aio_next, acb);
+    } else if (offset != -1) {
+        acb->hd_aiocb = bdrv_aio_readv(bs->file, offset >> BDRV_SECTOR_BITS,
+                                       &acb->cur_qiov, acb->n,
+                                       vpc_aio_next, acb);
+    } else {
+        qemu_iovec_memset(&acb->cur_qiov, 0, acb->cur_qiov.size);
+        goto next;
+    }
 
-        nb_sectors -= sectors;
-        sector_num += sectors;
-        buf += sectors * BDRV_SECTOR_SIZE;
+    if (acb->hd_aiocb == NULL) {
+        ret = -EIO;
+        goto done;
     }
+    return;
 
-    return 0;
+done:
+    vpc_aio_complete(acb, ret);
+}
+
+static BlockDriverAIOCB *vpc_aio_setup(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    VpcAIOCB *acb;
+
+    acb = qemu_aio_get(&vpc_aio_pool, bs, cb, opaque);
+    acb->sector_num = sector_num;
+    acb->qiov = qiov;
+    acb->nb_sectors = nb_sectors;
+    acb->is_write = is_write;
+    acb->n = 0;
+    acb->qiov_offset = 0;
+    acb->hd_aiocb = NULL;
+    acb->bh = NULL;
+    acb->finished = NULL;
+    qemu_iovec_init(&acb->cur_qiov, qiov->niov);
+
+    vpc_aio_next(acb, 0);
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *vpc_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return vpc_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
+}
+
+static BlockDriverAIOCB *vpc_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return vpc_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
 }
 
 static int vpc_flush(BlockDriverState *bs)
@@ -442,6 +551,12 @@ static int vpc_flush(BlockDriverState *bs)
     return bdrv_flush(bs->file);
 }
 
+static BlockDriverAIOCB *vpc_aio_flush(BlockDriverState *bs,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return bdrv_aio_flush(bs->file, cb, opaque);
+}
+
 /*
  * Calculates the number of cylinders, heads and sectors per cylinder
  * based on a given number of sectors. This is the algorithm described
@@ -614,6 +729,7 @@ static void vpc_close(BlockDriverState *bs)
 {
     BDRVVPCState *s = bs->opaque;
     qemu_free(s->pagetable);
+    qemu_free(s->bitmap_written);
 #ifdef CACHE
     qemu_free(s->pageentry_u8);
 #endif
@@ -633,12 +749,14 @@ static BlockDriver bdrv_vpc = {
     .instance_size  = sizeof(BDRVVPCState),
     .bdrv_probe     = vpc_probe,
     .bdrv_open      = vpc_open,
-    .bdrv_read      = vpc_read,
-    .bdrv_write     = vpc_write,
     .bdrv_flush     = vpc_flush,
     .bdrv_close     = vpc_close,
     .bdrv_create    = vpc_create,
 
+    .bdrv_aio_readv = vpc_aio_readv,
+    .bdrv_aio_writev = vpc_aio_writev,
+    .bdrv_aio_flush = vpc_aio_flush,
+
     .create_options = vpc_create_options,
 };
 
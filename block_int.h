@@ -31,6 +31,18 @@
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
 
+#define BDRV_ACCT_READ          0
+#define BDRV_ACCT_WRITE         1
+#define BDRV_ACCT_FLUSH         2
+#define BDRV_MAX_ACCT_TYPE      3
+
+/*
+ * Request latencies are counted in log2 buckets of microseconds: bucket 0
+ * is below 1 us, bucket i covers [2^(i-1), 2^i) us and the last bucket
+ * everything from about 4 s up.
+ */
+#define BDRV_LATENCY_BUCKETS    24
+
 #define BLOCK_OPT_SIZE          "size"
 #define BLOCK_OPT_ENCRYPT       "encryption"
 #define BLOCK_OPT_COMPAT6       "compat6"
@@ -40,6 +52,34 @@
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
 
+typedef struct BlockThrottledAIOCB BlockThrottledAIOCB;
+typedef struct BdrvTrackedRequest BdrvTrackedRequest;
+typedef struct BlockJob BlockJob;
+
+/*
+ * Requests that are tracked while copy-on-read or a block job needs it.
+ * Serialising requests (copies of existing data) and writes that overlap
+ * wait for each other; writes among themselves don't.
+ */
+struct BdrvTrackedRequest {
+    int64_t sector_num;
+    int nb_sectors;
+    int serialising;
+    void (*resume)(BdrvTrackedRequest *req);
+    QLIST_ENTRY(BdrvTrackedRequest) list;
+    QTAILQ_ENTRY(BdrvTrackedRequest) wait_list;
+};
+
+typedef struct BdrvDirtyBitmap {
+    char *name;
+    int granularity;            /* bytes covered by one bit */
+    int nb_bits;
+    unsigned long *bitmap;
+    int64_t count;              /* number of set bits */
+    int busy;                   /* in use by a block job */
+    QLIST_ENTRY(BdrvDirtyBitmap) list;
+} BdrvDirtyBitmap;
+
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
@@ -75,18 +115,42 @@ struct BlockDriver {
         BlockDriverCompletionFunc *cb, void *opaque);
     int (*bdrv_discard)(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors);
+    /*
+     * Writes zeroes without allocating space where the format allows it.
+     * qiov contains the zeroes, so the driver can fall back to a normal write
+     * for parts of the request that it can't represent in its metadata.
+     */
+    BlockDriverAIOCB *(*bdrv_aio_write_zeroes)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
 
     int (*bdrv_aio_multiwrite)(BlockDriverState *bs, BlockRequest *reqs,
         int num_reqs);
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
+    /* io queue for linux-aio */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+    void (*bdrv_set_aio_poll)(BlockDriverState *bs, int64_t poll_ns);
+    int (*bdrv_set_metadata_cache_size)(BlockDriverState *bs, int64_t size);
+
 
     const char *protocol_name;
     int (*bdrv_truncate)(BlockDriverState *bs, int64_t offset);
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * bdrv_write_compressed split in two: bdrv_compress_cluster must not
+     * touch any mutable state because it may run in another thread.
+     */
+    int (*bdrv_compress_cluster)(BlockDriverState *bs, uint8_t *out_buf,
+                                 const uint8_t *buf);
+    int (*bdrv_write_compressed_cluster)(BlockDriverState *bs,
+                                         int64_t sector_num,
+                                         const uint8_t *buf, int nb_sectors,
+                                         const uint8_t *out_buf, int out_len);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -181,6 +245,52 @@ struct BlockDriverState {
     uint64_t rd_ops;
     uint64_t wr_ops;
     uint64_t wr_highest_sector;
+    uint64_t flush_ops;
+    uint64_t rd_merged;             /* requests folded into another one */
+    uint64_t wr_merged;
+
+    /* Latency and queue depth stats, see bdrv_acct_start() */
+    uint64_t latency[BDRV_MAX_ACCT_TYPE][BDRV_LATENCY_BUCKETS];
+    uint64_t total_time_ns[BDRV_MAX_ACCT_TYPE];
+    int in_flight;                  /* requests submitted and not completed */
+    int max_in_flight;
+    uint64_t queue_depth_sum;       /* in_flight seen by each new request */
+    uint64_t queue_depth_samples;
+
+    /* I/O throttling */
+    BlockIOLimit io_limits;
+    int io_limits_enabled;
+    QEMUTimer *io_limits_timer;
+    int64_t io_limits_timestamp;    /* last time the buckets were drained */
+    double io_level_bytes[3];       /* fill level of the byte buckets */
+    double io_level_ops[3];         /* fill level of the operation buckets */
+    QTAILQ_HEAD(, BlockThrottledAIOCB) throttled_reqs[2];
+
+    /*
+     * Copy-on-read: number of users that want data read from the backing
+     * file to be written into this image.  While enabled, writes and copy
+     * operations are tracked so that they don't race.
+     */
+    int copy_on_read;
+    /*
+     * Cluster size for copy-on-read, and the clusters known to be allocated
+     * in this image, which reads can take without copying.  Both are set up
+     * when copy-on-read is enabled so that reads need no metadata lookups.
+     */
+    int cor_cluster_sectors;
+    int64_t cor_nb_clusters;
+    unsigned long *cor_allocated;
+    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    QTAILQ_HEAD(, BdrvTrackedRequest) waiting_requests;
+
+    /* background operation running on this device, e.g. image streaming */
+    BlockJob *job;
+
+    /* named dirty bitmaps, kept in a file next to the image */
+    QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
+
+    /* image identity in the shared read cache, see bdrv_shared_cache_attach */
+    struct BdrvSharedImage *shared_image;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -205,6 +315,7 @@ struct BlockDriverState {
 
 #define CHANGE_MEDIA	0x01
 #define CHANGE_SIZE	0x02
+#define CHANGE_USERS	0x04    /* in_use or I/O limits changed */
 
 struct BlockDriverAIOCB {
     AIOPool *pool;
@@ -226,6 +337,69 @@ void *qemu_blockalign(BlockDriverState *bs, size_t size);
 int is_windows_drive(const char *filename);
 #endif
 
+/*
+ * Block jobs are long-running background operations on a device, such as
+ * image streaming.  Only one job can run on a device at a time, and the device
+ * is marked in use until the job completes.
+ */
+typedef struct BlockJobType {
+    /* derived job struct size */
+    size_t instance_size;
+
+    /* job type name as reported to the user */
+    const char *job_type;
+
+    /* optional, set the rate limit in bytes per second */
+    int (*set_speed)(BlockJob *job, int64_t value);
+
+    /*
+     * optional, called before a write to the device is started.  Writes are
+     * tracked while the job runs, so the job can make the write wait by
+     * starting serialising requests for the range.
+     */
+    void (*before_write)(BlockJob *job, int64_t sector_num, int nb_sectors);
+} BlockJobType;
+
+struct BlockJob {
+    const BlockJobType *job_type;
+    BlockDriverState *bs;
+    int cancelled;
+
+    /* progress, in bytes */
+    int64_t offset;
+    int64_t len;
+
+    /* rate limit in bytes per second, 0 for unlimited */
+    int64_t speed;
+
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+};
+
+void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
+                       BlockDriverCompletionFunc *cb, void *opaque);
+void block_job_complete(BlockJob *job, int ret);
+int block_job_set_speed(BlockJob *job, int64_t value);
+void block_job_cancel(BlockJob *job);
+int block_job_is_cancelled(BlockJob *job);
+
+int stream_start(BlockDriverState *bs, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+int mirror_start(BlockDriverState *bs, BlockDriverState *target,
+                 int64_t speed, BlockDriverCompletionFunc *cb, void *opaque);
+int backup_start(BlockDriverState *bs, BlockDriverState *target,
+                 BdrvDirtyBitmap *bitmap, int64_t speed,
+                 BlockDriverCompletionFunc *cb, void *opaque);
+
+int bdrv_tracked_request_begin(BlockDriverState *bs, BdrvTrackedRequest *req);
+void bdrv_tracked_request_end(BlockDriverState *bs, BdrvTrackedRequest *req);
+
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs,
+                                        const char *name);
+int bdrv_add_dirty_bitmap(BlockDriverState *bs, const char *name,
+                          int granularity);
+int bdrv_remove_dirty_bitmap(BlockDriverState *bs, const char *name);
+
 typedef struct BlockConf {
     BlockDriverState *bs;
     uint16_t physical_block_size;
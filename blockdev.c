@@ -11,6 +11,7 @@
 #include "blockdev.h"
 #include "monitor.h"
 #include "qerror.h"
+#include "qemu-objects.h"
 #include "qemu-option.h"
 #include "qemu-config.h"
 #include "sysemu.h"
@@ -217,6 +218,36 @@ static int parse_block_error_action(const char *buf, int is_read)
     }
 }
 
+static int check_io_limits(BlockIOLimit *io_limits)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (io_limits->bps[i] < 0 || io_limits->iops[i] < 0) {
+            return 0;
+        }
+    }
+
+    if (io_limits->bps_burst < 0 || io_limits->iops_burst < 0) {
+        return 0;
+    }
+
+    /* A total limit excludes separate read/write limits of the same kind */
+    if (io_limits->bps[BLOCK_IO_LIMIT_TOTAL]
+        && (io_limits->bps[BLOCK_IO_LIMIT_READ]
+            || io_limits->bps[BLOCK_IO_LIMIT_WRITE])) {
+        return 0;
+    }
+
+    if (io_limits->iops[BLOCK_IO_LIMIT_TOTAL]
+        && (io_limits->iops[BLOCK_IO_LIMIT_READ]
+            || io_limits->iops[BLOCK_IO_LIMIT_WRITE])) {
+        return 0;
+    }
+
+    return 1;
+}
+
 DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 {
     const char *buf;
@@ -237,6 +268,12 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
+    int copy_on_read;
+    int detect_zeroes;
+    int shared_cache;
+    int64_t aio_poll = 0;
+    int64_t metadata_cache_size;
+    BlockIOLimit io_limits;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -261,6 +298,10 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
 
     snapshot = qemu_opt_get_bool(opts, "snapshot", 0);
     ro = qemu_opt_get_bool(opts, "readonly", 0);
+    copy_on_read = qemu_opt_get_bool(opts, "copy-on-read", 0);
+    detect_zeroes = qemu_opt_get_bool(opts, "detect-zeroes", 0);
+    shared_cache = qemu_opt_get_bool(opts, "shared-cache", 0);
+    metadata_cache_size = qemu_opt_get_size(opts, "metadata-cache-size", 0);
 
     file = qemu_opt_get(opts, "file");
     serial = qemu_opt_get(opts, "serial");
@@ -351,8 +392,32 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
            return NULL;
         }
     }
+
+    aio_poll = qemu_opt_get_number(opts, "aio_poll", 0);
+    if (aio_poll && !(bdrv_flags & BDRV_O_NATIVE_AIO)) {
+        error_report("aio_poll requires aio=native");
+        return NULL;
+    }
 #endif
 
+    memset(&io_limits, 0, sizeof(io_limits));
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "bps", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = qemu_opt_get_number(opts, "bps_rd", 0);
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qemu_opt_get_number(opts, "bps_wr", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qemu_opt_get_number(opts, "iops", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_READ] =
+        qemu_opt_get_number(opts, "iops_rd", 0);
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] =
+        qemu_opt_get_number(opts, "iops_wr", 0);
+    io_limits.bps_burst = qemu_opt_get_number(opts, "bps_burst", 0);
+    io_limits.iops_burst = qemu_opt_get_number(opts, "iops_burst", 0);
+
+    if (!check_io_limits(&io_limits)) {
+        error_report("bps and iops values cannot be combined with their "
+                     "bps_rd/bps_wr and iops_rd/iops_wr counterparts");
+        return NULL;
+    }
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
        if (strcmp(buf, "?") == 0) {
            error_printf("Supported formats:");
@@ -521,6 +586,18 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         bdrv_flags |= (BDRV_O_SNAPSHOT|BDRV_O_CACHE_WB|BDRV_O_NO_FLUSH);
     }
 
+    if (copy_on_read) {
+        bdrv_flags |= BDRV_O_COPY_ON_READ;
+    }
+
+    if (detect_zeroes) {
+        bdrv_flags |= BDRV_O_DETECT_ZEROES;
+    }
+
+    if (shared_cache) {
+        bdrv_flags |= BDRV_O_SHARED_CACHE;
+    }
+
     if (media == MEDIA_CDROM) {
         /* CDROM is fine for any interface, don't check.  */
         ro = 1;
@@ -540,6 +617,21 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         goto err;
     }
 
+    if (aio_poll) {
+        bdrv_set_aio_poll(dinfo->bdrv, aio_poll * 1000);
+    }
+
+    if (metadata_cache_size) {
+        ret = bdrv_set_metadata_cache_size(dinfo->bdrv, metadata_cache_size);
+        if (ret < 0) {
+            error_report("could not set metadata cache size of %s: %s",
+                         file, strerror(-ret));
+            goto err;
+        }
+    }
+
+    bdrv_set_io_limits(dinfo->bdrv, &io_limits);
+
     if (bdrv_key_required(dinfo->bdrv))
         autostart = 0;
     return dinfo;
@@ -593,6 +685,12 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        ret = -1;
+        goto out;
+    }
+
     pstrcpy(old_filename, sizeof(old_filename), bs->filename);
 
     old_drv = bs->drv;
@@ -650,6 +748,10 @@ out:
 
 static int eject_device(Monitor *mon, BlockDriverState *bs, int force)
 {
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, bdrv_get_device_name(bs));
+        return -1;
+    }
     if (!force) {
         if (!bdrv_is_removable(bs)) {
             qerror_report(QERR_DEVICE_NOT_REMOVABLE,
@@ -797,3 +899,401 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+int do_block_set_io_throttle(Monitor *mon,
+                             const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockIOLimit io_limits;
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    memset(&io_limits, 0, sizeof(io_limits));
+    io_limits.bps[BLOCK_IO_LIMIT_TOTAL] = qdict_get_int(qdict, "bps");
+    io_limits.bps[BLOCK_IO_LIMIT_READ] = qdict_get_int(qdict, "bps_rd");
+    io_limits.bps[BLOCK_IO_LIMIT_WRITE] = qdict_get_int(qdict, "bps_wr");
+    io_limits.iops[BLOCK_IO_LIMIT_TOTAL] = qdict_get_int(qdict, "iops");
+    io_limits.iops[BLOCK_IO_LIMIT_READ] = qdict_get_int(qdict, "iops_rd");
+    io_limits.iops[BLOCK_IO_LIMIT_WRITE] = qdict_get_int(qdict, "iops_wr");
+    io_limits.bps_burst = qdict_get_try_int(qdict, "bps_burst", 0);
+    io_limits.iops_burst = qdict_get_try_int(qdict, "iops_burst", 0);
+
+    if (!check_io_limits(&io_limits)) {
+        qerror_report(QERR_INVALID_PARAMETER_COMBINATION);
+        return -1;
+    }
+
+    bdrv_set_io_limits(bs, &io_limits);
+
+    return 0;
+}
+
+static QObject *qobject_from_block_job(BlockJob *job)
+{
+    return qobject_from_jsonf("{ 'type': %s,"
+                              "'device': %s,"
+                              "'len': %" PRId64 ","
+                              "'offset': %" PRId64 ","
+                              "'speed': %" PRId64 " }",
+                              job->job_type->job_type,
+                              bdrv_get_device_name(job->bs),
+                              job->len,
+                              job->offset,
+                              job->speed);
+}
+
+static void block_job_cb(void *opaque, int ret)
+{
+    BlockDriverState *bs = opaque;
+    QObject *obj;
+
+    obj = qobject_from_block_job(bs->job);
+    if (ret < 0) {
+        QDict *dict = qobject_to_qdict(obj);
+        qdict_put(dict, "error", qstring_from_str(strerror(-ret)));
+    }
+
+    if (block_job_is_cancelled(bs->job)) {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_CANCELLED, obj);
+    } else {
+        monitor_protocol_event(QEVENT_BLOCK_JOB_COMPLETED, obj);
+    }
+    qobject_decref(obj);
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    ret = stream_start(bs, speed, block_job_cb, bs);
+    switch (ret) {
+    case 0:
+        return 0;
+    case -EBUSY:
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    case -EACCES:
+        qerror_report(QERR_DEVICE_IS_READ_ONLY, device);
+        return -1;
+    case -EINVAL:
+        qerror_report(QERR_INVALID_PARAMETER, "speed");
+        return -1;
+    default:
+        qerror_report(QERR_UNDEFINED_ERROR);
+        return -1;
+    }
+}
+
+int do_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *target = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs, *target_bs;
+    BlockDriver *drv;
+    int flags;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    if (!format) {
+        format = bs->drv->format_name;
+    }
+    drv = bdrv_find_whitelisted_format(format);
+    if (!drv) {
+        qerror_report(QERR_INVALID_BLOCK_FORMAT, format);
+        return -1;
+    }
+
+    /* The target is a complete copy, it doesn't need the backing file */
+    flags = bs->open_flags | BDRV_O_RDWR;
+    flags &= ~(BDRV_O_SNAPSHOT | BDRV_O_COPY_ON_READ);
+    ret = bdrv_img_create(target, format, NULL, NULL, NULL,
+                          bdrv_getlength(bs), flags);
+    if (ret) {
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    ret = mirror_start(bs, target_bs, speed, block_job_cb, bs);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        if (ret == -EINVAL) {
+            qerror_report(QERR_INVALID_PARAMETER, "speed");
+        } else {
+            qerror_report(QERR_DEVICE_IN_USE, device);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int do_block_dirty_bitmap_add(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *name = qdict_get_str(qdict, "name");
+    int granularity = qdict_get_try_int(qdict, "granularity", 0);
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    switch (bdrv_add_dirty_bitmap(bs, name, granularity)) {
+    case 0:
+        return 0;
+    case -EACCES:
+        qerror_report(QERR_DEVICE_IS_READ_ONLY, device);
+        break;
+    case -ENOTSUP:
+        qerror_report(QERR_NOT_SUPPORTED);
+        break;
+    case -EEXIST:
+        qerror_report(QERR_DUPLICATE_ID, name, "dirty bitmap");
+        break;
+    case -EINVAL:
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "granularity",
+                      "a power of two of at least 512");
+        break;
+    default:
+        qerror_report(QERR_UNDEFINED_ERROR);
+        break;
+    }
+    return -1;
+}
+
+int do_block_dirty_bitmap_remove(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *name = qdict_get_str(qdict, "name");
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+
+    switch (bdrv_remove_dirty_bitmap(bs, name)) {
+    case 0:
+        return 0;
+    case -ENOENT:
+        qerror_report(QERR_DIRTY_BITMAP_NOT_FOUND, device, name);
+        break;
+    case -EBUSY:
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        break;
+    default:
+        qerror_report(QERR_UNDEFINED_ERROR);
+        break;
+    }
+    return -1;
+}
+
+int do_block_dirty_bitmap_export(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *name = qdict_get_str(qdict, "name");
+    const char *target = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int64_t speed = qdict_get_try_int(qdict, "speed", 0);
+    BlockDriverState *bs, *target_bs;
+    BdrvDirtyBitmap *bitmap;
+    BlockDriver *drv;
+    int flags;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bdrv_is_inserted(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (!bitmap) {
+        qerror_report(QERR_DIRTY_BITMAP_NOT_FOUND, device, name);
+        return -1;
+    }
+    if (bdrv_in_use(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    /* Only the changed clusters are written, the rest stays unallocated */
+    if (!format) {
+        format = "qcow2";
+    }
+    drv = bdrv_find_whitelisted_format(format);
+    if (!drv) {
+        qerror_report(QERR_INVALID_BLOCK_FORMAT, format);
+        return -1;
+    }
+
+    flags = bs->open_flags | BDRV_O_RDWR;
+    flags &= ~(BDRV_O_SNAPSHOT | BDRV_O_COPY_ON_READ);
+    ret = bdrv_img_create(target, format, NULL, NULL, NULL,
+                          bdrv_getlength(bs), flags);
+    if (ret) {
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    target_bs = bdrv_new("");
+    ret = bdrv_open(target_bs, target, flags, drv);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        qerror_report(QERR_OPEN_FILE_FAILED, target);
+        return -1;
+    }
+
+    ret = backup_start(bs, target_bs, bitmap, speed, block_job_cb, bs);
+    if (ret < 0) {
+        bdrv_delete(target_bs);
+        if (ret == -EINVAL) {
+            qerror_report(QERR_INVALID_PARAMETER, "speed");
+        } else {
+            qerror_report(QERR_DEVICE_IN_USE, device);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+static BlockJob *find_block_job(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs || !bs->job) {
+        qerror_report(QERR_BLOCK_JOB_NOT_ACTIVE, device);
+        return NULL;
+    }
+    return bs->job;
+}
+
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    int64_t value = qdict_get_int(qdict, "value");
+    BlockJob *job;
+
+    job = find_block_job(device);
+    if (!job) {
+        return -1;
+    }
+
+    switch (block_job_set_speed(job, value)) {
+    case 0:
+        return 0;
+    case -ENOTSUP:
+        qerror_report(QERR_NOT_SUPPORTED);
+        return -1;
+    default:
+        qerror_report(QERR_INVALID_PARAMETER, "value");
+        return -1;
+    }
+}
+
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockJob *job;
+
+    job = find_block_job(device);
+    if (!job) {
+        return -1;
+    }
+
+    block_job_cancel(job);
+    return 0;
+}
+
+static void block_job_print_iter(QObject *obj, void *opaque)
+{
+    Monitor *mon = opaque;
+    QDict *dict = qobject_to_qdict(obj);
+
+    monitor_printf(mon, "Type %s, device %s: Completed %" PRId64
+                        " of %" PRId64 " bytes, speed limit %" PRId64
+                        " bytes/s\n",
+                        qdict_get_str(dict, "type"),
+                        qdict_get_str(dict, "device"),
+                        qdict_get_int(dict, "offset"),
+                        qdict_get_int(dict, "len"),
+                        qdict_get_int(dict, "speed"));
+}
+
+void do_info_block_jobs_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active jobs\n");
+        return;
+    }
+    qlist_iter(list, block_job_print_iter, mon);
+}
+
+void do_info_block_jobs(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    BlockDriverState *bs;
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        if (bs->job) {
+            qlist_append_obj(list, qobject_from_block_job(bs->job));
+        }
+    }
+
+    *ret_data = QOBJECT(list);
+}
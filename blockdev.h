@@ -65,5 +65,20 @@ int do_change_block(Monitor *mon, const char *device,
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_set_io_throttle(Monitor *mon,
+                             const QDict *qdict, QObject **ret_data);
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_drive_mirror(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_dirty_bitmap_add(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+int do_block_dirty_bitmap_remove(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data);
+int do_block_dirty_bitmap_export(Monitor *mon, const QDict *qdict,
+                                 QObject **ret_data);
+int do_block_job_set_speed(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data);
+int do_block_job_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data);
+void do_info_block_jobs_print(Monitor *mon, const QObject *data);
+void do_info_block_jobs(Monitor *mon, QObject **ret_data);
 
 #endif
@@ -25,6 +25,10 @@
 #include "host-utils.h"
 #include <math.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
     int c;
@@ -298,6 +302,82 @@ void qemu_iovec_memset_skip(QEMUIOVector *qiov, int c, size_t count,
     }
 }
 
+/*
+ * Checks whether all bytes in buf are zero.  This is on the hot path of
+ * sparse image conversion and of zero write detection, so the bulk of the
+ * buffer is checked with vector instructions where available.
+ */
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const unsigned long *l;
+
+    /* Check the first bytes one by one until p is aligned */
+    while (len && ((uintptr_t)p & 15)) {
+        if (*p) {
+            return false;
+        }
+        p++;
+        len--;
+    }
+
+#ifdef __SSE2__
+    {
+        const __m128i *v = (const __m128i *)p;
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc;
+
+        for (; len >= 64; len -= 64, v += 4) {
+            acc = _mm_or_si128(_mm_or_si128(v[0], v[1]),
+                               _mm_or_si128(v[2], v[3]));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+                return false;
+            }
+        }
+        p = (const unsigned char *)v;
+    }
+#endif
+
+    /*
+     * Use long as the biggest available internal data type that fits into the
+     * CPU register and unroll the loop to smooth out the effect of memory
+     * latency.
+     */
+    l = (const unsigned long *)p;
+    for (; len >= 4 * sizeof(long); len -= 4 * sizeof(long), l += 4) {
+        if (l[0] | l[1] | l[2] | l[3]) {
+            return false;
+        }
+    }
+
+    p = (const unsigned char *)l;
+    while (len--) {
+        if (*p++) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Checks whether the first count bytes of qiov are all zero.
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov, size_t count)
+{
+    size_t n;
+    int i;
+
+    for (i = 0; i < qiov->niov && count; i++) {
+        n = MIN(count, qiov->iov[i].iov_len);
+        if (!buffer_is_zero(qiov->iov[i].iov_base, n)) {
+            return false;
+        }
+        count -= n;
+    }
+    return true;
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -4054,6 +4054,28 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
     return ret;
 }
 
+/* Marks RAM that was written through a pointer obtained from
+ * cpu_physical_memory_map() as dirty, without unmapping it.
+ */
+void cpu_physical_memory_mark_written(ram_addr_t addr, ram_addr_t len)
+{
+    while (len) {
+        ram_addr_t l;
+        l = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+        if (l > len)
+            l = len;
+        if (!cpu_physical_memory_is_dirty(addr)) {
+            /* invalidate code */
+            tb_invalidate_phys_page_range(addr, addr + l, 0);
+            /* set dirty bit */
+            cpu_physical_memory_set_dirty_flags(
+                addr, (0xff & ~CODE_DIRTY_FLAG));
+        }
+        addr += l;
+        len -= l;
+    }
+}
+
 /* Unmaps a memory region previously mapped by cpu_physical_memory_map().
  * Will also mark the memory as dirty if is_write == 1.  access_len gives
  * the amount of memory that was actually read or written by the caller.
@@ -4063,22 +4085,8 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
 {
     if (buffer != bounce.buffer) {
         if (is_write) {
-            ram_addr_t addr1 = qemu_ram_addr_from_host_nofail(buffer);
-            while (access_len) {
-                unsigned l;
-                l = TARGET_PAGE_SIZE;
-                if (l > access_len)
-                    l = access_len;
-                if (!cpu_physical_memory_is_dirty(addr1)) {
-                    /* invalidate code */
-                    tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
-                    /* set dirty bit */
-                    cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
-                }
-                addr1 += l;
-                access_len -= l;
-            }
+            cpu_physical_memory_mark_written(
+                qemu_ram_addr_from_host_nofail(buffer), access_len);
         }
         if (xen_mapcache_enabled()) {
             uint8_t *buffer1 = buffer;
@@ -70,6 +70,150 @@ but should be used with extreme caution.  Note that this command only
 resizes image files, it can not resize block devices like LVM volumes.
 ETEXI
 
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_burst:l?,iops_burst:l?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr [bps_burst] [iops_burst]",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+STEXI
+@item block_set_io_throttle @var{device} @var{bps} @var{bps_rd} @var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr} [@var{bps_burst}] [@var{iops_burst}]
+@findex block_set_io_throttle
+Change I/O throttle limits for a block drive to @var{bps} @var{bps_rd}
+@var{bps_wr} @var{iops} @var{iops_rd} @var{iops_wr}, with optional burst
+sizes.  A value of 0 means no limit; setting all limits to 0 disables
+throttling.
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy data from the backing file chain into @var{device} while the guest is
+running, optionally limited to @var{speed} bytes per second.  Reads done by
+the guest meanwhile also populate the image.  When all data has been copied,
+the backing file is removed from the image.
+ETEXI
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "device:B,target:s,format:s?,speed:o?",
+        .params     = "device target [format] [speed]",
+        .help       = "copy a running block device to a new image and switch to it",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+STEXI
+@item drive_mirror @var{device} @var{target} [@var{format}] [@var{speed}]
+@findex drive_mirror
+Copy the contents of @var{device}, including data from its backing files,
+to a new image @var{target} while the guest is running.  Guest writes done
+meanwhile are tracked and copied again.  Once the target is in sync, the
+device switches over to it and the original image is no longer used.
+@var{format} defaults to the format of the current image, and the copy can be
+limited to @var{speed} bytes per second.
+ETEXI
+
+    {
+        .name       = "block_dirty_bitmap_add",
+        .args_type  = "device:B,name:s,granularity:i?",
+        .params     = "device name [granularity]",
+        .help       = "start recording writes to a block device in a named bitmap",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_add,
+    },
+
+STEXI
+@item block_dirty_bitmap_add @var{device} @var{name} [@var{granularity}]
+@findex block_dirty_bitmap_add
+Create a dirty bitmap @var{name} that records which parts of @var{device}
+are written from now on, in units of @var{granularity} bytes (by default the
+cluster size of the image).  Bitmaps are saved in @file{@var{image}.bitmaps}
+next to the image and survive restarts; this is only possible for images in
+local files.
+ETEXI
+
+    {
+        .name       = "block_dirty_bitmap_remove",
+        .args_type  = "device:B,name:s",
+        .params     = "device name",
+        .help       = "remove a dirty bitmap",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_remove,
+    },
+
+STEXI
+@item block_dirty_bitmap_remove @var{device} @var{name}
+@findex block_dirty_bitmap_remove
+Stop recording writes in the dirty bitmap @var{name} and delete it.
+ETEXI
+
+    {
+        .name       = "block_dirty_bitmap_export",
+        .args_type  = "device:B,name:s,target:s,format:s?,speed:o?",
+        .params     = "device name target [format] [speed]",
+        .help       = "copy the clusters recorded in a dirty bitmap to a new image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_export,
+    },
+
+STEXI
+@item block_dirty_bitmap_export @var{device} @var{name} @var{target} [@var{format}] [@var{speed}]
+@findex block_dirty_bitmap_export
+Copy the clusters of @var{device} that are marked in the dirty bitmap
+@var{name} to a new image @var{target} while the guest is running, for an
+incremental backup.  The target holds the contents of the clusters at the
+time the command was issued, all other clusters are left unallocated.  The
+bitmap is cleared and records the changes for the next export.
+@var{format} defaults to qcow2, and the copy can be limited to @var{speed}
+bytes per second.
+ETEXI
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+STEXI
+@item block_job_set_speed @var{device} @var{value}
+@findex block_job_set_speed
+Set maximum speed for a background block operation.
+ETEXI
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active block streaming operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+STEXI
+@item block_job_cancel @var{device}
+@findex block_job_cancel
+Stop an active background block operation.  For streaming, data copied so
+far is kept and the backing file stays in use.  For mirroring, the device
+keeps using the original image.  For a bitmap export, the clusters that were
+not copied stay marked in the bitmap.
+ETEXI
+
 
     {
         .name       = "eject",
@@ -1292,6 +1436,10 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-jobs
+show progress of ongoing block device operations
+@item info block-cache
+show shared block cache statistics
 @item info registers
 show the cpu registers
 @item info cpus
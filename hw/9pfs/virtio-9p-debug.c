@@ -22,17 +22,17 @@ static FILE *llogfile;
 static struct iovec *get_sg(V9fsPDU *pdu, int rx)
 {
     if (rx) {
-        return pdu->elem.in_sg;
+        return pdu->elem->in_sg;
     }
-    return pdu->elem.out_sg;
+    return pdu->elem->out_sg;
 }
 
 static int get_sg_count(V9fsPDU *pdu, int rx)
 {
     if (rx) {
-        return pdu->elem.in_num;
+        return pdu->elem->in_num;
     }
-    return pdu->elem.out_num;
+    return pdu->elem->out_num;
 
 }
 
@@ -266,9 +266,9 @@ static void pprint_sg(V9fsPDU *pdu, int rx, size_t *offsetp, const char *name)
     int i;
 
     if (rx) {
-        count = pdu->elem.in_num;
+        count = pdu->elem->in_num;
     } else {
-        count = pdu->elem.out_num;
+        count = pdu->elem->out_num;
     }
 
     fprintf(llogfile, "%s={", name);
@@ -293,9 +293,9 @@ static void pprint_data(V9fsPDU *pdu, int rx, size_t *offsetp, const char *name)
     ssize_t len;
 
     if (rx) {
-        count = pdu->elem.in_num;
+        count = pdu->elem->in_num;
     } else
-        count = pdu->elem.out_num;
+        count = pdu->elem->out_num;
     }
 
     BUG_ON((offset + sizeof(size)) > sg[0].iov_len);
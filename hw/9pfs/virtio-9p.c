@@ -595,8 +595,12 @@ static V9fsPDU *alloc_pdu(V9fsState *s)
 static void free_pdu(V9fsState *s, V9fsPDU *pdu)
 {
     if (pdu) {
-        if (debug_9p_pdu) {
-            pprint_pdu(pdu);
+        if (pdu->elem) {
+            if (debug_9p_pdu) {
+                pprint_pdu(pdu);
+            }
+            virtqueue_elem_free(pdu->elem);
+            pdu->elem = NULL;
         }
         QLIST_INSERT_HEAD(&s->free_list, pdu, next);
     }
@@ -636,14 +640,14 @@ size_t pdu_packunpack(void *addr, struct iovec *sg, int sg_count,
 
 static size_t pdu_unpack(void *dst, V9fsPDU *pdu, size_t offset, size_t size)
 {
-    return pdu_packunpack(dst, pdu->elem.out_sg, pdu->elem.out_num,
+    return pdu_packunpack(dst, pdu->elem->out_sg, pdu->elem->out_num,
                          offset, size, 0);
 }
 
 static size_t pdu_pack(V9fsPDU *pdu, size_t offset, const void *src,
                         size_t size)
 {
-    return pdu_packunpack((void *)src, pdu->elem.in_sg, pdu->elem.in_num,
+    return pdu_packunpack((void *)src, pdu->elem->in_sg, pdu->elem->in_num,
                              offset, size, 1);
 }
 
@@ -655,11 +659,11 @@ static int pdu_copy_sg(V9fsPDU *pdu, size_t offset, int rx, struct iovec *sg)
     unsigned int num;
 
     if (rx) {
-        src_sg = pdu->elem.in_sg;
-        num = pdu->elem.in_num;
+        src_sg = pdu->elem->in_sg;
+        num = pdu->elem->in_num;
     } else {
-        src_sg = pdu->elem.out_sg;
-        num = pdu->elem.out_num;
+        src_sg = pdu->elem->out_sg;
+        num = pdu->elem->out_num;
     }
 
     j = 0;
@@ -886,7 +890,7 @@ static void complete_pdu(V9fsState *s, V9fsPDU *pdu, ssize_t len)
     pdu->id = id;
 
     /* push onto queue and notify */
-    virtqueue_push(s->vq, &pdu->elem, len);
+    virtqueue_push(s->vq, pdu->elem, len);
 
     /* FIXME: we should batch these completions */
     virtio_notify(&s->vdev, s->vq);
@@ -3608,16 +3612,15 @@ static void handle_9p_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     V9fsState *s = (V9fsState *)vdev;
     V9fsPDU *pdu;
-    ssize_t len;
 
     while ((pdu = alloc_pdu(s)) &&
-            (len = virtqueue_pop(vq, &pdu->elem)) != 0) {
+            (pdu->elem = virtqueue_pop(vq)) != NULL) {
         uint8_t *ptr;
 
-        BUG_ON(pdu->elem.out_num == 0 || pdu->elem.in_num == 0);
-        BUG_ON(pdu->elem.out_sg[0].iov_len < 7);
+        BUG_ON(pdu->elem->out_num == 0 || pdu->elem->in_num == 0);
+        BUG_ON(pdu->elem->out_sg[0].iov_len < 7);
 
-        ptr = pdu->elem.out_sg[0].iov_base;
+        ptr = pdu->elem->out_sg[0].iov_base;
 
         memcpy(&pdu->size, ptr, 4);
         pdu->id = ptr[4];
@@ -115,7 +115,7 @@ struct V9fsPDU
     uint32_t size;
     uint16_t tag;
     uint8_t id;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     QLIST_ENTRY(V9fsPDU) next;
 };
 
@@ -31,6 +31,7 @@
 #include "net/checksum.h"
 #include "loader.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 
 #include "e1000_hw.h"
 
@@ -56,6 +57,19 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 
 #define IOPORT_SIZE       0x40
 #define PNPMMIO_SIZE      0x20000
+
+/* RDTR, RADV, TIDV and TADV count in 1.024us units, ITR in 256ns units */
+#define E1000_DELAY_UNIT_NS	1024
+#define E1000_ITR_UNIT_NS	256
+#define E1000_DELAY_FPD		(1U << 31)	/* flush partial descriptor block */
+
+enum {
+    E1000_FLAG_MIT_BIT = 0,
+};
+#define E1000_FLAG_MIT		(1 << E1000_FLAG_MIT_BIT)
+
+/* Transmit descriptors fetched and written back with one access */
+#define E1000_TX_BATCH		32
 #define MIN_BUF_SIZE      60 /* Min. octets in an ethernet frame sans FCS */
 
 /*
@@ -123,6 +137,16 @@ typedef struct E1000State_st {
         uint16_t reading;
         uint32_t old_eecd;
     } eecd_state;
+
+    /* Interrupt moderation */
+    uint32_t compat_flags;
+    QEMUTimer *rxt_timer;	/* RDTR/RADV, raises RXT0 */
+    QEMUTimer *txt_timer;	/* TIDV/TADV, raises TXDW */
+    QEMUTimer *itr_timer;	/* ITR throttling window */
+    int64_t rxt_abs_deadline;	/* 0 when the absolute timer is idle */
+    int64_t txt_abs_deadline;
+    int itr_timer_on;
+    int irq_level;
 } E1000State;
 
 #define	defreg(x)	x = (E1000_##x>>2)
@@ -137,7 +161,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TIDV),	defreg(TADV),
 };
 
 enum { PHY_R = 1, PHY_W = 2, PHY_RW = PHY_R | PHY_W };
@@ -161,11 +186,27 @@ ioport_map(PCIDevice *pci_dev, int region_num, pcibus_t addr,
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    int level;
+
     if (val)
         val |= E1000_ICR_INT_ASSERTED;
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+
+    level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    if (level && !s->irq_level && (s->compat_flags & E1000_FLAG_MIT)) {
+        if (s->itr_timer_on) {
+            /* still inside the throttling window, e1000_itr_timer raises it */
+            return;
+        }
+        if (s->mac_reg[ITR]) {
+            s->itr_timer_on = 1;
+            qemu_mod_timer(s->itr_timer, qemu_get_clock_ns(vm_clock) +
+                           (int64_t)s->mac_reg[ITR] * E1000_ITR_UNIT_NS);
+        }
+    }
+    s->irq_level = level;
+    qemu_set_irq(s->dev.irq[0], level);
 }
 
 static void
@@ -176,6 +217,70 @@ set_ics(E1000State *s, int index, uint32_t val)
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+static void
+e1000_itr_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->itr_timer_on = 0;
+    set_ics(s, 0, 0);
+}
+
+/*
+ * Start or restart a packet delay timer.  The packet timer is pushed out
+ * by every packet, the absolute one only starts with the first packet of
+ * a burst; whichever expires first raises the cause.
+ */
+static void
+mit_delay_cause(QEMUTimer *timer, int64_t *abs_deadline,
+                uint32_t delay, uint32_t abs_delay)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int64_t expire = now + (int64_t)delay * E1000_DELAY_UNIT_NS;
+
+    if (abs_delay) {
+        if (!*abs_deadline) {
+            *abs_deadline = now + (int64_t)abs_delay * E1000_DELAY_UNIT_NS;
+        }
+        if (expire > *abs_deadline) {
+            expire = *abs_deadline;
+        }
+    }
+    qemu_mod_timer(timer, expire);
+}
+
+static void
+e1000_rxt_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->rxt_abs_deadline = 0;
+    set_ics(s, 0, E1000_ICS_RXT0);
+}
+
+static void
+e1000_txt_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->txt_abs_deadline = 0;
+    set_ics(s, 0, E1000_ICS_TXDW);
+}
+
+/* Raise any delayed causes now, e.g. on a flush request or before saving */
+static void
+mit_flush(E1000State *s)
+{
+    if (qemu_timer_pending(s->rxt_timer)) {
+        qemu_del_timer(s->rxt_timer);
+        e1000_rxt_timer(s);
+    }
+    if (qemu_timer_pending(s->txt_timer)) {
+        qemu_del_timer(s->txt_timer);
+        e1000_txt_timer(s);
+    }
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -502,8 +607,10 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     tp->cptse = 0;
 }
 
+/* Sets the status of a descriptor that wants it reported; start_xmit
+ * writes it back to the guest */
 static uint32_t
-txdesc_writeback(target_phys_addr_t base, struct e1000_tx_desc *dp)
+txdesc_writeback(struct e1000_tx_desc *dp)
 {
     uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
 
@@ -512,8 +619,6 @@ txdesc_writeback(target_phys_addr_t base, struct e1000_tx_desc *dp)
     txd_upper = (le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD) &
                 ~(E1000_TXD_STAT_EC | E1000_TXD_STAT_LC | E1000_TXD_STAT_TU);
     dp->upper.data = cpu_to_le32(txd_upper);
-    cpu_physical_memory_write(base + ((char *)&dp->upper - (char *)dp),
-                              (void *)&dp->upper, sizeof(dp->upper));
     return E1000_ICR_TXDW;
 }
 
@@ -525,43 +630,94 @@ static uint64_t tx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Descriptors from TDH that the guest has handed over, up to the end of
+ * the ring and at most E1000_TX_BATCH */
+static int
+tx_desc_batch(E1000State *s)
+{
+    uint32_t head = s->mac_reg[TDH], tail = s->mac_reg[TDT];
+    uint32_t end = s->mac_reg[TDLEN] / sizeof(struct e1000_tx_desc);
+
+    if (tail > head && tail < end)
+        end = tail;
+    if (head >= end)	/* bogus TDH or TDLEN, take one at a time */
+        return 1;
+    return MIN(end - head, E1000_TX_BATCH);
+}
+
 static void
 start_xmit(E1000State *s)
 {
     target_phys_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[E1000_TX_BATCH], *desc;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    int delay_txdw = 0, wrapped = 0;
+    int i, n, wb_first, wb_last;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
         return;
     }
 
-    while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+    while (s->mac_reg[TDH] != s->mac_reg[TDT] && !wrapped) {
+        n = tx_desc_batch(s);
         base = tx_desc_base(s) +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        cpu_physical_memory_read(base, (void *)&desc, sizeof(desc));
+        cpu_physical_memory_read(base, (void *)descs, n * sizeof(descs[0]));
+
+        wb_first = wb_last = -1;
+        for (i = 0; i < n && s->mac_reg[TDH] != s->mac_reg[TDT]; i++) {
+            desc = &descs[i];
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc->buffer_addr, desc->lower.data,
+                   desc->upper.data);
+
+            process_tx_desc(s, desc);
+            if (txdesc_writeback(desc)) {
+                if (wb_first < 0)
+                    wb_first = i;
+                wb_last = i;
+                /* descriptors without IDE interrupt right away */
+                if ((s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[TIDV] &&
+                    (le32_to_cpu(desc->lower.data) & E1000_TXD_CMD_IDE)) {
+                    delay_txdw = 1;
+                } else {
+                    cause |= E1000_ICS_TXDW;
+                }
+            }
+
+            if (++s->mac_reg[TDH] * sizeof(*desc) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                wrapped = 1;
+                break;
+            }
+        }
 
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
-
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(base, &desc);
-
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        /* One write for the status of the whole batch, before the guest
+         * can be interrupted for it */
+        if (wb_first >= 0) {
+            cpu_physical_memory_write(base + wb_first * sizeof(descs[0]),
+                                      (void *)&descs[wb_first],
+                                      (wb_last - wb_first + 1) *
+                                      sizeof(descs[0]));
         }
     }
+    if (cause & E1000_ICS_TXDW) {
+        /* an immediate TXDW covers the delayed descriptors as well */
+        qemu_del_timer(s->txt_timer);
+        s->txt_abs_deadline = 0;
+    } else if (delay_txdw) {
+        mit_delay_cause(s->txt_timer, &s->txt_abs_deadline,
+                        s->mac_reg[TIDV], s->mac_reg[TADV]);
+    }
     set_ics(s, 0, cause);
 }
 
@@ -767,12 +923,21 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
         s->mac_reg[TORH]++;
     s->mac_reg[TORL] = n;
 
-    n = E1000_ICS_RXT0;
+    n = 0;
+    if ((s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[RDTR]) {
+        mit_delay_cause(s->rxt_timer, &s->rxt_abs_deadline,
+                        s->mac_reg[RDTR], s->mac_reg[RADV]);
+    } else {
+        n |= E1000_ICS_RXT0;
+    }
     if ((rdt = s->mac_reg[RDT]) < s->mac_reg[RDH])
         rdt += s->mac_reg[RDLEN] / sizeof(desc);
     if (((rdt - s->mac_reg[RDH]) * sizeof(desc)) <= s->mac_reg[RDLEN] >>
-        s->rxbuf_min_shift)
+        s->rxbuf_min_shift) {
+        /* running low on buffers, don't let the guest sleep on them */
         n |= E1000_ICS_RXDMT0;
+        mit_flush(s);
+    }
 
     set_ics(s, 0, n);
 
@@ -847,6 +1012,15 @@ set_tctl(E1000State *s, int index, uint32_t val)
     start_xmit(s);
 }
 
+static void
+set_delay_timer(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & 0xffff;
+    if (val & E1000_DELAY_FPD) {
+        mit_flush(s);
+    }
+}
+
 static void
 set_icr(E1000State *s, int index, uint32_t val)
 {
@@ -876,7 +1050,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(ITR),	getreg(RDTR),
+    getreg(RADV),	getreg(TIDV),	getreg(TADV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -898,6 +1073,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [ITR] = set_16bit,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [RDTR] = set_delay_timer,	[TIDV] = set_delay_timer,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -969,11 +1146,55 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static void e1000_pre_save(void *opaque)
+{
+    E1000State *s = opaque;
+
+    /* Delayed interrupts are not migrated, deliver them early instead */
+    mit_flush(s);
+    if (s->itr_timer_on) {
+        qemu_del_timer(s->itr_timer);
+        e1000_itr_timer(s);
+    }
+}
+
+static int e1000_post_load(void *opaque, int version_id)
+{
+    E1000State *s = opaque;
+
+    s->irq_level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    return 0;
+}
+
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields      = (VMStateField []) {
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .pre_save = e1000_pre_save,
+    .post_load = e1000_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_PCI_DEVICE(dev, E1000State),
         VMSTATE_UNUSED_TEST(is_version_1, 4), /* was instance id */
@@ -1044,6 +1265,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection []) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1128,6 +1357,12 @@ pci_e1000_uninit(PCIDevice *dev)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, dev);
 
+    qemu_del_timer(d->rxt_timer);
+    qemu_free_timer(d->rxt_timer);
+    qemu_del_timer(d->txt_timer);
+    qemu_free_timer(d->txt_timer);
+    qemu_del_timer(d->itr_timer);
+    qemu_free_timer(d->itr_timer);
     cpu_unregister_io_memory(d->mmio_index);
     qemu_del_vlan_client(&d->nic->nc);
     return 0;
@@ -1137,6 +1372,13 @@ static void e1000_reset(void *opaque)
 {
     E1000State *d = opaque;
 
+    qemu_del_timer(d->rxt_timer);
+    qemu_del_timer(d->txt_timer);
+    qemu_del_timer(d->itr_timer);
+    d->rxt_abs_deadline = 0;
+    d->txt_abs_deadline = 0;
+    d->itr_timer_on = 0;
+    d->irq_level = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -1201,6 +1443,10 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     qemu_format_nic_info_str(&d->nic->nc, macaddr);
 
+    d->rxt_timer = qemu_new_timer_ns(vm_clock, e1000_rxt_timer, d);
+    d->txt_timer = qemu_new_timer_ns(vm_clock, e1000_txt_timer, d);
+    d->itr_timer = qemu_new_timer_ns(vm_clock, e1000_itr_timer, d);
+
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     return 0;
@@ -1223,6 +1469,8 @@ static PCIDeviceInfo e1000_info = {
     .romfile    = "pxe-e1000.rom",
     .qdev.props = (Property[]) {
         DEFINE_NIC_PROPERTIES(E1000State, conf),
+        DEFINE_PROP_BIT("mitigation", E1000State, compat_flags,
+                        E1000_FLAG_MIT_BIT, true),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
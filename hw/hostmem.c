@@ -0,0 +1,168 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "hostmem.h"
+
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len)
+{
+    void *host_addr = NULL;
+    int i;
+
+    qemu_mutex_lock(&hostmem->lock);
+    for (i = 0; i < hostmem->num_regions; i++) {
+        HostMemRegion *region = &hostmem->regions[i];
+
+        if (phys >= region->guest_addr &&
+            phys - region->guest_addr < region->size &&
+            len <= region->size - (phys - region->guest_addr)) {
+            host_addr = region->host_addr + (phys - region->guest_addr);
+            break;
+        }
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+
+    return host_addr;
+}
+
+/* Drop [start, start + size) from the table, splitting regions as needed */
+static void hostmem_unassign(HostMem *hostmem, target_phys_addr_t start,
+                             target_phys_addr_t size)
+{
+    target_phys_addr_t end = start + size;
+    int i = 0;
+
+    while (i < hostmem->num_regions) {
+        HostMemRegion *region = &hostmem->regions[i];
+        target_phys_addr_t reg_start = region->guest_addr;
+        target_phys_addr_t reg_end = reg_start + region->size;
+
+        if (reg_end <= start || reg_start >= end) {
+            i++;
+            continue;
+        }
+
+        if (reg_start < start && reg_end > end) {
+            /* Punch a hole: keep the head here, the tail goes at the end */
+            HostMemRegion tail = {
+                .guest_addr = end,
+                .size = reg_end - end,
+                .host_addr = region->host_addr + (end - reg_start),
+            };
+
+            region->size = start - reg_start;
+            hostmem->regions = qemu_realloc(hostmem->regions,
+                (hostmem->num_regions + 1) * sizeof(hostmem->regions[0]));
+            hostmem->regions[hostmem->num_regions++] = tail;
+            i++;
+        } else if (reg_start < start) {
+            region->size = start - reg_start;
+            i++;
+        } else if (reg_end > end) {
+            region->host_addr += end - reg_start;
+            region->guest_addr = end;
+            region->size = reg_end - end;
+            i++;
+        } else {
+            memmove(region, region + 1,
+                    (hostmem->num_regions - i - 1) * sizeof(*region));
+            hostmem->num_regions--;
+        }
+    }
+}
+
+static void hostmem_assign(HostMem *hostmem, target_phys_addr_t start,
+                           target_phys_addr_t size, uint8_t *host_addr)
+{
+    int i;
+
+    /* Pages are reported one at a time, grow a neighbour where possible */
+    for (i = 0; i < hostmem->num_regions; i++) {
+        HostMemRegion *region = &hostmem->regions[i];
+
+        if (region->guest_addr + region->size == start &&
+            region->host_addr + region->size == host_addr) {
+            region->size += size;
+            return;
+        }
+        if (start + size == region->guest_addr &&
+            host_addr + size == region->host_addr) {
+            region->guest_addr = start;
+            region->host_addr = host_addr;
+            region->size += size;
+            return;
+        }
+    }
+
+    hostmem->regions = qemu_realloc(hostmem->regions,
+        (hostmem->num_regions + 1) * sizeof(hostmem->regions[0]));
+    hostmem->regions[hostmem->num_regions].guest_addr = start;
+    hostmem->regions[hostmem->num_regions].size = size;
+    hostmem->regions[hostmem->num_regions].host_addr = host_addr;
+    hostmem->num_regions++;
+}
+
+static void hostmem_client_set_memory(CPUPhysMemoryClient *client,
+                                      target_phys_addr_t start_addr,
+                                      ram_addr_t size,
+                                      ram_addr_t phys_offset,
+                                      bool log_dirty)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+    ram_addr_t flags = phys_offset & ~TARGET_PAGE_MASK;
+
+    qemu_mutex_lock(&hostmem->lock);
+    hostmem_unassign(hostmem, start_addr, size);
+    if (flags == IO_MEM_RAM) {
+        hostmem_assign(hostmem, start_addr, size,
+                       qemu_get_ram_ptr(phys_offset));
+    }
+    qemu_mutex_unlock(&hostmem->lock);
+}
+
+static int hostmem_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                            target_phys_addr_t start_addr,
+                                            target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int hostmem_client_migration_log(CPUPhysMemoryClient *client,
+                                        int enable)
+{
+    HostMem *hostmem = container_of(client, HostMem, client);
+
+    hostmem->logging = enable;
+    if (enable && hostmem->log_start) {
+        hostmem->log_start(hostmem->opaque);
+    }
+    return 0;
+}
+
+void hostmem_init(HostMem *hostmem, void (*log_start)(void *opaque),
+                  void *opaque)
+{
+    memset(hostmem, 0, sizeof(*hostmem));
+    qemu_mutex_init(&hostmem->lock);
+    hostmem->log_start = log_start;
+    hostmem->opaque = opaque;
+
+    hostmem->client.set_memory = hostmem_client_set_memory;
+    hostmem->client.sync_dirty_bitmap = hostmem_client_sync_dirty_bitmap;
+    hostmem->client.migration_log = hostmem_client_migration_log;
+    cpu_register_phys_memory_client(&hostmem->client);
+}
+
+void hostmem_finalize(HostMem *hostmem)
+{
+    cpu_unregister_phys_memory_client(&hostmem->client);
+    qemu_mutex_destroy(&hostmem->lock);
+    qemu_free(hostmem->regions);
+    hostmem->regions = NULL;
+    hostmem->num_regions = 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "hw.h"
+#include "qemu-thread.h"
+
+typedef struct {
+    target_phys_addr_t guest_addr;
+    target_phys_addr_t size;
+    uint8_t *host_addr;
+} HostMemRegion;
+
+/*
+ * Copy of the guest RAM layout that can be looked up from threads which do
+ * not hold the global mutex.  The table is kept up to date by a physical
+ * memory client; the RAM blocks it points to are never freed while the
+ * machine runs.
+ */
+typedef struct HostMem {
+    CPUPhysMemoryClient client;
+    QemuMutex lock;
+    HostMemRegion *regions;
+    int num_regions;
+
+    /* Called when dirty logging for migration is turned on */
+    void (*log_start)(void *opaque);
+    void *opaque;
+    bool logging;
+} HostMem;
+
+void hostmem_init(HostMem *hostmem, void (*log_start)(void *opaque),
+                  void *opaque);
+void hostmem_finalize(HostMem *hostmem);
+
+/*
+ * Return the host address of the guest range [phys, phys + len), or NULL if
+ * it is not entirely backed by a single RAM region.
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len);
+
+#endif
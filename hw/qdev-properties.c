@@ -764,6 +764,24 @@ void qdev_prop_set_globals(DeviceState *dev)
     }
 }
 
+/*
+ * Looks up a global property for code that is not a device, but needs to
+ * stay compatible with older machine types too.
+ */
+const char *qdev_prop_get_global(const char *driver, const char *property)
+{
+    GlobalProperty *prop;
+    const char *value = NULL;
+
+    QTAILQ_FOREACH(prop, &global_props, next) {
+        if (strcmp(prop->driver, driver) == 0 &&
+            strcmp(prop->property, property) == 0) {
+            value = prop->value;
+        }
+    }
+    return value;
+}
+
 static int qdev_add_one_global(QemuOpts *opts, void *opaque)
 {
     GlobalProperty *g;
@@ -316,6 +316,7 @@ void qdev_prop_set_defaults(DeviceState *dev, Property *props);
 
 void qdev_prop_register_global_list(GlobalProperty *props);
 void qdev_prop_set_globals(DeviceState *dev);
+const char *qdev_prop_get_global(const char *driver, const char *property);
 
 static inline const char *qdev_fw_name(DeviceState *dev)
 {
@@ -128,7 +128,7 @@ static int s390_virtio_blk_init(VirtIOS390Device *dev)
 {
     VirtIODevice *vdev;
 
-    vdev = virtio_blk_init((DeviceState *)dev, &dev->block);
+    vdev = virtio_blk_init((DeviceState *)dev, &dev->block, &dev->blk);
     if (!vdev) {
         return -1;
     }
@@ -355,6 +355,8 @@ static VirtIOS390DeviceInfo s390_virtio_blk = {
     .qdev.size = sizeof(VirtIOS390Device),
     .qdev.props = (Property[]) {
         DEFINE_BLOCK_PROPERTIES(VirtIOS390Device, block),
+        DEFINE_PROP_UINT32("x-batch", VirtIOS390Device, blk.batch,
+                           VIRTIO_BLK_BATCH),
         DEFINE_PROP_END_OF_LIST(),
     },
 };
@@ -39,7 +39,7 @@ typedef struct VirtIOBalloon
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
-    VirtQueueElement stats_vq_elem;
+    VirtQueueElement *stats_vq_elem;
     size_t stats_vq_offset;
     MonitorCompletion *stats_callback;
     void *stats_opaque_callback_data;
@@ -101,13 +101,13 @@ static QObject *get_stats_qobject(VirtIOBalloon *dev)
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = to_virtio_balloon(vdev);
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq))) {
         size_t offset = 0;
         uint32_t pfn;
 
-        while (iov_to_buf(elem.out_sg, elem.out_num, &pfn, offset, 4) == 4) {
+        while (iov_to_buf(elem->out_sg, elem->out_num, &pfn, offset, 4) == 4) {
             ram_addr_t pa;
             ram_addr_t addr;
 
@@ -123,8 +123,9 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
             balloon_page(qemu_get_ram_ptr(addr), !!(vq == s->dvq));
         }
 
-        virtqueue_push(vq, &elem, offset);
+        virtqueue_push(vq, elem, offset);
         virtio_notify(vdev, vq);
+        virtqueue_elem_free(elem);
     }
 }
 
@@ -145,13 +146,18 @@ static void complete_stats_request(VirtIOBalloon *vb)
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = DO_UPCAST(VirtIOBalloon, vdev, vdev);
-    VirtQueueElement *elem = &s->stats_vq_elem;
+    VirtQueueElement *elem;
     VirtIOBalloonStat stat;
     size_t offset = 0;
 
-    if (!virtqueue_pop(vq, elem)) {
+    elem = virtqueue_pop(vq);
+    if (!elem) {
         return;
     }
+    if (s->stats_vq_elem) {
+        virtqueue_elem_free(s->stats_vq_elem);
+    }
+    s->stats_vq_elem = elem;
 
     /* Initialize the stats to get rid of any stale values.  This is only
      * needed to handle the case where a guest supports fewer stats than it
@@ -219,9 +225,12 @@ static void virtio_balloon_to_target(void *opaque, ram_addr_t target,
         }
         dev->stats_callback = cb;
         dev->stats_opaque_callback_data = cb_data; 
-        if (ENABLE_GUEST_STATS && (dev->vdev.guest_features & (1 << VIRTIO_BALLOON_F_STATS_VQ))) {
-            virtqueue_push(dev->svq, &dev->stats_vq_elem, dev->stats_vq_offset);
+        if (ENABLE_GUEST_STATS && dev->stats_vq_elem &&
+            (dev->vdev.guest_features & (1 << VIRTIO_BALLOON_F_STATS_VQ))) {
+            virtqueue_push(dev->svq, dev->stats_vq_elem, dev->stats_vq_offset);
             virtio_notify(&dev->vdev, dev->svq);
+            virtqueue_elem_free(dev->stats_vq_elem);
+            dev->stats_vq_elem = NULL;
         } else {
             /* Stats are not supported.  Clear out any stale values that might
              * have been set by a more featureful guest kernel.
@@ -0,0 +1,615 @@
+/*
+ * Virtio block device data plane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu-error.h"
+#include "virtio-blk-dataplane.h"
+
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#include <poll.h>
+#include <linux/aio_abi.h>
+#include "qemu-thread.h"
+#include "block_int.h"
+#include "blockdev.h"
+#include "kvm.h"
+#include "iov.h"
+#include "hostmem.h"
+#include "vring.h"
+#include "virtio-blk.h"
+
+typedef struct VirtIOBlockDataPlaneReq {
+    struct iocb iocb;
+    unsigned int head;
+    struct virtio_blk_inhdr *inhdr;
+    struct iovec *iov;              /* data buffers, the headers excluded */
+    unsigned int niov;
+    size_t len;
+    void *bounce;                   /* aligned copy of iov for O_DIRECT */
+} VirtIOBlockDataPlaneReq;
+
+struct VirtIOBlockDataPlane {
+    VirtIODevice *vdev;
+    VirtQueue *vq;
+    BlockDriverState *bs;
+    unsigned int logical_block_size;
+    char sn[BLOCK_SERIAL_STRLEN];
+
+    bool started;
+    bool switching;                 /* in the middle of start or stop */
+    bool disabled;                  /* transport can't do it, don't retry */
+
+    HostMem hostmem;
+    Vring vring;
+    QemuThread thread;
+    EventNotifier *host_notifier;   /* guest kicks */
+    EventNotifier *guest_notifier;  /* interrupts, injected by the iothread */
+    EventNotifier stop_notifier;
+
+    /* Image state, taken when starting */
+    int fd;
+    bool direct;
+    bool no_flush;
+    bool read_only;
+    uint64_t nb_sectors;
+
+    /* Linux AIO; completions are signalled on io_notifier */
+    aio_context_t io_ctx;
+    EventNotifier io_notifier;
+    VirtIOBlockDataPlaneReq *reqs;  /* indexed by head descriptor */
+    struct iocb **pending;          /* prepared, not yet submitted */
+    unsigned int num_pending;
+    unsigned int num_reqs;          /* submitted, not yet completed */
+};
+
+/* Completions reaped per io_getevents() call */
+#define DATA_PLANE_MAX_EVENTS 128
+
+static long dataplane_io_setup(unsigned int nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static long dataplane_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static long dataplane_io_submit(aio_context_t ctx, long nr,
+                                struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static long dataplane_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                                   struct io_event *events,
+                                   struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static void data_plane_complete(VirtIOBlockDataPlane *s, unsigned int head,
+                                struct virtio_blk_inhdr *inhdr,
+                                unsigned char status, size_t len)
+{
+    stb_p(&inhdr->status, status);
+    vring_push(&s->vring, head, len + sizeof(*inhdr));
+}
+
+static void data_plane_notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (vring_should_notify(&s->vring)) {
+        event_notifier_set(s->guest_notifier);
+    }
+}
+
+static void data_plane_rw_complete(VirtIOBlockDataPlane *s,
+                                   VirtIOBlockDataPlaneReq *req, long ret)
+{
+    bool is_read = req->iocb.aio_lio_opcode == IOCB_CMD_PREADV ||
+                   req->iocb.aio_lio_opcode == IOCB_CMD_PREAD;
+    unsigned char status = VIRTIO_BLK_S_OK;
+
+    if (ret < 0) {
+        status = VIRTIO_BLK_S_IOERR;
+    } else if (is_read) {
+        /* Reading past the end of a file that is not sector aligned */
+        if (ret < req->len) {
+            if (req->bounce) {
+                memset((uint8_t *)req->bounce + ret, 0, req->len - ret);
+            } else {
+                QEMUIOVector qiov;
+
+                qemu_iovec_init_external(&qiov, req->iov, req->niov);
+                qemu_iovec_memset_skip(&qiov, 0, req->len - ret, ret);
+            }
+        }
+        if (req->bounce) {
+            iov_from_buf(req->iov, req->niov, req->bounce, req->len);
+        }
+    } else if (ret != req->len) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+
+    data_plane_complete(s, req->head, req->inhdr, status, req->len);
+
+    qemu_vfree(req->bounce);
+    qemu_free(req->iov);
+    req->bounce = NULL;
+    req->iov = NULL;
+}
+
+static void data_plane_submit(VirtIOBlockDataPlane *s)
+{
+    unsigned int done = 0;
+    long ret;
+
+    while (done < s->num_pending) {
+        ret = dataplane_io_submit(s->io_ctx, s->num_pending - done,
+                                  s->pending + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            VirtIOBlockDataPlaneReq *req;
+
+            fprintf(stderr, "virtio-blk data plane: io_submit failed: %s\n",
+                    strerror(ret < 0 ? errno : EIO));
+            while (done < s->num_pending) {
+                req = container_of(s->pending[done++],
+                                   VirtIOBlockDataPlaneReq, iocb);
+                data_plane_rw_complete(s, req, -EIO);
+            }
+            break;
+        }
+        s->num_reqs += ret;
+        done += ret;
+    }
+    s->num_pending = 0;
+}
+
+static bool data_plane_iov_aligned(const struct iovec *iov, unsigned int niov,
+                                   size_t align)
+{
+    unsigned int i;
+
+    for (i = 0; i < niov; i++) {
+        if ((uintptr_t)iov[i].iov_base % align || iov[i].iov_len % align) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void data_plane_rw(VirtIOBlockDataPlane *s, unsigned int head,
+                          struct virtio_blk_inhdr *inhdr, bool is_write,
+                          uint64_t sector, struct iovec *iov,
+                          unsigned int niov)
+{
+    VirtIOBlockDataPlaneReq *req = &s->reqs[head];
+    size_t len = iov_size(iov, niov);
+
+    if ((sector * BDRV_SECTOR_SIZE) % s->logical_block_size ||
+        len % s->logical_block_size ||
+        sector > s->nb_sectors ||
+        len / BDRV_SECTOR_SIZE > s->nb_sectors - sector ||
+        (is_write && s->read_only)) {
+        data_plane_complete(s, head, inhdr, VIRTIO_BLK_S_IOERR, 0);
+        return;
+    }
+
+    req->head = head;
+    req->inhdr = inhdr;
+    req->len = len;
+    req->niov = niov;
+    req->iov = qemu_malloc(niov * sizeof(*iov));
+    memcpy(req->iov, iov, niov * sizeof(*iov));
+    req->bounce = NULL;
+
+    memset(&req->iocb, 0, sizeof(req->iocb));
+    req->iocb.aio_data = (uintptr_t)req;
+    req->iocb.aio_fildes = s->fd;
+    req->iocb.aio_offset = sector * BDRV_SECTOR_SIZE;
+    req->iocb.aio_flags = IOCB_FLAG_RESFD;
+    req->iocb.aio_resfd = event_notifier_get_fd(&s->io_notifier);
+
+    if (s->direct && !data_plane_iov_aligned(iov, niov, BDRV_SECTOR_SIZE)) {
+        req->bounce = qemu_memalign(BDRV_SECTOR_SIZE, len);
+        if (is_write) {
+            iov_to_buf(iov, niov, req->bounce, 0, len);
+        }
+        req->iocb.aio_lio_opcode = is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+        req->iocb.aio_buf = (uintptr_t)req->bounce;
+        req->iocb.aio_nbytes = len;
+    } else {
+        req->iocb.aio_lio_opcode = is_write ? IOCB_CMD_PWRITEV :
+                                              IOCB_CMD_PREADV;
+        req->iocb.aio_buf = (uintptr_t)req->iov;
+        req->iocb.aio_nbytes = niov;
+    }
+
+    s->pending[s->num_pending++] = &req->iocb;
+}
+
+static void data_plane_flush(VirtIOBlockDataPlane *s, unsigned int head,
+                             struct virtio_blk_inhdr *inhdr)
+{
+    unsigned char status = VIRTIO_BLK_S_OK;
+
+    /* Make sure all outstanding writes are posted to the backing device */
+    data_plane_submit(s);
+
+    if (!s->no_flush && qemu_fdatasync(s->fd) < 0) {
+        status = VIRTIO_BLK_S_IOERR;
+    }
+    data_plane_complete(s, head, inhdr, status, 0);
+}
+
+static int data_plane_handle_request(VirtIOBlockDataPlane *s,
+                                     unsigned int head, struct iovec *iov,
+                                     unsigned int out_num, unsigned int in_num)
+{
+    struct virtio_blk_outhdr *outhdr;
+    struct virtio_blk_inhdr *inhdr;
+    uint32_t type;
+
+    if (out_num < 1 || in_num < 1 ||
+        iov[0].iov_len < sizeof(*outhdr) ||
+        iov[out_num + in_num - 1].iov_len < sizeof(*inhdr)) {
+        fprintf(stderr, "virtio-blk missing headers\n");
+        return -EFAULT;
+    }
+
+    outhdr = iov[0].iov_base;
+    inhdr = iov[out_num + in_num - 1].iov_base;
+    type = ldl_p(&outhdr->type);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        data_plane_flush(s, head, inhdr);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        data_plane_complete(s, head, inhdr, VIRTIO_BLK_S_UNSUPP, 0);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        if (in_num > 1) {
+            memcpy(iov[out_num].iov_base, s->sn,
+                   MIN(iov[out_num].iov_len, sizeof(s->sn)));
+        }
+        data_plane_complete(s, head, inhdr, VIRTIO_BLK_S_OK, 0);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        data_plane_rw(s, head, inhdr, true, ldq_p(&outhdr->sector),
+                      &iov[1], out_num - 1);
+    } else {
+        data_plane_rw(s, head, inhdr, false, ldq_p(&outhdr->sector),
+                      &iov[out_num], in_num - 1);
+    }
+    return 0;
+}
+
+/* The guest kicked us: take everything it queued and submit it at once */
+static void data_plane_handle_notify(VirtIOBlockDataPlane *s)
+{
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    unsigned int out_num, in_num;
+    int head;
+
+    for (;;) {
+        /* No kicks needed while we are draining the ring anyway */
+        vring_disable_notification(&s->vring);
+
+        while ((head = vring_pop(&s->vring, iov, ARRAY_SIZE(iov),
+                                 &out_num, &in_num)) >= 0) {
+            if (data_plane_handle_request(s, head, iov, out_num,
+                                          in_num) < 0) {
+                s->vring.broken = true;
+                break;
+            }
+        }
+
+        data_plane_submit(s);
+
+        if (s->vring.broken) {
+            break;
+        }
+        if (vring_enable_notification(&s->vring)) {
+            break;
+        }
+    }
+
+    data_plane_notify_guest(s);
+}
+
+static void data_plane_handle_io(VirtIOBlockDataPlane *s)
+{
+    struct io_event events[DATA_PLANE_MAX_EVENTS];
+    struct timespec ts = { 0 };
+    long i, ret;
+
+    event_notifier_test_and_clear(&s->io_notifier);
+
+    for (;;) {
+        ret = dataplane_io_getevents(s->io_ctx, 0, ARRAY_SIZE(events),
+                                     events, &ts);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        for (i = 0; i < ret; i++) {
+            VirtIOBlockDataPlaneReq *req =
+                (VirtIOBlockDataPlaneReq *)(uintptr_t)events[i].data;
+
+            data_plane_rw_complete(s, req, events[i].res);
+            s->num_reqs--;
+        }
+        if (ret < ARRAY_SIZE(events)) {
+            break;
+        }
+    }
+
+    data_plane_notify_guest(s);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct pollfd fds[3];
+    bool stopping = false;
+
+    fds[0].fd = event_notifier_get_fd(s->host_notifier);
+    fds[1].fd = event_notifier_get_fd(&s->io_notifier);
+    fds[2].fd = event_notifier_get_fd(&s->stop_notifier);
+    fds[0].events = fds[1].events = fds[2].events = POLLIN;
+
+    /* Once asked to stop, let the requests in flight finish */
+    while (!stopping || s->num_reqs) {
+        if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+            continue;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            event_notifier_test_and_clear(&s->stop_notifier);
+            stopping = true;
+            fds[0].fd = -1;
+            fds[0].revents = 0;
+        }
+        if (fds[1].revents & POLLIN) {
+            data_plane_handle_io(s);
+        }
+        if ((fds[0].revents & POLLIN) &&
+            event_notifier_test_and_clear(s->host_notifier)) {
+            data_plane_handle_notify(s);
+        }
+    }
+
+    return NULL;
+}
+
+/* Whether requests must go through the block layer right now */
+static bool data_plane_bs_busy(BlockDriverState *bs)
+{
+    return !bs->drv || bdrv_in_use(bs) || bs->job || bs->dirty_bitmap ||
+           !QLIST_EMPTY(&bs->dirty_bitmaps) || bs->io_limits_enabled ||
+           bs->copy_on_read || bs->shared_image || bs->backing_hd;
+}
+
+static bool data_plane_open_image(VirtIOBlockDataPlane *s)
+{
+    BlockDriverState *bs = s->bs;
+    int flags;
+
+    s->read_only = bdrv_is_read_only(bs);
+    s->direct = bs->open_flags & BDRV_O_NOCACHE;
+    s->no_flush = bs->open_flags & BDRV_O_NO_FLUSH;
+    s->nb_sectors = bs->total_sectors;
+
+    /* Same flags as raw-posix uses for the image */
+    flags = s->read_only ? O_RDONLY : O_RDWR;
+    if (s->direct) {
+        flags |= O_DIRECT;
+    } else if (!(bs->open_flags & BDRV_O_CACHE_WB)) {
+        flags |= O_DSYNC;
+    }
+
+    s->fd = qemu_open(bs->file->filename, flags);
+    if (s->fd < 0) {
+        error_report("virtio-blk data plane: could not open %s: %s",
+                     bs->file->filename, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    void *opaque = vdev->binding_opaque;
+    unsigned int num;
+
+    if (s->started) {
+        return true;
+    }
+    if (s->switching || s->disabled || !vdev->vm_running ||
+        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) ||
+        s->hostmem.logging || data_plane_bs_busy(s->bs)) {
+        return false;
+    }
+    if (!binding->set_host_notifier || !binding->set_guest_notifiers) {
+        error_report("virtio-blk: x-data-plane is not supported by the "
+                     "transport, using the regular code path");
+        s->disabled = true;
+        return false;
+    }
+
+    /* Kicks seen while switching notifiers take the regular path */
+    s->switching = true;
+
+    num = virtio_queue_get_num(vdev, 0);
+    if (!data_plane_open_image(s)) {
+        goto fail_open;
+    }
+    s->io_ctx = 0;
+    if (dataplane_io_setup(num, &s->io_ctx) < 0) {
+        error_report("virtio-blk data plane: io_setup failed: %s",
+                     strerror(errno));
+        goto fail_io_setup;
+    }
+    if (event_notifier_init(&s->io_notifier, 0) < 0) {
+        goto fail_io_notifier;
+    }
+    if (event_notifier_init(&s->stop_notifier, 0) < 0) {
+        goto fail_stop_notifier;
+    }
+    if (binding->set_guest_notifiers(opaque, true) < 0) {
+        goto fail_guest_notifiers;
+    }
+    if (binding->set_host_notifier(opaque, 0, true) < 0) {
+        error_report("virtio-blk: no ioeventfd for x-data-plane, "
+                     "using the regular code path");
+        s->disabled = true;
+        goto fail_host_notifier;
+    }
+
+    /* The thread owns the ring, requests from the regular path must be done */
+    qemu_aio_flush();
+    if (!vdev->vm_running ||
+        !vring_setup(&s->vring, &s->hostmem, vdev, 0)) {
+        goto fail_vring;
+    }
+
+    s->host_notifier = virtio_queue_get_host_notifier(s->vq);
+    s->guest_notifier = virtio_queue_get_guest_notifier(s->vq);
+    s->reqs = qemu_mallocz(num * sizeof(s->reqs[0]));
+    s->pending = qemu_malloc(num * sizeof(s->pending[0]));
+    s->num_pending = 0;
+    s->num_reqs = 0;
+
+    qemu_thread_create(&s->thread, data_plane_thread, s);
+
+    s->started = true;
+    s->switching = false;
+    return true;
+
+fail_vring:
+    binding->set_host_notifier(opaque, 0, false);
+fail_host_notifier:
+    binding->set_guest_notifiers(opaque, false);
+fail_guest_notifiers:
+    event_notifier_cleanup(&s->stop_notifier);
+fail_stop_notifier:
+    event_notifier_cleanup(&s->io_notifier);
+fail_io_notifier:
+    dataplane_io_destroy(s->io_ctx);
+fail_io_setup:
+    close(s->fd);
+fail_open:
+    s->switching = false;
+    return false;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    VirtIODevice *vdev = s->vdev;
+    const VirtIOBindings *binding = vdev->binding;
+    void *opaque = vdev->binding_opaque;
+
+    if (!s->started || s->switching) {
+        return;
+    }
+    s->switching = true;
+
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+
+    vring_teardown(&s->vring, vdev, 0);
+
+    /* Deliver an interrupt the iothread did not get to */
+    if (event_notifier_test_and_clear(s->guest_notifier)) {
+        virtio_irq(s->vq);
+    }
+    binding->set_guest_notifiers(opaque, false);
+    /* A kick that is still pending is handled by the regular path here */
+    binding->set_host_notifier(opaque, 0, false);
+
+    qemu_free(s->reqs);
+    qemu_free(s->pending);
+    s->reqs = NULL;
+    s->pending = NULL;
+    event_notifier_cleanup(&s->stop_notifier);
+    event_notifier_cleanup(&s->io_notifier);
+    dataplane_io_destroy(s->io_ctx);
+    close(s->fd);
+
+    s->started = false;
+    s->switching = false;
+}
+
+static void data_plane_log_start(void *opaque)
+{
+    /* Guest memory written by the thread would escape dirty logging */
+    virtio_blk_data_plane_stop(opaque);
+}
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial)
+{
+    VirtIOBlockDataPlane *s;
+    BlockDriverState *bs = conf->bs;
+
+    if (!kvm_enabled()) {
+        error_report("virtio-blk: x-data-plane requires KVM");
+        return NULL;
+    }
+    if (!bs->drv || strcmp(bs->drv->format_name, "raw") || !bs->file ||
+        !bs->file->drv->protocol_name ||
+        (strcmp(bs->file->drv->protocol_name, "file") &&
+         strcmp(bs->file->drv->protocol_name, "host_device"))) {
+        error_report("virtio-blk: x-data-plane only supports raw images "
+                     "in files or on host devices");
+        return NULL;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->vdev = vdev;
+    s->vq = virtio_get_queue(vdev, 0);
+    s->bs = bs;
+    s->logical_block_size = conf->logical_block_size;
+    memcpy(s->sn, serial, sizeof(s->sn));
+    hostmem_init(&s->hostmem, data_plane_log_start, s);
+    return s;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    virtio_blk_data_plane_stop(s);
+    hostmem_finalize(&s->hostmem);
+    qemu_free(s);
+}
+
+#else /* !CONFIG_LINUX */
+
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial)
+{
+    error_report("virtio-blk: x-data-plane is not supported on this host");
+    return NULL;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+}
+
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    return false;
+}
+
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+}
+
+#endif
@@ -0,0 +1,35 @@
+/*
+ * Virtio block device data plane
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VIRTIO_BLK_DATAPLANE_H
+#define VIRTIO_BLK_DATAPLANE_H
+
+#include "virtio.h"
+
+typedef struct VirtIOBlockDataPlane VirtIOBlockDataPlane;
+
+/*
+ * The data plane runs the request queue of a virtio-blk device in a thread
+ * of its own: the thread waits for guest kicks on the ioeventfd, submits
+ * reads and writes with Linux AIO and completes them without ever taking
+ * the global mutex.
+ *
+ * It is started on the first kick after the driver is ready, and handing
+ * the queue back to the regular code path is always possible with
+ * virtio_blk_data_plane_stop().  virtio_blk_data_plane_start() refuses to
+ * run when something else needs to see the requests, e.g. a block job or
+ * migration; the caller then processes them as usual.
+ */
+VirtIOBlockDataPlane *virtio_blk_data_plane_create(VirtIODevice *vdev,
+                                                   BlockConf *conf,
+                                                   const char *serial);
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s);
+
+#endif
@@ -16,6 +16,7 @@
 #include "trace.h"
 #include "blockdev.h"
 #include "virtio-blk.h"
+#include "virtio-blk-dataplane.h"
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
@@ -29,8 +30,10 @@ typedef struct VirtIOBlock
     QEMUBH *bh;
     BlockConf *conf;
     unsigned short sector_mask;
+    unsigned int batch;
     char sn[BLOCK_SERIAL_STRLEN];
     DeviceState *qdev;
+    VirtIOBlockDataPlane *dataplane;
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -41,7 +44,7 @@ static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
 typedef struct VirtIOBlockReq
 {
     VirtIOBlock *dev;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr *out;
     struct virtio_scsi_inhdr *scsi;
@@ -56,9 +59,10 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, int status)
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
+    virtqueue_push(s->vq, req->elem, req->qiov.size + sizeof(*req->in));
     virtio_notify(&s->vdev, s->vq);
 
+    virtqueue_elem_free(req->elem);
     qemu_free(req);
 }
 
@@ -115,10 +119,12 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
 }
 
-static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s,
+                                                VirtQueueElement *elem)
 {
     VirtIOBlockReq *req = qemu_malloc(sizeof(*req));
     req->dev = s;
+    req->elem = elem;
     req->qiov.size = 0;
     req->next = NULL;
     return req;
@@ -126,16 +132,12 @@ static VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
 
 static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtQueueElement *elem = virtqueue_pop(s->vq);
 
-    if (req != NULL) {
-        if (!virtqueue_pop(s->vq, &req->elem)) {
-            qemu_free(req);
-            return NULL;
-        }
+    if (!elem) {
+        return NULL;
     }
-
-    return req;
+    return virtio_blk_alloc_request(s, elem);
 }
 
 #ifdef __linux__
@@ -153,7 +155,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * We also at least require the virtio_blk_inhdr, the virtio_scsi_inhdr
      * and the sense buffer pointer in the input segments.
      */
-    if (req->elem.out_num < 2 || req->elem.in_num < 3) {
+    if (req->elem->out_num < 2 || req->elem->in_num < 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         return;
     }
@@ -161,7 +163,7 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     /*
      * No support for bidirection commands yet.
      */
-    if (req->elem.out_num > 2 && req->elem.in_num > 3) {
+    if (req->elem->out_num > 2 && req->elem->in_num > 3) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
         return;
     }
@@ -170,38 +172,38 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
      * The scsi inhdr is placed in the second-to-last input segment, just
      * before the regular inhdr.
      */
-    req->scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
+    req->scsi = (void *)req->elem->in_sg[req->elem->in_num - 2].iov_base;
 
     memset(&hdr, 0, sizeof(struct sg_io_hdr));
     hdr.interface_id = 'S';
-    hdr.cmd_len = req->elem.out_sg[1].iov_len;
-    hdr.cmdp = req->elem.out_sg[1].iov_base;
+    hdr.cmd_len = req->elem->out_sg[1].iov_len;
+    hdr.cmdp = req->elem->out_sg[1].iov_base;
     hdr.dxfer_len = 0;
 
-    if (req->elem.out_num > 2) {
+    if (req->elem->out_num > 2) {
         /*
          * If there are more than the minimally required 2 output segments
          * there is write payload starting from the third iovec.
          */
         hdr.dxfer_direction = SG_DXFER_TO_DEV;
-        hdr.iovec_count = req->elem.out_num - 2;
+        hdr.iovec_count = req->elem->out_num - 2;
 
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.out_sg[i + 2].iov_len;
+            hdr.dxfer_len += req->elem->out_sg[i + 2].iov_len;
 
-        hdr.dxferp = req->elem.out_sg + 2;
+        hdr.dxferp = req->elem->out_sg + 2;
 
-    } else if (req->elem.in_num > 3) {
+    } else if (req->elem->in_num > 3) {
         /*
          * If we have more than 3 input segments the guest wants to actually
          * read data.
          */
         hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-        hdr.iovec_count = req->elem.in_num - 3;
+        hdr.iovec_count = req->elem->in_num - 3;
         for (i = 0; i < hdr.iovec_count; i++)
-            hdr.dxfer_len += req->elem.in_sg[i].iov_len;
+            hdr.dxfer_len += req->elem->in_sg[i].iov_len;
 
-        hdr.dxferp = req->elem.in_sg;
+        hdr.dxferp = req->elem->in_sg;
     } else {
         /*
          * Some SCSI commands don't actually transfer any data.
@@ -209,8 +211,8 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
         hdr.dxfer_direction = SG_DXFER_NONE;
     }
 
-    hdr.sbp = req->elem.in_sg[req->elem.in_num - 3].iov_base;
-    hdr.mx_sb_len = req->elem.in_sg[req->elem.in_num - 3].iov_len;
+    hdr.sbp = req->elem->in_sg[req->elem->in_num - 3].iov_base;
+    hdr.mx_sb_len = req->elem->in_sg[req->elem->in_num - 3].iov_len;
 
     ret = bdrv_ioctl(req->dev->bs, SG_IO, &hdr);
     if (ret) {
@@ -238,30 +240,62 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
 #endif /* __linux__ */
 
 typedef struct MultiReqBuffer {
-    BlockRequest        blkreq[32];
+    BlockRequest        writes[VIRTIO_BLK_MAX_BATCH];
     unsigned int        num_writes;
+    BlockRequest        reads[VIRTIO_BLK_MAX_BATCH];
+    unsigned int        num_reads;
 } MultiReqBuffer;
 
-static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
+static void virtio_submit_multireq(BlockDriverState *bs, BlockRequest *blkreq,
+                                   unsigned int num_reqs, int is_write)
 {
     int i, ret;
 
-    if (!mrb->num_writes) {
-        return;
+    if (is_write) {
+        ret = bdrv_aio_multiwrite(bs, blkreq, num_reqs);
+    } else {
+        ret = bdrv_aio_multiread(bs, blkreq, num_reqs);
     }
-
-    ret = bdrv_aio_multiwrite(bs, mrb->blkreq, mrb->num_writes);
     if (ret != 0) {
-        for (i = 0; i < mrb->num_writes; i++) {
-            if (mrb->blkreq[i].error) {
-                virtio_blk_rw_complete(mrb->blkreq[i].opaque, -EIO);
+        for (i = 0; i < num_reqs; i++) {
+            if (blkreq[i].error) {
+                virtio_blk_rw_complete(blkreq[i].opaque, -EIO);
             }
         }
     }
+}
 
+static void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    if (!mrb->num_writes) {
+        return;
+    }
+
+    virtio_submit_multireq(bs, mrb->writes, mrb->num_writes, 1);
     mrb->num_writes = 0;
 }
 
+static void virtio_submit_multiread(BlockDriverState *bs, MultiReqBuffer *mrb)
+{
+    if (!mrb->num_reads) {
+        return;
+    }
+
+    virtio_submit_multireq(bs, mrb->reads, mrb->num_reads, 0);
+    mrb->num_reads = 0;
+}
+
+static void virtio_blk_queue_req(BlockRequest *blkreq, VirtIOBlockReq *req,
+                                 uint64_t sector)
+{
+    blkreq->sector = sector;
+    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+    blkreq->qiov = &req->qiov;
+    blkreq->cb = virtio_blk_rw_complete;
+    blkreq->opaque = req;
+    blkreq->error = 0;
+}
+
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     BlockDriverAIOCB *acb;
@@ -279,7 +313,6 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockRequest *blkreq;
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
@@ -295,28 +328,21 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         return;
     }
 
-    if (mrb->num_writes == 32) {
+    if (mrb->num_writes == req->dev->batch) {
         virtio_submit_multiwrite(req->dev->bs, mrb);
     }
 
-    blkreq = &mrb->blkreq[mrb->num_writes];
-    blkreq->sector = sector;
-    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
-    blkreq->qiov = &req->qiov;
-    blkreq->cb = virtio_blk_rw_complete;
-    blkreq->opaque = req;
-    blkreq->error = 0;
-
-    mrb->num_writes++;
+    virtio_blk_queue_req(&mrb->writes[mrb->num_writes++], req, sector);
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockDriverAIOCB *acb;
     uint64_t sector;
 
     sector = ldq_p(&req->out->sector);
 
+    trace_virtio_blk_handle_read(req, sector, req->qiov.size / 512);
+
     if (sector & req->dev->sector_mask) {
         virtio_blk_rw_complete(req, -EIO);
         return;
@@ -326,12 +352,11 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
         return;
     }
 
-    acb = bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                         req->qiov.size / BDRV_SECTOR_SIZE,
-                         virtio_blk_rw_complete, req);
-    if (!acb) {
-        virtio_blk_rw_complete(req, -EIO);
+    if (mrb->num_reads == req->dev->batch) {
+        virtio_submit_multiread(req->dev->bs, mrb);
     }
+
+    virtio_blk_queue_req(&mrb->reads[mrb->num_reads++], req, sector);
 }
 
 static void virtio_blk_handle_request(VirtIOBlockReq *req,
@@ -339,19 +364,19 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
 {
     uint32_t type;
 
-    if (req->elem.out_num < 1 || req->elem.in_num < 1) {
+    if (req->elem->out_num < 1 || req->elem->in_num < 1) {
         error_report("virtio-blk missing headers");
         exit(1);
     }
 
-    if (req->elem.out_sg[0].iov_len < sizeof(*req->out) ||
-        req->elem.in_sg[req->elem.in_num - 1].iov_len < sizeof(*req->in)) {
+    if (req->elem->out_sg[0].iov_len < sizeof(*req->out) ||
+        req->elem->in_sg[req->elem->in_num - 1].iov_len < sizeof(*req->in)) {
         error_report("virtio-blk header not in correct element");
         exit(1);
     }
 
-    req->out = (void *)req->elem.out_sg[0].iov_base;
-    req->in = (void *)req->elem.in_sg[req->elem.in_num - 1].iov_base;
+    req->out = (void *)req->elem->out_sg[0].iov_base;
+    req->in = (void *)req->elem->in_sg[req->elem->in_num - 1].iov_base;
 
     type = ldl_p(&req->out->type);
 
@@ -362,17 +387,17 @@ static void virtio_blk_handle_request(VirtIOBlockReq *req,
     } else if (type & VIRTIO_BLK_T_GET_ID) {
         VirtIOBlock *s = req->dev;
 
-        memcpy(req->elem.in_sg[0].iov_base, s->sn,
-               MIN(req->elem.in_sg[0].iov_len, sizeof(s->sn)));
+        memcpy(req->elem->in_sg[0].iov_base, s->sn,
+               MIN(req->elem->in_sg[0].iov_len, sizeof(s->sn)));
         virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
     } else if (type & VIRTIO_BLK_T_OUT) {
-        qemu_iovec_init_external(&req->qiov, &req->elem.out_sg[1],
-                                 req->elem.out_num - 1);
+        qemu_iovec_init_external(&req->qiov, &req->elem->out_sg[1],
+                                 req->elem->out_num - 1);
         virtio_blk_handle_write(req, mrb);
     } else {
-        qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
-                                 req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        qemu_iovec_init_external(&req->qiov, &req->elem->in_sg[0],
+                                 req->elem->in_num - 1);
+        virtio_blk_handle_read(req, mrb);
     }
 }
 
@@ -380,15 +405,28 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
     VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {
-        .num_writes = 0,
-    };
+    MultiReqBuffer mrb;
+
+    /* Requests waiting for a restart must not race with the thread */
+    if (s->dataplane && !s->rq && !s->bh &&
+        virtio_blk_data_plane_start(s->dataplane)) {
+        return;
+    }
+
+    mrb.num_writes = 0;
+    mrb.num_reads = 0;
+
+    /* Let the host see the whole batch of requests at once */
+    bdrv_io_plug(s->bs);
 
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -401,21 +439,27 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 {
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
-    MultiReqBuffer mrb = {
-        .num_writes = 0,
-    };
+    MultiReqBuffer mrb;
+
+    mrb.num_writes = 0;
+    mrb.num_reads = 0;
 
     qemu_bh_delete(s->bh);
     s->bh = NULL;
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
+
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_submit_multiread(s->bs, &mrb);
+
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
@@ -431,6 +475,17 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running, int reason)
     }
 }
 
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    /* Started again by the next kick, see virtio_blk_handle_output() */
+    if (s->dataplane &&
+        (!(status & VIRTIO_CONFIG_S_DRIVER_OK) || !vdev->vm_running)) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
     /*
@@ -493,7 +548,7 @@ static void virtio_blk_save(QEMUFile *f, void *opaque)
     
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        virtqueue_elem_save(f, req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -508,15 +563,11 @@ static int virtio_blk_load(QEMUFile *f, void *opaque, int version_id)
 
     virtio_load(&s->vdev, f);
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
-        qemu_get_buffer(f, (unsigned char*)&req->elem, sizeof(req->elem));
+        VirtIOBlockReq *req;
+
+        req = virtio_blk_alloc_request(s, virtqueue_elem_load(f, s->vq));
         req->next = s->rq;
         s->rq = req;
-
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
-            req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
-            req->elem.out_num, 0);
     }
 
     return 0;
@@ -526,12 +577,18 @@ static void virtio_blk_change_cb(void *opaque, int reason)
 {
     VirtIOBlock *s = opaque;
 
+    /* Let the data plane pick up the new image state when it restarts */
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+
     if (reason & CHANGE_SIZE) {
         virtio_notify_config(&s->vdev);
     }
 }
 
-VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
+VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf,
+                              virtio_blk_conf *blk)
 {
     VirtIOBlock *s;
     int cylinders, heads, secs;
@@ -546,6 +603,11 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
         error_report("Device needs media, but drive is empty");
         return NULL;
     }
+    if (blk->batch == 0 || blk->batch > VIRTIO_BLK_MAX_BATCH) {
+        error_report("virtio-blk: x-batch must be between 1 and %d",
+                     VIRTIO_BLK_MAX_BATCH);
+        return NULL;
+    }
 
     s = (VirtIOBlock *)virtio_common_init("virtio-blk", VIRTIO_ID_BLOCK,
                                           sizeof(struct virtio_blk_config),
@@ -553,11 +615,13 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.get_features = virtio_blk_get_features;
+    s->vdev.set_status = virtio_blk_set_status;
     s->vdev.reset = virtio_blk_reset;
     s->bs = conf->bs;
     s->conf = conf;
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
+    s->batch = blk->batch;
     bdrv_guess_geometry(s->bs, &cylinders, &heads, &secs);
 
     /* NB: per existing s/n string convention the string is terminated
@@ -568,6 +632,15 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
 
+    if (blk->data_plane) {
+        s->dataplane = virtio_blk_data_plane_create(&s->vdev, conf, s->sn);
+        if (!s->dataplane) {
+            virtio_cleanup(&s->vdev);
+            qemu_free(s);
+            return NULL;
+        }
+    }
+
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
     register_savevm(dev, "virtio-blk", virtio_blk_id++, 2,
@@ -584,5 +657,9 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, BlockConf *conf)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_destroy(s->dataplane);
+    }
     unregister_savevm(s->qdev, "virtio-blk", s);
 }
@@ -95,6 +95,19 @@ struct virtio_scsi_inhdr
     uint32_t residual;
 };
 
+/*
+ * Number of reads or writes collected from the queue before they are merged
+ * and submitted, unless the queue runs empty first.
+ */
+#define VIRTIO_BLK_BATCH        32
+#define VIRTIO_BLK_MAX_BATCH    128
+
+typedef struct virtio_blk_conf
+{
+    uint32_t batch;
+    uint32_t data_plane;
+} virtio_blk_conf;
+
 #ifdef __linux__
 #define DEFINE_VIRTIO_BLK_FEATURES(_state, _field) \
         DEFINE_VIRTIO_COMMON_FEATURES(_state, _field), \
@@ -10,6 +10,7 @@
  * the COPYING file in the top-level directory.
  */
 
+#include "iov.h"
 #include "qemu-char.h"
 #include "qemu-error.h"
 #include "virtio-serial.h"
@@ -17,6 +18,7 @@
 typedef struct VirtConsole {
     VirtIOSerialPort port;
     CharDriverState *chr;
+    QEMUBH *write_ready_bh;     /* for chardevs without write notification */
 } VirtConsole;
 
 
@@ -28,6 +30,38 @@ static ssize_t flush_buf(VirtIOSerialPort *port, const uint8_t *buf, size_t len)
     return qemu_chr_write(vcon->chr, buf, len);
 }
 
+/* The chardev can take more data: resume writing what the guest sent */
+static void chr_write_ready(void *opaque)
+{
+    VirtConsole *vcon = opaque;
+
+    virtio_serial_throttle_port(&vcon->port, false);
+}
+
+/* Same as flush_buf for ports in bulk mode, without blocking on the chardev */
+static ssize_t flush_iov(VirtIOSerialPort *port, const struct iovec *iov,
+                         int iovcnt)
+{
+    VirtConsole *vcon = DO_UPCAST(VirtConsole, port, port);
+    size_t len = iov_size(iov, iovcnt);
+    int ret;
+
+    ret = qemu_chr_writev(vcon->chr, iov, iovcnt);
+    if (ret == -EAGAIN || (ret >= 0 && ret < len)) {
+        /* The port stays throttled until chr_write_ready() runs */
+        if (qemu_chr_add_write_ready(vcon->chr, chr_write_ready, vcon) < 0) {
+            /* The chardev can't tell when it has room, retry now and then */
+            qemu_bh_schedule_idle(vcon->write_ready_bh);
+        }
+        return ret;
+    }
+    if (ret < 0) {
+        /* Nowhere for the data to go, drop it like a disconnected socket */
+        return len;
+    }
+    return ret;
+}
+
 /* Callback function that's called when the guest opens the port */
 static void guest_open(VirtIOSerialPort *port)
 {
@@ -88,7 +122,9 @@ static int virtconsole_initfn(VirtIOSerialPort *port)
     if (vcon->chr) {
         qemu_chr_add_handlers(vcon->chr, chr_can_read, chr_read, chr_event,
                               vcon);
+        vcon->write_ready_bh = qemu_bh_new(chr_write_ready, vcon);
         info->have_data = flush_buf;
+        info->have_data_iov = flush_iov;
         info->guest_open = guest_open;
         info->guest_close = guest_close;
     }
@@ -106,6 +142,8 @@ static int virtconsole_exitfn(VirtIOSerialPort *port)
 	 * for other purposes.
 	 */
 	qemu_chr_add_handlers(vcon->chr, NULL, NULL, NULL, NULL);
+        qemu_chr_add_write_ready(vcon->chr, NULL, NULL);
+        qemu_bh_delete(vcon->write_ready_bh);
     }
 
     return 0;
@@ -140,6 +178,7 @@ static VirtIOSerialPortInfo virtserialport_info = {
         DEFINE_PROP_UINT32("nr", VirtConsole, port.id, VIRTIO_CONSOLE_BAD_ID),
         DEFINE_PROP_CHR("chardev", VirtConsole, chr),
         DEFINE_PROP_STRING("name", VirtConsole, port.name),
+        DEFINE_PROP_BIT("bulk", VirtConsole, port.bulk, 0, false),
         DEFINE_PROP_END_OF_LIST(),
     },
 };
@@ -26,27 +26,65 @@
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/*
+ * tx=auto looks at the transmit rate over windows of TX_AUTO_WINDOW.  The
+ * timer takes over from the bottom half when the guest sends more than
+ * TX_AUTO_HIGH_RATE packets per window, but fewer than TX_AUTO_MIN_BATCH per
+ * run, i.e. it kicks the device for every packet or two.  The bottom half
+ * takes over again below TX_AUTO_LOW_RATE, or when a timer run finds a full
+ * burst waiting.
+ */
+#define TX_AUTO_WINDOW      10000000 /* 10 ms */
+#define TX_AUTO_HIGH_RATE   500
+#define TX_AUTO_LOW_RATE    100
+#define TX_AUTO_MIN_BATCH   4
+
+/* Receive buffers a packet read with virtio_net_receive_direct() may use */
+#define VIRTIO_NET_RX_DIRECT_ELEMS  64
+
+/* Their pieces, plus rx_spill, in a single readv(), so no more than IOV_MAX */
+#define VIRTIO_NET_RX_DIRECT_SG     MIN(VIRTQUEUE_MAX_SIZE + 2, IOV_MAX)
+
+/* A receive and transmit queue pair, served by one queue of the backend */
+typedef struct VirtIONetQueue
+{
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    QEMUTimer *tx_timer;
+    QEMUBH *tx_bh;
+    int tx_use_timer;
+    int tx_waiting;
+    /* tx=auto statistics for the current window */
+    int64_t tx_window_start;
+    unsigned int tx_window_packets;
+    unsigned int tx_window_runs;
+    struct {
+        VirtQueueElement *elem;
+        ssize_t len;
+    } async_tx;
+    struct VirtIONet *n;
+    size_t rx_direct_hint;  /* size of the last packet read directly */
+} VirtIONetQueue;
+
 typedef struct VirtIONet
 {
     VirtIODevice vdev;
     uint8_t mac[ETH_ALEN];
     uint16_t status;
-    VirtQueue *rx_vq;
-    VirtQueue *tx_vq;
+    VirtIONetQueue vqs[VIRTIO_NET_MAX_QUEUES];
     VirtQueue *ctrl_vq;
     NICState *nic;
-    QEMUTimer *tx_timer;
-    QEMUBH *tx_bh;
     uint32_t tx_timeout;
     int32_t tx_burst;
-    int tx_waiting;
+    int tx_auto;
     uint32_t has_vnet_hdr;
     uint8_t has_ufo;
-    struct {
-        VirtQueueElement elem;
-        ssize_t len;
-    } async_tx;
     int mergeable_rx_bufs;
+    size_t config_size;
+    uint8_t *rx_spill;      /* overflow of packets read directly */
+    uint16_t max_queues;    /* queue pairs the backend can serve */
+    uint16_t curr_queues;   /* queue pairs the guest uses */
+    int multiqueue;         /* VIRTIO_NET_F_MQ queue layout */
     uint8_t promisc;
     uint8_t allmulti;
     uint8_t alluni;
@@ -65,6 +103,8 @@ typedef struct VirtIONet
     DeviceState *qdev;
 } VirtIONet;
 
+QEMU_BUILD_BUG_ON(VIRTIO_NET_MAX_QUEUES * 2 + 1 > VIRTIO_PCI_QUEUE_MAX);
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -74,14 +114,27 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+/* Receive queue 2n and transmit queue 2n + 1 make up queue pair n */
+static VirtIONetQueue *virtio_net_get_queue(VirtIONet *n, VirtQueue *vq)
+{
+    return &n->vqs[virtio_get_queue_index(vq) / 2];
+}
+
+/* Number of queue pairs in the current queue layout */
+static int virtio_net_queues(VirtIONet *n)
+{
+    return n->multiqueue ? n->max_queues : 1;
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     stw_p(&netcfg.status, n->status);
+    stw_p(&netcfg.max_virtqueue_pairs, n->max_queues);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
-    memcpy(config, &netcfg, sizeof(netcfg));
+    memcpy(config, &netcfg, n->config_size);
 }
 
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -89,7 +142,7 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
-    memcpy(&netcfg, config, sizeof(netcfg));
+    memcpy(&netcfg, config, n->config_size);
 
     if (memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
@@ -140,25 +193,30 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
 
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
-        return;
-    }
+    for (i = 0; i < virtio_net_queues(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+        if (!q->tx_waiting) {
+            continue;
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        if (virtio_net_started(n, status) && !n->vhost_started) {
+            if (q->tx_use_timer) {
+                qemu_mod_timer(q->tx_timer,
+                               qemu_get_clock_ns(vm_clock) + n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            if (q->tx_use_timer) {
+                qemu_del_timer(q->tx_timer);
+            } else {
+                qemu_bh_cancel(q->tx_bh);
+            }
         }
     }
 }
@@ -167,6 +225,21 @@ static void virtio_net_set_link_status(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
     uint16_t old_status = n->status;
+    int i;
+
+    /* Queue 0 stands for the link of the whole device */
+    if (nc->queue_index != 0) {
+        return;
+    }
+
+    for (i = 1; i < n->nic->queues; i++) {
+        VLANClientState *sub = qemu_get_subqueue(n->nic, i);
+
+        sub->link_down = nc->link_down;
+        if (sub->peer) {
+            sub->peer->link_down = nc->link_down;
+        }
+    }
 
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
@@ -179,6 +252,8 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue);
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -198,6 +273,8 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->mac_table.uni_overflow = 0;
     memset(n->mac_table.macs, 0, MAC_TABLE_ENTRIES * ETH_ALEN);
     memset(n->vlans, 0, MAX_VLAN >> 3);
+
+    virtio_net_set_multiqueue(n, 0);
 }
 
 static int peer_has_vnet_hdr(VirtIONet *n)
@@ -223,14 +300,37 @@ static int peer_has_ufo(VirtIONet *n)
     return n->has_ufo;
 }
 
+/* Applies the offloads the guest negotiated to all queues of the backend */
+static void virtio_net_set_offload(VirtIONet *n, uint32_t features)
+{
+    int i;
+
+    for (i = 0; i < n->nic->queues; i++) {
+        tap_set_offload(qemu_get_subqueue(n->nic, i)->peer,
+                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
+                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
+                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+    }
+}
+
 static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    if (n->max_queues <= 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
-        tap_using_vnet_hdr(n->nic->nc.peer, 1);
+        int i;
+
+        for (i = 0; i < n->nic->queues; i++) {
+            tap_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer, 1);
+        }
     } else {
         features &= ~(0x1 << VIRTIO_NET_F_CSUM);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO4);
@@ -279,13 +379,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
+    virtio_net_set_multiqueue(n, !!(features & (1 << VIRTIO_NET_F_MQ)));
+
     if (n->has_vnet_hdr) {
-        tap_set_offload(n->nic->nc.peer,
-                        (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                        (features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                        (features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+        virtio_net_set_offload(n, features);
     }
     if (!n->nic->nc.peer ||
         n->nic->nc.peer->info->type != NET_CLIENT_TYPE_TAP) {
@@ -404,39 +501,76 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static void virtio_net_flush_queued_packets(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->nic->queues; i++) {
+        qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
+}
+
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || !n->multiqueue ||
+        elem->out_num != 2 || elem->out_sg[1].iov_len != sizeof(queues)) {
+        error_report("virtio-net ctrl invalid multiqueue command");
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_p(elem->out_sg[1].iov_base);
+
+    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || queues > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->curr_queues = queues;
+
+    /* Packets held back for queues that were disabled can go now */
+    virtio_net_flush_queued_packets(n);
+
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_ctrl_hdr ctrl;
     virtio_net_ctrl_ack status = VIRTIO_NET_ERR;
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
-    while (virtqueue_pop(vq, &elem)) {
-        if ((elem.in_num < 1) || (elem.out_num < 1)) {
+    while ((elem = virtqueue_pop(vq))) {
+        if ((elem->in_num < 1) || (elem->out_num < 1)) {
             error_report("virtio-net ctrl missing headers");
             exit(1);
         }
 
-        if (elem.out_sg[0].iov_len < sizeof(ctrl) ||
-            elem.in_sg[elem.in_num - 1].iov_len < sizeof(status)) {
+        if (elem->out_sg[0].iov_len < sizeof(ctrl) ||
+            elem->in_sg[elem->in_num - 1].iov_len < sizeof(status)) {
             error_report("virtio-net ctrl header not in correct element");
             exit(1);
         }
 
-        ctrl.class = ldub_p(elem.out_sg[0].iov_base);
-        ctrl.cmd = ldub_p(elem.out_sg[0].iov_base + sizeof(ctrl.class));
+        ctrl.class = ldub_p(elem->out_sg[0].iov_base);
+        ctrl.cmd = ldub_p(elem->out_sg[0].iov_base + sizeof(ctrl.class));
 
         if (ctrl.class == VIRTIO_NET_CTRL_RX_MODE)
-            status = virtio_net_handle_rx_mode(n, ctrl.cmd, &elem);
+            status = virtio_net_handle_rx_mode(n, ctrl.cmd, elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_MAC)
-            status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
+            status = virtio_net_handle_mac(n, ctrl.cmd, elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
-            status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+            status = virtio_net_handle_vlan_table(n, ctrl.cmd, elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, elem);
 
-        stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
+        stb_p(elem->in_sg[elem->in_num - 1].iov_base, status);
 
-        virtqueue_push(vq, &elem, sizeof(status));
+        virtqueue_push(vq, elem, sizeof(status));
         virtio_notify(vdev, vq);
+        virtqueue_elem_free(elem);
     }
 }
 
@@ -446,45 +580,122 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    /* Any queue of the backend may steer packets to this queue */
+    virtio_net_flush_queued_packets(n);
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
     qemu_notify_event();
 }
 
+/*
+ * Hashes the addresses and ports of a packet so that packets of the same
+ * flow always end up on the same receive queue.
+ */
+static uint32_t virtio_net_flow_hash(VirtIONet *n, const uint8_t *buf,
+                                     size_t size)
+{
+    uint32_t hash;
+    size_t l3, l4;
+    int ethertype, proto;
+
+    if (n->has_vnet_hdr) {
+        buf += sizeof(struct virtio_net_hdr);
+        size -= sizeof(struct virtio_net_hdr);
+    }
+
+    if (size < 14) {
+        return 0;
+    }
+    ethertype = lduw_be_p(buf + 12);
+    l3 = 14;
+    if (ethertype == 0x8100 && size >= 18) {
+        ethertype = lduw_be_p(buf + 16);
+        l3 = 18;
+    }
+
+    if (ethertype == 0x0800 && size >= l3 + 20) {
+        proto = buf[l3 + 9];
+        hash = ldl_be_p(buf + l3 + 12) ^ ldl_be_p(buf + l3 + 16);
+        l4 = l3 + (buf[l3] & 0xf) * 4;
+        /* Only the first fragment has the ports */
+        if (lduw_be_p(buf + l3 + 6) & 0x3fff) {
+            proto = 0;
+        }
+    } else if (ethertype == 0x86dd && size >= l3 + 40) {
+        int i;
+
+        proto = buf[l3 + 6];
+        hash = 0;
+        for (i = 8; i < 40; i += 4) {
+            hash ^= ldl_be_p(buf + l3 + i);
+        }
+        l4 = l3 + 40;
+    } else {
+        return 0;
+    }
+
+    if ((proto == 6 /* TCP */ || proto == 17 /* UDP */) && size >= l4 + 4) {
+        hash ^= ldl_be_p(buf + l4);
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+/*
+ * Queue n of the backend feeds receive queue n.  Backend queues beyond the
+ * queue pairs the guest uses have their packets spread over the enabled
+ * queues by flow.
+ */
+static VirtIONetQueue *virtio_net_rx_queue(VirtIONet *n, VLANClientState *nc,
+                                           const uint8_t *buf, size_t size)
+{
+    if (nc->queue_index < n->curr_queues) {
+        return &n->vqs[nc->queue_index];
+    }
+    return &n->vqs[virtio_net_flow_hash(n, buf, size) % n->curr_queues];
+}
+
 static int virtio_net_can_receive(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q;
+
     if (!n->vdev.vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    q = &n->vqs[nc->queue_index < n->curr_queues ? nc->queue_index : 0];
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -596,19 +807,22 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q;
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
+    q = virtio_net_rx_queue(n, nc, buf, size);
+
     /* hdr_len refers to the header we supply to the guest */
     guest_hdr_len = n->mergeable_rx_bufs ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -617,13 +831,14 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
     offset = i = 0;
 
     while (offset < size) {
-        VirtQueueElement elem;
+        VirtQueueElement *elem;
         int len, total;
         struct iovec sg[VIRTQUEUE_MAX_SIZE];
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        elem = virtqueue_pop(q->rx_vq);
+        if (!elem) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -634,29 +849,29 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
             exit(1);
         }
 
-        if (elem.in_num < 1) {
+        if (elem->in_num < 1) {
             error_report("virtio-net receive queue contains no in buffers");
             exit(1);
         }
 
-        if (!n->mergeable_rx_bufs && elem.in_sg[0].iov_len != guest_hdr_len) {
+        if (!n->mergeable_rx_bufs && elem->in_sg[0].iov_len != guest_hdr_len) {
             error_report("virtio-net header not in first element");
             exit(1);
         }
 
-        memcpy(&sg, &elem.in_sg[0], sizeof(sg[0]) * elem.in_num);
+        memcpy(&sg, &elem->in_sg[0], sizeof(sg[0]) * elem->in_num);
 
         if (i == 0) {
             if (n->mergeable_rx_bufs)
                 mhdr = (struct virtio_net_hdr_mrg_rxbuf *)sg[0].iov_base;
 
-            offset += receive_header(n, sg, elem.in_num,
+            offset += receive_header(n, sg, elem->in_num,
                                      buf + offset, size - offset, guest_hdr_len);
             total += guest_hdr_len;
         }
 
         /* copy in packet.  ugh */
-        len = iov_from_buf(sg, elem.in_num,
+        len = iov_from_buf(sg, elem->in_num,
                            buf + offset, size - offset);
         total += len;
         offset += len;
@@ -671,42 +886,257 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
                          i, n->mergeable_rx_bufs,
                          offset, size, guest_hdr_len, host_hdr_len);
 #endif
+            virtqueue_elem_free(elem);
             return size;
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_elem_free(elem);
     }
 
     if (mhdr) {
         stw_p(&mhdr->num_buffers, i);
     }
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    virtqueue_flush(q->rx_vq, i);
+    virtio_notify(&n->vdev, q->rx_vq);
 
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+/* Gives back the elements of a packet that was not delivered */
+static void virtio_net_rx_discard(VirtIONetQueue *q, VirtQueueElement **elems,
+                                  int num)
+{
+    while (num-- > 0) {
+        virtqueue_discard(q->rx_vq, elems[num]);
+        virtqueue_elem_free(elems[num]);
+    }
+}
+
+/*
+ * Lets the backend read a packet straight into the receive buffers, instead
+ * of into a buffer of its own that virtio_net_receive() then copies from.
+ *
+ * The size of the packet is only known once it has been read, so the
+ * buffers are offered by guess: one buffer without mergeable buffers, as it
+ * has to take the whole packet anyway, and enough for a packet as large as
+ * the previous one with them.  Buffers that turn out not to be needed are
+ * given back.  The part of a packet that does not fit goes to rx_spill and
+ * is copied into further buffers.
+ */
+static ssize_t virtio_net_receive_direct(VLANClientState *nc,
+                                         NetReadIOV *read_iov, void *opaque)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q;
+    VirtQueueElement *elems[VIRTIO_NET_RX_DIRECT_ELEMS];
+    size_t lens[VIRTIO_NET_RX_DIRECT_ELEMS];
+    struct iovec sg[VIRTIO_NET_RX_DIRECT_SG];
+    uint8_t head[sizeof(struct virtio_net_hdr) + 36];
+    struct virtio_net_hdr *hdr = NULL;
+    size_t guest_hdr_len, host_hdr_len, avail, pkt_len, offset;
+    ssize_t size;
+    int i, num, used, sg_num;
+
+    /* Flow steering needs the packet before the queue can be picked */
+    if (nc->queue_index >= n->curr_queues || !virtio_net_can_receive(nc)) {
+        return -ENOBUFS;
+    }
+
+    q = &n->vqs[nc->queue_index];
+    if (!virtio_net_has_buffers(q, 1)) {
+        return -ENOBUFS;
+    }
+
+    guest_hdr_len = n->mergeable_rx_bufs ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+    host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+
+    num = sg_num = 0;
+    avail = 0;
+    do {
+        VirtQueueElement *elem = virtqueue_pop(q->rx_vq);
+
+        if (!elem) {
+            break;
+        }
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            exit(1);
+        }
+        /* Room for the element, the split header and rx_spill.  If even
+         * the first element doesn't fit, the copy path has to take it. */
+        if (sg_num + elem->in_num + 2 > ARRAY_SIZE(sg)) {
+            virtqueue_discard(q->rx_vq, elem);
+            virtqueue_elem_free(elem);
+            break;
+        }
+
+        if (num == 0) {
+            struct iovec *first = &elem->in_sg[0];
+
+            if (first->iov_len < guest_hdr_len ||
+                (!n->mergeable_rx_bufs && first->iov_len != guest_hdr_len)) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
+
+            /* The header from the tap goes where the guest expects it, the
+             * packet after the full guest header */
+            hdr = first->iov_base;
+            if (host_hdr_len) {
+                sg[sg_num].iov_base = first->iov_base;
+                sg[sg_num].iov_len = host_hdr_len;
+                sg_num++;
+            }
+            if (first->iov_len > guest_hdr_len) {
+                sg[sg_num].iov_base = first->iov_base + guest_hdr_len;
+                sg[sg_num].iov_len = first->iov_len - guest_hdr_len;
+                sg_num++;
+            }
+            memcpy(&sg[sg_num], &elem->in_sg[1],
+                   sizeof(sg[0]) * (elem->in_num - 1));
+            sg_num += elem->in_num - 1;
+            lens[num] = iov_size(elem->in_sg, elem->in_num) - guest_hdr_len;
+        } else {
+            memcpy(&sg[sg_num], elem->in_sg, sizeof(sg[0]) * elem->in_num);
+            sg_num += elem->in_num;
+            lens[num] = iov_size(elem->in_sg, elem->in_num);
+        }
+        avail += lens[num];
+        elems[num++] = elem;
+    } while (n->mergeable_rx_bufs && avail < q->rx_direct_hint &&
+             num < ARRAY_SIZE(elems));
+
+    if (num == 0) {
+        return -ENOBUFS;
+    }
+
+    sg[sg_num].iov_base = n->rx_spill;
+    sg[sg_num].iov_len = VIRTIO_NET_MAX_BUFSIZE;
+    sg_num++;
+
+    size = read_iov(opaque, sg, sg_num);
+    if (size <= 0) {
+        virtio_net_rx_discard(q, elems, num);
+        return 0;
+    }
+    if (size < host_hdr_len) {
+        virtio_net_rx_discard(q, elems, num);
+        return size;
+    }
+
+    pkt_len = size - host_hdr_len;
+    q->rx_direct_hint = pkt_len;
+
+    memset(head, 0, sizeof(head));
+    iov_to_buf(sg, sg_num, head, 0, sizeof(head));
+    if (!receive_filter(n, head, size)) {
+        virtio_net_rx_discard(q, elems, num);
+        return size;
+    }
+
+    if (!n->has_vnet_hdr) {
+        hdr->flags = 0;
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    } else if ((hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) && pkt_len < 1500) {
+        /* Candidates for the dhclient workaround are rare, bounce them */
+        uint8_t buf[1500];
+
+        iov_to_buf(sg, sg_num, buf, host_hdr_len, pkt_len);
+        work_around_broken_dhclient(hdr, buf, pkt_len);
+        if (!(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            iov_from_buf(&sg[1], sg_num - 1, buf, pkt_len);
+        }
+    }
+
+    /* Hand out the packet to the buffers in order, give back the rest */
+    offset = 0;
+    for (used = 0; used < num && offset < pkt_len; used++) {
+        lens[used] = MIN(lens[used], pkt_len - offset);
+        offset += lens[used];
+    }
+    if (used == 0) {
+        /* Empty packet, it still takes the header */
+        lens[used++] = 0;
+    }
+    virtio_net_rx_discard(q, elems + used, num - used);
+    num = used;
+
+    if (offset < pkt_len) {
+        if (!n->mergeable_rx_bufs) {
+            /* Truncated, dropped just like virtio_net_receive() drops it */
+            virtio_net_rx_discard(q, elems, num);
+            return size;
+        }
+
+        while (offset < pkt_len) {
+            VirtQueueElement *elem = NULL;
+
+            if (num < ARRAY_SIZE(elems)) {
+                elem = virtqueue_pop(q->rx_vq);
+            }
+            if (!elem) {
+                /* Out of buffers in the middle of the packet */
+                virtio_net_rx_discard(q, elems, num);
+                return size;
+            }
+            if (elem->in_num < 1) {
+                error_report("virtio-net receive queue contains no in buffers");
+                exit(1);
+            }
+            lens[num] = iov_from_buf(elem->in_sg, elem->in_num,
+                                     n->rx_spill + (offset - avail),
+                                     pkt_len - offset);
+            offset += lens[num];
+            elems[num++] = elem;
+        }
+    }
+
+    if (n->mergeable_rx_bufs) {
+        struct virtio_net_hdr_mrg_rxbuf *mhdr = (void *)hdr;
+
+        stw_p(&mhdr->num_buffers, num);
+    }
+
+    for (i = 0; i < num; i++) {
+        virtqueue_fill(q->rx_vq, elems[i],
+                       i == 0 ? guest_hdr_len + lens[i] : lens[i], i);
+        virtqueue_elem_free(elems[i]);
+    }
+    virtqueue_flush(q->rx_vq, num);
+    virtio_notify(&n->vdev, q->rx_vq);
+
+    return size;
+}
+
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = &n->vqs[nc->queue_index];
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+    virtqueue_push(q->tx_vq, q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+    virtqueue_elem_free(q->async_tx.elem);
+    q->async_tx.elem = NULL;
+    q->async_tx.len = 0;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
-    VirtQueueElement elem;
+    VirtIONet *n = q->n;
+    VirtQueue *vq = q->tx_vq;
+    VLANClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    VirtQueueElement *elem;
     int32_t num_packets = 0;
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
@@ -714,15 +1144,15 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
 
     assert(n->vdev.vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem) {
+        virtio_queue_set_notification(vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq))) {
         ssize_t ret, len = 0;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num = elem->out_num;
+        struct iovec *out_sg = &elem->out_sg[0];
         unsigned hdr_len;
 
         /* hdr_len refers to the header received from the guest */
@@ -747,46 +1177,89 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
+        ret = qemu_sendv_packet_async(nc, out_sg, out_num,
                                       virtio_net_tx_complete);
         if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
-            return -EBUSY;
+            virtio_queue_set_notification(vq, 0);
+            q->async_tx.elem = elem;
+            q->async_tx.len  = len;
+            break;
         }
 
         len += ret;
 
-        virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
+        virtqueue_fill(vq, elem, len, num_packets);
+        virtqueue_elem_free(elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    /* Complete the whole burst with one used index update and interrupt */
+    if (num_packets) {
+        virtqueue_flush(vq, num_packets);
+        virtio_notify(&n->vdev, vq);
+        q->tx_window_packets += num_packets;
+    }
+
+    if (q->async_tx.elem) {
+        return -EBUSY;
+    }
     return num_packets;
 }
 
+/*
+ * Picks the transmit mode for the next kick of a queue in tx=auto mode.  Only
+ * called when neither the timer nor the bottom half is pending.
+ */
+static void virtio_net_tx_adapt(VirtIONetQueue *q)
+{
+    int64_t now;
+
+    if (!q->n->tx_auto) {
+        return;
+    }
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (now - q->tx_window_start < TX_AUTO_WINDOW) {
+        return;
+    }
+
+    if (!q->tx_use_timer) {
+        if (q->tx_window_packets >= TX_AUTO_HIGH_RATE &&
+            q->tx_window_packets < q->tx_window_runs * TX_AUTO_MIN_BATCH) {
+            q->tx_use_timer = 1;
+        }
+    } else if (q->tx_window_packets < TX_AUTO_LOW_RATE) {
+        q->tx_use_timer = 0;
+    }
+
+    q->tx_window_start = now;
+    q->tx_window_packets = 0;
+    q->tx_window_runs = 0;
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_get_queue(n, vq);
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock_ns(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -794,48 +1267,80 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = virtio_net_get_queue(n, vq);
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vdev.vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
+}
+
+static void virtio_net_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(to_virtio_net(vdev), vq);
+
+    if (q->tx_use_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    int32_t ret;
+
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    q->tx_window_runs++;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    ret = virtio_net_flush_tx(q);
+    if (ret == -EBUSY) {
+        return;
+    }
+
+    /* The guest fills the queue faster than the timer drains it */
+    if (n->tx_auto && ret >= n->tx_burst) {
+        q->tx_use_timer = 0;
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+        return;
+    }
+
+    virtio_net_tx_adapt(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vdev.vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    q->tx_window_runs++;
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -843,20 +1348,27 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    ret = virtio_net_flush_tx(q);
+    if (ret == -EBUSY) {
+        return;
+    }
+    if (ret > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+        return;
     }
+
+    virtio_net_tx_adapt(q);
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
@@ -869,7 +1381,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -885,20 +1397,35 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+
+    /* Only a guest that negotiated VIRTIO_NET_F_MQ has more queues */
+    if (n->multiqueue) {
+        int i;
+
+        qemu_put_be16(f, n->max_queues);
+        qemu_put_be16(f, n->curr_queues);
+        for (i = 1; i < n->max_queues; i++) {
+            qemu_put_be32(f, n->vqs[i].tx_waiting);
+        }
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
 {
     VirtIONet *n = opaque;
-    int i;
+    int i, ret, max_queues;
 
     if (version_id < 2 || version_id > VIRTIO_NET_VM_VERSION)
         return -EINVAL;
 
-    virtio_load(&n->vdev, f);
+    /* Features the backend lacks, e.g. VIRTIO_NET_F_MQ, fail here */
+    ret = virtio_load(&n->vdev, f);
+    if (ret) {
+        return ret;
+    }
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -937,13 +1464,10 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
 
         if (n->has_vnet_hdr) {
-            tap_using_vnet_hdr(n->nic->nc.peer, 1);
-            tap_set_offload(n->nic->nc.peer,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO4) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_TSO6) & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_ECN)  & 1,
-                    (n->vdev.guest_features >> VIRTIO_NET_F_GUEST_UFO)  & 1);
+            for (i = 0; i < n->nic->queues; i++) {
+                tap_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer, 1);
+            }
+            virtio_net_set_offload(n, n->vdev.guest_features);
         }
     }
 
@@ -966,6 +1490,28 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    /*
+     * virtio_load() already set up the queue layout, which only matches the
+     * saved virtqueues if both sides have the same number of queue pairs.
+     */
+    if (n->multiqueue) {
+        max_queues = qemu_get_be16(f);
+        if (max_queues != n->max_queues) {
+            error_report("virtio-net: saved image has %d queue pairs, "
+                         "backend has %d", max_queues, n->max_queues);
+            return -1;
+        }
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+            error_report("virtio-net: saved image uses %d queue pairs, "
+                         "backend has %d", n->curr_queues, n->max_queues);
+            return -1;
+        }
+        for (i = 1; i < n->max_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -980,7 +1526,9 @@ static void virtio_net_cleanup(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
 
-    n->nic = NULL;
+    if (nc->queue_index == 0) {
+        n->nic = NULL;
+    }
 }
 
 static NetClientInfo net_virtio_info = {
@@ -988,18 +1536,87 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_direct = virtio_net_receive_direct,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
 };
 
+static void virtio_net_add_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    q->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx);
+}
+
+static void virtio_net_del_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    qemu_purge_queued_packets(qemu_get_subqueue(n->nic, index));
+    if (q->async_tx.elem) {
+        virtqueue_elem_free(q->async_tx.elem);
+        q->async_tx.elem = NULL;
+    }
+
+    if (q->tx_timer) {
+        qemu_del_timer(q->tx_timer);
+    }
+    if (q->tx_bh) {
+        qemu_bh_cancel(q->tx_bh);
+    }
+    q->tx_waiting = 0;
+
+    virtio_del_queue(&n->vdev, index * 2);
+    virtio_del_queue(&n->vdev, index * 2 + 1);
+    q->rx_vq = q->tx_vq = NULL;
+}
+
+/*
+ * Without VIRTIO_NET_F_MQ the device has a receive, a transmit and the
+ * control queue.  With it, all queue pairs come first and the control queue
+ * follows them, so the layout is changed when the guest acks the feature.
+ */
+static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
+{
+    int i;
+
+    if (n->multiqueue == multiqueue) {
+        return;
+    }
+
+    virtio_del_queue(&n->vdev, virtio_get_queue_index(n->ctrl_vq));
+    for (i = 1; i < virtio_net_queues(n); i++) {
+        virtio_net_del_queue(n, i);
+    }
+
+    n->multiqueue = multiqueue;
+    n->curr_queues = 1;
+
+    for (i = 1; i < virtio_net_queues(n); i++) {
+        virtio_net_add_queue(n, i);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+}
+
 VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    const char *tx = net->tx ? net->tx : "bh";
+    size_t config_size;
+    int i, queues = 1;
+
+    /* One queue pair per queue of the backend */
+    if (conf->peer) {
+        queues = MIN(qemu_get_netdev_queues(conf->peer), VIRTIO_NET_MAX_QUEUES);
+    }
+    config_size = queues > 1 ? sizeof(struct virtio_net_config) :
+                  offsetof(struct virtio_net_config, max_virtqueue_pairs);
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
-                                        sizeof(struct virtio_net_config),
-                                        sizeof(VirtIONet));
+                                        config_size, sizeof(VirtIONet));
+    n->config_size = config_size;
 
     n->vdev.get_config = virtio_net_get_config;
     n->vdev.set_config = virtio_net_set_config;
@@ -1008,38 +1625,54 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
-                     net->tx);
+    if (strcmp(tx, "timer") && strcmp(tx, "bh") && strcmp(tx, "auto")) {
+        error_report("virtio-net: Unknown option tx=%s, "
+                     "valid options: \"timer\" \"bh\" \"auto\"", tx);
         error_report("Defaulting to \"bh\"");
+        tx = "bh";
     }
-
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
+    if (net->txburst <= 0) {
+        error_report("virtio-net: x-txburst=%d must be positive, "
+                     "defaulting to %d", net->txburst, TX_BURST);
+        net->txburst = TX_BURST;
     }
-    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
+    conf->queues = queues;
     n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id, n);
+    n->max_queues = n->nic->queues;
+    n->curr_queues = 1;
 
     qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
 
-    n->tx_waiting = 0;
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        if (strcmp(tx, "bh")) {
+            q->tx_timer = qemu_new_timer_ns(vm_clock, virtio_net_tx_timer, q);
+        }
+        if (strcmp(tx, "timer")) {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        /* tx=auto starts out with the bottom half */
+        q->tx_use_timer = !q->tx_bh;
+    }
+    n->tx_auto = !strcmp(tx, "auto");
+    n->tx_timeout = net->txtimer;
+    virtio_net_add_queue(n, 0);
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+
     n->tx_burst = net->txburst;
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = qemu_mallocz(MAC_TABLE_ENTRIES * ETH_ALEN);
+    n->rx_spill = qemu_malloc(VIRTIO_NET_MAX_BUFSIZE);
 
     n->vlans = qemu_mallocz(MAX_VLAN >> 3);
 
@@ -1055,23 +1688,34 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        if (q->async_tx.elem) {
+            virtqueue_elem_free(q->async_tx.elem);
+            q->async_tx.elem = NULL;
+        }
+
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        }
+        if (q->tx_bh) {
+            qemu_bh_delete(q->tx_bh);
+        }
+    }
 
     unregister_savevm(n->qdev, "virtio-net", n);
 
     qemu_free(n->mac_table.macs);
     qemu_free(n->vlans);
-
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
-    }
+    qemu_free(n->rx_spill);
 
     virtio_cleanup(&n->vdev);
     qemu_del_vlan_client(&n->nic->nc);
@@ -112,6 +112,7 @@ typedef struct {
 #endif
     virtio_serial_conf serial;
     virtio_net_conf net;
+    virtio_blk_conf blk;
     bool ioeventfd_disabled;
     bool ioeventfd_started;
 } VirtIOPCIProxy;
@@ -730,7 +731,7 @@ static int virtio_blk_init_pci(PCIDevice *pci_dev)
         proxy->class_code != PCI_CLASS_STORAGE_OTHER)
         proxy->class_code = PCI_CLASS_STORAGE_SCSI;
 
-    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block);
+    vdev = virtio_blk_init(&pci_dev->qdev, &proxy->block, &proxy->blk);
     if (!vdev) {
         return -1;
     }
@@ -868,6 +869,10 @@ static PCIDeviceInfo virtio_info[] = {
                             VIRTIO_PCI_FLAG_USE_IOEVENTFD_BIT, true),
             DEFINE_PROP_UINT32("vectors", VirtIOPCIProxy, nvectors, 2),
             DEFINE_VIRTIO_BLK_FEATURES(VirtIOPCIProxy, host_features),
+            DEFINE_PROP_UINT32("x-batch", VirtIOPCIProxy, blk.batch,
+                               VIRTIO_BLK_BATCH),
+            DEFINE_PROP_BIT("x-data-plane", VirtIOPCIProxy, blk.data_plane,
+                            0, false),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
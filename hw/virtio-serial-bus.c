@@ -85,7 +85,7 @@ static bool use_multiport(VirtIOSerial *vser)
 static size_t write_to_port(VirtIOSerialPort *port,
                             const uint8_t *buf, size_t size)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
     size_t offset;
 
@@ -98,15 +98,17 @@ static size_t write_to_port(VirtIOSerialPort *port,
     while (offset < size) {
         size_t len;
 
-        if (!virtqueue_pop(vq, &elem)) {
+        elem = virtqueue_pop(vq);
+        if (!elem) {
             break;
         }
 
-        len = iov_from_buf(elem.in_sg, elem.in_num,
+        len = iov_from_buf(elem->in_sg, elem->in_num,
                            buf + offset, size - offset);
         offset += len;
 
-        virtqueue_push(vq, &elem, len);
+        virtqueue_push(vq, elem, len);
+        virtqueue_elem_free(elem);
     }
 
     virtio_notify(&port->vser->vdev, vq);
@@ -115,17 +117,121 @@ static size_t write_to_port(VirtIOSerialPort *port,
 
 static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     if (!virtio_queue_ready(vq)) {
         return;
     }
-    while (virtqueue_pop(vq, &elem)) {
-        virtqueue_push(vq, &elem, 0);
+    while ((elem = virtqueue_pop(vq))) {
+        virtqueue_push(vq, elem, 0);
+        virtqueue_elem_free(elem);
     }
     virtio_notify(vdev, vq);
 }
 
+/* How much guest data a bulk mode port gathers for one have_data_iov call */
+#define BULK_MAX_BYTES (1024 * 1024)
+
+/*
+ * Bulk mode: offer the app the rest of the element we left off in, plus as
+ * many further elements as fit, in one go.  Elements that went out in full
+ * are returned to the guest, the one the app stopped in becomes port->elem
+ * and the untouched ones are given back to the queue, so that there is
+ * never more than one element held across calls, just like below.
+ */
+static void do_flush_queued_data_bulk(VirtIOSerialPort *port, VirtQueue *vq,
+                                      VirtIOSerialPortInfo *info)
+{
+    VirtQueueElement *elems[VIRTQUEUE_MAX_SIZE];
+    unsigned int elem_end[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+
+    while (!port->throttled) {
+        VirtQueueElement *elem;
+        unsigned int nelems = 0, niov = 0, i, k;
+        size_t size = 0;
+        ssize_t ret;
+
+        if (port->elem) {
+            elem = port->elem;
+            for (k = port->iov_idx; k < elem->out_num; k++) {
+                iov[niov] = elem->out_sg[k];
+                if (k == port->iov_idx) {
+                    iov[niov].iov_base = (uint8_t *)iov[niov].iov_base +
+                                         port->iov_offset;
+                    iov[niov].iov_len -= port->iov_offset;
+                }
+                size += iov[niov++].iov_len;
+            }
+            elem_end[nelems] = niov;
+            elems[nelems++] = elem;
+            port->elem = NULL;
+        }
+
+        while (nelems < VIRTQUEUE_MAX_SIZE && size < BULK_MAX_BYTES) {
+            elem = virtqueue_pop(vq);
+            if (!elem) {
+                break;
+            }
+            if (niov + elem->out_num > VIRTQUEUE_MAX_SIZE) {
+                virtqueue_discard(vq, elem);
+                virtqueue_elem_free(elem);
+                break;
+            }
+            for (k = 0; k < elem->out_num; k++) {
+                iov[niov] = elem->out_sg[k];
+                size += iov[niov++].iov_len;
+            }
+            elem_end[nelems] = niov;
+            elems[nelems++] = elem;
+        }
+        if (!nelems) {
+            break;
+        }
+
+        ret = info->have_data_iov(port, iov, niov);
+        if (ret < 0 && ret != -EAGAIN) {
+            /* We don't handle any other type of errors here */
+            abort();
+        }
+        if (ret < 0) {
+            ret = 0;
+        }
+
+        /* Retire the elements that went out in full */
+        k = 0;
+        for (i = 0; i < nelems; i++) {
+            for (; k < elem_end[i]; k++) {
+                if (ret < iov[k].iov_len) {
+                    break;
+                }
+                ret -= iov[k].iov_len;
+            }
+            if (k < elem_end[i]) {
+                break;
+            }
+            virtqueue_fill(vq, elems[i], 0, i);
+            virtqueue_elem_free(elems[i]);
+        }
+        virtqueue_flush(vq, i);
+
+        if (i == nelems) {
+            continue;
+        }
+
+        /* Keep the element the app stopped in, as the unbatched path does */
+        port->elem = elem = elems[i];
+        port->iov_idx = elem->out_num - (elem_end[i] - k);
+        port->iov_offset = (uint8_t *)iov[k].iov_base + ret -
+                           (uint8_t *)elem->out_sg[port->iov_idx].iov_base;
+        while (--nelems > i) {
+            virtqueue_discard(vq, elems[nelems]);
+            virtqueue_elem_free(elems[nelems]);
+        }
+        virtio_serial_throttle_port(port, true);
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -136,25 +242,32 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
 
     info = DO_UPCAST(VirtIOSerialPortInfo, qdev, port->dev.info);
 
+    if (port->bulk && info->have_data_iov) {
+        do_flush_queued_data_bulk(port, vq, info);
+        virtio_notify(vdev, vq);
+        return;
+    }
+
     while (!port->throttled) {
         unsigned int i;
 
         /* Pop an elem only if we haven't left off a previous one mid-way */
-        if (!port->elem.out_num) {
-            if (!virtqueue_pop(vq, &port->elem)) {
+        if (!port->elem) {
+            port->elem = virtqueue_pop(vq);
+            if (!port->elem) {
                 break;
             }
             port->iov_idx = 0;
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem.out_num; i++) {
+        for (i = port->iov_idx; i < port->elem->out_num; i++) {
             size_t buf_size;
             ssize_t ret;
 
-            buf_size = port->elem.out_sg[i].iov_len - port->iov_offset;
+            buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
             ret = info->have_data(port,
-                                  port->elem.out_sg[i].iov_base
+                                  port->elem->out_sg[i].iov_base
                                   + port->iov_offset,
                                   buf_size);
             if (ret < 0 && ret != -EAGAIN) {
@@ -174,8 +287,9 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
         if (port->throttled) {
             break;
         }
-        virtqueue_push(vq, &port->elem, 0);
-        port->elem.out_num = 0;
+        virtqueue_push(vq, port->elem, 0);
+        virtqueue_elem_free(port->elem);
+        port->elem = NULL;
     }
     virtio_notify(vdev, vq);
 }
@@ -192,7 +306,7 @@ static void flush_queued_data(VirtIOSerialPort *port)
 
 static size_t send_control_msg(VirtIOSerialPort *port, void *buf, size_t len)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtQueue *vq;
     struct virtio_console_control *cpkt;
 
@@ -200,15 +314,17 @@ static size_t send_control_msg(VirtIOSerialPort *port, void *buf, size_t len)
     if (!virtio_queue_ready(vq)) {
         return 0;
     }
-    if (!virtqueue_pop(vq, &elem)) {
+    elem = virtqueue_pop(vq);
+    if (!elem) {
         return 0;
     }
 
     cpkt = (struct virtio_console_control *)buf;
     stl_p(&cpkt->id, port->id);
-    memcpy(elem.in_sg[0].iov_base, buf, len);
+    memcpy(elem->in_sg[0].iov_base, buf, len);
 
-    virtqueue_push(vq, &elem, len);
+    virtqueue_push(vq, elem, len);
+    virtqueue_elem_free(elem);
     virtio_notify(&port->vser->vdev, vq);
     return len;
 }
@@ -418,7 +534,7 @@ static void control_in(VirtIODevice *vdev, VirtQueue *vq)
 
 static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 {
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
     VirtIOSerial *vser;
     uint8_t *buf;
     size_t len;
@@ -427,10 +543,10 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
 
     len = 0;
     buf = NULL;
-    while (virtqueue_pop(vq, &elem)) {
+    while ((elem = virtqueue_pop(vq))) {
         size_t cur_len, copied;
 
-        cur_len = iov_size(elem.out_sg, elem.out_num);
+        cur_len = iov_size(elem->out_sg, elem->out_num);
         /*
          * Allocate a new buf only if we didn't have one previously or
          * if the size of the buf differs
@@ -441,10 +557,11 @@ static void control_out(VirtIODevice *vdev, VirtQueue *vq)
             buf = qemu_malloc(cur_len);
             len = cur_len;
         }
-        copied = iov_to_buf(elem.out_sg, elem.out_num, buf, 0, len);
+        copied = iov_to_buf(elem->out_sg, elem->out_num, buf, 0, len);
 
         handle_control_message(vser, buf, copied);
-        virtqueue_push(vq, &elem, 0);
+        virtqueue_push(vq, elem, 0);
+        virtqueue_elem_free(elem);
     }
     qemu_free(buf);
     virtio_notify(vdev, vq);
@@ -546,7 +663,7 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
         qemu_put_byte(f, port->host_connected);
 
 	elem_popped = 0;
-        if (port->elem.out_num) {
+        if (port->elem) {
             elem_popped = 1;
         }
         qemu_put_be32s(f, &elem_popped);
@@ -554,8 +671,7 @@ static void virtio_serial_save(QEMUFile *f, void *opaque)
             qemu_put_be32s(f, &port->iov_idx);
             qemu_put_be64s(f, &port->iov_offset);
 
-            qemu_put_buffer(f, (unsigned char *)&port->elem,
-                            sizeof(port->elem));
+            virtqueue_elem_save(f, port->elem);
         }
     }
 }
@@ -633,12 +749,7 @@ static int virtio_serial_load(QEMUFile *f, void *opaque, int version_id)
                 qemu_get_be32s(f, &port->iov_idx);
                 qemu_get_be64s(f, &port->iov_offset);
 
-                qemu_get_buffer(f, (unsigned char *)&port->elem,
-                                sizeof(port->elem));
-                virtqueue_map_sg(port->elem.in_sg, port->elem.in_addr,
-                                 port->elem.in_num, 1);
-                virtqueue_map_sg(port->elem.out_sg, port->elem.out_addr,
-                                 port->elem.out_num, 1);
+                port->elem = virtqueue_elem_load(f, port->ovq);
 
                 /*
                  *  Port was throttled on source machine.  Let's
@@ -778,7 +889,7 @@ static int virtser_port_qdev_init(DeviceState *qdev, DeviceInfo *base)
         port->guest_connected = true;
     }
 
-    port->elem.out_num = 0;
+    port->elem = NULL;
 
     QTAILQ_INSERT_TAIL(&port->vser->ports, port, next);
     port->ivq = port->vser->ivqs[port->id];
@@ -802,6 +913,13 @@ static int virtser_port_qdev_exit(DeviceState *qdev)
     qemu_bh_delete(port->bh);
     remove_port(port->vser, port->id);
 
+    /* Give back the buffer we were still consuming */
+    if (port->elem) {
+        virtqueue_push(port->ovq, port->elem, 0);
+        virtqueue_elem_free(port->elem);
+        port->elem = NULL;
+    }
+
     QTAILQ_REMOVE(&vser->ports, port, next);
 
     if (info->exit) {
@@ -109,7 +109,7 @@ struct VirtIOSerialPort {
      * element popped and continue consuming it once the backend
      * becomes writable again.
      */
-    VirtQueueElement elem;
+    VirtQueueElement *elem;
 
     /*
      * The index and the offset into the iov buffer that was popped in
@@ -129,6 +129,12 @@ struct VirtIOSerialPort {
     bool host_connected;
     /* Do apps not want to receive data? */
     bool throttled;
+
+    /*
+     * Hand guest data to the app many buffers at a time, through
+     * have_data_iov, instead of one buffer per have_data call.
+     */
+    uint32_t bulk;
 };
 
 struct VirtIOSerialPortInfo {
@@ -164,6 +170,15 @@ struct VirtIOSerialPortInfo {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          size_t len);
+
+    /*
+     * Optional, used instead of have_data for ports in bulk mode.  The
+     * buffers of several guest writes are gathered into one call.  The
+     * app can consume less than offered, or return -EAGAIN, and must
+     * unthrottle the port once it can take more.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port, const struct iovec *iov,
+                             int iovcnt);
 };
 
 /* Interface to the virtio-serial bus */
@@ -15,48 +15,16 @@
 
 #include "trace.h"
 #include "qemu-error.h"
+#include "qemu-barrier.h"
 #include "virtio.h"
+#include "xen.h"
 
 /* The alignment to use between consumer and producer parts of vring.
  * x86 pagesize again. */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
-/* QEMU doesn't strictly need write barriers since everything runs in
- * lock-step.  We'll leave the calls to wmb() in though to make it obvious for
- * KVM or if kqemu gets SMP support.
- * In any case, we must prevent the compiler from reordering the code.
- * TODO: we likely need some rmb()/mb() as well.
- */
-
-#define wmb() __asm__ __volatile__("": : :"memory")
-
-typedef struct VRingDesc
-{
-    uint64_t addr;
-    uint32_t len;
-    uint16_t flags;
-    uint16_t next;
-} VRingDesc;
-
-typedef struct VRingAvail
-{
-    uint16_t flags;
-    uint16_t idx;
-    uint16_t ring[0];
-} VRingAvail;
-
-typedef struct VRingUsedElem
-{
-    uint32_t id;
-    uint32_t len;
-} VRingUsedElem;
-
-typedef struct VRingUsed
-{
-    uint16_t flags;
-    uint16_t idx;
-    VRingUsedElem ring[0];
-} VRingUsed;
+/* Element pool size classes hold 1, 2, 4, ... VIRTQUEUE_MAX_SIZE buffers */
+#define VIRTQUEUE_ELEM_CLASSES          11
 
 typedef struct VRing
 {
@@ -64,19 +32,149 @@ typedef struct VRing
     target_phys_addr_t desc;
     target_phys_addr_t avail;
     target_phys_addr_t used;
+
+    /* Host mapping of the rings, NULL if they are accessed with ldX_phys */
+    VRingDesc *desc_ptr;
+    VRingAvail *avail_ptr;
+    VRingUsed *used_ptr;
+    target_phys_addr_t map_len;
+    ram_addr_t used_ram_addr;       /* for dirty tracking of used ring */
 } VRing;
 
 struct VirtQueue
 {
     VRing vring;
+    QLIST_ENTRY(VirtQueue) ring_list;
+    bool in_ring_list;
     target_phys_addr_t pa;
     uint16_t last_avail_idx;
+    /* Last used index value we have signalled on */
+    uint16_t signalled_used;
+    /* Whether signalled_used is valid */
+    bool signalled_used_valid;
+    /* Notification enabled? */
+    bool notification;
     int inuse;
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    /* Released elements, by size class */
+    VirtQueueElement *free_elems[VIRTQUEUE_ELEM_CLASSES];
+    unsigned int nr_free_elems;
+};
+
+/*
+ * Ring mapping
+ *
+ * The rings of a queue are mapped into host memory once when the guest sets
+ * the queue address, so the hot paths can access them with plain loads and
+ * stores instead of a physical page lookup per field.  Rings that do not lie
+ * in contiguous guest RAM keep using ldX_phys/stX_phys.  The mappings are
+ * dropped when the guest memory layout changes underneath them and are set up
+ * again from a bottom half, once the new layout is in place.
+ */
+
+static QLIST_HEAD(, VirtQueue) virtio_rings =
+    QLIST_HEAD_INITIALIZER(virtio_rings);
+static QEMUBH *virtio_remap_bh;
+
+static void virtqueue_unmap_rings(VirtQueue *vq)
+{
+    if (vq->vring.desc_ptr) {
+        cpu_physical_memory_unmap(vq->vring.desc_ptr, vq->vring.map_len, 1, 0);
+        vq->vring.desc_ptr = NULL;
+        vq->vring.avail_ptr = NULL;
+        vq->vring.used_ptr = NULL;
+    }
+}
+
+static void virtqueue_map_rings(VirtQueue *vq)
+{
+    target_phys_addr_t size = vq->vring.used - vq->vring.desc +
+                              offsetof(VRingUsed, ring[vq->vring.num]) +
+                              sizeof(uint16_t); /* avail_event */
+    target_phys_addr_t len = size;
+    ram_addr_t ram_addr, ram_end;
+    uint8_t *ptr;
+
+    /* The map cache may drop mappings at any time */
+    if (xen_mapcache_enabled()) {
+        return;
+    }
+
+    ptr = cpu_physical_memory_map(vq->vring.desc, &len, 1);
+    if (!ptr) {
+        return;
+    }
+    if (len != size || qemu_ram_addr_from_host(ptr, &ram_addr) ||
+        qemu_ram_addr_from_host(ptr + len - 1, &ram_end) ||
+        ram_end != ram_addr + len - 1) {
+        cpu_physical_memory_unmap(ptr, len, 0, 0);
+        return;
+    }
+
+    vq->vring.desc_ptr = (VRingDesc *)ptr;
+    vq->vring.avail_ptr = (VRingAvail *)(ptr + (vq->vring.avail -
+                                                vq->vring.desc));
+    vq->vring.used_ptr = (VRingUsed *)(ptr + (vq->vring.used -
+                                              vq->vring.desc));
+    vq->vring.used_ram_addr = ram_addr + (vq->vring.used - vq->vring.desc);
+    vq->vring.map_len = len;
+}
+
+static void virtio_remap_bh_cb(void *opaque)
+{
+    VirtQueue *vq;
+
+    QLIST_FOREACH(vq, &virtio_rings, ring_list) {
+        if (!vq->vring.desc_ptr) {
+            virtqueue_map_rings(vq);
+        }
+    }
+}
+
+static void virtio_client_set_memory(CPUPhysMemoryClient *client,
+                                     target_phys_addr_t start_addr,
+                                     ram_addr_t size,
+                                     ram_addr_t phys_offset,
+                                     bool log_dirty)
+{
+    VirtQueue *vq;
+    bool remap = false;
+
+    /* Called before the change is made, so only drop mappings here */
+    QLIST_FOREACH(vq, &virtio_rings, ring_list) {
+        if (vq->vring.desc_ptr &&
+            start_addr < vq->vring.desc + vq->vring.map_len &&
+            vq->vring.desc < start_addr + size) {
+            virtqueue_unmap_rings(vq);
+            remap = true;
+        }
+    }
+    if (remap) {
+        qemu_bh_schedule(virtio_remap_bh);
+    }
+}
+
+static int virtio_client_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                           target_phys_addr_t start_addr,
+                                           target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int virtio_client_migration_log(CPUPhysMemoryClient *client,
+                                       int enable)
+{
+    return 0;
+}
+
+static CPUPhysMemoryClient virtio_memory_client = {
+    .set_memory = virtio_client_set_memory,
+    .sync_dirty_bitmap = virtio_client_sync_dirty_bitmap,
+    .migration_log = virtio_client_migration_log,
 };
 
 /* virt queue functions */
@@ -84,44 +182,58 @@ static void virtqueue_init(VirtQueue *vq)
 {
     target_phys_addr_t pa = vq->pa;
 
+    virtqueue_unmap_rings(vq);
+
     vq->vring.desc = pa;
     vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
-}
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
-}
+    if (!pa) {
+        if (vq->in_ring_list) {
+            QLIST_REMOVE(vq, ring_list);
+            vq->in_ring_list = false;
+        }
+        return;
+    }
 
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
+    if (!virtio_remap_bh) {
+        virtio_remap_bh = qemu_bh_new(virtio_remap_bh_cb, NULL);
+        cpu_register_phys_memory_client(&virtio_memory_client);
+    }
+    if (!vq->in_ring_list) {
+        QLIST_INSERT_HEAD(&virtio_rings, vq, ring_list);
+        vq->in_ring_list = true;
+    }
+    virtqueue_map_rings(vq);
 }
 
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
+/* Reads descriptor i of a descriptor table in guest memory */
+static inline void vring_desc_read(target_phys_addr_t desc_pa,
+                                   VRingDesc *desc_ptr, int i,
+                                   VRingDesc *desc)
 {
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
-}
+    VRingDesc raw;
 
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    if (desc_ptr) {
+        raw = desc_ptr[i];
+    } else {
+        cpu_physical_memory_read(desc_pa + sizeof(VRingDesc) * i,
+                                 (uint8_t *)&raw, sizeof(raw));
+    }
+    desc->addr = ldq_p(&raw.addr);
+    desc->len = ldl_p(&raw.len);
+    desc->flags = lduw_p(&raw.flags);
+    desc->next = lduw_p(&raw.next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_ptr) {
+        return lduw_p(&vq->vring.avail_ptr->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -129,6 +241,9 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_ptr) {
+        return lduw_p(&vq->vring.avail_ptr->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -136,58 +251,125 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+    if (vq->vring.avail_ptr) {
+        return lduw_p(&vq->vring.avail_ptr->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
 
-static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
+static inline uint16_t vring_used_event(VirtQueue *vq)
 {
-    target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    stl_phys(pa, val);
+    return vring_avail_ring(vq, vq->vring.num);
+}
+
+/* Marks a part of the mapped used ring dirty after it was written */
+static inline void vring_used_written(VirtQueue *vq, size_t offset,
+                                      size_t len)
+{
+    cpu_physical_memory_mark_written(vq->vring.used_ram_addr + offset, len);
 }
 
-static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
+static inline void vring_used_ring_elem(VirtQueue *vq, int i, uint32_t id,
+                                        uint32_t len)
 {
     target_phys_addr_t pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    stl_phys(pa, val);
+    if (vq->vring.used_ptr) {
+        stl_p(&vq->vring.used_ptr->ring[i].id, id);
+        stl_p(&vq->vring.used_ptr->ring[i].len, len);
+        vring_used_written(vq, offsetof(VRingUsed, ring[i]),
+                           sizeof(VRingUsedElem));
+        return;
+    }
+    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
+    stl_phys(pa + offsetof(VRingUsedElem, id), id);
+    stl_phys(pa + offsetof(VRingUsedElem, len), len);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_ptr) {
+        return lduw_p(&vq->vring.used_ptr->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
 
-static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
+static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_ptr) {
+        stw_p(&vq->vring.used_ptr->idx, val);
+        vring_used_written(vq, offsetof(VRingUsed, idx), sizeof(uint16_t));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
-    stw_phys(pa, vring_used_idx(vq) + val);
+    stw_phys(pa, val);
 }
 
-static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+static inline uint16_t vring_used_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_ptr) {
+        return lduw_p(&vq->vring.used_ptr->flags);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    return lduw_phys(pa);
 }
 
-static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+static inline void vring_used_flags_set(VirtQueue *vq, uint16_t flags)
 {
     target_phys_addr_t pa;
+    if (vq->vring.used_ptr) {
+        stw_p(&vq->vring.used_ptr->flags, flags);
+        vring_used_written(vq, offsetof(VRingUsed, flags), sizeof(uint16_t));
+        return;
+    }
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    stw_phys(pa, flags);
+}
+
+static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
+{
+    vring_used_flags_set(vq, vring_used_flags(vq) | mask);
+}
+
+static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
+{
+    vring_used_flags_set(vq, vring_used_flags(vq) & ~mask);
+}
+
+static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
+{
+    target_phys_addr_t pa;
+    if (vq->vring.used_ptr) {
+        stw_p(&vq->vring.used_ptr->ring[vq->vring.num], val);
+        vring_used_written(vq, offsetof(VRingUsed, ring[vq->vring.num]),
+                           sizeof(uint16_t));
+        return;
+    }
+    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
+    stw_phys(pa, val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
-    if (enable)
+    vq->notification = enable;
+    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        /* Ask for a kick for the next buffer; stale when disabled */
+        if (enable) {
+            vring_avail_event(vq, vring_avail_idx(vq));
+        }
+    } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
-    else
+    } else {
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    }
+    if (enable) {
+        /* Expose avail event/used flags before caller checks the avail idx */
+        smp_mb();
+    }
 }
 
 int virtio_queue_ready(VirtQueue *vq)
@@ -227,17 +409,48 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     idx = (idx + vring_used_idx(vq)) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
-    vring_used_ring_id(vq, idx, elem->index);
-    vring_used_ring_len(vq, idx, len);
+    vring_used_ring_elem(vq, idx, elem->index, len);
+}
+
+/*
+ * Gives back the element that virtqueue_pop() returned last without using
+ * it, so that the next virtqueue_pop() returns it again.  Whatever was
+ * written to the buffers is lost.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    int i;
+
+    for (i = 0; i < elem->in_num; i++) {
+        cpu_physical_memory_unmap(elem->in_sg[i].iov_base,
+                                  elem->in_sg[i].iov_len, 1, 0);
+    }
+    for (i = 0; i < elem->out_num; i++) {
+        cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
+                                  elem->out_sg[i].iov_len, 0, 0);
+    }
+
+    vq->last_avail_idx--;
+    vq->inuse--;
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
+    uint16_t old, new;
+
     /* Make sure buffer is written before we update index. */
-    wmb();
+    smp_wmb();
     trace_virtqueue_flush(vq, count);
-    vring_used_idx_increment(vq, count);
+    old = vring_used_idx(vq);
+    new = old + count;
+    vring_used_idx_set(vq, new);
     vq->inuse -= count;
+
+    /* If we skipped past the signalled index, it can no longer be compared
+     * against the guest's used event */
+    if ((int16_t)(new - vq->signalled_used) < (uint16_t)(new - old)) {
+        vq->signalled_used_valid = false;
+    }
 }
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
@@ -258,6 +471,11 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
         exit(1);
     }
 
+    /* Don't read ring entries before the index that makes them valid */
+    if (num_heads) {
+        smp_rmb();
+    }
+
     return num_heads;
 }
 
@@ -278,19 +496,16 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    wmb();
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -311,15 +526,19 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
         target_phys_addr_t desc_pa;
+        VRingDesc *desc_ptr;
+        VRingDesc desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc_ptr = vq->vring.desc_ptr;
+        vring_desc_read(desc_pa, desc_ptr, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -332,9 +551,11 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = desc.len / sizeof(VRingDesc);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            desc_pa = desc.addr;
+            desc_ptr = NULL;
+            vring_desc_read(desc_pa, desc_ptr, i, &desc);
         }
 
         do {
@@ -344,16 +565,21 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
+                    (in_total += desc.len) >= in_bytes)
                     return 1;
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
+                    (out_total += desc.len) >= out_bytes)
                     return 1;
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(desc_pa, desc_ptr, i, &desc);
+            }
+        } while (i != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -380,53 +606,217 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
     }
 }
 
-int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
+/*
+ * Element pool
+ *
+ * Elements are allocated with room for exactly as many buffers as their size
+ * class holds, so a typical request takes a few hundred bytes instead of the
+ * worst case chain length.  Released elements are kept on a per-queue free
+ * list for each size class and reused by the next pop of a similar chain.
+ */
+
+static unsigned int virtqueue_elem_size_class(unsigned int num)
+{
+    unsigned int size_class = 0;
+
+    while ((1U << size_class) < num) {
+        size_class++;
+    }
+    return size_class;
+}
+
+static VirtQueueElement *virtqueue_elem_alloc(VirtQueue *vq,
+                                              unsigned int in_num,
+                                              unsigned int out_num)
+{
+    unsigned int size_class = virtqueue_elem_size_class(in_num + out_num);
+    unsigned int max = 1U << size_class;
+    VirtQueueElement *elem = vq->free_elems[size_class];
+    target_phys_addr_t *addr;
+    struct iovec *sg;
+
+    if (elem) {
+        vq->free_elems[size_class] = elem->next_free;
+        vq->nr_free_elems--;
+    } else {
+        elem = qemu_malloc(sizeof(*elem) + max * (sizeof(*addr) + sizeof(*sg)));
+        elem->vq = vq;
+        elem->size_class = size_class;
+    }
+
+    addr = (target_phys_addr_t *)(elem + 1);
+    sg = (struct iovec *)(addr + max);
+    elem->in_num = in_num;
+    elem->out_num = out_num;
+    elem->in_addr = addr;
+    elem->out_addr = addr + in_num;
+    elem->in_sg = sg;
+    elem->out_sg = sg + in_num;
+    elem->next_free = NULL;
+    return elem;
+}
+
+void virtqueue_elem_free(VirtQueueElement *elem)
+{
+    VirtQueue *vq = elem->vq;
+
+    /* No more elements can be in flight than the ring has entries */
+    if (vq->nr_free_elems >= MAX(vq->vring.num, 1)) {
+        qemu_free(elem);
+        return;
+    }
+    elem->next_free = vq->free_elems[elem->size_class];
+    vq->free_elems[elem->size_class] = elem;
+    vq->nr_free_elems++;
+}
+
+static void virtqueue_elem_pool_drain(VirtQueue *vq)
+{
+    VirtQueueElement *elem;
+    int i;
+
+    for (i = 0; i < VIRTQUEUE_ELEM_CLASSES; i++) {
+        while ((elem = vq->free_elems[i])) {
+            vq->free_elems[i] = elem->next_free;
+            qemu_free(elem);
+        }
+    }
+    vq->nr_free_elems = 0;
+}
+
+/*
+ * Elements that are still outstanding on migration are put into the stream
+ * in the layout the fixed size element used to have, so older versions can
+ * read them.
+ */
+typedef struct VirtQueueElementOld
+{
+    unsigned int index;
+    unsigned int out_num;
+    unsigned int in_num;
+    target_phys_addr_t in_addr[VIRTQUEUE_MAX_SIZE];
+    target_phys_addr_t out_addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec in_sg[VIRTQUEUE_MAX_SIZE];
+    struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
+} VirtQueueElementOld;
+
+void virtqueue_elem_save(QEMUFile *f, const VirtQueueElement *elem)
+{
+    VirtQueueElementOld *old = qemu_mallocz(sizeof(*old));
+
+    old->index = elem->index;
+    old->in_num = elem->in_num;
+    old->out_num = elem->out_num;
+    memcpy(old->in_addr, elem->in_addr, elem->in_num * sizeof(old->in_addr[0]));
+    memcpy(old->out_addr, elem->out_addr,
+           elem->out_num * sizeof(old->out_addr[0]));
+    memcpy(old->in_sg, elem->in_sg, elem->in_num * sizeof(old->in_sg[0]));
+    memcpy(old->out_sg, elem->out_sg, elem->out_num * sizeof(old->out_sg[0]));
+
+    qemu_put_buffer(f, (unsigned char *)old, sizeof(*old));
+    qemu_free(old);
+}
+
+VirtQueueElement *virtqueue_elem_load(QEMUFile *f, VirtQueue *vq)
+{
+    VirtQueueElementOld *old = qemu_malloc(sizeof(*old));
+    VirtQueueElement *elem;
+
+    qemu_get_buffer(f, (unsigned char *)old, sizeof(*old));
+    if (old->in_num > VIRTQUEUE_MAX_SIZE || old->out_num > VIRTQUEUE_MAX_SIZE ||
+        old->in_num + old->out_num > VIRTQUEUE_MAX_SIZE) {
+        error_report("virtio: invalid element in migration stream");
+        exit(1);
+    }
+
+    elem = virtqueue_elem_alloc(vq, old->in_num, old->out_num);
+    elem->index = old->index;
+    memcpy(elem->in_addr, old->in_addr, elem->in_num * sizeof(old->in_addr[0]));
+    memcpy(elem->out_addr, old->out_addr,
+           elem->out_num * sizeof(old->out_addr[0]));
+    memcpy(elem->in_sg, old->in_sg, elem->in_num * sizeof(old->in_sg[0]));
+    memcpy(elem->out_sg, old->out_sg, elem->out_num * sizeof(old->out_sg[0]));
+    qemu_free(old);
+
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    return elem;
+}
+
+VirtQueueElement *virtqueue_pop(VirtQueue *vq)
 {
-    unsigned int i, head, max;
+    unsigned int i, head, max, num, in_num, out_num;
     target_phys_addr_t desc_pa = vq->vring.desc;
+    VRingDesc *desc_ptr = vq->vring.desc_ptr;
+    VRingDesc desc;
+    VRingDesc chain[VIRTQUEUE_MAX_SIZE];
+    VirtQueueElement *elem;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
-        return 0;
+        return NULL;
 
     /* When we start there are none of either input nor output. */
-    elem->out_num = elem->in_num = 0;
+    num = in_num = out_num = 0;
 
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (vq->notification &&
+        (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        vring_avail_event(vq, vring_avail_idx(vq));
+    }
+    vring_desc_read(desc_pa, desc_ptr, i, &desc);
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        desc_ptr = NULL;
         i = 0;
+        vring_desc_read(desc_pa, desc_ptr, i, &desc);
     }
 
     /* Collect all the descriptors */
     do {
-        struct iovec *sg;
+        /* If we've got too many, that implies a descriptor loop. */
+        if (num >= max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+        if (num >= VIRTQUEUE_MAX_SIZE) {
+            error_report("virtio: too many descriptors in chain");
+            exit(1);
+        }
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
+        chain[num++] = desc;
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            in_num++;
         } else {
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
+            out_num++;
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(desc_pa, desc_ptr, i, &desc);
+        }
+    } while (i != max);
 
-        /* If we've got too many, that implies a descriptor loop. */
-        if ((elem->in_num + elem->out_num) > max) {
-            error_report("Looped descriptor");
-            exit(1);
+    elem = virtqueue_elem_alloc(vq, in_num, out_num);
+    in_num = out_num = 0;
+    for (i = 0; i < num; i++) {
+        if (chain[i].flags & VRING_DESC_F_WRITE) {
+            elem->in_addr[in_num] = chain[i].addr;
+            elem->in_sg[in_num++].iov_len = chain[i].len;
+        } else {
+            elem->out_addr[out_num] = chain[i].addr;
+            elem->out_sg[out_num++].iov_len = chain[i].len;
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+    }
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -437,7 +827,7 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
-    return elem->in_num + elem->out_num;
+    return elem;
 }
 
 /* virtio device */
@@ -471,12 +861,16 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vdev->vq[i].pa = 0;
+        virtqueue_init(&vdev->vq[i]);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
-        vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
+        vdev->vq[i].signalled_used = 0;
+        vdev->vq[i].signalled_used_valid = false;
+        vdev->vq[i].notification = true;
     }
 }
 
@@ -621,6 +1015,36 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+/*
+ * Removes queue n, so that the device can lay out its queues differently.
+ * Only valid while the guest is not using the queue, e.g. from set_features.
+ */
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq;
+
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vq = &vdev->vq[n];
+    vq->pa = 0;
+    virtqueue_init(vq);
+    virtqueue_elem_pool_drain(vq);
+    vq->vring.num = 0;
+    vq->last_avail_idx = 0;
+    vq->signalled_used_valid = false;
+    vq->notification = true;
+    vq->inuse = 0;
+    vq->vector = VIRTIO_NO_VECTOR;
+    vq->handle_output = NULL;
+}
+
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -628,13 +1052,36 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
-void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    uint16_t old, new;
+    bool v;
+
+    /* We need to expose used array entries before checking used event. */
+    smp_mb();
+
     /* Always notify when queue is empty (when feature acknowledge) */
-    if ((vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT) &&
-        (!(vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) ||
-         (vq->inuse || vring_avail_idx(vq) != vq->last_avail_idx)))
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !vq->inuse && vring_avail_idx(vq) == vq->last_avail_idx) {
+        return true;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vring_used_idx(vq);
+    return !v || virtio_need_event(vring_used_event(vq), new, old);
+}
+
+void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    if (!vring_notify(vdev, vq)) {
         return;
+    }
 
     trace_virtio_notify(vdev, vq);
     vdev->isr |= 0x01;
@@ -717,6 +1164,8 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
         vdev->vq[i].vring.num = qemu_get_be32(f);
         vdev->vq[i].pa = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].signalled_used_valid = false;
+        vdev->vq[i].notification = true;
 
         if (vdev->vq[i].pa) {
             uint16_t nheads;
@@ -750,6 +1199,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        vdev->vq[i].pa = 0;
+        virtqueue_init(&vdev->vq[i]);
+        virtqueue_elem_pool_drain(&vdev->vq[i]);
+    }
     qemu_del_vm_change_state_handler(vdev->vmstate);
     if (vdev->config)
         qemu_free(vdev->config);
@@ -792,6 +1248,7 @@ VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
+        vdev->vq[i].notification = true;
     }
 
     vdev->name = name;
@@ -866,6 +1323,11 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].last_avail_idx = idx;
 }
 
+void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
+{
+    vdev->vq[n].signalled_used_valid = false;
+}
+
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n)
 {
     return vdev->vq + n;
@@ -0,0 +1,266 @@
+/*
+ * Virtqueue processing outside the global mutex
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-barrier.h"
+#include "vring.h"
+
+/* Called from the device thread, where the monitor must not be used */
+#define vring_error(vring, fmt, ...) do { \
+        fprintf(stderr, "virtio: " fmt "\n", ## __VA_ARGS__); \
+        (vring)->broken = true; \
+    } while (0)
+
+bool vring_setup(Vring *vring, HostMem *hostmem, VirtIODevice *vdev, int n)
+{
+    unsigned int num = virtio_queue_get_num(vdev, n);
+
+    memset(vring, 0, sizeof(*vring));
+    vring->hostmem = hostmem;
+    vring->num = num;
+
+    vring->desc = hostmem_lookup(hostmem,
+                                 virtio_queue_get_desc_addr(vdev, n),
+                                 num * sizeof(VRingDesc));
+    vring->avail = hostmem_lookup(hostmem,
+                                  virtio_queue_get_avail_addr(vdev, n),
+                                  offsetof(VRingAvail, ring[num]) +
+                                  sizeof(uint16_t)); /* used_event */
+    vring->used = hostmem_lookup(hostmem,
+                                 virtio_queue_get_used_addr(vdev, n),
+                                 offsetof(VRingUsed, ring[num]) +
+                                 sizeof(uint16_t)); /* avail_event */
+    if (!num || !vring->desc || !vring->avail || !vring->used) {
+        return false;
+    }
+
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = lduw_p(&vring->used->idx);
+    vring->event_idx = vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX);
+    vring->notify_on_empty =
+        vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY);
+    return true;
+}
+
+/* Hand the queue back to the regular virtio code */
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
+{
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
+    virtio_queue_invalidate_signalled_used(vdev, n);
+}
+
+void vring_disable_notification(Vring *vring)
+{
+    if (!vring->event_idx) {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) | VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+/*
+ * Ask the guest to kick us for new buffers.  Returns false if buffers were
+ * added in the meantime, in which case the caller must process them instead
+ * of waiting for the kick.
+ */
+bool vring_enable_notification(Vring *vring)
+{
+    if (vring->event_idx) {
+        stw_p(&vring->used->ring[vring->num], vring->last_avail_idx);
+    } else {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) & ~VRING_USED_F_NO_NOTIFY);
+    }
+    /* Expose avail event/used flags before we check the avail idx */
+    smp_mb();
+    return lduw_p(&vring->avail->idx) == vring->last_avail_idx;
+}
+
+bool vring_should_notify(Vring *vring)
+{
+    uint16_t old, new;
+    bool v;
+
+    /* We need to expose used array entries before checking used event. */
+    smp_mb();
+
+    /* Always notify when queue is empty (when feature acknowledge) */
+    if (vring->notify_on_empty && !vring->inuse &&
+        lduw_p(&vring->avail->idx) == vring->last_avail_idx) {
+        return true;
+    }
+
+    if (!vring->event_idx) {
+        return !(lduw_p(&vring->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+
+    v = vring->signalled_used_valid;
+    vring->signalled_used_valid = true;
+    old = vring->signalled_used;
+    new = vring->signalled_used = vring->last_used_idx;
+    return !v || virtio_need_event(lduw_p(&vring->avail->ring[vring->num]),
+                                   new, old);
+}
+
+static void vring_desc_read(const VRingDesc *src, VRingDesc *desc)
+{
+    desc->addr = ldq_p(&src->addr);
+    desc->len = ldl_p(&src->len);
+    desc->flags = lduw_p(&src->flags);
+    desc->next = lduw_p(&src->next);
+}
+
+/* Readable buffers end up in iov[0 .. out_num), writable ones after them */
+static int vring_map_desc(Vring *vring, struct iovec iov[],
+                          unsigned int max_iov, unsigned int *out_num,
+                          unsigned int *in_num, const VRingDesc *desc)
+{
+    unsigned int num = *out_num + *in_num;
+
+    if (num >= max_iov) {
+        vring_error(vring, "too many descriptors in chain");
+        return -EFAULT;
+    }
+
+    if (desc->flags & VRING_DESC_F_WRITE) {
+        (*in_num)++;
+    } else if (*in_num) {
+        vring_error(vring, "readable descriptor after writable one");
+        return -EFAULT;
+    } else {
+        (*out_num)++;
+    }
+
+    iov[num].iov_base = hostmem_lookup(vring->hostmem, desc->addr, desc->len);
+    iov[num].iov_len = desc->len;
+    if (!iov[num].iov_base) {
+        vring_error(vring, "failed to map descriptor addr %#" PRIx64
+                    " len %u", desc->addr, desc->len);
+        return -EFAULT;
+    }
+    return 0;
+}
+
+static int vring_map_indirect(Vring *vring, struct iovec iov[],
+                              unsigned int max_iov, unsigned int *out_num,
+                              unsigned int *in_num, const VRingDesc *indirect)
+{
+    VRingDesc *table, desc;
+    unsigned int i = 0, max, found = 0;
+
+    if (!indirect->len || indirect->len % sizeof(VRingDesc)) {
+        vring_error(vring, "invalid size for indirect buffer table");
+        return -EFAULT;
+    }
+    max = indirect->len / sizeof(VRingDesc);
+
+    table = hostmem_lookup(vring->hostmem, indirect->addr, indirect->len);
+    if (!table) {
+        vring_error(vring, "failed to map indirect table addr %#" PRIx64,
+                    indirect->addr);
+        return -EFAULT;
+    }
+
+    do {
+        if (i >= max || ++found > max) {
+            vring_error(vring, "looped or truncated indirect descriptor");
+            return -EFAULT;
+        }
+        vring_desc_read(&table[i], &desc);
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            vring_error(vring, "nested indirect descriptor");
+            return -EFAULT;
+        }
+        if (vring_map_desc(vring, iov, max_iov, out_num, in_num, &desc) < 0) {
+            return -EFAULT;
+        }
+        i = desc.next;
+    } while (desc.flags & VRING_DESC_F_NEXT);
+
+    return 0;
+}
+
+/*
+ * Take the next buffer from the ring and map its descriptors into iov.
+ * Returns the head descriptor index, -EAGAIN if the ring is empty or
+ * -EFAULT if the guest gave us a broken ring.
+ */
+int vring_pop(Vring *vring, struct iovec iov[], unsigned int max_iov,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    VRingDesc desc;
+    unsigned int i, head, found = 0, num = vring->num;
+    uint16_t avail_idx;
+    int ret;
+
+    if (vring->broken) {
+        return -EFAULT;
+    }
+
+    avail_idx = lduw_p(&vring->avail->idx);
+    if (avail_idx == vring->last_avail_idx) {
+        return -EAGAIN;
+    }
+    if ((uint16_t)(avail_idx - vring->last_avail_idx) > num) {
+        vring_error(vring, "guest moved used index from %u to %u",
+                    vring->last_avail_idx, avail_idx);
+        return -EFAULT;
+    }
+
+    /* Don't read ring entries before the index that makes them valid */
+    smp_rmb();
+
+    head = lduw_p(&vring->avail->ring[vring->last_avail_idx % num]);
+    if (head >= num) {
+        vring_error(vring, "guest says index %u is available", head);
+        return -EFAULT;
+    }
+
+    *out_num = *in_num = 0;
+    i = head;
+    do {
+        if (i >= num || ++found > num) {
+            vring_error(vring, "looped descriptor");
+            return -EFAULT;
+        }
+        vring_desc_read(&vring->desc[i], &desc);
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            ret = vring_map_indirect(vring, iov, max_iov, out_num, in_num,
+                                     &desc);
+        } else {
+            ret = vring_map_desc(vring, iov, max_iov, out_num, in_num, &desc);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        i = desc.next;
+    } while (desc.flags & VRING_DESC_F_NEXT);
+
+    vring->last_avail_idx++;
+    vring->inuse++;
+    return head;
+}
+
+void vring_push(Vring *vring, unsigned int head, unsigned int len)
+{
+    VRingUsedElem *elem = &vring->used->ring[vring->last_used_idx % vring->num];
+    uint16_t new;
+
+    stl_p(&elem->id, head);
+    stl_p(&elem->len, len);
+
+    /* Make sure buffer is written before we update index. */
+    smp_wmb();
+    new = ++vring->last_used_idx;
+    stw_p(&vring->used->idx, new);
+    vring->inuse--;
+
+    /* If we skipped past the signalled index, it can no longer be compared
+     * against the guest's used event */
+    if ((int16_t)(new - vring->signalled_used) < 1) {
+        vring->signalled_used_valid = false;
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * Virtqueue processing outside the global mutex
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VRING_H
+#define VRING_H
+
+#include "virtio.h"
+#include "hostmem.h"
+
+/*
+ * A virtqueue that is driven by a thread of its own.  Descriptors are mapped
+ * through a HostMem table instead of cpu_physical_memory_map(), so nothing
+ * here needs the global mutex.  The VirtQueue must not be touched by the
+ * regular virtio code between vring_setup() and vring_teardown().
+ */
+typedef struct {
+    HostMem *hostmem;
+    unsigned int num;
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    uint16_t last_avail_idx;
+    uint16_t last_used_idx;
+    /* Last used index value we have signalled on */
+    uint16_t signalled_used;
+    bool signalled_used_valid;
+    unsigned int inuse;
+    bool event_idx;
+    bool notify_on_empty;
+    /* Set on a malformed ring, the queue is not processed any further */
+    bool broken;
+} Vring;
+
+bool vring_setup(Vring *vring, HostMem *hostmem, VirtIODevice *vdev, int n);
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
+void vring_disable_notification(Vring *vring);
+bool vring_enable_notification(Vring *vring);
+bool vring_should_notify(Vring *vring);
+int vring_pop(Vring *vring, struct iovec iov[], unsigned int max_iov,
+              unsigned int *out_num, unsigned int *in_num);
+void vring_push(Vring *vring, unsigned int head, unsigned int len);
+
+#endif
@@ -9,6 +9,7 @@
  */
 #include "qemu-common.h"
 #include "qemu-aio.h"
+#include "qemu-timer.h"
 #include "block_int.h"
 #include "block/raw-posix-aio.h"
 
@@ -25,6 +26,9 @@
  */
 #define MAX_EVENTS 128
 
+/* Polling for completions never goes on longer than this many poll periods */
+#define MAX_POLL_PERIODS 8
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -35,11 +39,34 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+/*
+ * Requests prepared while the queue is plugged.  They are handed to the
+ * kernel with a single io_submit() once the last plug reference is dropped
+ * or when the array fills up.
+ */
+typedef struct LaioQueue {
+    struct iocb *iocbs[MAX_EVENTS];
+    int plugged;
+    unsigned int size;
+    unsigned int idx;
+    /* requests owned by the kernel */
+    unsigned int in_flight;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* completes requests that failed to submit, outside of laio_submit() */
+    QEMUBH *completion_bh;
+
+    /* I/O queue for batched submission */
+    LaioQueue io_q;
+
+    /* how long to poll for completions before going back to sleep (ns) */
+    int64_t poll_ns;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -110,29 +137,21 @@ static void qemu_laio_enqueue_completed(struct qemu_laio_state *s,
     }
 }
 
-static void qemu_laio_completion_cb(void *opaque)
+/*
+ * Reaps all events that are currently available in the completion ring,
+ * MAX_EVENTS at a time, without blocking.
+ *
+ * Returns the number of requests that were completed.
+ */
+static int qemu_laio_reap_events(struct qemu_laio_state *s)
 {
-    struct qemu_laio_state *s = opaque;
-
-    while (1) {
-        struct io_event events[MAX_EVENTS];
-        uint64_t val;
-        ssize_t ret;
-        struct timespec ts = { 0 };
-        int nevents, i;
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i, total = 0;
 
+    do {
         do {
-            ret = read(s->efd, &val, sizeof(val));
-        } while (ret == -1 && errno == EINTR);
-
-        if (ret == -1 && errno == EAGAIN)
-            break;
-
-        if (ret != 8)
-            break;
-
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
+            nevents = io_getevents(s->ctx, 0, MAX_EVENTS, events, &ts);
         } while (nevents == -EINTR);
 
         for (i = 0; i < nevents; i++) {
@@ -143,9 +162,76 @@ static void qemu_laio_completion_cb(void *opaque)
             laiocb->ret = io_event_ret(&events[i]);
             qemu_laio_enqueue_completed(s, laiocb);
         }
+
+        if (nevents > 0) {
+            s->io_q.in_flight -= nevents;
+            total += nevents;
+        }
+    } while (nevents == MAX_EVENTS);
+
+    return total;
+}
+
+/*
+ * Spins on the completion ring for up to s->poll_ns while requests are in
+ * flight.  Fast devices often complete the next request within a few
+ * microseconds, which is much cheaper to pick up here than through another
+ * eventfd wakeup of the main loop.  Each completion extends the window, but
+ * never past MAX_POLL_PERIODS of s->poll_ns in total.
+ */
+static void qemu_laio_poll_events(struct qemu_laio_state *s)
+{
+    int64_t now, deadline, limit;
+
+    if (s->poll_ns <= 0) {
+        return;
+    }
+
+    now = get_clock();
+    deadline = now + s->poll_ns;
+    limit = now + MAX_POLL_PERIODS * s->poll_ns;
+    while (s->io_q.in_flight > 0 && (now = get_clock()) < deadline) {
+        if (qemu_laio_reap_events(s) > 0) {
+            deadline = MIN(now + s->poll_ns, limit);
+        }
+    }
+}
+
+static void ioq_submit(struct qemu_laio_state *s);
+
+static void qemu_laio_completion_cb(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    uint64_t val;
+    ssize_t ret;
+
+    do {
+        ret = read(s->efd, &val, sizeof(val));
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret != 8) {
+        return;
+    }
+
+    /*
+     * The eventfd counter only tells us that something completed; the
+     * ring may hold more events than that (e.g. completions that raced with
+     * the read above), so always drain it completely.
+     */
+    qemu_laio_reap_events(s);
+    qemu_laio_poll_events(s);
+
+    /* Completions made room for requests that io_submit() turned away */
+    if (s->io_q.idx > 0 && !s->io_q.plugged) {
+        ioq_submit(s);
     }
 }
 
+static void qemu_laio_completion_bh(void *opaque)
+{
+    qemu_laio_process_requests(opaque);
+}
+
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
@@ -156,11 +242,28 @@ static int qemu_laio_flush_cb(void *opaque)
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
+    unsigned int i;
     int ret;
 
-    if (laiocb->ret != -EINPROGRESS)
+    if (laiocb->ret != -EINPROGRESS) {
+        /* Completed but not reported yet: the callback must not run now */
+        laiocb->ret = -ECANCELED;
         return;
+    }
+
+    /* Still waiting in the submission queue, the kernel never saw it */
+    for (i = 0; i < s->io_q.idx; i++) {
+        if (s->io_q.iocbs[i] == &laiocb->iocb) {
+            memmove(&s->io_q.iocbs[i], &s->io_q.iocbs[i + 1],
+                    (s->io_q.idx - i - 1) * sizeof(s->io_q.iocbs[0]));
+            s->io_q.idx--;
+            s->count--;
+            qemu_aio_release(laiocb);
+            return;
+        }
+    }
 
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
@@ -180,8 +283,9 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
      * We might be able to do this slightly more optimal by removing the
      * O_NONBLOCK flag.
      */
-    while (laiocb->ret == -EINPROGRESS)
-        qemu_laio_completion_cb(laiocb->ctx);
+    while (laiocb->ret == -EINPROGRESS) {
+        qemu_laio_reap_events(laiocb->ctx);
+    }
 }
 
 static AIOPool laio_pool = {
@@ -189,6 +293,92 @@ static AIOPool laio_pool = {
     .cancel             = laio_cancel,
 };
 
+/*
+ * Hands all queued requests to the kernel.  Whatever io_submit() did not take
+ * stays queued and is retried once requests in flight complete.  If nothing
+ * is in flight, or on an error other than EAGAIN, the remaining requests are
+ * failed; their callbacks run from a bottom half, never from here.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    unsigned int i, len = s->io_q.idx;
+    int ret;
+
+    if (len == 0) {
+        return;
+    }
+
+    ret = io_submit(s->ctx, len, s->io_q.iocbs);
+    if (ret > 0) {
+        s->io_q.in_flight += ret;
+        len -= ret;
+        memmove(s->io_q.iocbs, &s->io_q.iocbs[ret],
+                len * sizeof(s->io_q.iocbs[0]));
+        s->io_q.idx = len;
+        if (len == 0) {
+            return;
+        }
+        /* The kernel stops at the first request it cannot queue */
+        ret = -EAGAIN;
+    }
+
+    if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        struct qemu_laiocb *laiocb =
+            container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        QLIST_INSERT_HEAD(&s->completed_reqs, laiocb, node);
+    }
+    s->io_q.idx = 0;
+    qemu_bh_schedule(s->completion_bh);
+}
+
+/*
+ * Returns -EAGAIN if the queue is full and could not be submitted, the
+ * request is not queued then.
+ */
+static int ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    if (s->io_q.idx == s->io_q.size) {
+        return -EAGAIN;
+    }
+    s->io_q.iocbs[s->io_q.idx++] = iocb;
+
+    /* submit immediately if queue is full */
+    if (s->io_q.idx == s->io_q.size) {
+        ioq_submit(s);
+    }
+    return 0;
+}
+
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0) {
+        ioq_submit(s);
+    }
+}
+
+void laio_set_poll(void *aio_ctx, int64_t poll_ns)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->poll_ns = poll_ns;
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -223,14 +413,22 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
+    /* Don't overtake requests that are still waiting for io_submit() */
+    if (s->io_q.plugged || s->io_q.idx > 0) {
+        if (ioq_enqueue(s, iocbs) < 0) {
+            goto out_dec_count;
+        }
+    } else if (io_submit(s->ctx, 1, &iocbs) < 0) {
         goto out_dec_count;
+    } else {
+        s->io_q.in_flight++;
+    }
     return &laiocb->common;
 
-out_free_aiocb:
-    qemu_aio_release(laiocb);
 out_dec_count:
     s->count--;
+out_free_aiocb:
+    qemu_aio_release(laiocb);
     return NULL;
 }
 
@@ -240,6 +438,8 @@ void *laio_init(void)
 
     s = qemu_mallocz(sizeof(*s));
     QLIST_INIT(&s->completed_reqs);
+    s->io_q.size = MAX_EVENTS;
+    s->completion_bh = qemu_bh_new(qemu_laio_completion_bh, s);
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
@@ -256,6 +456,7 @@ void *laio_init(void)
 out_close_efd:
     close(s->efd);
 out_free_state:
+    qemu_bh_delete(s->completion_bh);
     qemu_free(s);
     return NULL;
 }
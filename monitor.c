@@ -468,6 +468,12 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_JOB_COMPLETED:
+            event_name = "BLOCK_JOB_COMPLETED";
+            break;
+        case QEVENT_BLOCK_JOB_CANCELLED:
+            event_name = "BLOCK_JOB_CANCELLED";
+            break;
         default:
             abort();
             break;
@@ -2852,6 +2858,22 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
+    {
+        .name       = "block-cache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show shared block cache statistics",
+        .user_print = bdrv_shared_cache_print,
+        .mhandler.info_new = bdrv_info_shared_cache,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -3151,6 +3173,22 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-jobs",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show progress of ongoing block device operations",
+        .user_print = do_info_block_jobs_print,
+        .mhandler.info_new = do_info_block_jobs,
+    },
+    {
+        .name       = "block-cache",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show shared block cache statistics",
+        .user_print = bdrv_shared_cache_print,
+        .mhandler.info_new = bdrv_info_shared_cache,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
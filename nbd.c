@@ -49,6 +49,7 @@
 
 /* This is all part of the "official" NBD API */
 
+#define NBD_REQUEST_SIZE        (4 + 4 + 8 + 8 + 4)
 #define NBD_REPLY_SIZE          (4 + 4 + 8)
 #define NBD_REQUEST_MAGIC       0x25609513
 #define NBD_REPLY_MAGIC         0x67446698
@@ -451,43 +452,6 @@ int nbd_send_request(int csock, struct nbd_request *request)
     return 0;
 }
 
-static int nbd_receive_request(int csock, struct nbd_request *request)
-{
-    uint8_t buf[4 + 4 + 8 + 8 + 4];
-    uint32_t magic;
-
-    if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("read failed");
-        errno = EINVAL;
-        return -1;
-    }
-
-    /* Request
-       [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
-       [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
-       [ 8 .. 15]   handle
-       [16 .. 23]   from
-       [24 .. 27]   len
-     */
-
-    magic = be32_to_cpup((uint32_t*)buf);
-    request->type  = be32_to_cpup((uint32_t*)(buf + 4));
-    request->handle = be64_to_cpup((uint64_t*)(buf + 8));
-    request->from  = be64_to_cpup((uint64_t*)(buf + 16));
-    request->len   = be32_to_cpup((uint32_t*)(buf + 24));
-
-    TRACE("Got request: "
-          "{ magic = 0x%x, .type = %d, from = %" PRIu64" , len = %u }",
-          magic, request->type, request->from, request->len);
-
-    if (magic != NBD_REQUEST_MAGIC) {
-        LOG("invalid magic (got 0x%x)", magic);
-        errno = EINVAL;
-        return -1;
-    }
-    return 0;
-}
-
 int nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
     uint8_t buf[NBD_REPLY_SIZE];
@@ -523,144 +487,471 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
     return 0;
 }
 
-static int nbd_send_reply(int csock, struct nbd_reply *reply)
+/*
+ * Server side
+ *
+ * Each client is served from fd handlers: requests are read from the socket
+ * as they come in and submitted with bdrv_aio_readv/writev() right away, so
+ * many of them can be in flight per client.  Replies are queued as the
+ * requests complete, in any order, and sent with writev() straight from the
+ * request buffers.
+ */
+
+/* Requests in flight per client before we stop reading from its socket */
+#define NBD_MAX_REQUESTS 16
+
+#define NBD_MAX_BUFFER_SIZE (32 * 1024 * 1024)
+
+/*
+ * Request buffers per client before we stop reading from its socket.  The
+ * check is made before a request is read, so a client never holds more than
+ * this plus one request of NBD_MAX_BUFFER_SIZE.
+ */
+#define NBD_MAX_CLIENT_BUFFERS (16 * 1024 * 1024)
+
+struct NBDExport {
+    BlockDriverState *bs;
+    off_t dev_offset;
+    off_t size;
+    bool readonly;
+};
+
+typedef struct NBDServerRequest {
+    NBDClient *client;
+    struct nbd_request request;
+    uint8_t reply[NBD_REPLY_SIZE];
+    uint8_t *data;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    int error;
+    QTAILQ_ENTRY(NBDServerRequest) next;
+} NBDServerRequest;
+
+struct NBDClient {
+    NBDExport *exp;
+    int sock;
+    void (*close)(NBDClient *client, void *opaque);
+    void *opaque;
+    int refcount;               /* the connection and each request */
+    bool closing;
+    int nb_requests;            /* received, reply not sent yet */
+    size_t buffered;            /* data buffers of these requests */
+
+    /* request being received */
+    uint8_t request_buf[NBD_REQUEST_SIZE];
+    size_t request_offset;
+    NBDServerRequest *write_req; /* waiting for its data */
+    size_t write_offset;
+
+    /* replies that are ready to be sent */
+    QTAILQ_HEAD(, NBDServerRequest) replies;
+    size_t reply_offset;
+};
+
+NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
+                          bool readonly)
+{
+    NBDExport *exp = qemu_mallocz(sizeof(*exp));
+
+    exp->bs = bs;
+    exp->dev_offset = dev_offset;
+    exp->size = size;
+    exp->readonly = readonly;
+    return exp;
+}
+
+void nbd_export_close(NBDExport *exp)
+{
+    qemu_free(exp);
+}
+
+static void nbd_client_update_handlers(NBDClient *client);
+
+/* Whether another request may be read from the client */
+static bool nbd_client_can_read_request(NBDClient *client)
+{
+    return client->nb_requests < NBD_MAX_REQUESTS &&
+           client->buffered < NBD_MAX_CLIENT_BUFFERS;
+}
+
+/* Returns bytes transferred, 0 if the socket isn't ready or -1 on error */
+static ssize_t nbd_client_io(NBDClient *client, void *buf, size_t len,
+                             bool do_read)
+{
+    ssize_t ret;
+
+    if (do_read) {
+        ret = recv(client->sock, buf, len, 0);
+    } else {
+        ret = send(client->sock, buf, len, 0);
+    }
+    if (ret < 0) {
+        errno = socket_error();
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+    if (ret == 0) {
+        /* eof */
+        return -1;
+    }
+    return ret;
+}
+
+static void nbd_client_get(NBDClient *client)
+{
+    client->refcount++;
+}
+
+static void nbd_client_put(NBDClient *client)
+{
+    if (--client->refcount > 0) {
+        return;
+    }
+
+    if (client->close) {
+        client->close(client, client->opaque);
+    }
+    qemu_free(client);
+}
+
+static void nbd_client_free_request(NBDServerRequest *req)
+{
+    NBDClient *client = req->client;
+
+    client->buffered -= req->request.len;
+    qemu_vfree(req->data);
+    qemu_free(req);
+    client->nb_requests--;
+    nbd_client_put(client);
+}
+
+/* Stops serving the client; requests that are in flight still complete */
+static void nbd_client_close(NBDClient *client)
+{
+    NBDServerRequest *req;
+
+    if (client->closing) {
+        return;
+    }
+
+    TRACE("Closing connection");
+    client->closing = true;
+    qemu_aio_set_fd_handler(client->sock, NULL, NULL, NULL, NULL, NULL);
+    closesocket(client->sock);
+
+    if (client->write_req) {
+        nbd_client_free_request(client->write_req);
+        client->write_req = NULL;
+    }
+    while ((req = QTAILQ_FIRST(&client->replies))) {
+        QTAILQ_REMOVE(&client->replies, req, next);
+        nbd_client_free_request(req);
+    }
+
+    /* Freed once the requests in flight are done */
+    nbd_client_put(client);
+}
+
+static void nbd_client_send_replies(NBDClient *client)
+{
+    NBDServerRequest *req;
+    struct iovec iov[2];
+    size_t len, offset;
+    int iovcnt;
+    ssize_t ret;
+
+    nbd_client_get(client);
+    while (!client->closing && (req = QTAILQ_FIRST(&client->replies))) {
+        iov[0].iov_base = req->reply;
+        iov[0].iov_len = NBD_REPLY_SIZE;
+        iovcnt = 1;
+        if (req->request.type == NBD_CMD_READ && req->error == 0) {
+            iov[1].iov_base = req->data;
+            iov[1].iov_len = req->request.len;
+            iovcnt = 2;
+        }
+        len = iov[0].iov_len + (iovcnt == 2 ? iov[1].iov_len : 0);
+
+        /* skip what has been sent already */
+        offset = client->reply_offset;
+        if (offset >= NBD_REPLY_SIZE) {
+            iov[1].iov_base += offset - NBD_REPLY_SIZE;
+            iov[1].iov_len -= offset - NBD_REPLY_SIZE;
+            ret = writev(client->sock, &iov[1], 1);
+        } else {
+            iov[0].iov_base += offset;
+            iov[0].iov_len -= offset;
+            ret = writev(client->sock, iov, iovcnt);
+        }
+
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            LOG("writing to socket failed");
+            nbd_client_close(client);
+            break;
+        }
+
+        client->reply_offset += ret;
+        if (client->reply_offset < len) {
+            continue;
+        }
+
+        TRACE("Sent reply for handle %" PRIu64, req->request.handle);
+        client->reply_offset = 0;
+        QTAILQ_REMOVE(&client->replies, req, next);
+        nbd_client_free_request(req);
+    }
+
+    nbd_client_update_handlers(client);
+    nbd_client_put(client);
+}
+
+static void nbd_client_queue_reply(NBDServerRequest *req)
 {
-    uint8_t buf[4 + 4 + 8];
+    NBDClient *client = req->client;
+
+    if (client->closing) {
+        nbd_client_free_request(req);
+        return;
+    }
 
     /* Reply
        [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
-    cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
-    cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
-    cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+    cpu_to_be32w((uint32_t*)req->reply, NBD_REPLY_MAGIC);
+    cpu_to_be32w((uint32_t*)(req->reply + 4), req->error);
+    cpu_to_be64w((uint64_t*)(req->reply + 8), req->request.handle);
 
-    TRACE("Sending response to client");
+    QTAILQ_INSERT_TAIL(&client->replies, req, next);
+    nbd_client_send_replies(client);
+}
 
-    if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-        LOG("writing to socket failed");
-        errno = EINVAL;
-        return -1;
+static void nbd_client_request_cb(void *opaque, int ret)
+{
+    NBDServerRequest *req = opaque;
+
+    if (ret < 0) {
+        LOG("%s failed: %s",
+            req->request.type == NBD_CMD_READ ? "read" : "write",
+            strerror(-ret));
+        req->error = -ret;
     }
-    return 0;
+    nbd_client_queue_reply(req);
 }
 
-int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
-             off_t *offset, bool readonly, uint8_t *data, int data_size)
+static void nbd_client_submit(NBDServerRequest *req)
 {
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (req->request.from + exp->dev_offset) / 512;
+    int nb_sectors = req->request.len / 512;
+    BlockDriverAIOCB *acb;
+
+    if (req->error) {
+        nbd_client_queue_reply(req);
+        return;
+    }
+
+    req->iov.iov_base = req->data;
+    req->iov.iov_len = req->request.len;
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+    if (req->request.type == NBD_CMD_READ) {
+        acb = bdrv_aio_readv(exp->bs, sector_num, &req->qiov, nb_sectors,
+                             nbd_client_request_cb, req);
+    } else {
+        acb = bdrv_aio_writev(exp->bs, sector_num, &req->qiov, nb_sectors,
+                              nbd_client_request_cb, req);
+    }
+    if (!acb) {
+        req->error = EIO;
+        nbd_client_queue_reply(req);
+    }
+}
+
+/* Decodes a complete request header; returns NULL if the client must go */
+static NBDServerRequest *nbd_client_new_request(NBDClient *client)
+{
+    NBDExport *exp = client->exp;
+    NBDServerRequest *req;
     struct nbd_request request;
-    struct nbd_reply reply;
+    uint8_t *buf = client->request_buf;
+    uint32_t magic;
 
-    TRACE("Reading request.");
+    /* Request
+       [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
+       [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
+       [ 8 .. 15]   handle
+       [16 .. 23]   from
+       [24 .. 27]   len
+     */
+    magic = be32_to_cpup((uint32_t*)buf);
+    request.type = be32_to_cpup((uint32_t*)(buf + 4));
+    request.handle = be64_to_cpup((uint64_t*)(buf + 8));
+    request.from = be64_to_cpup((uint64_t*)(buf + 16));
+    request.len = be32_to_cpup((uint32_t*)(buf + 24));
 
-    if (nbd_receive_request(csock, &request) == -1)
-        return -1;
+    TRACE("Got request: "
+          "{ magic = 0x%x, .type = %d, from = %" PRIu64" , len = %u }",
+          magic, request.type, request.from, request.len);
 
-    if (request.len + NBD_REPLY_SIZE > data_size) {
-        LOG("len (%u) is larger than max len (%u)",
-            request.len + NBD_REPLY_SIZE, data_size);
-        errno = EINVAL;
-        return -1;
+    if (magic != NBD_REQUEST_MAGIC) {
+        LOG("invalid magic (got 0x%x)", magic);
+        return NULL;
+    }
+
+    if (request.type == NBD_CMD_DISC) {
+        TRACE("Request type is DISCONNECT");
+        return NULL;
+    }
+    if (request.type != NBD_CMD_READ && request.type != NBD_CMD_WRITE) {
+        LOG("invalid request type (%u) received", request.type);
+        return NULL;
     }
 
+    if (request.len > NBD_MAX_BUFFER_SIZE) {
+        LOG("len (%u) is larger than max len (%u)",
+            request.len, NBD_MAX_BUFFER_SIZE);
+        return NULL;
+    }
     if ((request.from + request.len) < request.from) {
         LOG("integer overflow detected! "
             "you're probably being attacked");
-        errno = EINVAL;
-        return -1;
+        return NULL;
     }
-
-    if ((request.from + request.len) > size) {
-            LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
+    if ((request.from + request.len) > exp->size) {
+        LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
             ", Offset: %" PRIu64 "\n",
-                    request.from, request.len, (uint64_t)size, dev_offset);
+            request.from, request.len, (uint64_t)exp->size,
+            (uint64_t)exp->dev_offset);
         LOG("requested operation past EOF--bad client?");
-        errno = EINVAL;
-        return -1;
+        return NULL;
     }
 
-    TRACE("Decoding type");
-
-    reply.handle = request.handle;
-    reply.error = 0;
-
-    switch (request.type) {
-    case NBD_CMD_READ:
-        TRACE("Request type is READ");
+    req = qemu_mallocz(sizeof(*req));
+    req->client = client;
+    req->request = request;
+    req->data = qemu_blockalign(exp->bs, request.len);
+    client->buffered += request.len;
+    client->nb_requests++;
+    nbd_client_get(client);
+
+    if ((request.from | request.len) & 511) {
+        req->error = EINVAL;
+    } else if (request.type == NBD_CMD_WRITE && exp->readonly) {
+        TRACE("Server is read-only, return error");
+        req->error = EPERM;
+    }
+    return req;
+}
 
-        if (bdrv_read(bs, (request.from + dev_offset) / 512,
-                  data + NBD_REPLY_SIZE,
-                  request.len / 512) == -1) {
-            LOG("reading from file failed");
-            errno = EINVAL;
-            return -1;
+static void nbd_client_read(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDServerRequest *req;
+    ssize_t ret;
+
+    nbd_client_get(client);
+    while (!client->closing) {
+        req = client->write_req;
+        if (req) {
+            ret = nbd_client_io(client, req->data + client->write_offset,
+                                req->request.len - client->write_offset,
+                                true);
+            if (ret < 0) {
+                LOG("reading from socket failed");
+                nbd_client_close(client);
+            }
+            if (ret <= 0) {
+                break;
+            }
+            client->write_offset += ret;
+            if (client->write_offset == req->request.len) {
+                client->write_req = NULL;
+                nbd_client_submit(req);
+            }
+            continue;
         }
-        *offset += request.len;
-
-        TRACE("Read %u byte(s)", request.len);
-
-        /* Reply
-           [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
-           [ 4 ..  7]    error   (0 == no error)
-           [ 7 .. 15]    handle
-         */
 
-        cpu_to_be32w((uint32_t*)data, NBD_REPLY_MAGIC);
-        cpu_to_be32w((uint32_t*)(data + 4), reply.error);
-        cpu_to_be64w((uint64_t*)(data + 8), reply.handle);
-
-        TRACE("Sending data to client");
-
-        if (write_sync(csock, data,
-                   request.len + NBD_REPLY_SIZE) !=
-                   request.len + NBD_REPLY_SIZE) {
-            LOG("writing to socket failed");
-            errno = EINVAL;
-            return -1;
+        if (!nbd_client_can_read_request(client)) {
+            break;
         }
-        break;
-    case NBD_CMD_WRITE:
-        TRACE("Request type is WRITE");
 
-        TRACE("Reading %u byte(s)", request.len);
-
-        if (read_sync(csock, data, request.len) != request.len) {
-            LOG("reading from socket failed");
-            errno = EINVAL;
-            return -1;
+        ret = nbd_client_io(client,
+                            client->request_buf + client->request_offset,
+                            NBD_REQUEST_SIZE - client->request_offset, true);
+        if (ret < 0) {
+            nbd_client_close(client);
         }
+        if (ret <= 0) {
+            break;
+        }
+        client->request_offset += ret;
+        if (client->request_offset < NBD_REQUEST_SIZE) {
+            continue;
+        }
+        client->request_offset = 0;
 
-        if (readonly) {
-            TRACE("Server is read-only, return error");
-            reply.error = 1;
+        req = nbd_client_new_request(client);
+        if (!req) {
+            nbd_client_close(client);
+            break;
+        }
+        if (req->request.type == NBD_CMD_WRITE && req->request.len > 0) {
+            client->write_req = req;
+            client->write_offset = 0;
         } else {
-            TRACE("Writing to device");
+            nbd_client_submit(req);
+        }
+    }
 
-            if (bdrv_write(bs, (request.from + dev_offset) / 512,
-                       data, request.len / 512) == -1) {
-                LOG("writing to file failed");
-                errno = EINVAL;
-                return -1;
-            }
+    nbd_client_update_handlers(client);
+    nbd_client_put(client);
+}
 
-            *offset += request.len;
-        }
+static void nbd_client_write(void *opaque)
+{
+    nbd_client_send_replies(opaque);
+}
 
-        if (nbd_send_reply(csock, &reply) == -1)
-            return -1;
-        break;
-    case NBD_CMD_DISC:
-        TRACE("Request type is DISCONNECT");
-        errno = 0;
-        return 1;
-    default:
-        LOG("invalid request type (%u) received", request.type);
-        errno = EINVAL;
-        return -1;
+static void nbd_client_update_handlers(NBDClient *client)
+{
+    if (client->closing) {
+        return;
     }
+    qemu_aio_set_fd_handler(client->sock,
+        client->write_req || nbd_client_can_read_request(client) ?
+        nbd_client_read : NULL,
+        QTAILQ_EMPTY(&client->replies) ? NULL : nbd_client_write,
+        NULL, NULL, client);
+}
 
-    TRACE("Request/Reply complete");
+/*
+ * Negotiates with a new client and starts serving it.  close is called
+ * once the client has disconnected and all its requests have completed.
+ */
+NBDClient *nbd_client_new(NBDExport *exp, int csock,
+                          void (*close)(NBDClient *, void *), void *opaque)
+{
+    NBDClient *client;
 
-    return 0;
+    if (nbd_negotiate(csock, exp->size) == -1) {
+        return NULL;
+    }
+    socket_set_nonblock(csock);
+
+    client = qemu_mallocz(sizeof(*client));
+    client->exp = exp;
+    client->sock = csock;
+    client->close = close;
+    client->opaque = opaque;
+    client->refcount = 1;
+    QTAILQ_INIT(&client->replies);
+    nbd_client_update_handlers(client);
+    return client;
 }
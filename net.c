@@ -219,6 +219,41 @@ VLANClientState *qemu_new_net_client(NetClientInfo *info,
     return vc;
 }
 
+static VLANClientState *qemu_find_netdev_queue(const char *id,
+                                               unsigned queue_index)
+{
+    VLANClientState *vc;
+
+    QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
+        if (vc->info->type != NET_CLIENT_TYPE_NIC &&
+            vc->queue_index == queue_index && !strcmp(vc->name, id)) {
+            return vc;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns the number of queues of the netdev whose queue 0 is vc */
+int qemu_get_netdev_queues(VLANClientState *vc)
+{
+    int queues = 1;
+
+    if (vc->vlan || vc->info->type == NET_CLIENT_TYPE_NIC) {
+        return 1;
+    }
+    while (qemu_find_netdev_queue(vc->name, queues)) {
+        queues++;
+    }
+    return queues;
+}
+
+/*
+ * A NIC model that can handle more than one queue sets conf->queues to its
+ * maximum.  If the netdev has several queues, queue n of the NIC is
+ * connected to queue n of the netdev; each queue has a client of its own
+ * that carries its index in queue_index.
+ */
 NICState *qemu_new_nic(NetClientInfo *info,
                        NICConf *conf,
                        const char *model,
@@ -227,19 +262,56 @@ NICState *qemu_new_nic(NetClientInfo *info,
 {
     VLANClientState *nc;
     NICState *nic;
+    int i, queues = 1;
 
     assert(info->type == NET_CLIENT_TYPE_NIC);
     assert(info->size >= sizeof(NICState));
 
+    if (conf->peer) {
+        queues = qemu_get_netdev_queues(conf->peer);
+        if (queues > MAX(conf->queues, 1)) {
+            error_report("warning: netdev %s has %d queues, %s uses %d",
+                         conf->peer->name, queues, model,
+                         MAX(conf->queues, 1));
+            queues = MAX(conf->queues, 1);
+        }
+    }
+
     nc = qemu_new_net_client(info, conf->vlan, conf->peer, model, name);
 
     nic = DO_UPCAST(NICState, nc, nc);
     nic->conf = conf;
     nic->opaque = opaque;
+    nic->queues = queues;
+
+    if (queues > 1) {
+        nic->subqueues = qemu_mallocz(queues * sizeof(*nic->subqueues));
+        nic->subqueues[0] = nc;
+        for (i = 1; i < queues; i++) {
+            VLANClientState *peer = qemu_find_netdev_queue(conf->peer->name, i);
+            NICState *sub;
+
+            nc = qemu_new_net_client(info, NULL, peer, model, nic->nc.name);
+            nc->queue_index = i;
+            sub = DO_UPCAST(NICState, nc, nc);
+            sub->conf = conf;
+            sub->opaque = opaque;
+            nic->subqueues[i] = nc;
+        }
+    }
 
     return nic;
 }
 
+VLANClientState *qemu_get_subqueue(NICState *nic, int queue_index)
+{
+    if (queue_index == 0) {
+        return &nic->nc;
+    }
+    assert(queue_index < nic->queues);
+    return nic->subqueues[queue_index];
+}
+
 static void qemu_cleanup_vlan_client(VLANClientState *vc)
 {
     if (vc->vlan) {
@@ -268,7 +340,7 @@ static void qemu_free_vlan_client(VLANClientState *vc)
     qemu_free(vc);
 }
 
-void qemu_del_vlan_client(VLANClientState *vc)
+static void qemu_del_vlan_client_queue(VLANClientState *vc)
 {
     /* If there is a peer NIC, delete and cleanup client, but do not free. */
     if (!vc->vlan && vc->peer && vc->peer->info->type == NET_CLIENT_TYPE_NIC) {
@@ -298,6 +370,22 @@ void qemu_del_vlan_client(VLANClientState *vc)
     qemu_free_vlan_client(vc);
 }
 
+void qemu_del_vlan_client(VLANClientState *vc)
+{
+    if (vc->info->type == NET_CLIENT_TYPE_NIC) {
+        NICState *nic = DO_UPCAST(NICState, nc, vc);
+        int i;
+
+        for (i = nic->queues - 1; i > 0; i--) {
+            qemu_del_vlan_client_queue(nic->subqueues[i]);
+        }
+        qemu_free(nic->subqueues);
+        nic->subqueues = NULL;
+        nic->queues = 1;
+    }
+    qemu_del_vlan_client_queue(vc);
+}
+
 VLANClientState *
 qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                               const char *client_str)
@@ -943,6 +1031,15 @@ static const struct {
                 .name = "fd",
                 .type = QEMU_OPT_STRING,
                 .help = "file descriptor of an already opened tap",
+            }, {
+                .name = "fds",
+                .type = QEMU_OPT_STRING,
+                .help = "colon separated file descriptors of the queues "
+                        "of an already opened multiqueue tap",
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues to open on a multiqueue tap",
             }, {
                 .name = "script",
                 .type = QEMU_OPT_STRING,
@@ -1216,7 +1313,11 @@ int do_netdev_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
         qerror_report(QERR_DEVICE_NOT_FOUND, id);
         return -1;
     }
-    qemu_del_vlan_client(vc);
+    /* Delete the other queues of a multiqueue netdev as well */
+    do {
+        qemu_del_vlan_client(vc);
+        vc = qemu_find_netdev(id);
+    } while (vc && vc->info->type != NET_CLIENT_TYPE_NIC);
     qemu_opts_del(qemu_opts_find(qemu_find_opts("netdev"), id));
     return 0;
 }
@@ -1295,7 +1396,8 @@ void net_cleanup(void)
         }
     }
 
-    QTAILQ_FOREACH_SAFE(vc, &non_vlan_clients, next, next_vc) {
+    /* Deleting a multiqueue NIC deletes the clients of all its queues */
+    while ((vc = QTAILQ_FIRST(&non_vlan_clients))) {
         qemu_del_vlan_client(vc);
     }
 }
@@ -1347,7 +1449,7 @@ void net_check_clients(void)
                     vlan->id);
     }
     QTAILQ_FOREACH(vc, &non_vlan_clients, next) {
-        if (vc->info->type == NET_CLIENT_TYPE_NIC) {
+        if (vc->info->type == NET_CLIENT_TYPE_NIC && vc->queue_index == 0) {
             seen_nics++;
         }
         if (!vc->peer) {
@@ -11,6 +11,13 @@ struct MACAddr {
     uint8_t a[6];
 };
 
+/*
+ * Most queues of a multiqueue netdev.  virtio-net, the only NIC model using
+ * several, needs two virtqueues per queue and one for its control queue out
+ * of the 64 a virtio device has (VIRTIO_PCI_QUEUE_MAX).
+ */
+#define NET_MAX_QUEUES 31
+
 /* qdev nic properties */
 
 typedef struct NICConf {
@@ -18,6 +25,7 @@ typedef struct NICConf {
     VLANState *vlan;
     VLANClientState *peer;
     int32_t bootindex;
+    int32_t queues;     /* set by multiqueue NIC models, not a property */
 } NICConf;
 
 #define DEFINE_NIC_PROPERTIES(_state, _conf)                            \
@@ -44,6 +52,8 @@ typedef ssize_t (NetReceive)(VLANClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(VLANClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (VLANClientState *);
 typedef void (LinkStatusChanged)(VLANClientState *);
+typedef ssize_t (NetReadIOV)(void *, const struct iovec *, int);
+typedef ssize_t (NetReceiveDirect)(VLANClientState *, NetReadIOV *, void *);
 
 typedef struct NetClientInfo {
     net_client_type type;
@@ -55,6 +65,14 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     NetPoll *poll;
+    /*
+     * Lets a backend that is the only peer of a NIC read a packet straight
+     * into the receive buffers of the NIC: the NIC calls read_iov with its
+     * buffers and returns the size of the packet, 0 if there was none, or
+     * -ENOBUFS if it has no buffers to offer and the packet has to take the
+     * normal path.
+     */
+    NetReceiveDirect *receive_direct;
 } NetClientInfo;
 
 struct VLANClientState {
@@ -68,6 +86,7 @@ struct VLANClientState {
     char *name;
     char info_str[256];
     unsigned receive_disabled : 1;
+    unsigned queue_index;
 };
 
 typedef struct NICState {
@@ -75,6 +94,9 @@ typedef struct NICState {
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
+    /* Queue 0 keeps the clients of all queues of a multiqueue NIC */
+    int queues;
+    VLANClientState **subqueues;
 } NICState;
 
 struct VLANState {
@@ -86,6 +108,7 @@ struct VLANState {
 
 VLANState *qemu_find_vlan(int id, int allocate);
 VLANClientState *qemu_find_netdev(const char *id);
+int qemu_get_netdev_queues(VLANClientState *vc);
 VLANClientState *qemu_new_net_client(NetClientInfo *info,
                                      VLANState *vlan,
                                      VLANClientState *peer,
@@ -97,6 +120,7 @@ NICState *qemu_new_nic(NetClientInfo *info,
                        const char *name,
                        void *opaque);
 void qemu_del_vlan_client(VLANClientState *vc);
+VLANClientState *qemu_get_subqueue(NICState *nic, int queue_index);
 VLANClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                                const char *client_str);
 typedef void (*qemu_nic_foreach)(NICState *nic, void *opaque);
@@ -49,6 +49,9 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Upper bound for queues= and fds= */
+#define TAP_MAX_QUEUES NET_MAX_QUEUES
+
 typedef struct TAPState {
     VLANClientState nc;
     int fd;
@@ -189,6 +192,36 @@ static void tap_send_completed(VLANClientState *nc, ssize_t len)
     tap_read_poll(s, 1);
 }
 
+static ssize_t tap_read_iov(void *opaque, const struct iovec *iov, int iovcnt)
+{
+    TAPState *s = opaque;
+    ssize_t len;
+
+    do {
+        len = readv(s->fd, iov, iovcnt);
+    } while (len == -1 && errno == EINTR);
+
+    return len;
+}
+
+/*
+ * Whether the peer can take packets without the copy through s->buf.  While
+ * either link is down or the peer has stopped receiving, packets go the copy
+ * path, which drops or queues them like qemu_send_packet_async() does.
+ */
+static int tap_can_send_direct(TAPState *s)
+{
+#ifdef __sun__
+    /* Packets have to be read with getmsg() */
+    return 0;
+#else
+    return !s->nc.vlan && s->nc.peer && s->nc.peer->info->receive_direct &&
+        !s->nc.link_down && !s->nc.peer->link_down &&
+        !s->nc.peer->receive_disabled &&
+        !(s->host_vnet_hdr_len && !s->using_vnet_hdr);
+#endif
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
@@ -197,6 +230,14 @@ static void tap_send(void *opaque)
     do {
         uint8_t *buf = s->buf;
 
+        if (tap_can_send_direct(s)) {
+            size = s->nc.peer->info->receive_direct(s->nc.peer,
+                                                     tap_read_iov, s);
+            if (size != -ENOBUFS) {
+                continue;
+            }
+        }
+
         size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
         if (size <= 0) {
             break;
@@ -389,7 +430,7 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int mq_required)
 {
     int fd, vnet_hdr_required;
     char ifname[128] = {0,};
@@ -406,7 +447,8 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
+    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required,
+                      mq_required));
     if (fd < 0) {
         return -1;
     }
@@ -425,28 +467,108 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
     return fd;
 }
 
+/* Opens another queue of the interface that net_tap_init() set up */
+static int net_tap_open_queue(QemuOpts *opts, int vnet_hdr)
+{
+    char ifname[128];
+    int fd, queue_vnet_hdr = vnet_hdr;
+
+    pstrcpy(ifname, sizeof(ifname), qemu_opt_get(opts, "ifname"));
+    TFR(fd = tap_open(ifname, sizeof(ifname), &queue_vnet_hdr, vnet_hdr, 1));
+    return fd;
+}
+
+/* Parses fds=, a colon separated list of already opened tap queues */
+static int net_tap_parse_fds(Monitor *mon, const char *str, int *fds, int max)
+{
+    char buf[128];
+    const char *p = str;
+    int n = 0;
+
+    while (*p) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? end - p : strlen(p);
+
+        if (n == max || len == 0 || len >= sizeof(buf)) {
+            error_report("invalid fds=%s, at most %d queues are supported",
+                         str, max);
+            return -1;
+        }
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+
+        fds[n] = net_handle_fd_param(mon, buf);
+        if (fds[n] == -1) {
+            return -1;
+        }
+        fcntl(fds[n], F_SETFL, O_NONBLOCK);
+        n++;
+
+        p += len;
+        if (*p == ':') {
+            p++;
+        }
+    }
+    return n;
+}
+
 int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
 {
-    TAPState *s;
-    int fd, vnet_hdr = 0;
+    TAPState *s = NULL;
+    int fds[TAP_MAX_QUEUES];
+    int i, queues, vnet_hdr = 0;
 
-    if (qemu_opt_get(opts, "fd")) {
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1 || queues > TAP_MAX_QUEUES) {
+        error_report("queues= must be between 1 and %d", TAP_MAX_QUEUES);
+        return -1;
+    }
+    if (vlan && (queues > 1 || qemu_opt_get(opts, "fds"))) {
+        error_report("multiqueue tap is only supported with -netdev");
+        return -1;
+    }
+
+    if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "fds")) {
         if (qemu_opt_get(opts, "ifname") ||
             qemu_opt_get(opts, "script") ||
             qemu_opt_get(opts, "downscript") ||
             qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
+            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd= and fds=");
             return -1;
         }
 
-        fd = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
-        if (fd == -1) {
-            return -1;
+        if (qemu_opt_get(opts, "fds")) {
+            if (qemu_opt_get(opts, "fd") || qemu_opt_get(opts, "queues")) {
+                error_report("fd= and queues= are invalid with fds=");
+                return -1;
+            }
+            queues = net_tap_parse_fds(mon, qemu_opt_get(opts, "fds"), fds,
+                                       TAP_MAX_QUEUES);
+            if (queues <= 0) {
+                if (queues == 0) {
+                    error_report("fds= needs at least one file descriptor");
+                }
+                return -1;
+            }
+        } else {
+            if (queues > 1) {
+                error_report("queues= is invalid with fd=, use fds=");
+                return -1;
+            }
+            fds[0] = net_handle_fd_param(mon, qemu_opt_get(opts, "fd"));
+            if (fds[0] == -1) {
+                return -1;
+            }
+            fcntl(fds[0], F_SETFL, O_NONBLOCK);
         }
 
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-
-        vnet_hdr = tap_probe_vnet_hdr(fd);
+        vnet_hdr = tap_probe_vnet_hdr(fds[0]);
+        for (i = 1; i < queues; i++) {
+            if (tap_probe_vnet_hdr(fds[i]) != vnet_hdr) {
+                error_report("all fds= must agree on IFF_VNET_HDR");
+                return -1;
+            }
+        }
     } else {
         if (!qemu_opt_get(opts, "script")) {
             qemu_opt_set(opts, "script", DEFAULT_NETWORK_SCRIPT);
@@ -456,38 +578,72 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
             qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
         }
 
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
+        fds[0] = net_tap_init(opts, &vnet_hdr, queues > 1);
+        if (fds[0] == -1) {
             return -1;
         }
+        for (i = 1; i < queues; i++) {
+            fds[i] = net_tap_open_queue(opts, vnet_hdr);
+            if (fds[i] == -1) {
+                while (i-- > 0) {
+                    close(fds[i]);
+                }
+                return -1;
+            }
+        }
     }
 
-    s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
-    if (!s) {
-        close(fd);
-        return -1;
-    }
-
-    if (tap_set_sndbuf(s->fd, opts) < 0) {
-        return -1;
-    }
-
-    if (qemu_opt_get(opts, "fd")) {
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
-    } else {
-        const char *ifname, *script, *downscript;
+    /*
+     * Every queue is a client of its own, named after the netdev and told
+     * apart by queue_index; queue 0 is created first so that it is the one
+     * a NIC finds with netdev=.
+     */
+    for (i = 0; i < queues; i++) {
+        TAPState *q;
+
+        q = net_tap_fd_init(vlan, "tap", name, fds[i], vnet_hdr);
+        if (!q) {
+            close(fds[i]);
+            return -1;
+        }
+        q->nc.queue_index = i;
+        if (i == 0) {
+            s = q;
+        }
 
-        ifname     = qemu_opt_get(opts, "ifname");
-        script     = qemu_opt_get(opts, "script");
-        downscript = qemu_opt_get(opts, "downscript");
+        if (tap_set_sndbuf(q->fd, opts) < 0) {
+            return -1;
+        }
 
-        snprintf(s->nc.info_str, sizeof(s->nc.info_str),
-                 "ifname=%s,script=%s,downscript=%s",
-                 ifname, script, downscript);
+        if (qemu_opt_get(opts, "fd")) {
+            snprintf(q->nc.info_str, sizeof(q->nc.info_str), "fd=%d", fds[i]);
+        } else if (qemu_opt_get(opts, "fds")) {
+            snprintf(q->nc.info_str, sizeof(q->nc.info_str),
+                     "fd=%d,queue=%d", fds[i], i);
+        } else {
+            const char *ifname, *script, *downscript;
+
+            ifname     = qemu_opt_get(opts, "ifname");
+            script     = qemu_opt_get(opts, "script");
+            downscript = qemu_opt_get(opts, "downscript");
+
+            if (queues > 1) {
+                snprintf(q->nc.info_str, sizeof(q->nc.info_str),
+                         "ifname=%s,script=%s,downscript=%s,queue=%d",
+                         ifname, script, downscript, i);
+            } else {
+                snprintf(q->nc.info_str, sizeof(q->nc.info_str),
+                         "ifname=%s,script=%s,downscript=%s",
+                         ifname, script, downscript);
+            }
 
-        if (strcmp(downscript, "no") != 0) {
-            snprintf(s->down_script, sizeof(s->down_script), "%s", downscript);
-            snprintf(s->down_script_arg, sizeof(s->down_script_arg), "%s", ifname);
+            /* The interface goes away with the last queue */
+            if (i == 0 && strcmp(downscript, "no") != 0) {
+                snprintf(q->down_script, sizeof(q->down_script), "%s",
+                         downscript);
+                snprintf(q->down_script_arg, sizeof(q->down_script_arg), "%s",
+                         ifname);
+            }
         }
     }
 
@@ -495,6 +651,10 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
                           qemu_opt_get_bool(opts, "vhostforce", false))) {
         int vhostfd, r;
         bool force = qemu_opt_get_bool(opts, "vhostforce", false);
+        if (queues > 1) {
+            error_report("vhost-net does not support multiqueue tap");
+            return -1;
+        }
         if (qemu_opt_get(opts, "vhostfd")) {
             r = net_handle_fd_param(mon, qemu_opt_get(opts, "vhostfd"));
             if (r == -1) {
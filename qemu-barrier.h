@@ -1,10 +1,32 @@
 #ifndef __QEMU_BARRIER_H
 #define __QEMU_BARRIER_H 1
 
-/* FIXME: arch dependant, x86 version */
-#define smp_wmb()   asm volatile("" ::: "memory")
-
 /* Compiler barrier */
 #define barrier()   asm volatile("" ::: "memory")
 
+#if defined(__i386__) || defined(__x86_64__)
+
+/*
+ * Stores are not reordered with other stores and loads are not reordered
+ * with other loads on x86, only a store followed by a load needs a fence.
+ */
+#define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+#define smp_mb()    __sync_synchronize()
+
+#elif defined(__powerpc__)
+
+#define smp_wmb()   asm volatile("eieio" ::: "memory")
+#define smp_rmb()   asm volatile("sync" ::: "memory")
+#define smp_mb()    asm volatile("sync" ::: "memory")
+
+#else
+
+/* Full barrier for everything else; correct but possibly slower */
+#define smp_wmb()   __sync_synchronize()
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
+
+#endif
+
 #endif
@@ -28,6 +28,7 @@
 #include "sysemu.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "iov.h"
 #include "hw/usb.h"
 #include "hw/baum.h"
 #include "hw/msmouse.h"
@@ -145,6 +146,62 @@ int qemu_chr_write(CharDriverState *s, const uint8_t *buf, int len)
     return s->chr_write(s, buf, len);
 }
 
+/*
+ * Gather write.  Backends that implement it never block: they return the
+ * number of bytes taken, which may be less than asked for, or -EAGAIN.  Use
+ * qemu_chr_add_write_ready() to learn when to try again.  Other backends
+ * fall back to qemu_chr_write() and behave like it.
+ */
+int qemu_chr_writev(CharDriverState *s, const struct iovec *iov, int iovcnt)
+{
+    int i, ret, total = 0;
+
+    if (s->chr_writev) {
+        return s->chr_writev(s, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        ret = qemu_chr_write(s, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0) {
+            return total ? total : ret;
+        }
+        total += ret;
+        if (ret < iov[i].iov_len) {
+            break;
+        }
+    }
+    return total;
+}
+
+/*
+ * Call fd_write_ready once, as soon as the backend can take more data.
+ * Passing NULL cancels a pending request.
+ */
+int qemu_chr_add_write_ready(CharDriverState *s, IOHandler *fd_write_ready,
+                             void *opaque)
+{
+    if (!s->chr_update_write_handler) {
+        return -ENOTSUP;
+    }
+    s->chr_write_ready = fd_write_ready;
+    s->write_ready_opaque = opaque;
+    s->chr_update_write_handler(s);
+    return 0;
+}
+
+#ifndef _WIN32
+static void qemu_chr_write_ready(CharDriverState *s)
+{
+    IOHandler *fd_write_ready = s->chr_write_ready;
+
+    s->chr_write_ready = NULL;
+    s->chr_update_write_handler(s);
+    if (fd_write_ready) {
+        fd_write_ready(s->write_ready_opaque);
+    }
+}
+#endif
+
 int qemu_chr_ioctl(CharDriverState *s, int cmd, void *arg)
 {
     if (!s->chr_ioctl)
@@ -554,6 +611,27 @@ static int fd_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     return send_all(s->fd_out, buf, len);
 }
 
+static int fd_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                         int iovcnt)
+{
+    FDCharDriver *s = chr->opaque;
+    ssize_t ret;
+
+    do {
+        ret = writev(s->fd_out, iov, MIN(iovcnt, IOV_MAX));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+    }
+    return ret;
+}
+
+static void fd_chr_write_ready(void *opaque)
+{
+    qemu_chr_write_ready(opaque);
+}
+
 static int fd_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -590,16 +668,33 @@ static void fd_chr_read(void *opaque)
 static void fd_chr_update_read_handler(CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
+    IOHandler *fd_write = NULL;
 
+    if (s->fd_in == s->fd_out && chr->chr_write_ready) {
+        fd_write = fd_chr_write_ready;
+    }
     if (s->fd_in >= 0) {
         if (display_type == DT_NOGRAPHIC && s->fd_in == 0) {
         } else {
             qemu_set_fd_handler2(s->fd_in, fd_chr_read_poll,
-                                 fd_chr_read, NULL, chr);
+                                 fd_chr_read, fd_write, chr);
         }
     }
 }
 
+static void fd_chr_update_write_handler(CharDriverState *chr)
+{
+    FDCharDriver *s = chr->opaque;
+
+    if (s->fd_out == s->fd_in) {
+        fd_chr_update_read_handler(chr);
+    } else if (s->fd_out >= 0) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL,
+                             chr->chr_write_ready ? fd_chr_write_ready : NULL,
+                             chr);
+    }
+}
+
 static void fd_chr_close(struct CharDriverState *chr)
 {
     FDCharDriver *s = chr->opaque;
@@ -610,6 +705,9 @@ static void fd_chr_close(struct CharDriverState *chr)
             qemu_set_fd_handler2(s->fd_in, NULL, NULL, NULL, NULL);
         }
     }
+    if (s->fd_out >= 0 && s->fd_out != s->fd_in) {
+        qemu_set_fd_handler2(s->fd_out, NULL, NULL, NULL, NULL);
+    }
 
     qemu_free(s);
     qemu_chr_event(chr, CHR_EVENT_CLOSED);
@@ -627,7 +725,9 @@ static CharDriverState *qemu_chr_open_fd(int fd_in, int fd_out)
     s->fd_out = fd_out;
     chr->opaque = s;
     chr->chr_write = fd_chr_write;
+    chr->chr_writev = fd_chr_writev;
     chr->chr_update_read_handler = fd_chr_update_read_handler;
+    chr->chr_update_write_handler = fd_chr_update_write_handler;
     chr->chr_close = fd_chr_close;
 
     qemu_chr_generic_open(chr);
@@ -1929,6 +2029,37 @@ static int tcp_chr_write(CharDriverState *chr, const uint8_t *buf, int len)
     }
 }
 
+#ifndef _WIN32
+static int tcp_chr_writev(CharDriverState *chr, const struct iovec *iov,
+                          int iovcnt)
+{
+    TCPCharDriver *s = chr->opaque;
+    struct msghdr msg;
+    ssize_t ret;
+
+    if (!s->connected) {
+        return iov_size(iov, iovcnt);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = MIN(iovcnt, IOV_MAX);
+    do {
+        ret = sendmsg(s->fd, &msg, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+    }
+    return ret;
+}
+
+static void tcp_chr_write_ready(void *opaque)
+{
+    qemu_chr_write_ready(opaque);
+}
+#endif
+
 static int tcp_chr_read_poll(void *opaque)
 {
     CharDriverState *chr = opaque;
@@ -2076,6 +2207,12 @@ static void tcp_chr_read(void *opaque)
         qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
         closesocket(s->fd);
         s->fd = -1;
+#ifndef _WIN32
+        /* Let a waiting writer find out the data is going nowhere */
+        if (chr->chr_write_ready) {
+            qemu_chr_write_ready(chr);
+        }
+#endif
         qemu_chr_event(chr, CHR_EVENT_CLOSED);
     } else if (size > 0) {
         if (s->do_telnetopt)
@@ -2092,14 +2229,30 @@ CharDriverState *qemu_chr_open_eventfd(int eventfd)
 }
 #endif
 
+static void tcp_chr_update_handlers(CharDriverState *chr)
+{
+    TCPCharDriver *s = chr->opaque;
+    IOHandler *fd_write = NULL;
+
+    if (!s->connected) {
+        return;
+    }
+#ifndef _WIN32
+    if (chr->chr_write_ready) {
+        fd_write = tcp_chr_write_ready;
+    }
+#endif
+    qemu_set_fd_handler2(s->fd, tcp_chr_read_poll, tcp_chr_read, fd_write,
+                         chr);
+}
+
 static void tcp_chr_connect(void *opaque)
 {
     CharDriverState *chr = opaque;
     TCPCharDriver *s = chr->opaque;
 
     s->connected = 1;
-    qemu_set_fd_handler2(s->fd, tcp_chr_read_poll,
-                         tcp_chr_read, NULL, chr);
+    tcp_chr_update_handlers(chr);
     qemu_chr_generic_open(chr);
 }
 
@@ -2229,6 +2382,10 @@ static CharDriverState *qemu_chr_open_socket(QemuOpts *opts)
 
     chr->opaque = s;
     chr->chr_write = tcp_chr_write;
+#ifndef _WIN32
+    chr->chr_writev = tcp_chr_writev;
+    chr->chr_update_write_handler = tcp_chr_update_handlers;
+#endif
     chr->chr_close = tcp_chr_close;
     chr->get_msgfd = tcp_get_msgfd;
 
@@ -58,6 +58,58 @@ static QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "aio_poll",
+            .type = QEMU_OPT_NUMBER,
+            .help = "time to poll for native AIO completions (in microseconds)",
+        },{
+            .name = "metadata-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "memory used to cache image metadata tables",
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy read backing sectors into the image",
+        },{
+            .name = "detect-zeroes",
+            .type = QEMU_OPT_BOOL,
+            .help = "avoid allocating space for writes of zeroes",
+        },{
+            .name = "shared-cache",
+            .type = QEMU_OPT_BOOL,
+            .help = "cache reads of backing files together with other drives",
+        },{
+            .name = "bps",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total bytes per second",
+        },{
+            .name = "bps_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read bytes per second",
+        },{
+            .name = "bps_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write bytes per second",
+        },{
+            .name = "iops",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit total I/O operations per second",
+        },{
+            .name = "iops_rd",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit read operations per second",
+        },{
+            .name = "iops_wr",
+            .type = QEMU_OPT_NUMBER,
+            .help = "limit write operations per second",
+        },{
+            .name = "bps_burst",
+            .type = QEMU_OPT_NUMBER,
+            .help = "bytes that may be transferred in a burst",
+        },{
+            .name = "iops_burst",
+            .type = QEMU_OPT_NUMBER,
+            .help = "I/O operations that may be issued in a burst",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -256,6 +308,21 @@ static QemuOptsList qemu_rtc_opts = {
     },
 };
 
+static QemuOptsList qemu_block_cache_opts = {
+    .name = "block-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_block_cache_opts.head),
+    .desc = {
+        {
+            .name = "size",
+            .type = QEMU_OPT_SIZE,
+        },{
+            .name = "name",
+            .type = QEMU_OPT_STRING,
+        },
+        { /* end of list */ }
+    },
+};
+
 static QemuOptsList qemu_global_opts = {
     .name = "global",
     .head = QTAILQ_HEAD_INITIALIZER(qemu_global_opts.head),
@@ -470,6 +537,7 @@ static QemuOptsList *vm_config_groups[32] = {
     &qemu_netdev_opts,
     &qemu_net_opts,
     &qemu_rtc_opts,
+    &qemu_block_cache_opts,
     &qemu_global_opts,
     &qemu_mon_opts,
     &qemu_cpudef_opts,
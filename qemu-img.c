@@ -27,6 +27,7 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "qemu-thread.h"
 #include <stdio.h>
 
 #ifdef _WIN32
@@ -78,6 +79,8 @@ static void help(void)
            "       rebasing in this case (useful for renaming the backing file)\n"
            "  '-h' with or without a command shows this help and lists the supported formats\n"
            "  '-p' show progress of command (only certain commands)\n"
+           "  '-m' number of parallel requests during conversion (default 8)\n"
+           "  '-W' allow out-of-order writes during conversion\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -502,34 +505,6 @@ static int img_commit(int argc, char **argv)
  * Attention! The len must be a multiple of 4 * sizeof(long) due to
  * restriction of optimizations in this function.
  */
-static int is_not_zero(const uint8_t *sector, int len)
-{
-    /*
-     * Use long as the biggest available internal data type that fits into the
-     * CPU register and unroll the loop to smooth out the effect of memory
-     * latency.
-     */
-
-    int i;
-    long d0, d1, d2, d3;
-    const long * const data = (const long *) sector;
-
-    len /= sizeof(long);
-
-    for(i = 0; i < len; i += 4) {
-        d0 = data[i + 0];
-        d1 = data[i + 1];
-        d2 = data[i + 2];
-        d3 = data[i + 3];
-
-        if (d0 || d1 || d2 || d3) {
-            return 1;
-        }
-    }
-
-    return 0;
-}
-
 /*
  * Returns true iff the first sector pointed to by 'buf' contains at least
  * a non-NUL byte.
@@ -545,10 +520,17 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         *pnum = 0;
         return 0;
     }
-    v = is_not_zero(buf, 512);
+    v = !buffer_is_zero(buf, 512);
+
+    /* Long runs of zeroes are common, check them in one go */
+    if (!v && buffer_is_zero(buf, n * 512)) {
+        *pnum = n;
+        return 0;
+    }
+
     for(i = 1; i < n; i++) {
         buf += 512;
-        if (v != is_not_zero(buf, 512))
+        if (v != !buffer_is_zero(buf, 512))
             break;
     }
     *pnum = i;
@@ -588,30 +570,537 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/* Default number of requests that img_convert keeps in flight */
+#define CONVERT_DEFAULT_REQUESTS 8
+#define CONVERT_MAX_REQUESTS 64
+
+enum {
+    CONVERT_READING,        /* reads from the source images are in flight */
+    CONVERT_READ_DONE,      /* ready to be written */
+    CONVERT_COMPRESSING,    /* queued for or running in a compression thread */
+    CONVERT_COMPRESSED,     /* compressed and ready to be written */
+    CONVERT_WRITING,        /* writes to the target are in flight */
+};
+
+typedef struct ImgConvertState ImgConvertState;
+
+typedef struct ImgConvertRequest {
+    ImgConvertState *s;
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    int state;
+    int pending;            /* AIO requests in flight, plus one while issuing */
+    int ret;
+
+    /* compressed clusters; a length of 0 means the cluster doesn't compress,
+     * -1 that it is zero and is skipped */
+    uint8_t *out_buf;
+    int *out_len;
+
+    QTAILQ_ENTRY(ImgConvertRequest) next;
+    QTAILQ_ENTRY(ImgConvertRequest) compress_next;
+} ImgConvertRequest;
+
+/* A single read from one source image or write to the target */
+typedef struct ImgConvertIO {
+    ImgConvertRequest *req;
+    int64_t sector_num;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} ImgConvertIO;
+
+struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    int has_zero_init;
+    int target_has_backing;
+    int compressed;
+    int cluster_sectors;
+    int buf_sectors;        /* maximum size of a request */
+    int max_requests;
+    int wr_in_order;
+
+    int64_t sector_num;     /* next sector to read */
+    int nb_requests;
+    int aio_pending;
+    int ret;
+    QTAILQ_HEAD(, ImgConvertRequest) requests;  /* sorted by sector_num */
+
+    /* Compression threads, used if the target supports split compression */
+    int nb_threads;
+    int running_threads;
+    QemuThread *threads;
+    QemuMutex lock;
+    QemuCond request_cond;
+    QemuCond done_cond;
+    int completed;          /* requests compressed since the last wait */
+    int shutdown;
+    QTAILQ_HEAD(, ImgConvertRequest) compress_queue;
+};
+
+/*
+ * Returns the index of the source image that contains sector_num, sets
+ * *src_sector to the sector in it and *remaining to the number of sectors
+ * left in that image.
+ */
+static int convert_find_source(ImgConvertState *s, int64_t sector_num,
+                               int64_t *src_sector, int64_t *remaining)
+{
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        if (sector_num < s->src_sectors[i]) {
+            *src_sector = sector_num;
+            *remaining = s->src_sectors[i] - sector_num;
+            return i;
+        }
+        sector_num -= s->src_sectors[i];
+    }
+    abort();
+}
+
+static void convert_account(ImgConvertState *s, int nb_sectors)
+{
+    qemu_progress_add_bytes((uint64_t)nb_sectors * 512);
+    qemu_progress_print(100.0 * nb_sectors / s->total_sectors, 100);
+}
+
+static void convert_free_request(ImgConvertRequest *req)
+{
+    ImgConvertState *s = req->s;
+
+    QTAILQ_REMOVE(&s->requests, req, next);
+    s->nb_requests--;
+    qemu_vfree(req->buf);
+    qemu_free(req->out_buf);
+    qemu_free(req->out_len);
+    qemu_free(req);
+}
+
+/* Only the first error is reported; it stops the conversion */
+static void convert_error(ImgConvertState *s, const char *op,
+                          int64_t sector_num, int ret)
+{
+    if (s->ret == 0) {
+        error_report("error while %s sector %" PRId64 ": %s",
+                     op, sector_num, strerror(-ret));
+        s->ret = ret;
+    }
+}
+
+static void convert_queue_compress(ImgConvertRequest *req)
+{
+    ImgConvertState *s = req->s;
+
+    qemu_mutex_lock(&s->lock);
+    req->state = CONVERT_COMPRESSING;
+    QTAILQ_INSERT_TAIL(&s->compress_queue, req, compress_next);
+    qemu_cond_signal(&s->request_cond);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void convert_io_done(ImgConvertRequest *req)
+{
+    ImgConvertState *s = req->s;
+    int cluster_size = s->cluster_sectors * 512;
+    int len;
+
+    if (--req->pending > 0) {
+        return;
+    }
+
+    if (req->state == CONVERT_WRITING || s->ret < 0) {
+        if (req->state == CONVERT_WRITING && s->ret == 0) {
+            convert_account(s, req->nb_sectors);
+        }
+        convert_free_request(req);
+        return;
+    }
+
+    req->state = CONVERT_READ_DONE;
+    if (s->compressed) {
+        /* Pad the last cluster of the image */
+        len = req->nb_sectors * 512;
+        if (len % cluster_size) {
+            memset(req->buf + len, 0, cluster_size - len % cluster_size);
+        }
+        if (s->nb_threads) {
+            convert_queue_compress(req);
+        }
+    }
+}
+
+static void convert_io_cb(void *opaque, int ret)
+{
+    ImgConvertIO *io = opaque;
+    ImgConvertRequest *req = io->req;
+    ImgConvertState *s = req->s;
+
+    s->aio_pending--;
+    if (ret < 0) {
+        convert_error(s, req->state == CONVERT_WRITING ? "writing" : "reading",
+                      io->sector_num, ret);
+    }
+    qemu_free(io);
+    convert_io_done(req);
+}
+
+static void convert_submit_io(ImgConvertRequest *req, BlockDriverState *bs,
+                              int64_t bs_sector, int64_t sector_num,
+                              uint8_t *buf, int nb_sectors, int is_write)
+{
+    ImgConvertState *s = req->s;
+    ImgConvertIO *io;
+    BlockDriverAIOCB *acb;
+
+    io = qemu_mallocz(sizeof(*io));
+    io->req = req;
+    io->sector_num = sector_num;
+    io->iov.iov_base = buf;
+    io->iov.iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(&io->qiov, &io->iov, 1);
+
+    req->pending++;
+    s->aio_pending++;
+    if (is_write) {
+        acb = bdrv_aio_writev(bs, bs_sector, &io->qiov, nb_sectors,
+                              convert_io_cb, io);
+    } else {
+        acb = bdrv_aio_readv(bs, bs_sector, &io->qiov, nb_sectors,
+                             convert_io_cb, io);
+    }
+    if (!acb) {
+        convert_io_cb(io, -EIO);
+    }
+}
+
+static void convert_read(ImgConvertRequest *req)
+{
+    ImgConvertState *s = req->s;
+    int64_t sector_num = req->sector_num;
+    int64_t src_sector, remaining;
+    int nb_sectors = req->nb_sectors;
+    uint8_t *buf = req->buf;
+    int i, n;
+
+    req->pending = 1;
+    while (nb_sectors > 0 && s->ret == 0) {
+        i = convert_find_source(s, sector_num, &src_sector, &remaining);
+        n = MIN(nb_sectors, remaining);
+        convert_submit_io(req, s->src[i], src_sector, sector_num, buf, n, 0);
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * 512;
+    }
+    convert_io_done(req);
+}
+
+/* Starts new requests until max_requests are in flight */
+static void convert_submit(ImgConvertState *s)
+{
+    ImgConvertRequest *req;
+    int64_t src_sector, remaining;
+    int i, n, n1;
+
+    while (s->ret == 0 && s->nb_requests < s->max_requests &&
+           s->sector_num < s->total_sectors) {
+        n = MIN(s->total_sectors - s->sector_num, s->buf_sectors);
+
+        if (!s->compressed) {
+            i = convert_find_source(s, s->sector_num, &src_sector, &remaining);
+            n = MIN(n, remaining);
+
+            /* If the output image is being created as a copy on write image,
+               assume that sectors which are unallocated in the input image
+               are present in both the output's and input's base images (no
+               need to copy them). */
+            if (s->has_zero_init && s->target_has_backing) {
+                if (!bdrv_is_allocated(s->src[i], src_sector, n, &n1)) {
+                    convert_account(s, n1);
+                    s->sector_num += n1;
+                    continue;
+                }
+                /* The next 'n1' sectors are allocated in the input image.
+                   Copy only those as they may be followed by unallocated
+                   sectors. */
+                n = n1;
+            }
+        }
+
+        req = qemu_mallocz(sizeof(*req));
+        req->s = s;
+        req->sector_num = s->sector_num;
+        req->nb_sectors = n;
+        req->buf = qemu_blockalign(s->target, s->buf_sectors * 512);
+        req->state = CONVERT_READING;
+        if (s->nb_threads) {
+            req->out_buf = qemu_malloc(s->buf_sectors * 512);
+            req->out_len = qemu_mallocz(s->buf_sectors / s->cluster_sectors *
+                                        sizeof(int));
+        }
+        QTAILQ_INSERT_TAIL(&s->requests, req, next);
+        s->nb_requests++;
+        s->sector_num += n;
+
+        convert_read(req);
+    }
+}
+
+static void convert_write(ImgConvertRequest *req)
+{
+    ImgConvertState *s = req->s;
+    int64_t sector_num = req->sector_num;
+    int cluster_size = s->cluster_sectors * 512;
+    int n = req->nb_sectors;
+    uint8_t *buf = req->buf;
+    int i, n1, ret;
+
+    req->state = CONVERT_WRITING;
+    req->pending = 1;
+
+    if (s->compressed) {
+        /* Compressed clusters are appended to the image, so this is
+           synchronous to keep them in order */
+        for (i = 0; i * s->cluster_sectors < req->nb_sectors; i++) {
+            buf = req->buf + i * cluster_size;
+            sector_num = req->sector_num + i * s->cluster_sectors;
+            if (s->nb_threads) {
+                if (req->out_len[i] < 0) {
+                    continue;
+                }
+                ret = bdrv_write_compressed_cluster(s->target, sector_num,
+                                                    buf, s->cluster_sectors,
+                                                    req->out_buf +
+                                                    i * cluster_size,
+                                                    req->out_len[i]);
+            } else {
+                if (buffer_is_zero(buf, cluster_size)) {
+                    continue;
+                }
+                ret = bdrv_write_compressed(s->target, sector_num, buf,
+                                            s->cluster_sectors);
+            }
+            if (ret < 0) {
+                convert_error(s, "compressing", sector_num, ret);
+                break;
+            }
+        }
+        convert_io_done(req);
+        return;
+    }
+
+    while (n > 0 && s->ret == 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing) {
+            n1 = n;
+            convert_submit_io(req, s->target, sector_num, sector_num, buf, n1,
+                              1);
+        } else if (is_allocated_sectors(buf, n, &n1)) {
+            convert_submit_io(req, s->target, sector_num, sector_num, buf, n1,
+                              1);
+        }
+        sector_num += n1;
+        n -= n1;
+        buf += n1 * 512;
+    }
+    convert_io_done(req);
+}
+
+/*
+ * Submits the writes of all requests that are ready.  Unless out of order
+ * writes are allowed, a request is only written once all requests before it
+ * have been, so that formats which allocate clusters on the first write lay
+ * out the target like a sequential copy would.
+ */
+static void convert_write_requests(ImgConvertState *s)
+{
+    ImgConvertRequest *req, *next_req;
+    int state;
+
+    QTAILQ_FOREACH_SAFE(req, &s->requests, next, next_req) {
+        if (s->nb_threads) {
+            qemu_mutex_lock(&s->lock);
+            state = req->state;
+            qemu_mutex_unlock(&s->lock);
+        } else {
+            state = req->state;
+        }
+
+        if (state == CONVERT_COMPRESSED && req->ret < 0) {
+            convert_error(s, "compressing", req->sector_num, req->ret);
+        }
+
+        if (state == CONVERT_READ_DONE || state == CONVERT_COMPRESSED) {
+            if (s->ret < 0) {
+                convert_free_request(req);
+            } else {
+                convert_write(req);
+            }
+        } else if (state != CONVERT_WRITING && s->wr_in_order) {
+            break;
+        }
+    }
+}
+
+static void convert_compress(ImgConvertRequest *req)
+{
+    ImgConvertState *s = req->s;
+    int cluster_size = s->cluster_sectors * 512;
+    int i, ret;
+
+    for (i = 0; i * s->cluster_sectors < req->nb_sectors; i++) {
+        if (buffer_is_zero(req->buf + i * cluster_size, cluster_size)) {
+            req->out_len[i] = -1;
+            continue;
+        }
+        ret = bdrv_compress_cluster(s->target, req->out_buf + i * cluster_size,
+                                    req->buf + i * cluster_size);
+        if (ret < 0) {
+            req->ret = ret;
+            break;
+        }
+        req->out_len[i] = ret;
+    }
+}
+
+static void *convert_compress_thread(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ImgConvertRequest *req;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&s->compress_queue) && !s->shutdown) {
+            qemu_cond_wait(&s->request_cond, &s->lock);
+        }
+        if (QTAILQ_EMPTY(&s->compress_queue)) {
+            break;
+        }
+        req = QTAILQ_FIRST(&s->compress_queue);
+        QTAILQ_REMOVE(&s->compress_queue, req, compress_next);
+        qemu_mutex_unlock(&s->lock);
+
+        convert_compress(req);
+
+        qemu_mutex_lock(&s->lock);
+        req->state = CONVERT_COMPRESSED;
+        s->completed++;
+        qemu_cond_signal(&s->done_cond);
+    }
+    s->running_threads--;
+    qemu_cond_signal(&s->done_cond);
+    qemu_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void convert_start_threads(ImgConvertState *s, int nb_threads)
+{
+    int i;
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->request_cond);
+    qemu_cond_init(&s->done_cond);
+    QTAILQ_INIT(&s->compress_queue);
+
+    s->nb_threads = nb_threads;
+    s->running_threads = nb_threads;
+    s->threads = qemu_mallocz(nb_threads * sizeof(QemuThread));
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&s->threads[i], convert_compress_thread, s);
+    }
+}
+
+static void convert_stop_threads(ImgConvertState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    s->shutdown = 1;
+    qemu_cond_broadcast(&s->request_cond);
+    while (s->running_threads > 0) {
+        qemu_cond_wait(&s->done_cond, &s->lock);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    qemu_cond_destroy(&s->request_cond);
+    qemu_cond_destroy(&s->done_cond);
+    qemu_mutex_destroy(&s->lock);
+    qemu_free(s->threads);
+}
+
+/* Waits until a compression thread has finished a request */
+static void convert_wait_compressed(ImgConvertState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    while (s->completed == 0) {
+        qemu_cond_wait(&s->done_cond, &s->lock);
+    }
+    s->completed = 0;
+    qemu_mutex_unlock(&s->lock);
+}
+
+/*
+ * Copies the source images to the target with up to max_requests requests
+ * in flight.  Reads are submitted in order and complete in any order; zero
+ * detection and compression happen as the data arrives.
+ */
+static int convert_run(ImgConvertState *s)
+{
+    QTAILQ_INIT(&s->requests);
+
+    for (;;) {
+        convert_submit(s);
+        convert_write_requests(s);
+
+        if (QTAILQ_EMPTY(&s->requests)) {
+            if (s->ret < 0 || s->sector_num >= s->total_sectors) {
+                break;
+            }
+            continue;
+        }
+
+        if (s->aio_pending) {
+            qemu_aio_wait();
+        } else {
+            /* Nothing but compression can be holding up the requests */
+            assert(s->nb_threads);
+            convert_wait_compressed(s);
+        }
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
-    int progress = 0;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size;
+    int progress = 0, num_requests = CONVERT_DEFAULT_REQUESTS, wr_in_order = 1;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors, *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
-    char *options = NULL;
+    char *options = NULL, *end;
     const char *snapshot_name = NULL;
-    float local_progress;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:p");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pm:W");
         if (c == -1) {
             break;
         }
@@ -649,6 +1138,19 @@ static int img_convert(int argc, char **argv)
         case 'p':
             progress = 1;
             break;
+        case 'm':
+            num_requests = strtol(optarg, &end, 0);
+            if (*end || num_requests < 1 ||
+                num_requests > CONVERT_MAX_REQUESTS) {
+                error_report("Invalid number of parallel requests '%s', "
+                             "must be between 1 and %d", optarg,
+                             CONVERT_MAX_REQUESTS);
+                return 1;
+            }
+            break;
+        case 'W':
+            wr_in_order = 0;
+            break;
         }
     }
 
@@ -675,6 +1177,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = qemu_mallocz(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = qemu_mallocz(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -684,8 +1187,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -786,10 +1290,17 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_malloc(IO_BUF_SIZE);
+    memset(&state, 0, sizeof(state));
+    state.src = bs;
+    state.src_sectors = bs_sectors;
+    state.src_num = bs_n;
+    state.total_sectors = total_sectors;
+    state.target = out_bs;
+    state.has_zero_init = bdrv_has_zero_init(out_bs);
+    state.target_has_backing = !!out_baseimg;
+    state.max_requests = num_requests;
+    state.wr_in_order = wr_in_order;
+    state.buf_sectors = IO_BUF_SIZE / 512;
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -803,165 +1314,33 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, cluster_sectors));
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading");
-                    goto out;
-                }
+        state.compressed = 1;
+        state.cluster_sectors = cluster_size >> 9;
+        state.buf_sectors = (IO_BUF_SIZE / cluster_size) * (cluster_size >> 9);
+        /* compressed clusters are appended to the image in order */
+        state.wr_in_order = 1;
+        if (drv->bdrv_compress_cluster) {
+            convert_start_threads(&state, num_requests);
+        }
+    }
 
-                buf2 += nlow * 512;
-                bs_num += nlow;
+    if (total_sectors > 0) {
+        ret = convert_run(&state);
+    }
 
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
+    if (state.nb_threads) {
+        convert_stop_threads(&state);
+    }
 
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
+    if (compress && ret == 0) {
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        local_progress = (float)100 /
-            (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
     }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_free(buf);
+    qemu_free(bs_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
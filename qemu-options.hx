@@ -120,7 +120,11 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,aio_poll=usecs][,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,metadata-cache-size=size][,detect-zeroes=on|off]\n"
+    "       [,shared-cache=on|off]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][,bps_burst=bb]\n"
+    "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]][,iops_burst=ib]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -152,6 +156,43 @@ These options have the same definition as they have in @option{-hdachs}.
 @var{cache} is "none", "writeback", "unsafe", or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
 @var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@item aio_poll=@var{usecs}
+With @option{aio=native}, busy-poll for request completions for up to
+@var{usecs} microseconds before going back to waiting for a notification.
+This trades CPU time for lower latency on fast storage. Polling is disabled
+by default.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" and enables whether to copy read backing
+file sectors into the image file.  This avoids going to the backing file
+again for data that has been read once, which helps when the backing file
+is on slow or remote storage.
+@item metadata-cache-size=@var{size}
+Use up to @var{size} bytes of memory to cache the metadata tables of the
+image, e.g. the grain tables of vmdk images.  The default is 256k; a larger
+cache avoids rereading tables from disk for random I/O on large images.
+Only image formats that keep such a cache support this option.
+@item detect-zeroes=@var{detect-zeroes}
+@var{detect-zeroes} is "on" or "off" and enables whether to check guest
+writes for blocks of zeroes.  Such writes are recorded in the image metadata
+instead of allocating space where the image format allows it, which keeps
+thin qcow2 and qed images small when the guest zeroes its disk.  Checking
+costs some CPU time for every write, so it is disabled by default.
+@item shared-cache=@var{shared-cache}
+@var{shared-cache} is "on" or "off" and enables whether reads from the
+read-only images of the drive, usually its backing files, go through a cache
+that is shared by all drives of the process with this option.  Drives with the
+same base image then read each part of it from the host only once.  The
+cache is configured with @option{-block-cache}.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the throughput of the drive to @var{b} bytes per second in total, or
+separately to @var{r} bytes per second for reads and @var{w} bytes per second
+for writes. @option{bps} cannot be combined with @option{bps_rd} or
+@option{bps_wr}. Requests exceeding the limit are delayed.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the number of requests per second in the same way.
+@item bps_burst=@var{bb},iops_burst=@var{ib}
+Allow short bursts of up to @var{bb} bytes or @var{ib} requests to be issued
+above the configured rates. The default is a tenth of a second worth of I/O.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -233,6 +274,30 @@ qemu -hda a -hdb b
 @end example
 ETEXI
 
+DEF("block-cache", HAS_ARG, QEMU_OPTION_block_cache,
+    "-block-cache [size=size][,name=name]\n"
+    "                size of the cache of drives with shared-cache=on and\n"
+    "                shared memory segment to keep it in\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -block-cache [size=@var{size}][,name=@var{name}]
+@findex -block-cache
+Configure the read cache that is shared by all drives with
+@option{shared-cache=on}.  It holds @var{size} bytes of data, by default 64M,
+and is private to the process.
+
+With @option{name}, the cache is kept in the POSIX shared memory segment
+@var{name} instead, which all QEMU processes of a user that use the same name
+share.  The process that creates the segment gives it room for @var{size}
+bytes; later users keep its size.  Every process using the segment can read
+the cached data of all images opened by the others and can change what they
+read from their images, so only VMs that trust each other may share a
+segment.  Reads bypass the segment while another process holds its lock for
+too long.  If the segment cannot be used, the cache is private to the
+process.  Statistics are shown by the @code{info block-cache} monitor
+command.
+ETEXI
+
 DEF("set", HAS_ARG, QEMU_OPTION_set,
     "-set group.id.arg=value\n"
     "                set <arg> parameter for item <id> of type <group>\n"
@@ -1080,12 +1145,16 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,fds=x:y:...:z][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,vhostforce=on|off][,queues=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
     "                use '[down]script=no' to disable script execution\n"
     "                use 'fd=h' to connect to an already opened TAP interface\n"
+    "                use 'fds=x:y:...:z' to connect to the queues of an already opened\n"
+    "                multiqueue TAP interface (-netdev only)\n"
+    "                use 'queues=n' to open 'n' queues of a multiqueue TAP interface,\n"
+    "                for use by a multiqueue NIC (-netdev only)\n"
     "                use 'sndbuf=nbytes' to limit the size of the send buffer (the\n"
     "                default is disabled 'sndbuf=0' to enable flow control set 'sndbuf=1048576')\n"
     "                use vnet_hdr=off to avoid enabling the IFF_VNET_HDR tap flag\n"
@@ -1253,7 +1322,7 @@ processed and applied to -net user. Mixing them with the new configuration
 syntax gives undefined results. Their use for new applications is discouraged
 as they will be removed from future versions.
 
-@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,ifname=@var{name}] [,script=@var{file}][,downscript=@var{dfile}]
+@item -net tap[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}][,fds=@var{x}:@var{y}:...:@var{z}][,ifname=@var{name}] [,script=@var{file}][,downscript=@var{dfile}][,queues=@var{n}]
 Connect the host TAP network interface @var{name} to VLAN @var{n}, use
 the network script @var{file} to configure it and the network script
 @var{dfile} to deconfigure it. If @var{name} is not provided, the OS
@@ -1267,6 +1336,15 @@ or @option{downscript=no} to disable script execution. Example:
 qemu linux.img -net nic -net tap
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of a
+multiqueue TAP interface, and @option{fds} passes the handles of the queues
+of an already opened one; up to 31 queues are supported. A NIC that supports
+multiple queues, such as virtio-net, gets one queue pair per TAP queue:
+@example
+qemu linux.img -netdev tap,id=hn0,queues=4 \
+               -device virtio-net-pci,netdev=hn0
+@end example
+
 More complicated example (two NICs, each one connected to a TAP device)
 @example
 qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
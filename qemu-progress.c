@@ -25,6 +25,7 @@
 #include "qemu-common.h"
 #include "osdep.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 #include <stdio.h>
 #include <signal.h>
 
@@ -32,6 +33,8 @@ struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    int64_t start_time;
+    uint64_t bytes;             /* amount of data processed so far */
     void (*print)(void);
     void (*end)(void);
 };
@@ -39,6 +42,20 @@ struct progress_state {
 static struct progress_state state;
 static volatile sig_atomic_t print_pending;
 
+/* Formats the throughput if the operation accounts processed bytes */
+static void progress_format_rate(char *buf, size_t size)
+{
+    int64_t elapsed = get_clock() - state.start_time;
+
+    if (state.bytes == 0 || elapsed <= 0) {
+        buf[0] = '\0';
+        return;
+    }
+    snprintf(buf, size, ", %.1f MB/s",
+             (double)state.bytes / (1024 * 1024) * get_ticks_per_sec() /
+             elapsed);
+}
+
 /*
  * Simple progress print function.
  * @percent relative percent of current operation
@@ -46,7 +63,10 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    char rate[32];
+
+    progress_format_rate(rate, sizeof(rate));
+    printf("    (%3.2f/100%%%s)\r", state.current, rate);
     fflush(stdout);
 }
 
@@ -71,7 +91,10 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        char rate[32];
+
+        progress_format_rate(rate, sizeof(rate));
+        fprintf(stderr, "    (%3.2f/100%%%s)\n", state.current, rate);
         print_pending = 0;
     }
 }
@@ -106,6 +129,8 @@ static void progress_dummy_init(void)
 void qemu_progress_init(int enabled, float min_skip)
 {
     state.min_skip = min_skip;
+    state.start_time = get_clock();
+    state.bytes = 0;
     if (enabled) {
         progress_simple_init();
     } else {
@@ -118,6 +143,15 @@ void qemu_progress_end(void)
     state.end();
 }
 
+/*
+ * Account @bytes of processed data, which makes the progress report show the
+ * average throughput of the operation.
+ */
+void qemu_progress_add_bytes(uint64_t bytes)
+{
+    state.bytes += bytes;
+}
+
 /*
  * Report progress.
  * @delta is how much progress we made.
@@ -38,4 +38,7 @@ void qemu_thread_get_self(QemuThread *thread);
 int qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 
+/* Only available on POSIX hosts */
+void *qemu_thread_join(QemuThread *thread);
+
 #endif
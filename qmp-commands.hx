@@ -664,6 +664,274 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_set_io_throttle",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_burst:l?,iops_burst:l?",
+        .params     = "device bps bps_rd bps_wr iops iops_rd iops_wr [bps_burst] [iops_burst]",
+        .help       = "change I/O throttle limits for a block drive",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_set_io_throttle,
+    },
+
+SQMP
+block_set_io_throttle
+---------------------
+
+Change I/O throttle limits for a block drive.  A value of 0 means no limit.
+
+Arguments:
+
+- "device": device name (json-string)
+- "bps": total throughput limit in bytes per second (json-int)
+- "bps_rd": read throughput limit in bytes per second (json-int)
+- "bps_wr": write throughput limit in bytes per second (json-int)
+- "iops": total I/O operations per second (json-int)
+- "iops_rd": read I/O operations per second (json-int)
+- "iops_wr": write I/O operations per second (json-int)
+- "bps_burst": bytes allowed above the rate in a burst (json-int, optional)
+- "iops_burst": operations allowed above the rate in a burst (json-int, optional)
+
+Example:
+
+-> { "execute": "block_set_io_throttle", "arguments": { "device": "virtio0",
+                                                        "bps": 1000000,
+                                                        "bps_rd": 0,
+                                                        "bps_wr": 0,
+                                                        "iops": 0,
+                                                        "iops_rd": 0,
+                                                        "iops_wr": 0 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy data from a backing file into a block device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Copy data from the backing file chain into the image while the guest is
+running.  Guest reads also populate the image while the operation runs.
+Once all data has been copied, the backing file is removed from the image
+and a BLOCK_JOB_COMPLETED event is emitted.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed": maximum speed in bytes per second (json-int, optional)
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "drive_mirror",
+        .args_type  = "device:B,target:s,format:s?,speed:o?",
+        .params     = "device target [format] [speed]",
+        .help       = "copy a running block device to a new image and switch to it",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_drive_mirror,
+    },
+
+SQMP
+drive_mirror
+------------
+
+Copy a running block device to a new image and switch the device over to
+it.  The whole content of the device, including data from backing files, is
+copied; guest writes done meanwhile are tracked with a dirty bitmap and
+copied again.  Once source and target are in sync, the device is reopened on
+the target image and a BLOCK_JOB_COMPLETED event is emitted.  If the job is
+cancelled, the device keeps using the original image.
+
+Arguments:
+
+- "device": device name (json-string)
+- "target": name of the new image file (json-string)
+- "format": format of the new image, defaults to the format of the current
+            image (json-string, optional)
+- "speed": maximum speed in bytes per second (json-int, optional)
+
+Example:
+
+-> { "execute": "drive_mirror", "arguments": { "device": "virtio0",
+                                               "target": "/some/place/new.img",
+                                               "format": "qcow2" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_dirty_bitmap_add",
+        .args_type  = "device:B,name:s,granularity:i?",
+        .params     = "device name [granularity]",
+        .help       = "start recording writes to a block device in a named bitmap",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_add,
+    },
+
+SQMP
+block_dirty_bitmap_add
+----------------------
+
+Create a named dirty bitmap that records which clusters of a block device are
+written from now on.  The bitmap is saved to a file next to the image
+("<image>.bitmaps") and is loaded again when the image is opened.  If QEMU did
+not shut down cleanly, all clusters are marked as dirty.  Only images in local
+files can have bitmaps.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": bitmap name (json-string)
+- "granularity": bytes per bit, a power of two of at least 512, defaults to
+                 the cluster size of the image (json-int, optional)
+
+Example:
+
+-> { "execute": "block_dirty_bitmap_add", "arguments": { "device": "virtio0",
+                                                         "name": "daily" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_dirty_bitmap_remove",
+        .args_type  = "device:B,name:s",
+        .params     = "device name",
+        .help       = "remove a dirty bitmap",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block_dirty_bitmap_remove
+-------------------------
+
+Delete a named dirty bitmap.  A bitmap that is being exported can't be
+removed.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": bitmap name (json-string)
+
+Example:
+
+-> { "execute": "block_dirty_bitmap_remove", "arguments": { "device": "virtio0",
+                                                            "name": "daily" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_dirty_bitmap_export",
+        .args_type  = "device:B,name:s,target:s,format:s?,speed:o?",
+        .params     = "device name target [format] [speed]",
+        .help       = "copy the clusters recorded in a dirty bitmap to a new image",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_dirty_bitmap_export,
+    },
+
+SQMP
+block_dirty_bitmap_export
+-------------------------
+
+Start a background job that copies the clusters marked in a dirty bitmap to a
+new image, for incremental backups.  The target image has the size of the
+device and only the exported clusters are allocated in it.  It holds their
+contents at the time the command was issued: guest writes to clusters that
+have not been copied yet wait until the old data is in the target.
+
+The bitmap is cleared when the job starts and records the changes for the
+next export.  If the job fails or is cancelled, the clusters that were not
+copied are marked in the bitmap again.  A BLOCK_JOB_COMPLETED event with type
+"backup" is emitted at the end.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": bitmap name (json-string)
+- "target": name of the new image file (json-string)
+- "format": format of the new image, defaults to "qcow2" (json-string,
+            optional)
+- "speed": maximum speed in bytes per second (json-int, optional)
+
+Example:
+
+-> { "execute": "block_dirty_bitmap_export",
+     "arguments": { "device": "virtio0", "name": "daily",
+                    "target": "/backup/virtio0-inc1.qcow2" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_set_speed",
+        .args_type  = "device:B,value:o",
+        .params     = "device value",
+        .help       = "set maximum speed for a background block operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_set_speed,
+    },
+
+SQMP
+block_job_set_speed
+-------------------
+
+Set the maximum speed of a background block operation.
+
+Arguments:
+
+- "device": device name (json-string)
+- "value": maximum speed in bytes per second, 0 for unlimited (json-int)
+
+Example:
+
+-> { "execute": "block_job_set_speed",
+     "arguments": { "device": "virtio0", "value": 1048576 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block_job_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop an active block streaming operation",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_job_cancel,
+    },
+
+SQMP
+block_job_cancel
+----------------
+
+Stop an active background block operation.  The operation stops after the
+request that is currently in flight and a BLOCK_JOB_CANCELLED event is
+emitted.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block_job_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1055,6 +1323,11 @@ Each json-object contain the following:
                                 "tftp", "vdi", "vmdk", "vpc", "vvfat"
          - "backing_file": backing file name (json-string, optional)
          - "encrypted": true if encrypted, false otherwise (json-bool)
+- "dirty-bitmaps": only present if the device has named dirty bitmaps, a
+   json-array of json-objects containing the following:
+         - "name": bitmap name (json-string)
+         - "granularity": bytes per bit (json-int)
+         - "count": number of dirty bits (json-int)
 
 Example:
 
@@ -1115,6 +1388,24 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "flush_operations": flush operations (json-int)
+    - "rd_merged": read requests merged into an adjacent one before
+                   submission (json-int)
+    - "wr_merged": write requests merged into an adjacent one before
+                   submission (json-int)
+    - "rd_total_time_ns": total time spent on reads in nano-seconds (json-int)
+    - "wr_total_time_ns": total time spent on writes in nano-seconds (json-int)
+    - "flush_total_time_ns": total time spent on flushes in nano-seconds
+                             (json-int)
+    - "in_flight": requests currently in flight (json-int)
+    - "max_in_flight": highest number of requests in flight (json-int)
+    - "avg_queue_depth": average number of requests already in flight when
+                         a new request is submitted (json-double)
+    - "latency": A json-object with the latency histograms "read", "write"
+                 and "flush".  Each is a json-array of 24 json-ints; element
+                 0 counts requests that took less than 1 us, element i
+                 those that took at least 2^(i-1) and less than 2^i us.
+                 The last element also counts all slower requests
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1141,7 +1432,24 @@ Example:
                "wr_bytes":9786368,
                "wr_operations":692,
                "rd_bytes":122739200,
-               "rd_operations":36604
+               "rd_operations":36604,
+               "flush_operations":61,
+               "rd_merged":5123,
+               "wr_merged":87,
+               "rd_total_time_ns":3465673657,
+               "wr_total_time_ns":1178592441,
+               "flush_total_time_ns":1083215,
+               "in_flight":0,
+               "max_in_flight":4,
+               "avg_queue_depth":0.12,
+               "latency":{
+                  "read":[0,0,0,0,0,0,512,9113,20851,5262,717,112,
+                          37,0,0,0,0,0,0,0,0,0,0,0],
+                  "write":[0,0,0,0,0,0,0,64,390,177,51,10,
+                           0,0,0,0,0,0,0,0,0,0,0,0],
+                  "flush":[0,0,0,0,0,0,0,0,0,0,61,0,
+                           0,0,0,0,0,0,0,0,0,0,0,0]
+               }
             }
          },
          {
@@ -1179,6 +1487,62 @@ Example:
 
 EQMP
 
+SQMP
+query-block-jobs
+----------------
+
+Show progress of ongoing block device operations.
+
+Return a json-array of all operations.  If no operation is active then an
+empty array is returned.  Each operation is a json-object with the following
+data:
+
+- "type": job type name (json-string, "stream", "mirror" or "backup")
+- "device": device name (json-string)
+- "len": maximum progress value (json-int)
+- "offset": current progress value (json-int)
+- "speed": rate limit, bytes per second (json-int)
+
+Progress can be observed as offset increases and it reaches len when the
+operation completes.  Offset and len have undefined units but can be used to
+calculate a percentage indicating the progress that has been made.
+
+Example:
+
+-> { "execute": "query-block-jobs" }
+<- { "return":[
+      { "type": "stream", "device": "virtio0",
+        "len": 10737418240, "offset": 709632,
+        "speed": 0 }
+   ]
+ }
+
+EQMP
+
+SQMP
+query-block-cache
+-----------------
+
+Show statistics of the read cache shared by drives with shared-cache=on.
+
+Return a json-object with the following data:
+
+- "size": memory currently used by cached data, including that of all
+          processes sharing the segment, in bytes (json-int)
+- "max-size": memory limit of the cache, in bytes (json-int)
+- "hits": number of chunk lookups of this process that found the chunk in the
+          cache or being loaded by another request (json-int)
+- "misses": number of chunk lookups of this process that had to read from
+            the image (json-int)
+
+Example:
+
+-> { "execute": "query-block-cache" }
+<- { "return": { "size": 52428800, "max-size": 67108864,
+                 "hits": 8192, "misses": 800 } }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+#
+# HTTP server with range support for the curl block driver tests
+#
+# Usage: http-range-server.py <dir> <port> <log>
+#
+# Serves the files in <dir> and writes every range request to <log> as
+# "RANGE <first>-<last>".  Range requests for files whose name contains "bad"
+# fail with 500 unless they start at offset 0, so that opening the image
+# works but reading from it does not.
+
+import http.server
+import os
+import re
+import sys
+from socketserver import ThreadingMixIn
+
+class Limited:
+    def __init__(self, f, n):
+        self.f, self.n = f, n
+
+    def read(self, k):
+        k = min(k, self.n)
+        self.n -= k
+        return self.f.read(k) if k else b''
+
+    def close(self):
+        self.f.close()
+
+class Handler(http.server.SimpleHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *args):
+        pass
+
+    def send_head(self):
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return None
+        size = os.path.getsize(path)
+        rng = self.headers.get('Range')
+        if not rng:
+            self.send_response(200)
+            self.send_header('Content-Length', str(size))
+            self.end_headers()
+            return open(path, 'rb')
+
+        if 'bad' in self.path and not rng.startswith('bytes=0-'):
+            self.send_error(500)
+            return None
+        m = re.match(r'bytes=(\d+)-(\d*)', rng)
+        start = int(m.group(1))
+        end = min(int(m.group(2)) if m.group(2) else size - 1, size - 1)
+        with open(log, 'a') as f:
+            f.write('RANGE %d-%d\n' % (start, end))
+        f = open(path, 'rb')
+        f.seek(start)
+        self.send_response(206)
+        self.send_header('Content-Range', 'bytes %d-%d/%d' % (start, end, size))
+        self.send_header('Content-Length', str(end - start + 1))
+        self.end_headers()
+        return Limited(f, end - start + 1)
+
+    def copyfile(self, src, dst):
+        while True:
+            buf = src.read(65536)
+            if not buf:
+                break
+            dst.write(buf)
+
+class Server(ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+log = os.path.abspath(sys.argv[3])
+os.chdir(sys.argv[1])
+Server(('127.0.0.1', int(sys.argv[2])), Handler).serve_forever()
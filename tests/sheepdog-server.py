@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# In-memory stand-in for a sheepdog cluster, for the sheepdog block driver
+# tests
+#
+# Usage: sheepdog-server.py <port> <log> [delay]
+#
+# Implements the object and vdi requests the block driver sends.  Every
+# accepted connection is written to <log> as "CONNECT", and every new
+# maximum of requests being served at the same time as "PARALLEL <n>".
+# Each request is delayed by [delay] seconds before it is served.
+
+import socket
+import struct
+import sys
+import threading
+import time
+
+SD_OP_CREATE_AND_WRITE_OBJ = 0x01
+SD_OP_READ_OBJ = 0x02
+SD_OP_WRITE_OBJ = 0x03
+SD_OP_NEW_VDI = 0x11
+SD_OP_LOCK_VDI = 0x12
+SD_OP_RELEASE_VDI = 0x13
+SD_OP_GET_VDI_INFO = 0x14
+SD_OP_READ_VDIS = 0x15
+
+SD_FLAG_CMD_WRITE = 0x01
+SD_FLAG_CMD_COW = 0x02
+SD_RES_NO_VDI = 0x08
+
+SD_DATA_OBJ_SIZE = 1 << 22
+SD_INODE_SIZE = 4664 + 4 * (1 << 20)
+VDI_BIT = 1 << 63
+
+objs = {}
+vdis = {}
+lock = threading.Lock()
+active = 0
+max_active = 0
+
+def log(line):
+    with open(sys.argv[2], 'a') as f:
+        f.write(line + '\n')
+
+def obj(oid):
+    if oid not in objs:
+        objs[oid] = bytearray(SD_INODE_SIZE if oid & VDI_BIT else
+                              SD_DATA_OBJ_SIZE)
+    return objs[oid]
+
+def inode(vid):
+    return obj(VDI_BIT | (vid << 32))
+
+def recvall(c, n):
+    b = b''
+    while len(b) < n:
+        d = c.recv(n - len(b))
+        if not d:
+            raise EOFError
+        b += d
+    return b
+
+def new_vdi(name, size, base, snapshot):
+    vid = (hash(name) & 0xffff) << 8
+    while vid in vdis:
+        vid += 1
+    vdis[vid] = name
+    ino = inode(vid)
+    ino[0:len(name)] = name
+    # ctime, snap_ctime, vm_clock_nsec, vdi_size, vm_state_size,
+    # copy_policy, nr_copies, block_size_shift, snap_id, vdi_id, parent
+    struct.pack_into('<QQQQQHBBIII', ino, 512, int(time.time()) << 32, 0, 0,
+                     size, 0, 0, 1, 22, 0, vid, base)
+    if base:
+        b = inode(base)
+        ino[4664:] = b[4664:]
+        struct.pack_into('<Q', ino, 536, struct.unpack_from('<Q', b, 536)[0])
+        if snapshot:
+            # the base becomes a snapshot
+            struct.pack_into('<Q', b, 520, int(time.time()) << 32)
+            struct.pack_into('<I', b, 556, 1)
+    return vid
+
+def find_vdi(name, snapid, tag):
+    current = None
+    for vid, n in sorted(vdis.items()):
+        if n != name:
+            continue
+        ino = inode(vid)
+        snap_ctime = struct.unpack_from('<Q', ino, 520)[0]
+        if snapid and struct.unpack_from('<I', ino, 556)[0] == snapid:
+            return vid
+        if tag and ino[256:256 + len(tag)] == tag and snap_ctime:
+            return vid
+        if not snapid and not tag and not snap_ctime:
+            current = vid
+    return current
+
+def handle(op, flags, hdr, data, dlen):
+    out = b''
+    result = 0
+    extra = b''
+    if op in (SD_OP_CREATE_AND_WRITE_OBJ, SD_OP_READ_OBJ, SD_OP_WRITE_OBJ):
+        oid, cow_oid, copies, rsvd, offset = struct.unpack_from('<QQIIQ',
+                                                                hdr, 16)
+        o = obj(oid)
+        if op == SD_OP_CREATE_AND_WRITE_OBJ and flags & SD_FLAG_CMD_COW:
+            o[:] = obj(cow_oid)
+        if op == SD_OP_READ_OBJ:
+            out = bytes(o[offset:offset + dlen])
+        else:
+            o[offset:offset + dlen] = data
+    elif op == SD_OP_NEW_VDI:
+        size, base, copies, snapid = struct.unpack_from('<QIII', hdr, 16)
+        vid = new_vdi(data.rstrip(b'\0'), size, base, snapid)
+        extra = struct.pack('<I', vid)
+    elif op in (SD_OP_LOCK_VDI, SD_OP_GET_VDI_INFO):
+        snapid = struct.unpack_from('<I', hdr, 32)[0]
+        vid = find_vdi(data[:256].rstrip(b'\0'), snapid,
+                       data[256:].rstrip(b'\0'))
+        if vid is None:
+            result = SD_RES_NO_VDI
+        else:
+            extra = struct.pack('<I', vid)
+    elif op == SD_OP_READ_VDIS:
+        bitmap = bytearray(dlen)
+        for vid in vdis:
+            bitmap[vid // 8] |= 1 << (vid % 8)
+        out = bytes(bitmap)
+    return out, result, extra
+
+def serve(c):
+    global active, max_active
+    try:
+        while True:
+            hdr = recvall(c, 48)
+            ver, op, flags, epoch, rid, dlen = struct.unpack_from('<BBHIII',
+                                                                  hdr)
+            data = b''
+            if flags & SD_FLAG_CMD_WRITE and dlen:
+                data = recvall(c, dlen)
+
+            with lock:
+                active += 1
+                if active > max_active:
+                    max_active = active
+                    log('PARALLEL %d' % max_active)
+            time.sleep(delay)
+            with lock:
+                active -= 1
+                out, result, extra = handle(op, flags, hdr, data, dlen)
+
+            rsp = struct.pack('<BBHIIII', 1, op, 0, 0, rid, len(out), result)
+            rsp += struct.pack('<I', 0) + extra
+            rsp += b'\0' * (48 - len(rsp))
+            c.sendall(rsp + out)
+    except (EOFError, ConnectionError):
+        pass
+    c.close()
+
+delay = float(sys.argv[3]) if len(sys.argv) > 3 else 0
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', int(sys.argv[1])))
+s.listen(64)
+while True:
+    c, _ = s.accept()
+    log('CONNECT')
+    threading.Thread(target=serve, args=(c,), daemon=True).start()
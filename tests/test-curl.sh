@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# Tests for the block cache of the curl block driver
+#
+# Usage: test-curl.sh <build dir>
+#
+# Serves images with tests/http-range-server.py and reads them through
+# http:// URLs with qemu-img and qemu-io.  Needs python3 and a QEMU built
+# with curl support.
+
+build=$(cd "${1:-.}" && pwd)
+src=$(cd "$(dirname "$0")" && pwd)
+port=${CURL_TEST_PORT:-18765}
+url=http://127.0.0.1:$port
+tmp=$(mktemp -d)
+fail=0
+
+cleanup() {
+    kill $server 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# A request that never completes must not hang the test
+run() {
+    timeout 120 "$@"
+    ret=$?
+    [ $ret -ne 124 ] || echo "failed: $1 timed out"
+    return $ret
+}
+
+error() {
+    echo "FAIL: $*"
+    fail=1
+}
+
+# Each 96k chunk of the image is filled with its own byte.  Chunks don't
+# line up with the 256k blocks of the cache, so some of them span two.
+python3 - "$tmp" <<'PY'
+import random, sys
+tmp = sys.argv[1]
+img = b''.join(bytes([(i * 7 + 1) % 256]) * 98304 for i in range(213))
+for name in ('img.raw', 'bad.raw'):
+    open('%s/%s' % (tmp, name), 'wb').write(img)
+random.seed(1)
+with open('%s/reads' % tmp, 'w') as f:
+    for i in range(400):
+        chunk = random.randrange(213)
+        offset = random.randrange(192) * 512
+        length = random.randrange(1, 192 - offset // 512 + 1) * 512
+        f.write('aio_read -q -P %d %d %d\n' %
+                ((chunk * 7 + 1) % 256, chunk * 98304 + offset, length))
+    f.write('aio_flush\n')
+PY
+
+"$src/http-range-server.py" "$tmp" $port "$tmp/ranges" &
+server=$!
+sleep 1
+
+# Every block is downloaded once, even with read-ahead.  The first one is
+# read again after probing the format, which opens the image separately.
+run "$build/qemu-img" convert -O raw "$url/img.raw" "$tmp/out.raw" ||
+    error "qemu-img convert"
+cmp -s "$tmp/img.raw" "$tmp/out.raw" || error "converted image differs"
+dups=$(grep -v "RANGE 0-" "$tmp/ranges" | sort | uniq -d | wc -l)
+[ "$dups" -eq 0 ] || error "$dups ranges downloaded more than once"
+
+# Random reads through a cache smaller than the image
+for opts in "cache_size=1M:" "cache_size=1M:cache_file=$tmp/spill:"; do
+    out=$(MALLOC_PERTURB_=165 run "$build/qemu-io" "$url/img.raw:$opts" \
+          < "$tmp/reads" 2>&1)
+    case "$out" in
+    *"verification failed"*|*"error"*|*"failed"*)
+        error "reads with $opts: $(echo "$out" | grep -i fail | head -1)"
+        ;;
+    esac
+done
+
+# Requests spanning blocks that are read back from the spill file while the
+# cache only holds one block.  Freed memory is scribbled over so that using
+# an evicted block shows up as corrupted data.
+out=$(MALLOC_PERTURB_=165 run "$build/qemu-io" \
+      -c "read 0 1M" -c "read 1M 2M" -c "read 3M 1M" \
+      -c "read -P 15 192k 96k" -c "read -P 148 2016k 96k" \
+      -c "read -P 15 192k 96k" -c "read -P 148 2016k 96k" \
+      "$url/img.raw:cache_size=256k:cache_file=$tmp/spill2:" 2>&1)
+case "$out" in
+*"verification failed"*|*"error"*|*"failed"*)
+    error "reads from the spill file: $(echo "$out" | grep -i fail | head -1)"
+    ;;
+esac
+
+# Server errors are reported to the reader
+out=$(run "$build/qemu-io" -c "read 1M 64k" "$url/bad.raw" 2>&1)
+case "$out" in
+*"Input/output error"*)
+    ;;
+*)
+    error "server error not reported: $out"
+    ;;
+esac
+
+[ $fail -eq 0 ] && echo "curl: all tests passed"
+exit $fail
@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Tests for the connection handling of the sheepdog block driver
+#
+# Usage: test-sheepdog.sh <build dir>
+#
+# Runs qemu-img and qemu-io against tests/sheepdog-server.py, which keeps
+# the cluster in memory.  Needs python3.
+
+build=$(cd "${1:-.}" && pwd)
+src=$(cd "$(dirname "$0")" && pwd)
+port=${SHEEPDOG_TEST_PORT:-17000}
+img=sheepdog:127.0.0.1:$port:test
+tmp=$(mktemp -d)
+log=$tmp/log
+fail=0
+
+cleanup() {
+    kill $server 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+# A request that never completes must not hang the test
+run() {
+    timeout 120 "$@"
+    ret=$?
+    [ $ret -ne 124 ] || echo "failed: $1 timed out"
+    return $ret
+}
+
+error() {
+    echo "FAIL: $*"
+    fail=1
+}
+
+qemu_io() {
+    out=$(run "$build/qemu-io" "$@" 2>&1)
+    case "$out" in
+    *"verification failed"*|*"error"*|*"failed"*)
+        error "qemu-io $*: $(echo "$out" | grep -i -e fail -e error | head -1)"
+        ;;
+    esac
+}
+
+# Every request is served 10ms late, so requests that are in flight on
+# different connections at the same time overlap on the server
+"$src/sheepdog-server.py" $port "$log" 0.01 &
+server=$!
+sleep 1
+
+run "$build/qemu-img" create "$img" 256M > /dev/null || error "create"
+
+qemu_io -c "write -P 17 0 1M" -c "write -P 34 8M 64k" "$img"
+qemu_io -c "read -P 17 0 1M" -c "read -P 34 8M 64k" -c "read -P 0 9M 64k" \
+    "$img"
+
+# Each image keeps one connection for metadata next to the ones for object
+# I/O.  qemu-img and qemu-io open the image twice, once to probe the format.
+max_conns=10
+
+# The snapshot keeps the old data, the current image gets copies of the
+# objects written after it was taken
+: > "$log"
+run "$build/qemu-img" snapshot -c snap1 "$img" || error "snapshot create"
+conns=$(grep -c CONNECT "$log")
+[ "$conns" -le $max_conns ] ||
+    error "$conns connections opened to take a snapshot"
+
+qemu_io -c "write -P 51 0 64k" "$img"
+qemu_io -c "read -P 51 0 64k" -c "read -P 17 64k 960k" -c "read -P 34 8M 64k" \
+    "$img"
+qemu_io -c "read -P 17 0 1M" "$img:snap1"
+
+# Parallel reads spread over many objects go out on all connections, and
+# no connection is opened per request
+i=0
+while [ $i -lt 96 ]; do
+    echo "aio_read -q $((i % 32 * 4))M 64k"
+    i=$((i + 1))
+done > "$tmp/reads"
+echo aio_flush >> "$tmp/reads"
+: > "$log"
+out=$(run "$build/qemu-io" "$img" < "$tmp/reads" 2>&1)
+case "$out" in
+*"error"*|*"failed"*)
+    error "parallel reads: $(echo "$out" | grep -i -e fail -e error | head -1)"
+    ;;
+esac
+conns=$(grep -c CONNECT "$log")
+[ "$conns" -le $max_conns ] ||
+    error "$conns connections opened for parallel reads"
+grep -q "PARALLEL [2-9]" "$log" || error "reads were not sent in parallel"
+
+[ $fail -eq 0 ] && echo "sheepdog: all tests passed"
+exit $fail
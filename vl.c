@@ -2198,6 +2198,19 @@ int main(int argc, char **argv, char **envp)
                     exit(1);
                 }
 	        break;
+            case QEMU_OPTION_block_cache:
+                opts = qemu_opts_parse(qemu_find_opts("block-cache"), optarg, 0);
+                if (!opts) {
+                    exit(1);
+                }
+                if (qemu_opt_get(opts, "size")) {
+                    bdrv_shared_cache_set_size(qemu_opt_get_size(opts, "size",
+                                                                 0));
+                }
+                if (qemu_opt_get(opts, "name")) {
+                    bdrv_shared_cache_set_name(qemu_opt_get(opts, "name"));
+                }
+                break;
             case QEMU_OPTION_set:
                 if (qemu_set_option(optarg) != 0)
                     exit(1);